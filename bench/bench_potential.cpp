@@ -0,0 +1,185 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*************************************************************************
+* bench_potential - time per slice of the real space, fft and reciprocal 
+* space potentials of make3DSlices() ("one time integration:" and
+* "reciprocal potential:" in stem3), and where the reciprocal space 
+* potential becomes the fastest one.
+*
+* usage: bench_potential [max cells [atom radius [2D]]]
+*
+* The structures are SrTiO3 super cells of n x n x 4 unit cells, 
+* n = 1, 2, 4, .. max cells (default 8), sampled at 32 pixels per unit
+* cell and cut into 8 slices of 3D (or 2D) potential, once as a perfect crystal 
+* and once with random displacements of up to 0.1A (as for TDS), which
+* gives every atom a height of its own.  The real space potential is 
+* compared with the reciprocal space potential to check the latter.
+* The atom boxes of the real space potential are kept in the current folder.
+************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <omp.h>
+#include "stemtypes_fftw3.h"
+#include "data_containers.h"
+#include "stemlib.h"
+
+#define LATTICE     3.905  /* SrTiO3 lattice constant in A */
+#define CELL_PIXELS 32     /* pixels per unit cell */
+#define CELLS_Z     4      /* unit cells in z */
+#define SLICES      8      /* slices of the whole super cell */
+#define REAL_SPACE  0
+#define FFT         1
+#define RECIPROCAL  2
+#define MODES       3
+
+static const char *modeNames[MODES] = {"real space","fft","reciprocal"};
+static const int modeOrder[MODES] = {REAL_SPACE, RECIPROCAL, FFT};
+
+// SrTiO3: Sr at the corner, Ti in the center, O in the face centers
+static void makeCrystal(std::vector<atom> &atoms, int n, int displace)
+{
+	static const double pos[5][3] = {{0,0,0},{0.5,0.5,0.5},{0.5,0.5,0},{0.5,0,0.5},{0,0.5,0.5}};
+	static const int Z[5] = {38,22,8,8,8};
+	static const float dw[5] = {0.62f,0.44f,0.73f,0.73f,0.73f};
+	atom a;
+
+	atoms.clear();
+	srand(1);
+	for (int ix=0; ix<n; ix++) for (int iy=0; iy<n; iy++) for (int iz=0; iz<CELLS_Z; iz++) {
+		for (int j=0; j<5; j++) {
+			a.x = (float)((ix+pos[j][0])*LATTICE);
+			a.y = (float)((iy+pos[j][1])*LATTICE);
+			a.z = (float)((iz+pos[j][2])*LATTICE);
+			if (displace) {
+				// displaced, but kept within the super cell
+				a.x = (float)fmod((ix+pos[j][0]+(0.2*rand()/RAND_MAX-0.1)/LATTICE+n)*LATTICE, n*LATTICE);
+				a.y = (float)fmod((iy+pos[j][1]+(0.2*rand()/RAND_MAX-0.1)/LATTICE+n)*LATTICE, n*LATTICE);
+				a.z = (float)fmod((iz+pos[j][2]+(0.2*rand()/RAND_MAX-0.1)/LATTICE+CELLS_Z)*LATTICE, CELLS_Z*LATTICE);
+			}
+			a.dw = dw[j];
+			a.occ = 1.0f;
+			a.q = 0.0f;
+			a.Znum = Z[j];
+			atoms.push_back(a);
+		}
+	}
+}
+
+// the parameters of make3DSlices() for the super cell of n x n x CELLS_Z unit cells
+static void setupMuls(MULS *muls, std::vector<atom> &atoms, int n, int mode, int displace, float radius, int potential3D)
+{
+	muls->ax = muls->by = (float)(n*LATTICE);
+	muls->c = (float)(CELLS_Z*LATTICE);
+	muls->potNx = muls->potNy = n*CELL_PIXELS;
+	muls->resolutionX = muls->resolutionY = (float)(LATTICE/CELL_PIXELS);
+	muls->slices = SLICES;
+	muls->sliceThickness = muls->c/SLICES;
+	muls->cellDiv = 1;
+	muls->divCount = 0;
+	muls->avgCount = 0;
+	muls->atoms = &atoms[0];
+	muls->natom = (int)atoms.size();
+	muls->atomRadius = radius;
+	muls->potential3D = potential3D;
+	muls->tds = displace;
+	muls->fftpotential = (mode == FFT);
+	muls->recipPotential = (mode == RECIPROCAL);
+	muls->v0 = 200.0f;
+	muls->printLevel = 0;
+	muls->rowRank = 1;  // no need to write the atoms to a cfg file
+	muls->trans.Resize(SLICES, muls->potNx, muls->potNy, "trans");
+}
+
+int main(int argc, char *argv[])
+{
+	int maxCells = (argc > 1) ? atoi(argv[1]) : 8;
+	float radius = (argc > 2) ? (float)atof(argv[2]) : 3.0f;
+	int potential3D = !((argc > 3) && (strcmp(argv[3], "2D") == 0));
+	std::vector<int> cells;
+	std::vector<atom> atoms;
+	std::vector<double> timing[2][MODES], diff[2];
+	std::vector<double> recipPot;
+	MULS *muls = new MULS();  // all zero
+	int n, c, m, iz, mode, displace, reps, crossover;
+	size_t i, size;
+	double start, d2, v2, v;
+
+	for (n=1; n<=maxCells; n*=2) cells.push_back(n);
+	strcpy(muls->folder, ".");
+	// The fft potential changes the table of scattering factors, so it comes last.
+	for (m=0; m<MODES; m++) for (displace=0; displace<2; displace++) for (c=0; c<(int)cells.size(); c++) {
+		mode = modeOrder[m];
+		n = cells[c];
+		makeCrystal(atoms, n, displace);
+		setupMuls(muls, atoms, n, mode, displace, radius, potential3D);
+		// the first call also makes the lookup tables
+		make3DSlices(muls, SLICES, NULL, NULL);
+		start = omp_get_wtime();
+		for (reps=0; (reps < 1) || (omp_get_wtime()-start < 1.0); reps++)
+			make3DSlices(muls, SLICES, NULL, NULL);
+		timing[displace][mode].push_back(1000.0*(omp_get_wtime()-start)/(reps*SLICES));
+
+		if (mode == RECIPROCAL) {
+			// the relative rms difference between the projected reciprocal and real space potential
+			// (the two place the slices differently, see addAtomPotentialsRecip())
+			size = (size_t)muls->potNx*muls->potNy;
+			recipPot.assign(size, 0.0);
+			for (iz=0; iz<SLICES; iz++) for (i=0; i<size; i++) recipPot[i] += muls->trans.Slice(iz)[i][0];
+			setupMuls(muls, atoms, n, REAL_SPACE, displace, radius, potential3D);
+			make3DSlices(muls, SLICES, NULL, NULL);
+			for (d2=0, v2=0, i=0; i<size; i++) {
+				for (v=0, iz=0; iz<SLICES; iz++) v += muls->trans.Slice(iz)[i][0];
+				d2 += (recipPot[i]-v)*(recipPot[i]-v);
+				v2 += v*v;
+			}
+			diff[displace].push_back(sqrt(d2/v2));
+		}
+	}
+
+	printf("\nSrTiO3, %d slices of %gA (%s potential), %gA pixels, atom radius %gA, %d threads\n",
+		SLICES, CELLS_Z*LATTICE/SLICES, potential3D ? "3D" : "2D", LATTICE/CELL_PIXELS, radius, omp_get_max_threads());
+	for (displace=0; displace<2; displace++) {
+		printf("\n%s:\n", displace ? "displaced atoms" : "perfect crystal");
+		crossover = -1;
+		printf("cells  pixels   atoms  ms per slice: real space       fft  reciprocal   fastest     projected: rms(recip-real)/rms(real)\n");
+		for (c=0; c<(int)cells.size(); c++) {
+			n = cells[c];
+			int fastest = 0;
+			for (m=1; m<MODES; m++) 
+				if (timing[displace][m][c] < timing[displace][fastest][c]) fastest = m;
+			printf("%5d %7d %7d %24.2f %9.2f %11.2f   %-12s %g\n", n*n*CELLS_Z, n*CELL_PIXELS*n*CELL_PIXELS,
+				5*n*n*CELLS_Z, timing[displace][0][c], timing[displace][1][c], timing[displace][2][c],
+				modeNames[fastest], diff[displace][c]);
+			if ((fastest == RECIPROCAL) && (crossover < 0)) crossover = c;
+		}
+		if (crossover >= 0) 
+			printf("The reciprocal space potential is the fastest from %d unit cells (%d atoms) on.\n",
+				cells[crossover]*cells[crossover]*CELLS_Z, 5*cells[crossover]*cells[crossover]*CELLS_Z);
+		else 
+			printf("The reciprocal space potential is not the fastest up to %d unit cells.\n",
+				cells.back()*cells.back()*CELLS_Z);
+	}
+	delete muls;
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*************************************************************************
+* bench_precision - speed and accuracy of the single and double precision
+* multislice engines (see "precision:" in stem3).
+*
+* usage: bench_precision [nx [slices [wave file]]]
+*
+* A probe (the nx x nx complex wave function in the wave file, e.g.
+* tests/data/mulswav_16_2.img with nx = 400, or else a Gaussian probe) is
+* propagated through slices random weak phase gratings with the kernels
+* of the fused slice engine, once in single and once in double precision.
+* Reported are the time per slice and the deviation of the single 
+* precision exit wave from the double precision one.
+************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "stemtypes_fftw3.h"
+#include "arrays.h"
+#include "fftw_plans.h"
+#include "propagator.h"
+#include "imagelib_fftw3.h"
+
+#define RESOLUTION 0.15   /* pixel size in A */
+#define SLICE_DZ   1.9525 /* slice thickness in A */
+#define V0         200.0  /* high tension in kV */
+#define GRATINGS   4      /* number of different phase gratings */
+
+static void applyPropagator(const Propagator &prop, fftwf_complex **w, float norm) {
+	prop.Apply((void **)w, norm);
+}
+static void applyPropagator(const Propagator &prop, fftw_complex **w, double norm) {
+	prop.Apply(w, norm);
+}
+
+// transmit, FFT, propagate, inverse FFT - as runMulsSTEM() does it
+template <class T> static double runSlices(Array2D<T[2]> &wave, const Array3D<fftwf_complex> &trans,
+										   const Propagator &prop, int slices)
+{
+	int nx = wave.Nx(), ny = wave.Ny();
+	typename FFTW<T>::plan forw = FFTW<T>::Plan(nx, ny, 1, FFTW_FORWARD);
+	typename FFTW<T>::plan inv = FFTW<T>::Plan(nx, ny, 1, FFTW_BACKWARD);
+	T norm = (T)1/((T)nx*(T)ny);
+	clock_t start = clock();
+
+	for (int islice=0; islice<slices; islice++) {
+		fftwf_complex **t = trans[islice % GRATINGS];
+		for (int ix=0; ix<nx; ix++) {
+			T *w = (T *)wave[ix];
+			const float *tr = (const float *)t[ix];
+			for (int iy=0; iy<2*ny; iy+=2) {
+				T wr = w[iy], wi = w[iy+1];
+				w[iy]   = wr*tr[iy] - wi*tr[iy+1];
+				w[iy+1] = wr*tr[iy+1] + wi*tr[iy];
+			}
+		}
+		FFTW<T>::Execute(forw, wave.Data());
+		applyPropagator(prop, wave.Rows(), norm);
+		FFTW<T>::Execute(inv, wave.Data());
+	}
+	return (double)(clock()-start)/CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[])
+{
+	int nx = (argc > 1) ? atoi(argv[1]) : 400;
+	int slices = (argc > 2) ? atoi(argv[2]) : 200;
+	double wavlen = 12.3984244/sqrt(V0*(2*510.99906+V0));
+	Array2D<fftwf_complex> probe(nx, nx, "probe"), waveF(nx, nx, "waveF");
+	Array2D<fftw_complex> waveD(nx, nx, "waveD");
+	Array3D<fftwf_complex> trans(GRATINGS, nx, nx, "trans");
+	Propagator prop(nx, nx, (real)(nx*RESOLUTION), (real)(nx*RESOLUTION), (real)SLICE_DZ, (real)wavlen);
+	size_t i, n = (size_t)nx*nx;
+
+	if (argc > 3) {
+		CImageIO imageIO(nx, nx);
+		imageIO.ReadImage((void **)probe, nx, nx, argv[3]);
+	}
+	else {
+		for (int ix=0; ix<nx; ix++) for (int iy=0; iy<nx; iy++) {
+			double r2 = ((ix-nx/2)*(ix-nx/2)+(iy-nx/2)*(iy-nx/2))*RESOLUTION*RESOLUTION;
+			probe[ix][iy][0] = (float)exp(-r2/2.0);
+		}
+	}
+
+	// weak phase gratings: gaussian 'atoms' at random positions, about 1 per 4 A^2
+	srand(1);
+	for (int g=0; g<GRATINGS; g++) {
+		std::vector<double> phase(n, 0.0);
+		int atoms = (int)(n*RESOLUTION*RESOLUTION/4.0);
+		for (int a=0; a<atoms; a++) {
+			int x0 = rand() % nx, y0 = rand() % nx;
+			for (int dx=-4; dx<=4; dx++) for (int dy=-4; dy<=4; dy++) {
+				double r2 = (dx*dx+dy*dy)*RESOLUTION*RESOLUTION;
+				phase[((x0+dx+nx) % nx)*nx+(y0+dy+nx) % nx] += 0.3*exp(-r2/(2*0.09));
+			}
+		}
+		for (i=0; i<n; i++) {
+			trans.Slice(g)[i][0] = (float)cos(phase[i]);
+			trans.Slice(g)[i][1] = (float)sin(phase[i]);
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		waveF.Data()[i][0] = waveD.Data()[i][0] = probe.Data()[i][0];
+		waveF.Data()[i][1] = waveD.Data()[i][1] = probe.Data()[i][1];
+	}
+	double timeF = runSlices(waveF, trans, prop, slices);
+	double timeD = runSlices(waveD, trans, prop, slices);
+
+	double diff = 0, sumF = 0, sumD = 0;
+	for (i=0; i<n; i++) {
+		double dr = waveF.Data()[i][0]-waveD.Data()[i][0];
+		double di = waveF.Data()[i][1]-waveD.Data()[i][1];
+		diff += dr*dr+di*di;
+		sumF += (double)waveF.Data()[i][0]*waveF.Data()[i][0]+(double)waveF.Data()[i][1]*waveF.Data()[i][1];
+		sumD += waveD.Data()[i][0]*waveD.Data()[i][0]+waveD.Data()[i][1]*waveD.Data()[i][1];
+	}
+
+	printf("%d x %d pixels, %d slices\n", nx, nx, slices);
+	printf("single precision: %8.3f ms/slice\n", 1000.0*timeF/slices);
+	printf("double precision: %8.3f ms/slice (%.2fx)\n", 1000.0*timeD/slices, (timeF > 0) ? timeD/timeF : 0.0);
+	printf("exit wave, relative rms error of single precision: %g\n", sqrt(diff/sumD));
+	printf("integrated intensity, single: %.9f  double: %.9f\n", sumF/n, sumD/n);
+	return 0;
+}
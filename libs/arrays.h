@@ -0,0 +1,232 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARRAYS_H
+#define ARRAYS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+/*************************************************************************
+* Contiguous, 64-byte aligned 2D and 3D arrays.
+*
+* The data is stored in one block in row major order (the last index runs
+* fastest), so that kernels can run over rows or the whole array with
+* unit stride.  For legacy code that expects pointer-of-pointer arrays 
+* (e.g. fftwf_complex **) the arrays also keep a row pointer table, and 
+* a[ix][iy] as well as (void **)a work as before.
+* Arrays own their memory (unless created with Wrap()) and free it when 
+* they go out of scope; they cannot be copied.
+************************************************************************/
+#define ARRAY_ALIGNMENT 64
+
+inline void *alignedMalloc(size_t size, const char *message)
+{
+	void *p = NULL;
+#ifdef _WIN32
+	p = _aligned_malloc(size > 0 ? size : 1, ARRAY_ALIGNMENT);
+#else
+	if (posix_memalign(&p, ARRAY_ALIGNMENT, size > 0 ? size : 1) != 0) p = NULL;
+#endif
+	if (p == NULL) {
+		printf("Cannot allocate %lu bytes for %s\n", (unsigned long)size, message);
+		exit(0);
+	}
+	return p;
+}
+
+inline void alignedFree(void *p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+// a (possibly strided) 2D window into an array.  Does not own the data.
+template <class T> class View2D
+{
+public:
+	View2D(T *data, int nx, int ny, ptrdiff_t stride) :
+	  m_data(data), m_nx(nx), m_ny(ny), m_stride(stride) {}
+
+	int Nx() const { return m_nx; }
+	int Ny() const { return m_ny; }
+	ptrdiff_t Stride() const { return m_stride; }
+	T *Row(int ix) const { return m_data+ix*m_stride; }
+	T &operator()(int ix, int iy) const { return m_data[ix*m_stride+iy]; }
+	View2D<T> Window(int x0, int y0, int nx, int ny) const 
+	{ return View2D<T>(Row(x0)+y0, nx, ny, m_stride); }
+
+private:
+	T *m_data;
+	int m_nx, m_ny;
+	ptrdiff_t m_stride;
+};
+
+template <class T> class Array2D
+{
+public:
+	Array2D() : m_data(NULL), m_rows(NULL), m_nx(0), m_ny(0), m_own(false) {}
+	Array2D(int nx, int ny, const char *message="Array2D") : 
+	  m_data(NULL), m_rows(NULL), m_nx(0), m_ny(0), m_own(false) 
+	{ Resize(nx, ny, message); }
+	~Array2D() { Free(); }
+
+	// (re-)allocate the array, the contents are set to zero
+	void Resize(int nx, int ny, const char *message="Array2D")
+	{
+		Free();
+		m_data = (T *)alignedMalloc((size_t)nx*ny*sizeof(T), message);
+		memset(m_data, 0, (size_t)nx*ny*sizeof(T));
+		m_own = true;
+		MakeRows(nx, ny);
+	}
+	// use memory that belongs to someone else (e.g. one slice of an Array3D)
+	void Wrap(T *data, int nx, int ny)
+	{
+		Free();
+		m_data = data;
+		m_own = false;
+		MakeRows(nx, ny);
+	}
+	void Free()
+	{
+		if (m_own) alignedFree(m_data);
+		delete [] m_rows;
+		m_data = NULL;
+		m_rows = NULL;
+		m_nx = m_ny = 0;
+		m_own = false;
+	}
+
+	bool Empty() const { return m_data == NULL; }
+	int Nx() const { return m_nx; }
+	int Ny() const { return m_ny; }
+	size_t Size() const { return (size_t)m_nx*m_ny; }
+	T *Data() const { return m_data; }
+	T &operator()(int ix, int iy) const { return m_data[(size_t)ix*m_ny+iy]; }
+	View2D<T> View() const { return View2D<T>(m_data, m_nx, m_ny, m_ny); }
+	View2D<T> Window(int x0, int y0, int nx, int ny) const { return View().Window(x0, y0, nx, ny); }
+
+	// legacy interface: row pointers
+	T *operator[](ptrdiff_t ix) const { return m_rows[ix]; }
+	T **Rows() const { return m_rows; }
+	operator T**() const { return m_rows; }
+	operator void**() const { return (void **)m_rows; }
+	// so that "a == NULL" keeps working
+	bool operator==(const T *const *p) const { return m_rows == p; }
+	bool operator!=(const T *const *p) const { return m_rows != p; }
+
+private:
+	void MakeRows(int nx, int ny)
+	{
+		m_nx = nx;
+		m_ny = ny;
+		m_rows = new T*[nx > 0 ? nx : 1];
+		for (int ix=0; ix<nx; ix++) m_rows[ix] = m_data+(size_t)ix*ny;
+	}
+	Array2D(const Array2D &);
+	Array2D &operator=(const Array2D &);
+
+	T *m_data;
+	T **m_rows;
+	int m_nx, m_ny;
+	bool m_own;
+};
+
+template <class T> class Array3D
+{
+public:
+	Array3D() : m_data(NULL), m_rows(NULL), m_slices(NULL), m_nz(0), m_nx(0), m_ny(0) {}
+	Array3D(int nz, int nx, int ny, const char *message="Array3D") :
+	  m_data(NULL), m_rows(NULL), m_slices(NULL), m_nz(0), m_nx(0), m_ny(0)
+	{ Resize(nz, nx, ny, message); }
+	~Array3D() { Free(); }
+
+	// (re-)allocate the array, the contents are set to zero
+	void Resize(int nz, int nx, int ny, const char *message="Array3D")
+	{
+		Free();
+		m_nz = nz;
+		m_nx = nx;
+		m_ny = ny;
+		m_data = (T *)alignedMalloc(Size()*sizeof(T), message);
+		memset(m_data, 0, Size()*sizeof(T));
+		m_rows = new T*[nz*nx > 0 ? nz*nx : 1];
+		m_slices = new T**[nz > 0 ? nz : 1];
+		for (int iz=0; iz<nz; iz++) {
+			m_slices[iz] = m_rows+(size_t)iz*nx;
+			for (int ix=0; ix<nx; ix++) m_slices[iz][ix] = m_data+((size_t)iz*nx+ix)*ny;
+		}
+	}
+	void Free()
+	{
+		alignedFree(m_data);
+		delete [] m_rows;
+		delete [] m_slices;
+		m_data = NULL;
+		m_rows = NULL;
+		m_slices = NULL;
+		m_nz = m_nx = m_ny = 0;
+	}
+
+	bool Empty() const { return m_data == NULL; }
+	int Nz() const { return m_nz; }
+	int Nx() const { return m_nx; }
+	int Ny() const { return m_ny; }
+	size_t Size() const { return (size_t)m_nz*m_nx*m_ny; }
+	T *Data() const { return m_data; }
+	T *Slice(int iz) const { return m_data+(size_t)iz*m_nx*m_ny; }
+	T &operator()(int iz, int ix, int iy) const { return m_data[((size_t)iz*m_nx+ix)*m_ny+iy]; }
+	View2D<T> View(int iz) const { return View2D<T>(Slice(iz), m_nx, m_ny, m_ny); }
+
+	// legacy interface: a[iz] is the row pointer table of slice iz
+	T **operator[](ptrdiff_t iz) const { return m_slices[iz]; }
+	operator T***() const { return m_slices; }
+
+	// exchanges the contents (and sizes) of two arrays without copying
+	void Swap(Array3D &other)
+	{
+		std::swap(m_data, other.m_data);
+		std::swap(m_rows, other.m_rows);
+		std::swap(m_slices, other.m_slices);
+		std::swap(m_nz, other.m_nz);
+		std::swap(m_nx, other.m_nx);
+		std::swap(m_ny, other.m_ny);
+	}
+
+private:
+	Array3D(const Array3D &);
+	Array3D &operator=(const Array3D &);
+
+	T *m_data;
+	T **m_rows;
+	T ***m_slices;
+	int m_nz, m_nx, m_ny;
+};
+
+#endif
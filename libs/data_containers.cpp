@@ -19,9 +19,11 @@ QSTEM - image simulation for TEM/STEM/CBED
 
 #include "stdio.h"
 #include <string.h>
+#include <algorithm>
 #include "data_containers.h"
+#include "fftw_plans.h"
 
-WAVEFUNC::WAVEFUNC(int x, int y, float_tt resX, float_tt resY) :
+WAVEFUNC::WAVEFUNC(int x, int y, float_tt resX, float_tt resY, void *waveData) :
 detPosX(0),
 detPosY(0),
 iPosX(0),
@@ -29,32 +31,31 @@ iPosY(0),
 thickness(0.0),
 nx(x),
 ny(y),
+config(NULL),
+numaNode(0),
 resolutionX(resX),
-resolutionY(resY)
+resolutionY(resY),
+fftPlanWaveDForw(NULL),
+fftPlanWaveDInv(NULL)
 {
 	char waveFile[256];
 	const char *waveFileBase = "mulswav";
-#if FLOAT_PRECISION == 1
-	diffpat = float2D(nx,ny,"diffpat");
-	avgArray = float2D(nx,ny,"avgArray");
-#else
-	diffpat = double2D(nx,ny,"diffpat");
-	avgArray = double2D(nx,ny,"avgArray");
-#endif
+	diffpat.Resize(nx,ny,"diffpat");
+	avgArray.Resize(nx,ny,"avgArray");
 
 	m_imageIO=ImageIOPtr(new CImageIO(nx, ny, thickness, resolutionX, resolutionY));
 	
 
 #if FLOAT_PRECISION == 1
-	wave = complex2Df(nx, ny, "wave");
-	fftPlanWaveForw = fftwf_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_FORWARD, FFTW_ESTIMATE);
-	fftPlanWaveInv = fftwf_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_BACKWARD, FFTW_ESTIMATE);
+	if (waveData != NULL) wave.Wrap((fftwf_complex *)waveData, nx, ny);
+	else wave.Resize(nx, ny, "wave");
+	fftPlanWaveForw = getFFTPlanf(nx,ny,1,FFTW_FORWARD,wave.Data());
+	fftPlanWaveInv = getFFTPlanf(nx,ny,1,FFTW_BACKWARD,wave.Data());
 #else
-	wave = complex2D(nx, ny, "wave");
-	fftPlanWaveForw = fftw_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_FORWARD,
-		fftMeasureFlag);
-	fftPlanWaveInv = fftw_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_BACKWARD,
-		fftMeasureFlag);
+	if (waveData != NULL) wave.Wrap((fftw_complex *)waveData, nx, ny);
+	else wave.Resize(nx, ny, "wave");
+	fftPlanWaveForw = getFFTPlan(nx,ny,1,FFTW_FORWARD,wave.Data());
+	fftPlanWaveInv = getFFTPlan(nx,ny,1,FFTW_BACKWARD,wave.Data());
 #endif
 
 	sprintf(waveFile,"%s.img",waveFileBase);
@@ -69,7 +70,7 @@ void WAVEFUNC::WriteWave(const char *fileName, const char *comment,
 	m_imageIO->SetResolution(resolutionX, resolutionY);
 	m_imageIO->SetParams(params);
 	m_imageIO->SetThickness(thickness);
-	m_imageIO->WriteComplexImage((void **)wave, fileName);
+	m_imageIO->WriteComplexImage((void **)wave.Rows(), fileName);
 }
 
 void WAVEFUNC::WriteDiffPat(const char *fileName, const char *comment,
@@ -79,7 +80,7 @@ void WAVEFUNC::WriteDiffPat(const char *fileName, const char *comment,
 	m_imageIO->SetResolution(1.0/(nx*resolutionX), 1.0/(ny*resolutionY));
 	m_imageIO->SetParams(params);
 	m_imageIO->SetThickness(thickness);
-	m_imageIO->WriteRealImage((void**)diffpat, fileName);
+	m_imageIO->WriteRealImage((void **)diffpat.Rows(), fileName);
 }
 
 void WAVEFUNC::WriteAvgArray(const char *fileName, const char *comment,
@@ -89,27 +90,73 @@ void WAVEFUNC::WriteAvgArray(const char *fileName, const char *comment,
 	m_imageIO->SetResolution(1.0/(nx*resolutionX), 1.0/(ny*resolutionY));
 	m_imageIO->SetParams(params);
 	m_imageIO->SetThickness(thickness);
-	m_imageIO->WriteRealImage((void **)avgArray, fileName);
+	m_imageIO->WriteRealImage((void **)avgArray.Rows(), fileName);
 }
 
 void WAVEFUNC::ReadWave(const char *fileName)
 {
 	// printf("Debug Wavefunc::ReadWave\n");
-	m_imageIO->ReadImage((void **)wave, nx, ny, fileName);
+	m_imageIO->ReadImage((void **)wave.Rows(), nx, ny, fileName);
 }
 
 void WAVEFUNC::ReadDiffPat(const char *fileName)
 {
-	m_imageIO->ReadImage((void **)diffpat, nx, ny, fileName);
+	m_imageIO->ReadImage((void **)diffpat.Rows(), nx, ny, fileName);
 }
 
 void WAVEFUNC::ReadAvgArray(const char *fileName)
 {
-	m_imageIO->ReadImage((void **)avgArray, nx, ny, fileName);
+	m_imageIO->ReadImage((void **)avgArray.Rows(), nx, ny, fileName);
+}
+
+std::vector<double> WAVEFUNC::GetParams() const
+{
+	return m_imageIO->GetParams();
+}
+
+void WAVEFUNC::UseDouble()
+{
+	if (!waveD.Empty()) return;
+	waveD.Resize(nx, ny, "waveD");
+	fftPlanWaveDForw = getFFTPlan(nx,ny,1,FFTW_FORWARD,waveD.Data());
+	fftPlanWaveDInv = getFFTPlan(nx,ny,1,FFTW_BACKWARD,waveD.Data());
+}
+
+void WAVEFUNC::ToDouble()
+{
+	const fftw_real *src = (const fftw_real *)wave.Data();
+	double *dst = (double *)waveD.Data();
+	for (size_t i=0; i<2*wave.Size(); i++) dst[i] = src[i];
+}
+
+void WAVEFUNC::FromDouble()
+{
+	const double *src = (const double *)waveD.Data();
+	fftw_real *dst = (fftw_real *)wave.Data();
+	for (size_t i=0; i<2*wave.Size(); i++) dst[i] = (fftw_real)src[i];
 }
 
 
 
+WAVEBATCH::WAVEBATCH(int k, int nx, int ny, float_tt resX, float_tt resY) :
+K(k),
+count(0)
+{
+	stack.Resize(K, nx, ny, "wave stack");
+#if FLOAT_PRECISION == 1
+	fftPlanForw = getFFTPlanf(nx, ny, K, FFTW_FORWARD, stack.Data());
+	fftPlanInv = getFFTPlanf(nx, ny, K, FFTW_BACKWARD, stack.Data());
+#else
+	fftPlanForw = getFFTPlan(nx, ny, K, FFTW_FORWARD, stack.Data());
+	fftPlanInv = getFFTPlan(nx, ny, K, FFTW_BACKWARD, stack.Data());
+#endif
+
+	for (int i=0; i<K; i++)
+	{
+		waves.push_back(WavePtr(new WAVEFUNC(nx, ny, resX, resY, (void *)stack.Slice(i))));
+	}
+}
+
 Detector::Detector(int nx, int ny, float_tt resX, float_tt resY) :
   error(0),
   shiftX(0),
@@ -117,20 +164,31 @@ Detector::Detector(int nx, int ny, float_tt resX, float_tt resY) :
   Navg(0),
   thickness(0)
 {
-#if FLOAT_PRECISION == 1
-	image = float2D(nx,ny,"ADFimag");
-	image2 = float2D(nx,ny,"ADFimag");
-#else
-	image = double2D(nx,ny,"ADFimag");	
-	image2 = double2D(nx,ny,"ADFimag");	
-#endif
+	image.Resize(nx,ny,"ADFimag");
+	image2.Resize(nx,ny,"ADFimag");
+	pass.Resize(nx,ny,"detector pass");
+	std::fill(pass.Data(), pass.Data()+pass.Size(), -1.0);
 	m_imageIO=ImageIOPtr(new CImageIO(nx, ny, thickness, resX, resY, std::vector<double>(2+nx*ny), "STEM image"));
 }
 
 void Detector::WriteImage(const char *fileName)
 {
 	m_imageIO->SetThickness(thickness);
-	m_imageIO->WriteRealImage((void **)image, fileName);
+	m_imageIO->WriteRealImage((void **)image.Rows(), fileName);
+}
+
+void Detector::AddPass()
+{
+	size_t i;
+	double intensity;
+
+	for (i=0; i<pass.Size(); i++) {
+		intensity = pass.Data()[i];
+		if (intensity < 0) continue;
+		image.Data()[i] = (image.Data()[i]*Navg+intensity)/(Navg+1);
+		image2.Data()[i] = (image2.Data()[i]*Navg+intensity*intensity)/(Navg+1);
+		pass.Data()[i] = -1.0;
+	}
 }
 
 void Detector::SetThickness(float_tt t)
@@ -23,6 +23,11 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include <vector>
 #include "stemtypes_fftw3.h"
 #include "imagelib_fftw3.h"
+#include "propagator.h"
+#include "arrays.h"
+#include "fftw_plans.h"
+
+struct PhononConfig;    /* see stem3/phononbatch.h */
 
 // a structure for a probe/parallel beam wavefunction.
 // Separate from mulsliceStruct for parallelization.
@@ -36,25 +41,37 @@ public:
 	int detPosX,detPosY;
 	char fileStart[512];
 	char fileout[512];
-	float_tt **diffpat;
-	float_tt **avgArray;
+	Array2D<float_tt> diffpat;
+	Array2D<float_tt> avgArray;
 	char avgName[512];
 	float_tt thickness;
 	float_tt intIntensity;
+	// the frozen phonon configuration the wave belongs to (in CBED and TEM 
+	// mode), NULL: the one in MULS
+	PhononConfig *config;
+	// the NUMA node of the thread that propagates the wave, it reads the 
+	// replica of the transmission function of that node (see MULS::transReplicas)
+	int numaNode;
 	// These are not used for anything aside from when saving files.
 	float_tt resolutionX, resolutionY;
 
+	// shared plans from the plan cache (fftw_plans.h), use with fftw(f)_execute_dft()
 #if FLOAT_PRECISION == 1
 	fftwf_plan fftPlanWaveForw,fftPlanWaveInv;
-	fftwf_complex  **wave; /* complex wave function */
+	Array2D<fftwf_complex> wave; /* complex wave function */
 #else
 	fftw_plan fftPlanWaveForw,fftPlanWaveInv;
-	fftw_complex  **wave; /* complex wave function */
+	Array2D<fftw_complex> wave; /* complex wave function */
 #endif
+	// double precision copy of wave for the double precision slice engine
+	// (precision: double), only allocated by UseDouble()
+	Array2D<fftw_complex> waveD;
+	fftw_plan fftPlanWaveDForw,fftPlanWaveDInv;
 
 public:
-	// initializing constructor:
-	WAVEFUNC(int nx, int ny, float_tt resX, float_tt resY);
+	// initializing constructor.  If waveData is given, the wave function
+	// uses this (already allocated, nx*ny) block instead of allocating its own.
+	WAVEFUNC(int nx, int ny, float_tt resX, float_tt resY, void *waveData=NULL);
 	// define a copy constructor to create new arrays
 	//WAVEFUNC( WAVEFUNC& other );
 
@@ -68,19 +85,70 @@ public:
 	void ReadWave(const char *fileName);
 	void ReadDiffPat(const char *fileName);
 	void ReadAvgArray(const char *fileName);
+	// the parameters of the image read last
+	std::vector<double> GetParams() const;
+
+	// allocate waveD and get its plans.  Must be called from serial code.
+	void UseDouble();
+	// copy wave to waveD and back
+	void ToDouble();
+	void FromDouble();
+	// the wave function and its plans in precision T (float or double)
+	template <class T> typename FFTW<T>::complex **Rows();
+	template <class T> typename FFTW<T>::plan PlanForw();
+	template <class T> typename FFTW<T>::plan PlanInv();
 };
 
+template <> inline fftw_complex **WAVEFUNC::Rows<double>() { return waveD; }
+template <> inline fftw_plan WAVEFUNC::PlanForw<double>() { return fftPlanWaveDForw; }
+template <> inline fftw_plan WAVEFUNC::PlanInv<double>() { return fftPlanWaveDInv; }
+#if FLOAT_PRECISION == 1
+template <> inline fftwf_complex **WAVEFUNC::Rows<float>() { return wave; }
+template <> inline fftwf_plan WAVEFUNC::PlanForw<float>() { return fftPlanWaveForw; }
+template <> inline fftwf_plan WAVEFUNC::PlanInv<float>() { return fftPlanWaveInv; }
+#endif
+
 typedef boost::shared_ptr<WAVEFUNC> WavePtr;
 
 
+// a stack of K wave functions in one contiguous block, so that all of
+// them can be transformed with a single batched FFT plan.  Used for
+// propagating several STEM probe positions together, slice by slice.
+class WAVEBATCH
+{
+public:
+	int K;                 /* number of waves in the stack */
+	int count;             /* number of waves currently in use (<= K) */
+	std::vector<WavePtr> waves;
+
+	// shared plans from the plan cache, use with fftw(f)_execute_dft() on stack[0][0]
+#if FLOAT_PRECISION == 1
+	fftwf_plan fftPlanForw,fftPlanInv;
+	Array3D<fftwf_complex> stack;  /* stack[k] is the wave function of waves[k] */
+#else
+	fftw_plan fftPlanForw,fftPlanInv;
+	Array3D<fftw_complex> stack;
+#endif
+
+public:
+	WAVEBATCH(int K, int nx, int ny, float_tt resX, float_tt resY);
+};
+
+typedef boost::shared_ptr<WAVEBATCH> WaveBatchPtr;
+
+
 
 class Detector {
 	ImageIOPtr m_imageIO;
 	float_tt thickness;
 public:
 	int Navg;
-	float_tt **image;        // place for storing avg image = sum(data)/Navg
-	float_tt **image2;        // we will store sum(data.^2)/Navg 
+	Array2D<float_tt> image;        // place for storing avg image = sum(data)/Navg
+	Array2D<float_tt> image2;       // we will store sum(data.^2)/Navg 
+	// the intensity of each pixel in the current pass over the scan (< 0: not
+	// collected yet).  Each pixel is only written by the thread propagating it,
+	// and AddPass() adds it to image and image2 after the threads are done.
+	Array2D<double> pass;
 	float_tt rInside,rOutside;
 	float_tt k2Inside,k2Outside;
 	char name[32];
@@ -92,12 +160,24 @@ public:
 	void SetParameter(int index, double value);
 	void SetThickness(float_tt t);
 	void SetComment(const char *comment);
+	// adds the pixels collected in pass to the averages over Navg runs in 
+	// image and image2 and clears them
+	void AddPass();
 	float_tt error;
 	float_tt shiftX,shiftY;
 };
 
 typedef boost::shared_ptr<Detector> DetectorPtr;
 
+class DetectorMap;      /* see detector_map.h */
+typedef boost::shared_ptr<DetectorMap> DetectorMapPtr;
+class WaveStore;        /* see wave_store.h */
+typedef boost::shared_ptr<WaveStore> WaveStorePtr;
+class DiffAccumulator;  /* see diff_accumulator.h */
+typedef boost::shared_ptr<DiffAccumulator> DiffAccumulatorPtr;
+class NumaLayout;       /* see numa_layout.h */
+typedef boost::shared_ptr<NumaLayout> NumaLayoutPtr;
+
 
 
 class MULS {
@@ -107,18 +187,23 @@ public:
   int printLevel;                       /* Flag indicating how much output should appear
 					 * in the window. */
   int saveLevel;
+  int sliceEngine;                      /* SLICE_ENGINE_FUSED or SLICE_ENGINE_REFERENCE */
+  int precision;                        /* PRECISION_SINGLE or PRECISION_DOUBLE */
   int complete_pixels;  //the number of pixels completed so far
 
 #if FLOAT_PRECISION == 1
   fftwf_plan fftPlanPotInv,fftPlanPotForw;
   // wave moved to probeStruct
   //fftwf_complex  **wave; /* complex wave function */
-  fftwf_complex ***trans;
+  Array3D<fftwf_complex> trans;
+  // copies of trans on the other NUMA nodes (NULL: use trans), see updateTransReplicas()
+  std::vector<boost::shared_ptr<Array3D<fftwf_complex> > > transReplicas;
 #else
   fftw_plan fftPlanPotInv,fftPlanPotForw;
   // wave moved to probeStruct
   //fftw_complex  **wave; /* complex wave function */
-  fftw_complex ***trans;
+  Array3D<fftw_complex> trans;
+  std::vector<boost::shared_ptr<Array3D<fftw_complex> > > transReplicas;
 #endif
 
   real **diffpat;
@@ -238,6 +323,18 @@ public:
   float_tt rmin,rmax;		/* min and max of real part */
   float_tt aimin,aimax;		/* min and max of imag part */
   float_tt *kx2,*ky2,k2max,*kx,*ky;
+  std::vector<PropagatorPtr> propagators;  /* propagator for each slice, shared by all threads */
+  char wisdomFile[512];                    /* FFTW wisdom file, empty if none */
+  int pruneFFT;                            /* flag: skip the FFTs of rows outside the band limit */
+  PrunedFFTPtr bandFFT;                    /* band limited FFT of the wave, NULL if pruneFFT is not set */
+  WavePtr probeCache;                      /* incident STEM probe, see updateProbeCache() */
+  WavePtr probeSpectrum;                   /* its fourier transform, used by probeShift() */
+  std::vector<double> probeKey;            /* the parameters probeCache was made with */
+  DetectorMapPtr detectorMap;              /* pixels seen by each detector, see initDetectorMap() */
+  WaveStorePtr waveStore;                  /* STEM exit waves between the slabs, see doSTEM() */
+  double waveStoreMB;                      /* memory for waveStore before it spills to a file, 0: automatic */
+  char waveStoreFolder[1024];              /* folder of the spill file of waveStore */
+  DiffAccumulatorPtr diffAvg;              /* averaged STEM diffraction patterns, see doSTEM() */
 
   int nlayer;
   float_tt *cz;
@@ -257,6 +354,7 @@ public:
   int nonPeriod;       /* for slicecell (make non periodic in x,y */
   int bandlimittrans;  /* flag for bandwidth limiting transmission function */
   int fftpotential;    /* flag indicating that we should use FFT for V_proj calculation */
+  int recipPotential;  /* build the slices from structure factors, see addAtomPotentialsRecip() */
   int plotPotential;
   int storeSeries;
   int tds;
@@ -275,6 +373,28 @@ public:
   int readPotential;
   float_tt scanXStart,scanXStop,scanYStart,scanYStop;
   int scanXN,scanYN;
+  int scanBatch;       /* number of probe positions propagated together per thread */
+  int scanTileSize;    /* edge length of the scan tiles handed to the threads, 0: automatic */
+  int shardIndex, shardCount;  /* this process computes the scan rows of shard shardIndex of shardCount */
+  int mpiRank, mpiSize;        /* this MPI process and the number of processes (0 and 1 without MPI) */
+  int phononGroups, phononGroup; /* groups of processes that share the TDS runs, see mpiSetupSTEM() */
+  int rowRanks, rowRank;       /* the processes of a group that share the scan rows of the shard */
+  long phononSeed;             /* seed of the random phonon displacements, 0: from the time */
+  int phononBatch;             /* CBED/TEM: configurations propagated at the same time, 0: one per thread */
+  double phononBatchMB;        /* memory for the configurations of the phonon batches, 0: automatic */
+  int waveThreads;             /* TEM/CBED/NBED: threads working on one wave function, 0: all */
+  int potThreads;              /* threads that add the atoms in make3DSlices(), 0: all */
+  int sliceRing;               /* TEM/CBED: slices built while the previous ones are propagated, 0: the whole slab (see runMulsSTEMRing()) */
+  char potCacheFolder[1024];   /* folder of the atom boxes of the real space potential, see getAtomBox() */
+  int threadPinning;           /* STEM: PIN_NONE, PIN_CORES or PIN_NODES (see numa_layout.h) */
+  int replicateTrans;          /* STEM: flag, one copy of trans per NUMA node */
+  NumaLayoutPtr numa;          /* STEM: the NUMA nodes and the threads on them, NULL: not pinned */
+  double checkpointInterval;   /* seconds between STEM checkpoints, 0: none (see stemcheckpoint.h) */
+  int resume;                  /* flag: continue from the last checkpoint */
+  int divCount;        /* make3DSlices(): subdivision of the unit cell (counting down from cellDiv) */
+  int sliceFirst;      /* the slice of the slab in trans[0], see makeSliceWindow() */
+  int keepAtoms;       /* flag: the next make3DSlices() uses muls->atoms instead of a new configuration */
+  int subpixelScan;    /* flag: place the probe at the exact scan position, see probeShift() */
   float_tt intIntensity;
   double imageGamma;
   char folder[1024];
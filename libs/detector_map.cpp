@@ -0,0 +1,193 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include "detector_map.h"
+
+// all parameters the map depends on, for Matches()
+static std::vector<double> detectorMapKey(int nx, int ny, const real *kx2, const real *ky2, 
+	const std::vector<DetectorPtr> &detectors)
+{
+	std::vector<double> key;
+	int i;
+
+	key.push_back(nx);
+	key.push_back(ny);
+	for (i=0; i<nx; i++) key.push_back(kx2[i]);
+	for (i=0; i<ny; i++) key.push_back(ky2[i]);
+	for (i=0; i<(int)detectors.size(); i++) {
+		key.push_back(detectors[i]->k2Inside);
+		key.push_back(detectors[i]->k2Outside);
+		key.push_back((int)detectors[i]->shiftX);
+		key.push_back((int)detectors[i]->shiftY);
+	}
+	return key;
+}
+
+// orders run indices by the first pixel of the run
+struct RunOrder {
+	const std::vector<int> &start;
+	RunOrder(const std::vector<int> &s) : start(s) {}
+	bool operator()(int a, int b) const { return start[a] < start[b]; }
+};
+
+DetectorMap::DetectorMap(int x, int y, const real *kx2, const real *ky2, 
+	const std::vector<DetectorPtr> &detectors) :
+nx(x),
+ny(y),
+detectorNum((int)detectors.size())
+{
+	int ix, iy, i, a, b, nc, key, seg, sx, sy;
+	real k2;
+	std::vector<int> centered, pixels;
+	std::vector<real> inside, outside;
+	std::vector<int> keySegment;
+	std::vector<std::vector<int> > members;
+	std::vector<int> starts, ends, segs, order;
+
+	m_key = detectorMapKey(nx, ny, kx2, ky2, detectors);
+
+	for (i=0; i<detectorNum; i++) {
+		if (((int)detectors[i]->shiftX == 0) && ((int)detectors[i]->shiftY == 0)) {
+			centered.push_back(i);
+			inside.push_back(detectors[i]->k2Inside);
+			outside.push_back(detectors[i]->k2Outside);
+		}
+	}
+	std::sort(inside.begin(), inside.end());
+	std::sort(outside.begin(), outside.end());
+	nc = (int)centered.size();
+
+	/* The centered detectors a pixel belongs to only depend on the number a 
+	 * of inner limits <= k2 and the number b of outer limits < k2, so 
+	 * (a,b) identifies its segment.  -1: not known yet, -2: no detector.
+	 */
+	keySegment.assign((nc+1)*(nc+1), -1);
+	for (ix=0; ix<nx; ix++) for (iy=0; iy<ny; iy++) {
+		k2 = kx2[ix]+ky2[iy];
+		a = (int)(std::upper_bound(inside.begin(), inside.end(), k2)-inside.begin());
+		b = (int)(std::lower_bound(outside.begin(), outside.end(), k2)-outside.begin());
+		key = a*(nc+1)+b;
+		if (keySegment[key] == -1) {
+			std::vector<int> list;
+			for (i=0; i<nc; i++) 
+				if ((k2 >= detectors[centered[i]]->k2Inside) && (k2 <= detectors[centered[i]]->k2Outside))
+					list.push_back(centered[i]);
+			if (list.empty()) keySegment[key] = -2;
+			else {
+				keySegment[key] = (int)members.size();
+				members.push_back(list);
+			}
+		}
+		if (keySegment[key] >= 0) AddPixel(ix*ny+iy, keySegment[key]);
+	}
+
+	/* a shifted detector at pixel (ix,iy) collects the intensity of 
+	 * pixel (ix+shiftX,iy+shiftY), see collectIntensity() 
+	 */
+	for (i=0; i<detectorNum; i++) {
+		sx = (int)detectors[i]->shiftX;
+		sy = (int)detectors[i]->shiftY;
+		if ((sx == 0) && (sy == 0)) continue;
+		pixels.clear();
+		for (ix=0; ix<nx; ix++) for (iy=0; iy<ny; iy++) {
+			k2 = kx2[ix]+ky2[iy];
+			if ((k2 >= detectors[i]->k2Inside) && (k2 <= detectors[i]->k2Outside))
+				pixels.push_back((((ix+sx)%nx+nx)%nx)*ny+((iy+sy)%ny+ny)%ny);
+		}
+		std::sort(pixels.begin(), pixels.end());
+		seg = (int)members.size();
+		members.push_back(std::vector<int>(1, i));
+		for (ix=0; ix<(int)pixels.size(); ix++) AddPixel(pixels[ix], seg);
+	}
+
+	// bring all runs into ascending order, so that the wave is read sequentially
+	for (i=0; i<(int)runStart.size(); i++) order.push_back(i);
+	std::stable_sort(order.begin(), order.end(), RunOrder(runStart));
+	for (i=0; i<(int)order.size(); i++) {
+		starts.push_back(runStart[order[i]]);
+		ends.push_back(runEnd[order[i]]);
+		segs.push_back(runSegment[order[i]]);
+	}
+	runStart.swap(starts);
+	runEnd.swap(ends);
+	runSegment.swap(segs);
+
+	segStart.push_back(0);
+	for (seg=0; seg<(int)members.size(); seg++) {
+		segDetectors.insert(segDetectors.end(), members[seg].begin(), members[seg].end());
+		segStart.push_back((int)segDetectors.size());
+	}
+}
+
+// pixels must be added in ascending order for each segment
+void DetectorMap::AddPixel(int pixel, int segment)
+{
+	if ((!runEnd.empty()) && (runSegment.back() == segment) && (runEnd.back() == pixel)) 
+		runEnd.back()++;
+	else {
+		runStart.push_back(pixel);
+		runEnd.push_back(pixel+1);
+		runSegment.push_back(segment);
+	}
+}
+
+template <class T> void DetectorMap::Integrate(T (**wave)[2], std::vector<double> &sums) const
+{
+	int r, i, j, n, seg;
+	double s0, s1, s2, s3;
+	const T *p;
+	std::vector<double> segSum(segStart.size()-1, 0.0);
+
+	for (r=0; r<(int)runStart.size(); r++) {
+		p = wave[0][runStart[r]];
+		n = runEnd[r]-runStart[r];
+		// independent partial sums, so that the compiler can use SIMD
+		s0 = s1 = s2 = s3 = 0.0;
+		for (i=0; i+4<=n; i+=4, p+=8) {
+			s0 += p[0]*p[0]+p[1]*p[1];
+			s1 += p[2]*p[2]+p[3]*p[3];
+			s2 += p[4]*p[4]+p[5]*p[5];
+			s3 += p[6]*p[6]+p[7]*p[7];
+		}
+		for (; i<n; i++, p+=2) s0 += p[0]*p[0]+p[1]*p[1];
+		segSum[runSegment[r]] += (s0+s1)+(s2+s3);
+	}
+
+	sums.assign(detectorNum, 0.0);
+	for (seg=0; seg<(int)segSum.size(); seg++) 
+		for (j=segStart[seg]; j<segStart[seg+1]; j++)
+			sums[segDetectors[j]] += segSum[seg];
+}
+
+template void DetectorMap::Integrate<float>(float (**wave)[2], std::vector<double> &sums) const;
+template void DetectorMap::Integrate<double>(double (**wave)[2], std::vector<double> &sums) const;
+
+bool DetectorMap::Matches(int x, int y, const real *kx2, const real *ky2, 
+	const std::vector<DetectorPtr> &detectors) const
+{
+	return (x == nx) && (y == ny) && (detectorMapKey(x, y, kx2, ky2, detectors) == m_key);
+}
+
+int DetectorMap::Pixels() const
+{
+	int r, n = 0;
+	for (r=0; r<(int)runStart.size(); r++) n += runEnd[r]-runStart[r];
+	return n;
+}
@@ -0,0 +1,64 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DETECTOR_MAP_H
+#define DETECTOR_MAP_H
+
+#include <vector>
+#include "data_containers.h"
+
+// Precomputed assignment of the pixels of a (fourier transformed) wave 
+// function to a set of STEM detectors.  A centered detector sees the 
+// pixels with k2Inside <= kx^2+ky^2 <= k2Outside, so the pixels seen by 
+// any of them fall into a few segments of identical detector membership 
+// (at most 2*detectors+1, however the rings overlap).  Every pixel 
+// belongs to at most one segment, which makes the integration O(pixels) 
+// for any number of detectors.  A shifted detector is a segment of its 
+// own, made of the (shifted) pixels whose intensity it collects.
+// The segments are stored as runs of consecutive pixels ix*ny+iy, in
+// ascending order.  The map never changes after construction, so one
+// DetectorMap can be shared by all threads.
+class DetectorMap
+{
+public:
+	int nx, ny;
+	int detectorNum;
+	// the runs [runStart, runEnd) of pixels and the segment they belong to
+	std::vector<int> runStart, runEnd, runSegment;
+	// the detectors of segment s are segDetectors[segStart[s]] .. segDetectors[segStart[s+1]-1]
+	std::vector<int> segStart, segDetectors;
+
+public:
+	DetectorMap(int nx, int ny, const real *kx2, const real *ky2, 
+		const std::vector<DetectorPtr> &detectors);
+	// sums[i] = sum of |wave|^2 over all pixels seen by detector i
+	template <class T> void Integrate(T (**wave)[2], std::vector<double> &sums) const;
+	// true, if this map can be used for these parameters
+	bool Matches(int nx, int ny, const real *kx2, const real *ky2, 
+		const std::vector<DetectorPtr> &detectors) const;
+	// number of pixels in all runs
+	int Pixels() const;
+
+private:
+	void AddPixel(int pixel, int segment);
+
+	std::vector<double> m_key;
+};
+
+#endif
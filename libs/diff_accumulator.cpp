@@ -0,0 +1,67 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "diff_accumulator.h"
+
+DiffAccumulator::DiffAccumulator(int nx, int ny, int firstPixel, int pixels, 
+								 double memoryLimitMB, const char *spillFile, bool persistent, bool resume) :
+m_n(nx*ny)
+{
+	int pixel;
+
+	m_store = WaveStorePtr(new WaveStore(HeaderBytes+2*m_n*sizeof(float), firstPixel, pixels, 1,
+		memoryLimitMB, spillFile, persistent));
+	if (!resume) 
+		for (pixel=firstPixel; pixel<firstPixel+pixels; pixel++) *(int *)m_store->Data(0, pixel) = 0;
+}
+
+double DiffAccumulator::Add(int pixel, int run, const float_tt *pattern)
+{
+	int i, runs = Runs(pixel);
+	float *mean = (float *)Mean(pixel), *m2 = M2(pixel);
+	float delta, x;
+	double change = 0;
+
+	if (run < runs) return 0;
+	if (runs == 0) {
+		for (i=0; i<m_n; i++) {
+			mean[i] = pattern[i];
+			m2[i] = 0;
+		}
+	}
+	else {
+		for (i=0; i<m_n; i++) {
+			x = pattern[i];
+			delta = (x-mean[i])/(runs+1);
+			mean[i] += delta;
+			m2[i] += (x-mean[i])*delta*(runs+1);
+			change += delta*delta;
+		}
+	}
+	*(int *)m_store->Data(0, pixel) = runs+1;
+	return change;
+}
+
+void DiffAccumulator::Variance(int pixel, float *variance)
+{
+	int i, runs = Runs(pixel);
+	const float *m2 = M2(pixel);
+
+	for (i=0; i<m_n; i++) variance[i] = (runs > 1) ? m2[i]/(runs-1) : 0.0f;
+}
@@ -0,0 +1,61 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DIFF_ACCUMULATOR_H
+#define DIFF_ACCUMULATOR_H
+
+#include "stemtypes_fftw3.h"
+#include "wave_store.h"
+
+// Running averages of the diffraction patterns of the pixels of a STEM 
+// scan over the frozen phonon runs.  Mean and variance are updated in 
+// place with Welford's method; the data is kept in a WaveStore (in 
+// memory or in a mapped file).  Each pixel also counts its runs, so 
+// that a run added again after a restart is ignored.
+class DiffAccumulator
+{
+public:
+	// nx x ny patterns of the pixels firstPixel .. firstPixel+pixels-1.  
+	// A persistent accumulator keeps its file (see WaveStore), with 
+	// resume it continues with the averages already in that file.
+	DiffAccumulator(int nx, int ny, int firstPixel, int pixels, 
+		double memoryLimitMB, const char *spillFile, bool persistent=false, bool resume=false);
+
+	// adds the pattern of run (0, 1, ...) to pixel and returns the sum of
+	// the squared changes of the mean (0 for the first run)
+	double Add(int pixel, int run, const float_tt *pattern);
+	int Runs(int pixel) { return *(int *)m_store->Data(0, pixel); }
+	const float *Mean(int pixel) { return (float *)(m_store->Data(0, pixel)+HeaderBytes); }
+	// the sample variance of the runs so far
+	void Variance(int pixel, float *variance);
+
+	WaveStorePtr Store() { return m_store; }
+
+private:
+	// the run counter, padded so that the arrays stay aligned
+	enum { HeaderBytes = 16 };
+	float *M2(int pixel) { return (float *)(m_store->Data(0, pixel)+HeaderBytes)+m_n; }
+
+	int m_n;
+	WaveStorePtr m_store;
+};
+
+typedef boost::shared_ptr<DiffAccumulator> DiffAccumulatorPtr;
+
+#endif
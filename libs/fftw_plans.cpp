@@ -0,0 +1,209 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "fftw_plans.h"
+
+struct FFTPlanKey {
+	int nx, ny, batch, direction, precision, threads;
+	bool operator<(const FFTPlanKey &k) const {
+		if (threads != k.threads) return threads < k.threads;
+		if (nx != k.nx) return nx < k.nx;
+		if (ny != k.ny) return ny < k.ny;
+		if (batch != k.batch) return batch < k.batch;
+		if (direction != k.direction) return direction < k.direction;
+		return precision < k.precision;
+	}
+};
+
+static std::map<FFTPlanKey, void *> s_plans;
+static unsigned s_rigor = FFTW_ESTIMATE;
+static int s_newPlans[3] = {0,0,0};   /* plans made since the wisdom was loaded/saved, by precision */
+static int s_threads = 1;
+
+void setFFTPlanRigor(unsigned rigor)
+{
+	s_rigor = rigor;
+}
+
+unsigned getFFTPlanRigor()
+{
+	return s_rigor;
+}
+
+void setWaveThreads(int nthreads)
+{
+#ifdef USE_FFTW_THREADS
+	static bool initialized = false;
+
+	if (!initialized) {
+		if ((fftwf_init_threads() == 0) || (fftw_init_threads() == 0)) {
+			printf("setWaveThreads: could not initialize the FFTW threads\n");
+			exit(0);
+		}
+		initialized = true;
+	}
+#endif
+	s_threads = (nthreads > 1) ? nthreads : 1;
+#ifdef USE_FFTW_THREADS
+	fftwf_plan_with_nthreads(s_threads);
+	fftw_plan_with_nthreads(s_threads);
+#endif
+}
+
+int getWaveThreads()
+{
+	return s_threads;
+}
+
+fftwf_plan getFFTPlanf(int nx, int ny, int batch, int direction, fftwf_complex *scratch, int threads)
+{
+	FFTPlanKey key = {nx, ny, batch, direction, 1, (threads > 0) ? threads : s_threads};
+	std::map<FFTPlanKey, void *>::iterator it = s_plans.find(key);
+	fftwf_complex *buf = scratch;
+	fftwf_plan plan;
+	int n[2];
+
+	if (it != s_plans.end()) return (fftwf_plan)it->second;
+
+	n[0] = nx;
+	n[1] = ny;
+	if (buf == NULL) buf = (fftwf_complex *)fftwf_malloc(batch*nx*ny*sizeof(fftwf_complex));
+	if (buf == NULL) {
+		printf("getFFTPlanf: cannot allocate %d x %d x %d array for planning\n", batch, nx, ny);
+		exit(0);
+	}
+#ifdef USE_FFTW_THREADS
+	fftwf_plan_with_nthreads(key.threads);
+#endif
+	plan = fftwf_plan_many_dft(2, n, batch, buf, NULL, 1, nx*ny, buf, NULL, 1, nx*ny, direction, s_rigor);
+#ifdef USE_FFTW_THREADS
+	fftwf_plan_with_nthreads(s_threads);
+#endif
+	if (scratch == NULL) fftwf_free(buf);
+	s_plans[key] = (void *)plan;
+	s_newPlans[1]++;
+	return plan;
+}
+
+fftw_plan getFFTPlan(int nx, int ny, int batch, int direction, fftw_complex *scratch, int threads)
+{
+	FFTPlanKey key = {nx, ny, batch, direction, 2, (threads > 0) ? threads : s_threads};
+	std::map<FFTPlanKey, void *>::iterator it = s_plans.find(key);
+	fftw_complex *buf = scratch;
+	fftw_plan plan;
+	int n[2];
+
+	if (it != s_plans.end()) return (fftw_plan)it->second;
+
+	n[0] = nx;
+	n[1] = ny;
+	if (buf == NULL) buf = (fftw_complex *)fftw_malloc(batch*nx*ny*sizeof(fftw_complex));
+	if (buf == NULL) {
+		printf("getFFTPlan: cannot allocate %d x %d x %d array for planning\n", batch, nx, ny);
+		exit(0);
+	}
+#ifdef USE_FFTW_THREADS
+	fftw_plan_with_nthreads(key.threads);
+#endif
+	plan = fftw_plan_many_dft(2, n, batch, buf, NULL, 1, nx*ny, buf, NULL, 1, nx*ny, direction, s_rigor);
+#ifdef USE_FFTW_THREADS
+	fftw_plan_with_nthreads(s_threads);
+#endif
+	if (scratch == NULL) fftw_free(buf);
+	s_plans[key] = (void *)plan;
+	s_newPlans[2]++;
+	return plan;
+}
+
+int loadFFTWisdom(const char *fileName)
+{
+	char name[1024];
+	FILE *fp;
+	int count = 0;
+
+	if ((fp = fopen(fileName, "r")) != NULL) {
+		count += fftwf_import_wisdom_from_file(fp);
+		fclose(fp);
+	}
+	sprintf(name, "%s_d", fileName);
+	if ((fp = fopen(name, "r")) != NULL) {
+		count += fftw_import_wisdom_from_file(fp);
+		fclose(fp);
+	}
+	s_newPlans[1] = s_newPlans[2] = 0;
+	return count;
+}
+
+/* write to a temporary file of this process first, so that concurrent 
+ * jobs never see a partially written wisdom file */
+static void writeWisdomFile(const char *fileName, int precision)
+{
+	static int count = 0;
+	char tmpName[1024];
+	FILE *fp;
+	int len;
+
+#ifdef _WIN32
+	len = snprintf(tmpName, sizeof(tmpName), "%s.%lu.%d.tmp", fileName, (unsigned long)GetCurrentProcessId(), count++);
+#else
+	len = snprintf(tmpName, sizeof(tmpName), "%s.%ld.%d.tmp", fileName, (long)getpid(), count++);
+#endif
+	if ((len < 0) || (len >= (int)sizeof(tmpName))) {
+		printf("Could not write FFTW wisdom to %s: the file name is too long\n", fileName);
+		return;
+	}
+	if ((fp = fopen(tmpName, "w")) == NULL) {
+		printf("Could not write FFTW wisdom to %s\n", tmpName);
+		return;
+	}
+	if (precision == 1) fftwf_export_wisdom_to_file(fp);
+	else fftw_export_wisdom_to_file(fp);
+	fclose(fp);
+#ifdef _WIN32
+	remove(fileName);
+#endif
+	if (rename(tmpName, fileName) != 0) {
+		printf("Could not rename %s to %s\n", tmpName, fileName);
+		remove(tmpName);
+	}
+}
+
+void saveFFTWisdom(const char *fileName)
+{
+	char name[1024];
+
+	// estimated plans do not add anything to the wisdom
+	if (s_rigor == FFTW_ESTIMATE) return;
+
+	if (s_newPlans[1] > 0) writeWisdomFile(fileName, 1);
+	if (s_newPlans[2] > 0) {
+		sprintf(name, "%s_d", fileName);
+		writeWisdomFile(name, 2);
+	}
+	s_newPlans[1] = s_newPlans[2] = 0;
+}
@@ -0,0 +1,86 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FFTW_PLANS_H
+#define FFTW_PLANS_H
+
+#include "fftw3.h"
+
+/*************************************************************************
+* FFTW plan cache
+* Plans are created once per (nx, ny, batch, direction, precision, threads)
+* and shared by all wave functions of that size.  They are in-place plans for
+* batch consecutive nx x ny arrays and must be run with 
+* fftw(f)_execute_dft(plan, array, array) on arrays allocated with 
+* fftw_malloc (e.g. by complex2Df()).
+* Planning is not thread safe (neither is FFTW's planner), so plans should
+* be requested from serial code only.
+************************************************************************/
+
+// set the planner rigor for all plans created from now on
+// (FFTW_ESTIMATE, FFTW_MEASURE or FFTW_PATIENT):
+void setFFTPlanRigor(unsigned rigor);
+unsigned getFFTPlanRigor();
+
+// Threads working on one wave function: the FFT plans created from now
+// on (if FFTW was built with thread support, see USE_FFTW_THREADS) and the
+// kernels applied to a whole wave function (transmit, propagate, ...).
+// Use 1 while several wave functions are propagated in parallel.
+void setWaveThreads(int nthreads);
+int getWaveThreads();
+
+// If scratch is given, it is used for planning (its content will be
+// destroyed unless the rigor is FFTW_ESTIMATE).  Otherwise a temporary
+// array is allocated.  threads > 0 plans for that many threads instead
+// of the wave threads, e.g. 1 for plans run by several threads at once.
+fftwf_plan getFFTPlanf(int nx, int ny, int batch, int direction, fftwf_complex *scratch=NULL, int threads=0);
+fftw_plan  getFFTPlan(int nx, int ny, int batch, int direction, fftw_complex *scratch=NULL, int threads=0);
+
+// import/export the accumulated FFTW wisdom (single and double precision).
+// The double precision wisdom goes to fileName with "_d" appended.
+// loadFFTWisdom() returns the number of files successfully read.
+int loadFFTWisdom(const char *fileName);
+void saveFFTWisdom(const char *fileName);
+
+/*************************************************************************
+* FFTW<T> maps the scalar type T (float or double) to the matching FFTW
+* types and functions, so that kernels can be written once as templates
+* and used in both precisions.
+************************************************************************/
+template <class T> struct FFTW;
+
+template <> struct FFTW<float>
+{
+	typedef fftwf_complex complex;
+	typedef fftwf_plan plan;
+	static plan Plan(int nx, int ny, int batch, int direction, complex *scratch=NULL)
+	{ return getFFTPlanf(nx, ny, batch, direction, scratch); }
+	static void Execute(plan p, complex *a) { fftwf_execute_dft(p, a, a); }
+};
+
+template <> struct FFTW<double>
+{
+	typedef fftw_complex complex;
+	typedef fftw_plan plan;
+	static plan Plan(int nx, int ny, int batch, int direction, complex *scratch=NULL)
+	{ return getFFTPlan(nx, ny, batch, direction, scratch); }
+	static void Execute(plan p, complex *a) { fftw_execute_dft(p, a, a); }
+};
+
+#endif
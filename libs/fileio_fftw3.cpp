@@ -56,6 +56,16 @@ QSTEM - image simulation for TEM/STEM/CBED
 #define	NCMAX	132	/* characters per line to read */
 #define NPARAM	64	/* number of parameters in tiff files */
 
+/* State of the random number generators (phonon displacements, 
+ * occupancies, ran1() and gasdev()).  It is kept here rather than in 
+ * the functions, so that getRandomState() can save it for a restart. */
+#define RAN1_NTAB 32
+static long phononIseed=0, phononSeedUsed=0;
+static long replicateIdum=-1, tiltIdum=-1;
+static long ran1Iy=0, ran1Iv[RAN1_NTAB];
+static int gasdevIset=0;
+static float gasdevGset;
+
 #define N_A 6.022e+23
 #define K_B 1.38062e-23      /* Boltzman constant */
 #define PID 3.14159265358979 /* pi */
@@ -379,7 +389,6 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 	static double *u2=NULL,*u2T,ux=0,uy=0,uz=0; // u2Collect=0; // Ttotal=0;
 	// static double uxCollect=0,uyCollect=0,uzCollect=0;
 	static int *u2Count = NULL,*u2CountT,runCount = 1,u2Size = -1;
-	static long iseed=0;
 	static double **Mm=NULL,**MmInv=NULL;
 	// static double **MmOrig=NULL,**MmOrigInv=NULL;
 	static double *axCell,*byCell,*czCell,*uf,*b;
@@ -493,7 +502,13 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 												   * introduced in order to match the wobble factor with <u^2>
 												   */
 							   scale = (float) sqrt(muls->tds_temp/300.0) ;
-							   iseed = -(long)(time(NULL));
+							   phononIseed = -(long)(time(NULL));
+						   }
+						   /* a fixed seed (e.g. shared by the processes of one MPI phonon group)
+						    * restarts the random sequence whenever it changes */
+						   if ((muls->phononSeed != 0) && (muls->phononSeed != phononSeedUsed)) {
+							   phononSeedUsed = muls->phononSeed;
+							   phononIseed = -labs(phononSeedUsed);
 						   }
 
 
@@ -575,8 +590,8 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 							   if (Nk > 800)
 								   printf("Will create phonon displacements for %d k-vectors - please wait ...\n",Nk);
 							   for (lambda=0;lambda<3*Ns;lambda++) for (ik=0;ik<Nk;ik++) {
-								   q1[lambda][ik] = (omega[ik][lambda] * gasdev( &iseed ));
-								   q2[lambda][ik] = (omega[ik][lambda] * gasdev( &iseed ));
+								   q1[lambda][ik] = (omega[ik][lambda] * gasdev( &phononIseed ));
+								   q2[lambda][ik] = (omega[ik][lambda] * gasdev( &phononIseed ));
 							   }
 							   // printf("Q: %g %g %g\n",q1[0][0],q1[5][8],q1[0][3]);
 						   }
@@ -586,9 +601,9 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 	if (muls->Einstein) {	    
 	   /* convert the Debye-Waller factor to sqrt(<u^2>) */
 	   wobble = scale*sqrt(dw*wobScale);
-	   u[0] = (wobble*sq3 * gasdev( &iseed ));
-	   u[1] = (wobble*sq3 * gasdev( &iseed ));
-	   u[2] = (wobble*sq3 * gasdev( &iseed ));
+	   u[0] = (wobble*sq3 * gasdev( &phononIseed ));
+	   u[1] = (wobble*sq3 * gasdev( &phononIseed ));
+	   u[2] = (wobble*sq3 * gasdev( &phononIseed ));
 	   ///////////////////////////////////////////////////////////////////////
 	   // Book keeping:
 		u2[ZnumIndex] += u[0]*u[0]+u[1]*u[1]+u[2]*u[2];
@@ -1054,8 +1069,7 @@ int readNextCSSRAtom(atom *newAtom,int flag, char *fileName) {
 // #define NPARAM	64    /* number of parameters */
 
 //MCS - why do we have this function and initMuls in stem3.cpp?
-MULS initMu() {
-	MULS muls;
+void initMu(MULS &muls) {
 	int sCount,i,slices = 2;
 	char waveFile[32];
 	char *waveFileBase = "w";
@@ -1092,7 +1106,7 @@ MULS initMu() {
 
 
 	/* make multislice read the inout files and assign transr and transi: */
-	muls.trans = NULL;
+	muls.trans.Free();
 	muls.cz = NULL;  // (float_t *)malloc(muls.slices*sizeof(float_t));
 
 	muls.onlyFresnel = 0;
@@ -1113,7 +1127,6 @@ MULS initMu() {
 	/****************************************************/
 	/* copied from slicecell.c                          */
 	muls.pendelloesung = NULL;
-	return muls;
 }
 // #undef NCINMAX 500
 // #undef NPARAM	64    /* number of parameters */
@@ -1123,7 +1136,8 @@ int readCubicCFG(double **pos,double **dw, int **Znums, double *ax,double *by,do
 					 atom *atoms;
 					 int Natom;
 					 int j;
-					 MULS mu = initMu();
+					 MULS mu;
+					 initMu(mu);
 
 					 mu.atomKinds = 0;
 					 mu.Znums = NULL;
@@ -1192,7 +1206,7 @@ void replicateUnitCell(int ncoord,int *natom,MULS *muls,atom* atoms,int handleVa
 	double choice,lastOcc;
 	double *u;
 	// seed for random number generation
-	static long idum = -1;
+	// (uses the file scope seed replicateIdum)
 
 	ncx = muls->nCellX;
 	ncy = muls->nCellY;
@@ -1256,8 +1270,8 @@ void replicateUnitCell(int ncoord,int *natom,MULS *muls,atom* atoms,int handleVa
 						// 
 						// if the total occupancy is less than 1 -> make sure we keep this
 						// if the total occupancy is greater than 1 (unphysical) -> rescale all partial occupancies!
-						if (totOcc < 1.0) choice = ran1(&idum);   
-						else choice = totOcc*ran1(&idum);
+						if (totOcc < 1.0) choice = ran1(&replicateIdum);   
+						else choice = totOcc*ran1(&replicateIdum);
 						// printf("Choice: %g %g %d, %d %d\n",totOcc,choice,j,i,jequal);
 						lastOcc = 0;
 						for (i2=i;i2>jequal;i2--) {
@@ -1688,7 +1702,7 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 	//static int u2Count = 0;
 	// static long iseed=0;
 	static double *u;
-	static long idum = -1;
+	// (uses the file scope seed tiltIdum)
 
 
 	// if (iseed == 0) iseed = -(long) time( NULL );
@@ -1849,8 +1863,8 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 						// 
 						// if the total occupancy is less than 1 -> make sure we keep this
 						// if the total occupancy is greater than 1 (unphysical) -> rescale all partial occupancies!
-						if (totOcc < 1.0) choice = ran1(&idum);   
-						else choice = totOcc*ran1(&idum);
+						if (totOcc < 1.0) choice = ran1(&tiltIdum);   
+						else choice = totOcc*ran1(&tiltIdum);
 						// printf("Choice: %g %g %d, %d %d\n",totOcc,choice,j,i,jequal);
 						lastOcc = 0;
 						for (i2=iatom;i2<jequal;i2++) {
@@ -2575,8 +2589,8 @@ float ran(long *idum) {
 double ran1(long *idum) { 
 	int j; 
 	long k; 
-	static long iy=0; 
-	static long iv[NTAB]; 
+	long &iy = ran1Iy;   // the state is at file scope, see getRandomState()
+	long *iv = ran1Iv; 
 	double temp; 
 	if (*idum <= 0 || !iy) { // Initialize. 
 		if (-(*idum) < 1) *idum=1; // Be sure to prevent  idum = 0. 
@@ -2609,8 +2623,8 @@ double gasdev(long *idum)
 * using ran1(idum) as the source of uniform deviates. */
 { 
 	// float ran1(long *idum); 
-	static int iset=0; 
-	static float gset; 
+	int &iset = gasdevIset;   // the state is at file scope, see getRandomState()
+	float &gset = gasdevGset; 
 	double fac,rsq,v1,v2; 
 	if (*idum < 0) {
 		iset=0; // Reinitialize. 
@@ -2638,6 +2652,47 @@ double gasdev(long *idum)
 	} 
 }
 
+/*****************************************************************
+* getRandomState(), setRandomState()
+* save and restore the complete state of the random numbers used for
+* the atom positions (phonon displacements and occupancies), so that
+* a restarted simulation draws the same configurations.  The phonon 
+* seed in use is part of the state; setRandomState() also puts it
+* into muls->phononSeed, so that phononDisplacement() continues the
+* restored sequence instead of restarting it.
+****************************************************************/
+void getRandomState(std::vector<double> &state)
+{
+	int j;
+
+	state.clear();
+	state.push_back((double)phononIseed);
+	state.push_back((double)phononSeedUsed);
+	state.push_back((double)replicateIdum);
+	state.push_back((double)tiltIdum);
+	state.push_back((double)gasdevIset);
+	state.push_back((double)gasdevGset);
+	state.push_back((double)ran1Iy);
+	for (j=0;j<RAN1_NTAB;j++) state.push_back((double)ran1Iv[j]);
+}
+
+int setRandomState(MULS *muls, const std::vector<double> &state)
+{
+	int j;
+
+	if (state.size() != 7+RAN1_NTAB) return 0;
+	phononIseed    = (long)state[0];
+	phononSeedUsed = (long)state[1];
+	replicateIdum  = (long)state[2];
+	tiltIdum       = (long)state[3];
+	gasdevIset     = (int)state[4];
+	gasdevGset     = (float)state[5];
+	ran1Iy         = (long)state[6];
+	for (j=0;j<RAN1_NTAB;j++) ran1Iv[j] = (long)state[7+j];
+	if (phononSeedUsed != 0) muls->phononSeed = phononSeedUsed;
+	return 1;
+}
+
 void writeSTEMinput(char* stemFile,char *cfgFile,MULS *muls) {
 	FILE *fpSTEM;
 	char folder[64];
@@ -48,6 +48,9 @@ void writeAmorphous(FILE *fp,superCellBox superCell,int nstart,int nstop);
 
 double gasdev(long *idum); 
 double ran1(long *idum);
+/* state of the random numbers for the atom positions, for restarts */
+void getRandomState(std::vector<double> &state);
+int setRandomState(MULS *muls, const std::vector<double> &state);
 float ran(long *idum);
 int atomCompareZYX(const void *atPtr1,const void *atPtr2);
 int atomCompareZnum(const void *atPtr1,const void *atPtr2);
@@ -134,8 +134,9 @@ void CImageIO::ReadHeader(const char *fileName)
     }
   if (m_commentSize>0)
     {
-	  fread( (void*)m_buf, 1, m_commentSize, fpHead );
-      m_comment = std::string(m_buf);
+      std::vector<char> comment(m_commentSize);
+	  fread( (void*)&comment[0], 1, m_commentSize, fpHead );
+      m_comment = std::string(comment.begin(), comment.end());
     }
 
 
@@ -162,13 +163,14 @@ void CImageIO::ReadImage(void **pix, int nx, int ny, const char *fileName)
     }
     else 
     {
-      if ((m_nx != nx)||(m_ny != nx)) {
+      if ((m_nx != nx)||(m_ny != ny)) {
         sprintf(m_buf, "readImage: image size mismatch nx = %d (%d), ny = %d (%d)\n", m_nx,nx,m_ny,ny);
         throw std::runtime_error(std::string(m_buf));
       }
       
       // Seek to the location of the actual data
-	  fseek( fpImage, 56 + (m_commentSize)+(2 * m_paramSize), SEEK_SET );
+	  // (header, parameters and comment, as written by WriteData())
+	  fseek( fpImage, m_headerSize + m_paramSize*sizeof(double) + m_commentSize, SEEK_SET );
       
       // this is type-agnostic - the type interpretation is done by the
       //   function sending in the pointer.  It casts it as void for the reading,
@@ -227,6 +229,21 @@ void CImageIO::ReadImage(void **pix, int nx, int ny, const char *fileName)
  * Image header routines
  ****************************************************************/
 
+std::vector<double> CImageIO::GetParams() const
+{
+  return m_params;
+}
+
+int CImageIO::GetNx() const
+{
+  return m_nx;
+}
+
+int CImageIO::GetNy() const
+{
+  return m_ny;
+}
+
 void CImageIO::SetComment(std::string comment) 
 {
   m_comment = comment;
@@ -22,9 +22,9 @@
  *
  * Note that header parameters are persistent on any object.  You
  *   should use the various Set* functions to set parameters as
- *   necessary.  You should not need to read values from this class - 
- *   only set them.  They will be recorded to any file saved from this
- *   this object.
+ *   necessary.  Apart from the parameters (GetParams()), you should 
+ *   not need to read values from this class - only set them.  They 
+ *   will be recorded to any file saved from this this object.
  **************************************************************/
 
 class CImageIO {
@@ -51,6 +51,8 @@ public:
   void WriteRealImage(void **pix, const char *fileName);
   void WriteComplexImage(void **pix, const char *fileName);
   void ReadImage(void **pix, int nx, int ny, const char *fileName);
+  // reads in the header only, e.g. to find out the size of an image before reading it
+  void ReadHeader(const char *fileName);
   
   //void WriteImage( std::string fileName);
         
@@ -59,10 +61,13 @@ public:
   void SetParams(std::vector<double> params);
   void SetParameter(int index, double value);
   void SetResolution(double resX, double resY);
+
+  // header values of the last image read (or the ones set)
+  std::vector<double> GetParams() const;
+  int GetNx() const;
+  int GetNy() const;
 private:
   void WriteData(void **pix, const char *fileName);
-  // reads in the header; returns the byte offset at which we should start reading image data.
-  void ReadHeader(const char *fileName);
 };
 
 typedef boost::shared_ptr<CImageIO> ImageIOPtr;
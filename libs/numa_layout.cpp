@@ -0,0 +1,162 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "numa_layout.h"
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+NumaLayout::NumaLayout(int nThreads, int pinMode, const char *sysfsDir, const std::vector<int> *allowed) :
+threads(nThreads > 0 ? nThreads : 1),
+pinning(pinMode)
+{
+	int cpu, ncpu;
+	std::vector<int> cpus;
+#ifdef __linux__
+	char fileName[1024], buf[4096];
+	std::vector<int> ids, usable;
+	struct dirent *entry;
+	cpu_set_t set;
+	DIR *dir;
+	FILE *fp;
+	size_t i, k;
+
+	if (allowed != NULL) allowedCpus = *allowed;
+	else if (sched_getaffinity(0, sizeof(set), &set) == 0) 
+		for (cpu=0; cpu<CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &set)) allowedCpus.push_back(cpu);
+	std::sort(allowedCpus.begin(), allowedCpus.end());
+
+	if ((dir = opendir(sysfsDir)) != NULL) {
+		while ((entry = readdir(dir)) != NULL) 
+			if ((strncmp(entry->d_name, "node", 4) == 0) && (entry->d_name[4] >= '0') && (entry->d_name[4] <= '9'))
+				ids.push_back(atoi(entry->d_name+4));
+		closedir(dir);
+	}
+	std::sort(ids.begin(), ids.end());
+	for (i=0; i<ids.size(); i++) {
+		snprintf(fileName, sizeof(fileName), "%s/node%d/cpulist", sysfsDir, ids[i]);
+		if ((fp = fopen(fileName, "r")) == NULL) continue;
+		if ((fgets(buf, sizeof(buf), fp) != NULL) && ParseCpuList(buf, cpus)) {
+			usable.clear();
+			for (k=0; k<cpus.size(); k++) 
+				if (allowedCpus.empty() || std::binary_search(allowedCpus.begin(), allowedCpus.end(), cpus[k])) 
+					usable.push_back(cpus[k]);
+			/* nodes without (allowed) cpus, e.g. memory only, are skipped */
+			if (usable.size() > 0) nodeCpus.push_back(usable);
+		}
+		fclose(fp);
+	}
+	ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	if (allowed != NULL) allowedCpus = *allowed;
+	ncpu = threads;
+#endif
+	if (nodeCpus.empty()) {
+		cpus.clear();
+		if (!allowedCpus.empty()) cpus = allowedCpus;
+		else for (cpu=0; cpu<ncpu; cpu++) cpus.push_back(cpu);
+		nodeCpus.push_back(cpus);
+	}
+	// more nodes than threads would leave nodes without threads
+	if ((int)nodeCpus.size() > threads) nodeCpus.resize(threads);
+}
+
+int NumaLayout::ThreadNode(int thread) const
+{
+	return (int)(((long)thread*Nodes())/threads);
+}
+
+int NumaLayout::FirstThread(int node) const
+{
+	int thread = (int)(((long)node*threads+Nodes()-1)/Nodes());
+	return ((thread < threads) && (ThreadNode(thread) == node)) ? thread : -1;
+}
+
+std::vector<int> NumaLayout::ThreadCpus(int thread) const
+{
+	int node = ThreadNode(thread);
+	const std::vector<int> &cpus = nodeCpus[node];
+
+	if (pinning == PIN_CORES) 
+		return std::vector<int>(1, cpus[(thread-FirstThread(node)) % cpus.size()]);
+	return cpus;
+}
+
+bool NumaLayout::Pin(int thread) const
+{
+	if (pinning == PIN_NONE) return true;
+#ifdef __linux__
+	std::vector<int> cpus = ThreadCpus(thread);
+	cpu_set_t set;
+	size_t i;
+
+	CPU_ZERO(&set);
+	for (i=0; i<cpus.size(); i++) 
+		if (cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+	return (sched_setaffinity(0, sizeof(set), &set) == 0);
+#else
+	return false;
+#endif
+}
+
+bool NumaLayout::Unpin() const
+{
+	if ((pinning == PIN_NONE) || allowedCpus.empty()) return true;
+#ifdef __linux__
+	cpu_set_t set;
+	size_t i;
+
+	CPU_ZERO(&set);
+	for (i=0; i<allowedCpus.size(); i++) 
+		if (allowedCpus[i] < CPU_SETSIZE) CPU_SET(allowedCpus[i], &set);
+	return (sched_setaffinity(0, sizeof(set), &set) == 0);
+#else
+	return false;
+#endif
+}
+
+bool NumaLayout::ParseCpuList(const char *list, std::vector<int> &cpus)
+{
+	const char *s = list;
+	char *end;
+	long first, last, cpu;
+
+	cpus.clear();
+	while ((*s != '\0') && (*s != '\n')) {
+		first = strtol(s, &end, 10);
+		if ((end == s) || (first < 0)) return false;
+		last = first;
+		s = end;
+		if (*s == '-') {
+			last = strtol(s+1, &end, 10);
+			if ((end == s+1) || (last < first)) return false;
+			s = end;
+		}
+		for (cpu=first; cpu<=last; cpu++) cpus.push_back((int)cpu);
+		if (*s == ',') s++;
+		else if ((*s != '\0') && (*s != '\n')) return false;
+	}
+	return true;
+}
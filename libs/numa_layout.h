@@ -0,0 +1,73 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NUMA_LAYOUT_H
+#define NUMA_LAYOUT_H
+
+#include <vector>
+#include "boost/shared_ptr.hpp"
+
+// thread pinning modes (MULS::threadPinning)
+#define PIN_NONE  0   /* threads float freely */
+#define PIN_CORES 1   /* every thread is bound to one cpu of its node */
+#define PIN_NODES 2   /* every thread is bound to all cpus of its node */
+
+// The NUMA nodes of the machine and how the OpenMP threads are spread 
+// over them.  Threads are assigned to nodes in contiguous blocks 
+// (threads 0 .. threads/nodes-1 on the first node, ...), so that threads
+// with neighboring numbers share a node.  On Linux the nodes are read 
+// from sysfsDir (/sys/devices/system/node), elsewhere, or if that fails,
+// the machine is a single node.  Only the cpus the process may run on
+// (e.g. under taskset or a batch system's cgroup) are used.
+// Memory is placed on the node of the thread that touches it first, so
+// arrays that a thread reads a lot should be allocated (and cleared) by
+// that thread after Pin().
+class NumaLayout
+{
+public:
+	int threads;
+	int pinning;                            /* PIN_NONE, PIN_CORES or PIN_NODES */
+	std::vector<std::vector<int> > nodeCpus;  /* the cpus of each node */
+	std::vector<int> allowedCpus;             /* the cpus the process may run on, empty: all */
+
+public:
+	// allowed: the cpus the process may run on, NULL: the affinity mask 
+	// of the calling thread
+	NumaLayout(int threads, int pinning, const char *sysfsDir="/sys/devices/system/node", 
+		const std::vector<int> *allowed=NULL);
+	int Nodes() const { return (int)nodeCpus.size(); }
+	// the node thread is assigned to
+	int ThreadNode(int thread) const;
+	// the lowest numbered thread on node (-1 if the node has no threads)
+	int FirstThread(int node) const;
+	// the cpus thread is bound to
+	std::vector<int> ThreadCpus(int thread) const;
+	// binds the calling thread to the cpus of thread.  Does nothing for 
+	// PIN_NONE, false if pinning is not supported.
+	bool Pin(int thread) const;
+	// binds the calling thread to allowedCpus again, as before Pin()
+	bool Unpin() const;
+
+	// reads a cpu list like "0-3,8,10-11", false if it is malformed
+	static bool ParseCpuList(const char *list, std::vector<int> &cpus);
+};
+
+typedef boost::shared_ptr<NumaLayout> NumaLayoutPtr;
+
+#endif
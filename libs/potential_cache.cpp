@@ -0,0 +1,213 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdexcept>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "potential_cache.h"
+
+/* the header of a cache file, followed by the nz x nx x ny floats of the box */
+struct FileHeader
+{
+	char magic[8];
+	int version;
+	int Z;
+	double B;
+	int nx, ny, nz, zOversample;
+	double dx, dy, dz, v0;
+	int scatFactors, reserved;
+	double radius;
+};
+
+static const char s_magic[8] = {'Q','S','T','E','M','B','O','X'};
+
+static bool sameValue(double a, double b)
+{
+	return fabs(a-b) <= 1e-6*(1.0+fabs(a));
+}
+
+bool AtomBoxKey::Matches(const AtomBoxKey &key) const
+{
+	return (Z == key.Z) && (nx == key.nx) && (ny == key.ny) && (nz == key.nz) &&
+		(zOversample == key.zOversample) && (scatFactors == key.scatFactors) &&
+		sameValue(B, key.B) && sameValue(dx, key.dx) && sameValue(dy, key.dy) && 
+		sameValue(dz, key.dz) && sameValue(v0, key.v0) && sameValue(radius, key.radius);
+}
+
+PotentialCache::PotentialCache(const std::string &folder) :
+m_folder(folder)
+{
+}
+
+PotentialCache::~PotentialCache()
+{
+	for (size_t i=0; i<m_mappings.size(); i++) {
+#ifdef _WIN32
+		UnmapViewOfFile(m_mappings[i].data);
+		CloseHandle(m_mappings[i].mapping);
+		CloseHandle(m_mappings[i].file);
+#else
+		munmap(m_mappings[i].data, m_mappings[i].bytes);
+#endif
+	}
+}
+
+/* The name tells the element and B, and a hash of the whole key keeps
+ * the boxes of different samplings apart. */
+std::string PotentialCache::FileName(const AtomBoxKey &key) const
+{
+	char text[256], name[64];
+	unsigned int hash = 2166136261u;
+	const char *c;
+
+	snprintf(text, sizeof(text), "%d %.6g %d %d %d %.6g %.6g %.6g %d %.6g %d %.6g", key.Z, key.B, key.nx, key.ny, 
+		key.nz, key.dx, key.dy, key.dz, key.zOversample, key.v0, key.scatFactors, key.radius);
+	for (c=text; *c != '\0'; c++) hash = (hash ^ (unsigned char)*c)*16777619u;
+	snprintf(name, sizeof(name), "atombox_Z%d_B%d_%08x.bin", key.Z, (int)floor(100.0*key.B+0.5), hash);
+	if (m_folder.empty()) return name;
+	return m_folder+"/"+name;
+}
+
+const float *PotentialCache::Load(const AtomBoxKey &key)
+{
+	std::string fileName = FileName(key);
+	size_t bytes = sizeof(FileHeader)+key.Values()*sizeof(float);
+	FileHeader header;
+	Mapping m;
+
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	m.file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m.file == INVALID_HANDLE_VALUE) return NULL;
+	if (!GetFileSizeEx(m.file, &size) || ((unsigned long long)size.QuadPart != bytes)) {
+		CloseHandle(m.file);
+		return NULL;
+	}
+	m.mapping = CreateFileMapping(m.file, NULL, PAGE_READONLY, 0, 0, NULL);
+	m.data = (m.mapping != NULL) ? MapViewOfFile(m.mapping, FILE_MAP_READ, 0, 0, bytes) : NULL;
+	if (m.data == NULL) {
+		if (m.mapping != NULL) CloseHandle(m.mapping);
+		CloseHandle(m.file);
+		return NULL;
+	}
+#else
+	struct stat status;
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) return NULL;
+	if ((fstat(fd, &status) != 0) || ((size_t)status.st_size != bytes)) {
+		close(fd);
+		return NULL;
+	}
+	m.data = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* the mapping keeps the file, even if another job replaces it */
+	close(fd);
+	if (m.data == MAP_FAILED) return NULL;
+#endif
+	m.bytes = bytes;
+
+	AtomBoxKey fileKey;
+	memcpy(&header, m.data, sizeof(FileHeader));
+	fileKey.Z = header.Z;
+	fileKey.B = header.B;
+	fileKey.nx = header.nx;
+	fileKey.ny = header.ny;
+	fileKey.nz = header.nz;
+	fileKey.dx = header.dx;
+	fileKey.dy = header.dy;
+	fileKey.dz = header.dz;
+	fileKey.zOversample = header.zOversample;
+	fileKey.v0 = header.v0;
+	fileKey.scatFactors = header.scatFactors;
+	fileKey.radius = header.radius;
+	if ((memcmp(header.magic, s_magic, sizeof(s_magic)) != 0) || (header.version != version) ||
+		!fileKey.Matches(key)) {
+#ifdef _WIN32
+		UnmapViewOfFile(m.data);
+		CloseHandle(m.mapping);
+		CloseHandle(m.file);
+#else
+		munmap(m.data, bytes);
+#endif
+		return NULL;
+	}
+	m_mappings.push_back(m);
+	return (const float *)((const char *)m.data+sizeof(FileHeader));
+}
+
+void PotentialCache::Store(const AtomBoxKey &key, const float *values)
+{
+	static int count = 0;
+	std::string fileName = FileName(key);
+	char tmpName[1024];
+	FileHeader header;
+	FILE *fp;
+	int length;
+	bool ok;
+
+	memset(&header, 0, sizeof(FileHeader));
+	memcpy(header.magic, s_magic, sizeof(s_magic));
+	header.version = version;
+	header.Z = key.Z;
+	header.B = key.B;
+	header.nx = key.nx;
+	header.ny = key.ny;
+	header.nz = key.nz;
+	header.zOversample = key.zOversample;
+	header.dx = key.dx;
+	header.dy = key.dy;
+	header.dz = key.dz;
+	header.v0 = key.v0;
+	header.scatFactors = key.scatFactors;
+	header.radius = key.radius;
+
+	/* a name of its own for every process and box, renamed only when complete */
+#ifdef _WIN32
+	length = snprintf(tmpName, sizeof(tmpName), "%s.%lu.%d.tmp", fileName.c_str(), 
+		(unsigned long)GetCurrentProcessId(), count++);
+#else
+	length = snprintf(tmpName, sizeof(tmpName), "%s.%ld.%d.tmp", fileName.c_str(), (long)getpid(), count++);
+#endif
+	if ((length < 0) || (length >= (int)sizeof(tmpName)))
+		throw std::runtime_error("PotentialCache: the file name "+fileName+" is too long");
+	if ((fp = fopen(tmpName, "wb")) == NULL)
+		throw std::runtime_error(std::string("PotentialCache: could not write ")+tmpName);
+	ok = (fwrite(&header, sizeof(FileHeader), 1, fp) == 1) &&
+		(fwrite(values, sizeof(float), key.Values(), fp) == key.Values());
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok) {
+		remove(tmpName);
+		throw std::runtime_error(std::string("PotentialCache: could not write ")+tmpName);
+	}
+#ifdef _WIN32
+	remove(fileName.c_str());
+#endif
+	if (rename(tmpName, fileName.c_str()) != 0) {
+		remove(tmpName);
+		throw std::runtime_error("PotentialCache: could not rename "+std::string(tmpName)+" to "+fileName);
+	}
+}
@@ -0,0 +1,88 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef POTENTIAL_CACHE_H
+#define POTENTIAL_CACHE_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "boost/shared_ptr.hpp"
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// The parameters an atom box was computed for: element, Debye-Waller
+// factor B (A^2), size and sampling (A) of the box, z-oversampling of
+// the slices, beam energy (kV), the table of scattering factors and 
+// the radius (A) at which the potential is cut off.
+struct AtomBoxKey
+{
+	int Z;
+	double B;
+	int nx, ny, nz;
+	double dx, dy, dz;
+	int zOversample;
+	double v0;
+	int scatFactors;
+	double radius;
+
+	size_t Values() const { return (size_t)nx*(size_t)ny*(size_t)nz; }
+	bool Matches(const AtomBoxKey &key) const;
+};
+
+// Keeps the real space potentials of the elements (the atom boxes of
+// stemlib.cpp, nz x nx x ny floats each) in files of a cache folder,
+// one per key.  A file starts with a header of its own version and key,
+// so that a box is only ever used for exactly the parameters it was 
+// computed for.  Load() maps the file and returns the values right in
+// the mapping, which stays valid as long as the cache.  Store() writes
+// a temporary file and renames it, so that concurrent jobs sharing the
+// cache never read a partially written box.
+class PotentialCache
+{
+public:
+	// folder: where the files are kept, the current folder if empty
+	PotentialCache(const std::string &folder);
+	~PotentialCache();
+
+	// the values of the box of key, NULL if it is not in the cache
+	const float *Load(const AtomBoxKey &key);
+	// throws std::runtime_error, if the box could not be written
+	void Store(const AtomBoxKey &key, const float *values);
+	std::string FileName(const AtomBoxKey &key) const;
+
+	static const int version = 2;
+
+private:
+	struct Mapping
+	{
+		void *data;
+		size_t bytes;
+#ifdef _WIN32
+		HANDLE file, mapping;
+#endif
+	};
+	std::string m_folder;
+	std::vector<Mapping> m_mappings;
+};
+
+typedef boost::shared_ptr<PotentialCache> PotentialCachePtr;
+
+#endif
@@ -0,0 +1,247 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <math.h>
+#include "matrixlib.h"
+#include "propagator.h"
+#include "fftw_plans.h"
+
+Propagator::Propagator(int x, int y, real ax, real by, real z, real wavlen) :
+nx(x),
+ny(y),
+dz(z),
+kx(x), ky(y), kx2(x), ky2(y),
+propxr(x), propxi(x), propyr(y), propyi(y),
+propxrD(x), propxiD(x), propyrD(y), propyiD(y),
+m_ax(ax),
+m_by(by),
+m_wavlen(wavlen)
+{
+	int ix, iy;
+	real scale, t;
+	double k, td;
+
+	scale = dz*PI;
+
+	for( ix=0; ix<nx; ix++) {
+		kx[ix] = (ix>nx/2) ? (real)(ix-nx)/ax : 
+			(real)ix/ax;
+		kx2[ix] = kx[ix]*kx[ix];
+		t = scale * (kx2[ix]*wavlen);
+		propxr[ix] = (real)  cos(t);
+		propxi[ix] = (real) -sin(t);
+		k = (ix>nx/2) ? (double)(ix-nx)/ax : (double)ix/ax;
+		td = PI*(double)dz*k*k*(double)wavlen;
+		propxrD[ix] =  cos(td);
+		propxiD[ix] = -sin(td);
+	}
+	for( iy=0; iy<ny; iy++) {
+		ky[iy] = (iy>ny/2) ? 
+			(real)(iy-ny)/by : 
+			(real)iy/by;
+		ky2[iy] = ky[iy]*ky[iy];
+		t = scale * (ky2[iy]*wavlen);
+		propyr[iy] = (real)  cos(t);
+		propyi[iy] = (real) -sin(t);
+		k = (iy>ny/2) ? (double)(iy-ny)/by : (double)iy/by;
+		td = PI*(double)dz*k*k*(double)wavlen;
+		propyrD[iy] =  cos(td);
+		propyiD[iy] = -sin(td);
+	}
+	k2max = nx/(2.0F*ax);
+	if (ny/(2.0F*by) < k2max ) k2max = ny/(2.0F*by);
+	k2max = 2.0/3.0 * k2max;
+	k2max = k2max*k2max;
+
+	/* collect the runs of pixels inside the bandwidth limit for each row */
+	rowSpans.push_back(0);
+	for( ix=0; ix<nx; ix++) {
+		if( kx2[ix] < k2max ) {
+			for( iy=0; iy<ny; iy++) {
+				if( (kx2[ix] + ky2[iy]) < k2max ) {
+					if ((iy == 0) || ((kx2[ix] + ky2[iy-1]) >= k2max)) spanStart.push_back(iy);
+					if ((iy == ny-1) || ((kx2[ix] + ky2[iy+1]) >= k2max)) spanEnd.push_back(iy+1);
+				}
+			}
+		}
+		rowSpans.push_back((int)spanStart.size());
+	}
+}
+
+bool Propagator::Matches(int x, int y, real ax, real by, real z, real wavlen) const
+{
+	return ((x == nx) && (y == ny) && (ax == m_ax) && (by == m_by) && 
+		(z == dz) && (wavlen == m_wavlen));
+}
+
+void Propagator::Apply(void **w, real norm) const
+{
+	ApplyTables((real (**)[2])w, norm, propxr, propxi, propyr, propyi);
+}
+
+void Propagator::Apply(fftw_complex **w, double norm) const
+{
+	ApplyTables(w, norm, propxrD, propxiD, propyrD, propyiD);
+}
+
+template <class T> void Propagator::ApplyTables(T (**wave)[2], T norm, 
+	const std::vector<T> &propxr, const std::vector<T> &propxi, 
+	const std::vector<T> &propyr, const std::vector<T> &propyi) const
+{
+	int ix, iy, is;
+	T wr, wi, tr, ti, pxr, pxi;
+	T (*row)[2];
+	int threads = getWaveThreads();
+
+#pragma omp parallel for if(threads > 1) num_threads(threads) private(iy,is,wr,wi,tr,ti,pxr,pxi,row)
+	for( ix=0; ix<nx; ix++) {
+		row = wave[ix];
+		pxr = propxr[ix]*norm;
+		pxi = propxi[ix]*norm;
+		iy = 0;
+		for (is=rowSpans[ix]; is<rowSpans[ix+1]; is++) {
+			if (spanStart[is] > iy) 
+				memset(row[iy], 0, (spanStart[is]-iy)*sizeof(row[0]));
+			for( iy=spanStart[is]; iy<spanEnd[is]; iy++) {
+				wr = row[iy][0];
+				wi = row[iy][1];
+				tr = wr*propyr[iy] - wi*propyi[iy];
+				ti = wr*propyi[iy] + wi*propyr[iy];
+				row[iy][0] = tr*pxr - ti*pxi;
+				row[iy][1] = tr*pxi + ti*pxr;
+			}
+		}
+		if (iy < ny) 
+			memset(row[iy], 0, (ny-iy)*sizeof(row[0]));
+	} /* end for(ix..) */
+}
+
+
+PrunedFFT::PrunedFFT(const Propagator &prop) :
+nx(prop.nx),
+ny(prop.ny),
+rowsLow(0),
+rowsHigh(0)
+{
+	int ix, n[1];
+	unsigned flags = getFFTPlanRigor();
+
+	/* the band limited rows must be one block at either end of the array: */
+	for (ix=0; (ix<nx) && (prop.rowSpans[ix+1] > prop.rowSpans[ix]); ix++) rowsLow++;
+	for (ix=nx-1; (ix>=rowsLow) && (prop.rowSpans[ix+1] > prop.rowSpans[ix]); ix--) rowsHigh++;
+	for (ix=rowsLow; ix<nx-rowsHigh; ix++) 
+		if (prop.rowSpans[ix+1] > prop.rowSpans[ix]) {
+			rowsLow = nx; 
+			rowsHigh = 0;
+		}
+	// the second block must have the same alignment as the plan
+	if (ny % 4 != 0) flags |= FFTW_UNALIGNED;
+
+	n[0] = nx;
+#if FLOAT_PRECISION == 1
+	fftwf_complex *buf = (fftwf_complex *)fftwf_malloc(nx*ny*sizeof(fftwf_complex));
+	m_colsForw = fftwf_plan_many_dft(1, n, ny, buf, NULL, ny, 1, buf, NULL, ny, 1, FFTW_FORWARD, flags);
+	m_colsInv  = fftwf_plan_many_dft(1, n, ny, buf, NULL, ny, 1, buf, NULL, ny, 1, FFTW_BACKWARD, flags);
+	n[0] = ny;
+	m_lowForw = m_lowInv = m_highForw = m_highInv = NULL;
+	if (rowsLow > 0) {
+		m_lowForw = fftwf_plan_many_dft(1, n, rowsLow, buf, NULL, 1, ny, buf, NULL, 1, ny, FFTW_FORWARD, flags);
+		m_lowInv  = fftwf_plan_many_dft(1, n, rowsLow, buf, NULL, 1, ny, buf, NULL, 1, ny, FFTW_BACKWARD, flags);
+	}
+	if (rowsHigh > 0) {
+		m_highForw = fftwf_plan_many_dft(1, n, rowsHigh, buf+(nx-rowsHigh)*ny, NULL, 1, ny, 
+			buf+(nx-rowsHigh)*ny, NULL, 1, ny, FFTW_FORWARD, flags);
+		m_highInv  = fftwf_plan_many_dft(1, n, rowsHigh, buf+(nx-rowsHigh)*ny, NULL, 1, ny, 
+			buf+(nx-rowsHigh)*ny, NULL, 1, ny, FFTW_BACKWARD, flags);
+	}
+	fftwf_free(buf);
+#else
+	fftw_complex *buf = (fftw_complex *)fftw_malloc(nx*ny*sizeof(fftw_complex));
+	m_colsForw = fftw_plan_many_dft(1, n, ny, buf, NULL, ny, 1, buf, NULL, ny, 1, FFTW_FORWARD, flags);
+	m_colsInv  = fftw_plan_many_dft(1, n, ny, buf, NULL, ny, 1, buf, NULL, ny, 1, FFTW_BACKWARD, flags);
+	n[0] = ny;
+	m_lowForw = m_lowInv = m_highForw = m_highInv = NULL;
+	if (rowsLow > 0) {
+		m_lowForw = fftw_plan_many_dft(1, n, rowsLow, buf, NULL, 1, ny, buf, NULL, 1, ny, FFTW_FORWARD, flags);
+		m_lowInv  = fftw_plan_many_dft(1, n, rowsLow, buf, NULL, 1, ny, buf, NULL, 1, ny, FFTW_BACKWARD, flags);
+	}
+	if (rowsHigh > 0) {
+		m_highForw = fftw_plan_many_dft(1, n, rowsHigh, buf+(nx-rowsHigh)*ny, NULL, 1, ny, 
+			buf+(nx-rowsHigh)*ny, NULL, 1, ny, FFTW_FORWARD, flags);
+		m_highInv  = fftw_plan_many_dft(1, n, rowsHigh, buf+(nx-rowsHigh)*ny, NULL, 1, ny, 
+			buf+(nx-rowsHigh)*ny, NULL, 1, ny, FFTW_BACKWARD, flags);
+	}
+	fftw_free(buf);
+#endif
+}
+
+PrunedFFT::~PrunedFFT()
+{
+#if FLOAT_PRECISION == 1
+	fftwf_destroy_plan(m_colsForw);
+	fftwf_destroy_plan(m_colsInv);
+	if (m_lowForw != NULL) fftwf_destroy_plan(m_lowForw);
+	if (m_lowInv != NULL) fftwf_destroy_plan(m_lowInv);
+	if (m_highForw != NULL) fftwf_destroy_plan(m_highForw);
+	if (m_highInv != NULL) fftwf_destroy_plan(m_highInv);
+#else
+	fftw_destroy_plan(m_colsForw);
+	fftw_destroy_plan(m_colsInv);
+	if (m_lowForw != NULL) fftw_destroy_plan(m_lowForw);
+	if (m_lowInv != NULL) fftw_destroy_plan(m_lowInv);
+	if (m_highForw != NULL) fftw_destroy_plan(m_highForw);
+	if (m_highInv != NULL) fftw_destroy_plan(m_highInv);
+#endif
+}
+
+void PrunedFFT::Forward(void **w) const
+{
+#if FLOAT_PRECISION == 1
+	fftwf_complex *wave = ((fftwf_complex **)w)[0];
+	fftwf_execute_dft(m_colsForw, wave, wave);
+	if (m_lowForw != NULL) fftwf_execute_dft(m_lowForw, wave, wave);
+	if (m_highForw != NULL) fftwf_execute_dft(m_highForw, wave+(nx-rowsHigh)*ny, wave+(nx-rowsHigh)*ny);
+#else
+	fftw_complex *wave = ((fftw_complex **)w)[0];
+	fftw_execute_dft(m_colsForw, wave, wave);
+	if (m_lowForw != NULL) fftw_execute_dft(m_lowForw, wave, wave);
+	if (m_highForw != NULL) fftw_execute_dft(m_highForw, wave+(nx-rowsHigh)*ny, wave+(nx-rowsHigh)*ny);
+#endif
+}
+
+void PrunedFFT::Inverse(void **w) const
+{
+#if FLOAT_PRECISION == 1
+	fftwf_complex *wave = ((fftwf_complex **)w)[0];
+	if (m_lowInv != NULL) fftwf_execute_dft(m_lowInv, wave, wave);
+	if (m_highInv != NULL) fftwf_execute_dft(m_highInv, wave+(nx-rowsHigh)*ny, wave+(nx-rowsHigh)*ny);
+	fftwf_execute_dft(m_colsInv, wave, wave);
+#else
+	fftw_complex *wave = ((fftw_complex **)w)[0];
+	if (m_lowInv != NULL) fftw_execute_dft(m_lowInv, wave, wave);
+	if (m_highInv != NULL) fftw_execute_dft(m_highInv, wave+(nx-rowsHigh)*ny, wave+(nx-rowsHigh)*ny);
+	fftw_execute_dft(m_colsInv, wave, wave);
+#endif
+}
+
+double PrunedFFT::Work() const
+{
+	return 0.5+0.5*(double)(rowsLow+rowsHigh)/(double)nx;
+}
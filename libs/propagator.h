@@ -0,0 +1,102 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROPAGATOR_H
+#define PROPAGATOR_H
+
+#include <vector>
+#include "stemtypes_fftw3.h"
+#include "boost/shared_ptr.hpp"
+
+// Fresnel propagator for one slice thickness, including the 2/3 bandwidth
+// limit.  All tables are computed in the constructor and never changed
+// afterwards, so one Propagator can be shared by all threads.
+class Propagator
+{
+public:
+	int nx, ny;                  /* size of the wave function arrays */
+	real dz;                     /* slice thickness this propagator is for */
+	real k2max;                  /* square of the bandwidth limit */
+	std::vector<real> kx, ky, kx2, ky2;
+	std::vector<real> propxr, propxi, propyr, propyi;
+	// the same tables, computed and stored in double precision
+	std::vector<double> propxrD, propxiD, propyrD, propyiD;
+
+	// The band limited region as a list of spans [spanStart, spanEnd) of 
+	// iy for every row ix.  The spans of row ix are spans 
+	// rowSpans[ix] .. rowSpans[ix+1]-1.  Rows outside the band limit have none.
+	std::vector<int> rowSpans;
+	std::vector<int> spanStart, spanEnd;
+
+public:
+	Propagator(int nx, int ny, real ax, real by, real dz, real wavlen);
+	// multiply the (reciprocal space) wave function by the propagator times norm
+	// and set everything outside the bandwidth limit to zero.
+	void Apply(void **wave, real norm) const;
+	// the same for a double precision wave function
+	void Apply(fftw_complex **wave, double norm) const;
+	// true, if this propagator can be used for these parameters
+	bool Matches(int nx, int ny, real ax, real by, real dz, real wavlen) const;
+
+private:
+	template <class T> void ApplyTables(T (**wave)[2], T norm, 
+		const std::vector<T> &pxr, const std::vector<T> &pxi, 
+		const std::vector<T> &pyr, const std::vector<T> &pyi) const;
+
+	real m_ax, m_by, m_wavlen;
+};
+
+typedef boost::shared_ptr<Propagator> PropagatorPtr;
+
+
+// 2D FFT of a wave function whose spectrum is zero outside the rows 
+// [0,rowsLow) and [nx-rowsHigh,nx), i.e. the band limit of a Propagator.  
+// The transforms along y are only done for these rows, the ones along 
+// x for all columns.  The arrays must be allocated with fftw_malloc.
+class PrunedFFT
+{
+public:
+	int nx, ny;
+	int rowsLow, rowsHigh;       /* number of rows at either end with non-zero spectrum */
+
+public:
+	PrunedFFT(const Propagator &prop);
+	~PrunedFFT();
+	// real space -> reciprocal space.  Rows outside the band limit are not
+	// transformed completely, they must be set to zero afterwards 
+	// (Propagator::Apply() does that).
+	void Forward(void **wave) const;
+	// reciprocal space -> real space, assumes a zero spectrum outside the band limit.
+	void Inverse(void **wave) const;
+	// fraction of the 1D transforms of a full 2D FFT that is actually done
+	double Work() const;
+
+private:
+#if FLOAT_PRECISION == 1
+	fftwf_plan m_colsForw, m_colsInv;
+	fftwf_plan m_lowForw, m_lowInv, m_highForw, m_highInv;
+#else
+	fftw_plan m_colsForw, m_colsInv;
+	fftw_plan m_lowForw, m_lowInv, m_highForw, m_highInv;
+#endif
+};
+
+typedef boost::shared_ptr<PrunedFFT> PrunedFFTPtr;
+
+#endif
@@ -0,0 +1,206 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include "scan_scheduler.h"
+
+// distance of (x,y) along the Hilbert curve filling an n x n square (n a power of 2)
+static long hilbertIndex(int n, int x, int y)
+{
+	int rx, ry, s, t;
+	long d = 0;
+
+	for (s=n/2; s>0; s/=2) {
+		rx = (x & s) > 0;
+		ry = (y & s) > 0;
+		d += (long)s*s*((3*rx)^ry);
+		// rotate the quadrant
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s-1-x;
+				y = s-1-y;
+			}
+			t = x; x = y; y = t;
+		}
+	}
+	return d;
+}
+
+void scanShardRows(int shard, int shards, int scanXN, int &ixStart, int &ixStop)
+{
+	ixStart = (int)(((long)shard*scanXN)/shards);
+	ixStop  = (int)(((long)(shard+1)*scanXN)/shards);
+}
+
+// orders tile indices by their position on the Hilbert curve
+struct HilbertOrder {
+	const std::vector<long> &d;
+	HilbertOrder(const std::vector<long> &dist) : d(dist) {}
+	bool operator()(int a, int b) const { return d[a] < d[b]; }
+};
+
+ScanScheduler::ScanScheduler(int scanXN, int scanYN, int tileSize, int nThreads, int ixStart, int ixStop) :
+threads(nThreads > 0 ? nThreads : 1),
+m_queues(threads > 0 ? threads : 1)
+{
+	int tx, ty, ntx, nty, nRows, n, i;
+	std::vector<ScanTile> grid;
+	std::vector<long> dist;
+	std::vector<int> order;
+	ScanTile tile;
+
+	if ((ixStop < 0) || (ixStop > scanXN)) ixStop = scanXN;
+	nRows = ixStop-ixStart;
+
+	/* by default, use the largest tiles (up to 8x8 pixels) that still 
+	 * give every thread 4 tiles to start with and some to steal
+	 */
+	if (tileSize < 1) {
+		for (tileSize=8; tileSize>1; tileSize--)
+			if (((nRows+tileSize-1)/tileSize)*((scanYN+tileSize-1)/tileSize) >= 4*threads) break;
+	}
+	ntx = (nRows+tileSize-1)/tileSize;
+	nty = (scanYN+tileSize-1)/tileSize;
+	for (n=1; (n < ntx) || (n < nty); n*=2);
+
+	for (tx=0; tx<ntx; tx++) for (ty=0; ty<nty; ty++) {
+		tile.ix0 = ixStart+tx*tileSize;
+		tile.iy0 = ty*tileSize;
+		tile.ix1 = std::min(tile.ix0+tileSize, ixStop);
+		tile.iy1 = std::min(tile.iy0+tileSize, scanYN);
+		grid.push_back(tile);
+		dist.push_back(hilbertIndex(n, tx, ty));
+		order.push_back((int)order.size());
+	}
+	std::sort(order.begin(), order.end(), HilbertOrder(dist));
+	for (i=0; i<(int)order.size(); i++) tiles.push_back(grid[order[i]]);
+
+#ifdef _OPENMP
+	for (i=0; i<threads; i++) omp_init_lock(&(m_queues[i].lock));
+#endif
+	Reset();
+}
+
+ScanScheduler::~ScanScheduler()
+{
+#ifdef _OPENMP
+	for (int i=0; i<threads; i++) omp_destroy_lock(&(m_queues[i].lock));
+#endif
+}
+
+void ScanScheduler::Reset()
+{
+	int i, n = (int)tiles.size();
+
+	for (i=0; i<threads; i++) {
+		m_queues[i].head    = (int)(((long)i*n)/threads);
+		m_queues[i].tail    = (int)(((long)(i+1)*n)/threads);
+		m_queues[i].pixels  = 0;
+		m_queues[i].steals  = 0;
+		m_queues[i].seconds = 0.0;
+	}
+}
+
+void ScanScheduler::Lock(int thread)
+{
+#ifdef _OPENMP
+	omp_set_lock(&(m_queues[thread].lock));
+#endif
+}
+
+void ScanScheduler::Unlock(int thread)
+{
+#ifdef _OPENMP
+	omp_unset_lock(&(m_queues[thread].lock));
+#endif
+}
+
+bool ScanScheduler::Next(int thread, ScanTile &tile)
+{
+	int i, victim, left, most, take, start;
+	Queue &q = m_queues[thread];
+
+	for (;;) {
+		Lock(thread);
+		if (q.head < q.tail) {
+			tile = tiles[q.head++];
+			Unlock(thread);
+			return true;
+		}
+		Unlock(thread);
+
+		// our own tiles are done: find the thread with the most tiles left
+		victim = -1;
+		most = 0;
+		for (i=0; i<threads; i++) {
+			if (i == thread) continue;
+			Lock(i);
+			left = m_queues[i].tail-m_queues[i].head;
+			Unlock(i);
+			if (left > most) {
+				most = left;
+				victim = i;
+			}
+		}
+		if (victim < 0) return false;
+
+		// take the back half, the owner keeps working on the front
+		Lock(victim);
+		left = m_queues[victim].tail-m_queues[victim].head;
+		take = (left+1)/2;
+		start = m_queues[victim].tail-take;
+		m_queues[victim].tail = start;
+		Unlock(victim);
+		if (take < 1) continue;   /* somebody else was faster, try again */
+
+		Lock(thread);
+		q.head = start;
+		q.tail = start+take;
+		q.steals++;
+		Unlock(thread);
+	}
+}
+
+void ScanScheduler::Done(int thread, int pixels, double seconds)
+{
+	m_queues[thread].pixels  += pixels;
+	m_queues[thread].seconds += seconds;
+}
+
+int ScanScheduler::PixelsDone() const
+{
+	int i, n = 0;
+	for (i=0; i<threads; i++) n += m_queues[i].pixels;
+	return n;
+}
+
+double ScanScheduler::TimeDone() const
+{
+	int i;
+	double t = 0.0;
+	for (i=0; i<threads; i++) t += m_queues[i].seconds;
+	return t;
+}
+
+int ScanScheduler::Steals() const
+{
+	int i, n = 0;
+	for (i=0; i<threads; i++) n += m_queues[i].steals;
+	return n;
+}
@@ -0,0 +1,100 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCAN_SCHEDULER_H
+#define SCAN_SCHEDULER_H
+
+#include <vector>
+#include "boost/shared_ptr.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// A rectangle of scan pixels ix0 <= ix < ix1, iy0 <= iy < iy1
+struct ScanTile
+{
+	int ix0, iy0, ix1, iy1;
+
+	int Pixels() const { return (ix1-ix0)*(iy1-iy0); }
+	// the k-th pixel of the tile, with iy running fastest
+	void Pixel(int k, int &ix, int &iy) const { ix = ix0+k/(iy1-iy0); iy = iy0+k%(iy1-iy0); }
+};
+
+// Distributes the pixels of a STEM scan over threads.  The scan is 
+// split into tiles, which are ordered along a Hilbert curve, and each 
+// thread starts with a contiguous part of that order, so that the 
+// pixels a thread works on are neighbors and read the same region of 
+// the potential.  A thread that runs out of tiles steals the back half
+// of the remaining tiles of the busiest thread.
+// Each thread also keeps its own progress counters, so that no shared
+// counter has to be updated for every pixel.
+// Rows of a scan that is split into several processes ("shards", see 
+// scanShardRows()) are written to images named 
+// <name>_shard<i>of<N>.img, which stem3-merge adds up again.
+#define SCAN_SHARD_SUFFIX "_shard%dof%d.img"
+
+// the scan rows ixStart <= ix < ixStop done by shard (0 .. shards-1)
+void scanShardRows(int shard, int shards, int scanXN, int &ixStart, int &ixStop);
+
+class ScanScheduler
+{
+public:
+	int threads;
+	std::vector<ScanTile> tiles;  /* all tiles, in Hilbert order */
+
+public:
+	// tileSize = 0 chooses the tile size from the number of threads.
+	// Only the rows ixStart <= ix < ixStop are scanned (all for ixStop < 0).
+	ScanScheduler(int scanXN, int scanYN, int tileSize, int threads, int ixStart=0, int ixStop=-1);
+	~ScanScheduler();
+	// hand out all tiles again and clear the progress counters
+	void Reset();
+	// gets the next tile for thread, false if all tiles have been handed out
+	bool Next(int thread, ScanTile &tile);
+	// record that thread has finished a tile of pixels in seconds
+	void Done(int thread, int pixels, double seconds);
+	// progress summed over all threads (only read while the other threads
+	// keep counting, so this is good for displaying progress only)
+	int PixelsDone() const;
+	double TimeDone() const;
+	int Steals() const;
+
+private:
+	// the tiles [head, tail) still to be done by one thread; 
+	// padded to a cache line, as every thread updates its own one
+	struct Queue {
+		int head, tail;
+		int pixels, steals;
+		double seconds;
+#ifdef _OPENMP
+		omp_lock_t lock;
+#endif
+		char pad[64];
+	};
+	std::vector<Queue> m_queues;
+
+	void Lock(int thread);
+	void Unlock(int thread);
+	ScanScheduler(const ScanScheduler &);
+	ScanScheduler &operator=(const ScanScheduler &);
+};
+
+typedef boost::shared_ptr<ScanScheduler> ScanSchedulerPtr;
+
+#endif
@@ -41,6 +41,15 @@ QSTEM - image simulation for TEM/STEM/CBED
 #define TOMO    6
 #define NBED    7
 
+/* multislice engines, see runMulsSTEM() */
+#define SLICE_ENGINE_REFERENCE 0
+#define SLICE_ENGINE_FUSED     1
+
+/* precision of the multislice propagation, see runMulsSTEM().  Potentials 
+* and transmission functions are always stored in single precision. */
+#define PRECISION_SINGLE 0
+#define PRECISION_DOUBLE 1
+
 ////////////////////////////////////////////////////////////////////////
 // Define physical constants
 ////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,113 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+#include "matrixlib.h"
+#include "fftw_plans.h"
+#include "structure_factor.h"
+
+const double StructureFactor::sigma = 1.2;
+
+StructureFactor::StructureFactor(int nx, int ny, double dx, double dy) :
+m_nx(nx), m_ny(ny), m_mx(2*nx), m_my(2*ny),
+m_dx(dx), m_dy(dy),
+m_wx(2*spread+1), m_wy(2*spread+1), m_corrX(nx), m_corrY(ny)
+{
+	int i, k;
+	double s;
+
+	m_grid = (fftwf_complex *)fftwf_malloc((size_t)m_mx*m_my*sizeof(fftwf_complex));
+	m_s = (fftwf_complex *)fftwf_malloc((size_t)m_nx*m_ny*sizeof(fftwf_complex));
+	// one thread per structure factor, several of them run at the same time:
+	m_plan = getFFTPlanf(m_mx, m_my, 1, FFTW_FORWARD, m_grid, 1);
+
+	// the grid holds h*sum_j exp(-(j h-x)^2/(2 s^2)) ~ sqrt(2 pi) s exp(-2 pi^2 s^2 k^2)
+	// for each point, with h = dx/2 and s = sigma*h:
+	for (i=0; i<m_nx; i++) {
+		k = (i > m_nx/2) ? i-m_nx : i;
+		s = sigma*0.5*m_dx*(double)k/(m_nx*m_dx);
+		m_corrX[i] = exp(2.0*PI*PI*s*s)/(sqrt(2.0*PI)*sigma);
+	}
+	for (i=0; i<m_ny; i++) {
+		k = (i > m_ny/2) ? i-m_ny : i;
+		s = sigma*0.5*m_dy*(double)k/(m_ny*m_dy);
+		m_corrY[i] = exp(2.0*PI*PI*s*s)/(sqrt(2.0*PI)*sigma);
+	}
+	Clear();
+}
+
+StructureFactor::~StructureFactor()
+{
+	fftwf_free(m_grid);
+	fftwf_free(m_s);
+}
+
+void StructureFactor::Clear()
+{
+	memset(m_grid, 0, (size_t)m_mx*m_my*sizeof(fftwf_complex));
+}
+
+void StructureFactor::Add(double x, double y, double w)
+{
+	double u, v, d;
+	int i0, j0, i, j, ix, iy;
+	fftwf_complex *row;
+
+	u = 2.0*x/m_dx;
+	v = 2.0*y/m_dy;
+	i0 = (int)floor(u)-spread;
+	j0 = (int)floor(v)-spread;
+	for (i=0; i<=2*spread; i++) {
+		d = (double)(i0+i)-u;
+		m_wx[i] = w*exp(-0.5*d*d/(sigma*sigma));
+		d = (double)(j0+i)-v;
+		m_wy[i] = exp(-0.5*d*d/(sigma*sigma));
+	}
+	// shift into the positive range:
+	i0 = (i0 % m_mx + m_mx) % m_mx;
+	j0 = (j0 % m_my + m_my) % m_my;
+	for (i=0, ix=i0; i<=2*spread; i++, ix = (ix+1 < m_mx) ? ix+1 : 0) {
+		row = m_grid+(size_t)ix*m_my;
+		for (j=0, iy=j0; j<=2*spread; j++, iy = (iy+1 < m_my) ? iy+1 : 0)
+			row[iy][0] += (float)(m_wx[i]*m_wy[j]);
+	}
+}
+
+const fftwf_complex *StructureFactor::Transform()
+{
+	int ix, iy, gx, gy;
+	double c;
+	fftwf_complex *g, *s;
+
+	fftwf_execute_dft(m_plan, m_grid, m_grid);
+	// keep the frequencies of the nx x ny cell and divide by the Gaussian
+	for (ix=0; ix<m_nx; ix++) {
+		gx = (ix > m_nx/2) ? ix-m_nx+m_mx : ix;
+		g = m_grid+(size_t)gx*m_my;
+		s = m_s+(size_t)ix*m_ny;
+		for (iy=0; iy<m_ny; iy++) {
+			gy = (iy > m_ny/2) ? iy-m_ny+m_my : iy;
+			c = m_corrX[ix]*m_corrY[iy];
+			s[iy][0] = (float)(c*g[gy][0]);
+			s[iy][1] = (float)(c*g[gy][1]);
+		}
+	}
+	return m_s;
+}
@@ -0,0 +1,71 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STRUCTURE_FACTOR_H
+#define STRUCTURE_FACTOR_H
+
+#include <vector>
+#include "fftw3.h"
+#include "boost/shared_ptr.hpp"
+
+// The structure factor S(k) = sum_j w_j exp(-2 pi i k.r_j) of weighted
+// points r_j = (x_j, y_j) in a periodic cell of nx*dx x ny*dy (A), at the
+// nx x ny frequencies k = (ix/(nx dx), iy/(ny dy)) of the cell, in FFT order
+// (ix > nx/2 are the negative ones).  The points are spread with a Gaussian
+// onto a grid of twice the sampling, which is fourier transformed, and the
+// Gaussian is divided out again (Greengard & Lee, SIAM Review 46, 443 (2004)).
+// This costs O(points + nx ny log(nx ny)) instead of O(points nx ny), at a 
+// relative accuracy of about 1e-6.
+// The FFT plan is made in the constructor, so objects should be created in 
+// serial code, one for each thread that uses them (see fftw_plans.h).
+class StructureFactor
+{
+public:
+	StructureFactor(int nx, int ny, double dx, double dy);
+	~StructureFactor();
+
+	// remove all points
+	void Clear();
+	// add the point (x, y) (A, any position - the cell is periodic) with weight w
+	void Add(double x, double y, double w);
+	// S(k) of the points added since the last Clear(), nx x ny values which 
+	// stay valid until the next call
+	const fftwf_complex *Transform();
+
+	int Nx() const { return m_nx; }
+	int Ny() const { return m_ny; }
+
+	// width (sigma) of the Gaussian and how far it is spread, in grid pixels
+	static const double sigma;
+	static const int spread = 7;
+
+private:
+	int m_nx, m_ny, m_mx, m_my;
+	double m_dx, m_dy;
+	fftwf_complex *m_grid, *m_s;
+	fftwf_plan m_plan;
+	std::vector<double> m_wx, m_wy, m_corrX, m_corrY;
+
+	StructureFactor(const StructureFactor &);
+	StructureFactor &operator=(const StructureFactor &);
+};
+
+typedef boost::shared_ptr<StructureFactor> StructureFactorPtr;
+
+#endif
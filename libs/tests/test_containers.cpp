@@ -37,6 +37,26 @@ BOOST_AUTO_TEST_CASE (testArrayAllocation)
   BOOST_CHECK(wave->wave != NULL);
 }
 
+BOOST_AUTO_TEST_CASE (testContiguousLayout)
+{
+  // rows must follow each other in one aligned block
+  BOOST_CHECK_EQUAL((size_t)wave->wave.Data() % ARRAY_ALIGNMENT, 0);
+  for (int ix=0; ix<10; ix++) {
+    BOOST_CHECK(wave->wave[ix] == wave->wave.Data()+ix*10);
+    BOOST_CHECK(&wave->diffpat(ix,3) == &wave->diffpat[ix][3]);
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testWaveBatch)
+{
+  // the waves of a batch are consecutive slices of one stack
+  WAVEBATCH batch(3, 10, 10, 1.0, 1.0);
+  for (int k=0; k<3; k++) {
+    BOOST_CHECK(batch.waves[k]->wave.Data() == batch.stack.Slice(k));
+    BOOST_CHECK(batch.waves[k]->wave[9]+10 == batch.stack.Slice(k)+100);
+  }
+}
+
 // Test image saving
 
 // Test image reading
@@ -0,0 +1,74 @@
+#include <boost/test/unit_test.hpp>
+
+#include "memory_fftw3.h"
+#include "detector_map.h"
+
+struct DetectorMapFixture {
+  DetectorMapFixture():
+    kx2(16), ky2(12)
+  { 
+    int i;
+    for (i=0; i<16; i++) kx2[i] = (float)((i > 8) ? (i-16)*(i-16) : i*i);
+    for (i=0; i<12; i++) ky2[i] = (float)((i > 6) ? (i-12)*(i-12) : i*i);
+    // overlapping rings, a shifted one and one that sees nothing
+    addDetector(0.0f, 10.0f, 0, 0);
+    addDetector(5.0f, 40.0f, 0, 0);
+    addDetector(20.0f, 200.0f, 0, 0);
+    addDetector(0.0f, 4.0f, 3, -2);
+    addDetector(500.0f, 600.0f, 0, 0);
+    wave = complex2Df(16, 12, "wave");
+    for (i=0; i<16*12; i++) {
+      wave[0][i][0] = (float)(i % 7);
+      wave[0][i][1] = (float)(i % 5)-2.0f;
+    }
+  }
+  void addDetector(float k2in, float k2out, int sx, int sy) {
+    DetectorPtr det = DetectorPtr(new Detector(2, 2, 1.0f, 1.0f));
+    det->k2Inside = k2in;
+    det->k2Outside = k2out;
+    det->shiftX = (float)sx;
+    det->shiftY = (float)sy;
+    detectors.push_back(det);
+  }
+
+  std::vector<float> kx2, ky2;
+  std::vector<DetectorPtr> detectors;
+  fftwf_complex **wave;
+};
+
+BOOST_FIXTURE_TEST_SUITE (TestDetectorMap, DetectorMapFixture)
+
+BOOST_AUTO_TEST_CASE (testIntegrate)
+{
+  DetectorMap map(16, 12, &kx2[0], &ky2[0], detectors);
+  std::vector<double> sums;
+  map.Integrate(wave, sums);
+  BOOST_REQUIRE_EQUAL(sums.size(), detectors.size());
+
+  // compare to the pixel by pixel sum of collectIntensity()
+  for (size_t i=0; i<detectors.size(); i++) {
+    double sum = 0.0;
+    for (int ix=0; ix<16; ix++) for (int iy=0; iy<12; iy++) {
+      float k2 = kx2[ix]+ky2[iy];
+      if ((k2 >= detectors[i]->k2Inside) && (k2 <= detectors[i]->k2Outside)) {
+        int ixs = (ix+(int)detectors[i]->shiftX+16) % 16;
+        int iys = (iy+(int)detectors[i]->shiftY+12) % 12;
+        sum += wave[ixs][iys][0]*wave[ixs][iys][0]+wave[ixs][iys][1]*wave[ixs][iys][1];
+      }
+    }
+    BOOST_CHECK_CLOSE(sums[i], sum, 1e-10);
+  }
+  BOOST_CHECK_EQUAL(sums[4], 0.0);
+  // the 4 centered rings only need 5 segments, the shifted detector one more
+  BOOST_CHECK(map.segStart.size()-1 <= 6);
+}
+
+BOOST_AUTO_TEST_CASE (testMatches)
+{
+  DetectorMap map(16, 12, &kx2[0], &ky2[0], detectors);
+  BOOST_CHECK(map.Matches(16, 12, &kx2[0], &ky2[0], detectors));
+  detectors[1]->k2Outside = 41.0f;
+  BOOST_CHECK(!map.Matches(16, 12, &kx2[0], &ky2[0], detectors));
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
@@ -0,0 +1,48 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+#include "diff_accumulator.h"
+
+BOOST_AUTO_TEST_SUITE (TestDiffAccumulator)
+
+BOOST_AUTO_TEST_CASE (testMeanVariance)
+{
+  const int n = 4*3, runs = 5;
+  DiffAccumulator acc(4, 3, 6, 2, 1.0, NULL);
+  std::vector<float_tt> pattern(n);
+  std::vector<double> sum(n, 0.0), sum2(n, 0.0);
+  std::vector<float> variance(n);
+  int i, run;
+
+  for (run=0; run<runs; run++) {
+    for (i=0; i<n; i++) {
+      pattern[i] = (float_tt)((i+1)*(run % 3)+0.5*i);
+      sum[i] += pattern[i];
+      sum2[i] += pattern[i]*pattern[i];
+    }
+    acc.Add(7, run, &pattern[0]);
+  }
+  BOOST_CHECK_EQUAL(acc.Runs(6), 0);
+  BOOST_CHECK_EQUAL(acc.Runs(7), runs);
+  acc.Variance(7, &variance[0]);
+  for (i=0; i<n; i++) {
+    BOOST_CHECK_CLOSE(acc.Mean(7)[i], sum[i]/runs, 1e-3);
+    BOOST_CHECK_CLOSE(variance[i], (sum2[i]-sum[i]*sum[i]/runs)/(runs-1), 1e-3);
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testRunAddedTwice)
+{
+  DiffAccumulator acc(2, 2, 0, 1, 1.0, NULL);
+  float_tt a[4] = {1, 2, 3, 4}, b[4] = {3, 2, 1, 0};
+
+  acc.Add(0, 0, a);
+  // the change of the mean, summed over the pattern
+  BOOST_CHECK_CLOSE(acc.Add(0, 1, b), 1+0+1+4, 1e-4);
+  // after a restart, a run that is in the average already is ignored
+  BOOST_CHECK_EQUAL(acc.Add(0, 1, a), 0);
+  BOOST_CHECK_EQUAL(acc.Runs(0), 2);
+  BOOST_CHECK_CLOSE(acc.Mean(0)[0], 2.0f, 1e-4);
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
@@ -0,0 +1,97 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include "numa_layout.h"
+
+BOOST_AUTO_TEST_SUITE (TestNumaLayout)
+
+BOOST_AUTO_TEST_CASE (testParseCpuList)
+{
+  std::vector<int> cpus;
+  BOOST_REQUIRE(NumaLayout::ParseCpuList("0-3,8,10-11\n", cpus));
+  BOOST_REQUIRE_EQUAL(cpus.size(), 7u);
+  BOOST_CHECK_EQUAL(cpus[3], 3);
+  BOOST_CHECK_EQUAL(cpus[4], 8);
+  BOOST_CHECK_EQUAL(cpus[6], 11);
+  BOOST_CHECK(NumaLayout::ParseCpuList("", cpus));
+  BOOST_CHECK(cpus.empty());
+  BOOST_CHECK(!NumaLayout::ParseCpuList("3-1", cpus));
+  BOOST_CHECK(!NumaLayout::ParseCpuList("0;1", cpus));
+}
+
+#ifdef __linux__
+static void writeNode(const std::string &dir, int node, const char *cpulist)
+{
+  char name[256];
+  sprintf(name, "%s/node%d", dir.c_str(), node);
+  mkdir(name, 0755);
+  strcat(name, "/cpulist");
+  FILE *fp = fopen(name, "w");
+  fprintf(fp, "%s\n", cpulist);
+  fclose(fp);
+}
+
+BOOST_AUTO_TEST_CASE (testThreadNodes)
+{
+  // two sockets with 4 cpus each, and a node without cpus
+  char dirTemplate[] = "/tmp/numa_layoutXXXXXX";
+  std::string dir = mkdtemp(dirTemplate);
+  writeNode(dir, 0, "0-1,4-5");
+  writeNode(dir, 1, "2-3,6-7");
+  writeNode(dir, 2, "");
+  // the process may run on all of them, whatever the test machine has
+  std::vector<int> all;
+  BOOST_REQUIRE(NumaLayout::ParseCpuList("0-7", all));
+
+  NumaLayout layout(6, PIN_CORES, dir.c_str(), &all);
+  BOOST_REQUIRE_EQUAL(layout.Nodes(), 2);
+  BOOST_CHECK_EQUAL(layout.ThreadNode(0), 0);
+  BOOST_CHECK_EQUAL(layout.ThreadNode(2), 0);
+  BOOST_CHECK_EQUAL(layout.ThreadNode(3), 1);
+  BOOST_CHECK_EQUAL(layout.FirstThread(1), 3);
+  BOOST_CHECK_EQUAL(layout.ThreadCpus(1)[0], 1);
+  BOOST_CHECK_EQUAL(layout.ThreadCpus(4)[0], 3);
+
+  NumaLayout nodes(3, PIN_NODES, dir.c_str(), &all);
+  BOOST_CHECK_EQUAL(nodes.ThreadCpus(2).size(), 4u);
+  BOOST_CHECK_EQUAL(nodes.ThreadCpus(2)[0], 2);
+
+  // more nodes than threads: every node keeps at least one thread
+  NumaLayout single(1, PIN_NONE, dir.c_str(), &all);
+  BOOST_CHECK_EQUAL(single.Nodes(), 1);
+  BOOST_CHECK(single.Pin(0));
+
+  // only the cpus the process may run on (taskset, cgroups) are used
+  int allowedList[] = {1, 2, 4};
+  std::vector<int> allowed(allowedList, allowedList+3);
+  NumaLayout restricted(4, PIN_CORES, dir.c_str(), &allowed);
+  BOOST_REQUIRE_EQUAL(restricted.Nodes(), 2);
+  BOOST_CHECK_EQUAL(restricted.nodeCpus[0].size(), 2u);
+  BOOST_CHECK_EQUAL(restricted.ThreadCpus(0)[0], 1);
+  BOOST_CHECK_EQUAL(restricted.ThreadCpus(1)[0], 4);
+  BOOST_CHECK_EQUAL(restricted.ThreadCpus(3)[0], 2);
+
+  // a node without allowed cpus gets no threads
+  allowed.assign(allowedList, allowedList+1);
+  NumaLayout oneNode(4, PIN_NODES, dir.c_str(), &allowed);
+  BOOST_REQUIRE_EQUAL(oneNode.Nodes(), 1);
+  BOOST_CHECK_EQUAL(oneNode.ThreadCpus(3).size(), 1u);
+  BOOST_CHECK_EQUAL(oneNode.ThreadCpus(3)[0], 1);
+
+  system(("rm -rf "+dir).c_str());
+}
+#endif
+
+BOOST_AUTO_TEST_CASE (testNoTopology)
+{
+  // without the sysfs tree, the machine is one node
+  NumaLayout layout(4, PIN_NODES, "/nonexistent");
+  BOOST_CHECK_EQUAL(layout.Nodes(), 1);
+  BOOST_CHECK_EQUAL(layout.ThreadNode(3), 0);
+  BOOST_CHECK_EQUAL(layout.FirstThread(0), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdio.h>
+#include <vector>
+#include <stdexcept>
+#include "potential_cache.h"
+
+BOOST_AUTO_TEST_SUITE (TestPotentialCache)
+
+static AtomBoxKey makeKey()
+{
+  AtomBoxKey key;
+  key.Z = 38;
+  key.B = 0.62;
+  key.nx = 5;
+  key.ny = 4;
+  key.nz = 3;
+  key.dx = 0.05;
+  key.dy = 0.05;
+  key.dz = 0.2;
+  key.zOversample = 9;
+  key.v0 = 200.0;
+  key.scatFactors = 1;
+  key.radius = 5.0;
+  return key;
+}
+
+BOOST_AUTO_TEST_CASE (testStoreLoad)
+{
+  AtomBoxKey key = makeKey();
+  std::vector<float> values(key.Values());
+  size_t i;
+  for (i=0; i<values.size(); i++) values[i] = 0.5f*(float)i;
+  PotentialCache cache("");
+  remove(cache.FileName(key).c_str());
+  BOOST_CHECK(cache.Load(key) == NULL);
+  cache.Store(key, &values[0]);
+  const float *loaded = cache.Load(key);
+  BOOST_REQUIRE(loaded != NULL);
+  for (i=0; i<values.size(); i++) BOOST_CHECK_EQUAL(loaded[i], values[i]);
+  // the mapping stays valid, even if the file is replaced
+  values[0] = 4711.0f;
+  cache.Store(key, &values[0]);
+  BOOST_CHECK_EQUAL(loaded[0], 0.0f);
+  BOOST_CHECK_EQUAL(cache.Load(key)[0], 4711.0f);
+  remove(cache.FileName(key).c_str());
+}
+
+BOOST_AUTO_TEST_CASE (testOtherKeys)
+{
+  AtomBoxKey key = makeKey(), other = makeKey();
+  std::vector<float> values(key.Values(), 1.0f);
+  PotentialCache cache("");
+  cache.Store(key, &values[0]);
+  // every parameter selects a file of its own
+  other.B = 0.5;
+  BOOST_CHECK(cache.FileName(other) != cache.FileName(key));
+  BOOST_CHECK(cache.Load(other) == NULL);
+  other = makeKey();
+  other.dx = 0.04;
+  BOOST_CHECK(cache.FileName(other) != cache.FileName(key));
+  BOOST_CHECK(cache.Load(other) == NULL);
+  other = makeKey();
+  other.scatFactors = 0;
+  BOOST_CHECK(cache.Load(other) == NULL);
+  // a radius with the same box size, but another cutoff
+  other = makeKey();
+  other.radius = 5.01;
+  BOOST_CHECK(cache.FileName(other) != cache.FileName(key));
+  BOOST_CHECK(cache.Load(other) == NULL);
+  remove(cache.FileName(key).c_str());
+}
+
+BOOST_AUTO_TEST_CASE (testWrongHeader)
+{
+  AtomBoxKey key = makeKey();
+  std::vector<float> values(key.Values(), 1.0f);
+  PotentialCache cache("");
+  cache.Store(key, &values[0]);
+  // a file of another version, or one that is cut short, is not used
+  FILE *fp = fopen(cache.FileName(key).c_str(), "r+b");
+  BOOST_REQUIRE(fp != NULL);
+  int version = PotentialCache::version+1;
+  fseek(fp, 8, SEEK_SET);
+  fwrite(&version, sizeof(int), 1, fp);
+  fclose(fp);
+  BOOST_CHECK(cache.Load(key) == NULL);
+  fp = fopen(cache.FileName(key).c_str(), "wb");
+  fwrite(&values[0], sizeof(float), values.size(), fp);
+  fclose(fp);
+  BOOST_CHECK(cache.Load(key) == NULL);
+  remove(cache.FileName(key).c_str());
+}
+
+BOOST_AUTO_TEST_CASE (testLongFolder)
+{
+  AtomBoxKey key = makeKey();
+  std::vector<float> values(key.Values(), 1.0f);
+  // no room for the name of the temporary file
+  PotentialCache cache(std::string(1020, 'x'));
+  BOOST_CHECK_THROW(cache.Store(key, &values[0]), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
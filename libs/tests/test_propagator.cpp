@@ -0,0 +1,94 @@
+#include <boost/test/unit_test.hpp>
+
+#include "memory_fftw3.h"
+#include "propagator.h"
+
+struct PropagatorFixture {
+  PropagatorFixture():
+    prop(PropagatorPtr( new Propagator(32, 24, 6.4f, 4.8f, 2.0f, 0.025f)))
+  { 
+    wave = complex2Df(32, 24, "wave");
+    for (int i=0; i<32*24; i++) {
+      wave[0][i][0] = 1.0f;
+      wave[0][i][1] = 0.5f;
+    }
+  }
+  ~PropagatorFixture()
+  { }
+
+  PropagatorPtr prop;
+  fftwf_complex **wave;
+};
+
+BOOST_FIXTURE_TEST_SUITE (TestPropagator, PropagatorFixture)
+
+BOOST_AUTO_TEST_CASE (testBandLimitSpans)
+{
+  // every pixel must be inside exactly one span if and only if it is 
+  // inside the bandwidth limit
+  for (int ix=0; ix<prop->nx; ix++) {
+    for (int iy=0; iy<prop->ny; iy++) {
+      int inside = 0;
+      for (int is=prop->rowSpans[ix]; is<prop->rowSpans[ix+1]; is++)
+        if ((iy >= prop->spanStart[is]) && (iy < prop->spanEnd[is])) inside++;
+      BOOST_CHECK_EQUAL(inside, (prop->kx2[ix]+prop->ky2[iy] < prop->k2max) ? 1 : 0);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testApply)
+{
+  prop->Apply((void **)wave, 0.5f);
+  for (int ix=0; ix<prop->nx; ix++) {
+    for (int iy=0; iy<prop->ny; iy++) {
+      if (prop->kx2[ix]+prop->ky2[iy] < prop->k2max) {
+        // |propagator| = 1, so only the norm changes the amplitude
+        float a = wave[ix][iy][0]*wave[ix][iy][0]+wave[ix][iy][1]*wave[ix][iy][1];
+        BOOST_CHECK_CLOSE(a, 0.25f*1.25f, 1e-3);
+      }
+      else {
+        BOOST_CHECK_EQUAL(wave[ix][iy][0], 0.0f);
+        BOOST_CHECK_EQUAL(wave[ix][iy][1], 0.0f);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testMatches)
+{
+  BOOST_CHECK(prop->Matches(32, 24, 6.4f, 4.8f, 2.0f, 0.025f));
+  BOOST_CHECK(!prop->Matches(32, 24, 6.4f, 4.8f, 1.0f, 0.025f));
+}
+
+BOOST_AUTO_TEST_CASE (testPrunedFFT)
+{
+  PrunedFFT fft(*prop);
+  fftwf_complex **ref = complex2Df(32, 24, "ref");
+  fftwf_plan plan = fftwf_plan_dft_2d(32, 24, ref[0], ref[0], FFTW_FORWARD, FFTW_ESTIMATE);
+
+  BOOST_CHECK(fft.rowsLow+fft.rowsHigh < 32);
+  for (int i=0; i<32*24; i++) {
+    wave[0][i][0] = ref[0][i][0] = (float)((i*7)%11);
+    wave[0][i][1] = ref[0][i][1] = (float)((i*5)%3);
+  }
+  fftwf_execute(plan);
+  fft.Forward((void **)wave);
+  prop->Apply((void **)wave, 1.0f);
+  prop->Apply((void **)ref, 1.0f);
+  for (int i=0; i<32*24; i++) {
+    BOOST_CHECK_SMALL(wave[0][i][0]-ref[0][i][0], 1e-2f);
+    BOOST_CHECK_SMALL(wave[0][i][1]-ref[0][i][1], 1e-2f);
+  }
+  // the inverse transform only needs the band limited rows:
+  fft.Inverse((void **)wave);
+  fftwf_destroy_plan(plan);
+  plan = fftwf_plan_dft_2d(32, 24, ref[0], ref[0], FFTW_BACKWARD, FFTW_ESTIMATE);
+  fftwf_execute(plan);
+  for (int i=0; i<32*24; i++) {
+    BOOST_CHECK_SMALL(wave[0][i][0]-ref[0][i][0], 1e-1f);
+    BOOST_CHECK_SMALL(wave[0][i][1]-ref[0][i][1], 1e-1f);
+  }
+  fftwf_destroy_plan(plan);
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
@@ -0,0 +1,65 @@
+#include <boost/test/unit_test.hpp>
+
+#include <cstdlib>
+#include "scan_scheduler.h"
+
+BOOST_AUTO_TEST_SUITE (TestScanScheduler)
+
+BOOST_AUTO_TEST_CASE (testCoverage)
+{
+  // thread 0 does its own tiles and then steals all the others
+  ScanScheduler scheduler(13, 7, 3, 4);
+  std::vector<int> count(13*7, 0);
+  ScanTile tile;
+  int ix, iy, k;
+
+  while (scheduler.Next(0, tile)) {
+    for (k=0; k<tile.Pixels(); k++) {
+      tile.Pixel(k, ix, iy);
+      count[ix*7+iy]++;
+    }
+    scheduler.Done(0, tile.Pixels(), 1.0);
+  }
+  for (k=0; k<13*7; k++) BOOST_CHECK_EQUAL(count[k], 1);
+  BOOST_CHECK_EQUAL(scheduler.PixelsDone(), 13*7);
+  BOOST_CHECK(scheduler.Steals() > 0);
+  BOOST_CHECK(!scheduler.Next(1, tile));
+
+  scheduler.Reset();
+  BOOST_CHECK_EQUAL(scheduler.PixelsDone(), 0);
+  BOOST_CHECK(scheduler.Next(3, tile));
+}
+
+BOOST_AUTO_TEST_CASE (testHilbertOrder)
+{
+  // consecutive tiles along the Hilbert curve are neighbors
+  ScanScheduler scheduler(32, 32, 4, 1);
+  BOOST_REQUIRE_EQUAL(scheduler.tiles.size(), 64u);
+  for (size_t i=1; i<scheduler.tiles.size(); i++) {
+    int d = abs(scheduler.tiles[i].ix0-scheduler.tiles[i-1].ix0)+
+      abs(scheduler.tiles[i].iy0-scheduler.tiles[i-1].iy0);
+    BOOST_CHECK_EQUAL(d, 4);
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testShards)
+{
+  // the shards cover all rows once, and each scheduler only its own rows
+  int ixStart, ixStop, next = 0, pixels = 0;
+  ScanTile tile;
+  for (int shard=0; shard<4; shard++) {
+    scanShardRows(shard, 4, 10, ixStart, ixStop);
+    BOOST_CHECK_EQUAL(ixStart, next);
+    next = ixStop;
+    ScanScheduler scheduler(10, 5, 0, 2, ixStart, ixStop);
+    while (scheduler.Next(1, tile)) {
+      BOOST_CHECK(tile.ix0 >= ixStart);
+      BOOST_CHECK(tile.ix1 <= ixStop);
+      pixels += tile.Pixels();
+    }
+  }
+  BOOST_CHECK_EQUAL(next, 10);
+  BOOST_CHECK_EQUAL(pixels, 10*5);
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
@@ -0,0 +1,69 @@
+#include <boost/test/unit_test.hpp>
+
+#include <math.h>
+#include <stdlib.h>
+#include <vector>
+#include "structure_factor.h"
+
+BOOST_AUTO_TEST_SUITE (TestStructureFactor)
+
+// S(k) of the points (x[j], y[j], w[j]) by the direct sum
+static void directSum(int nx, int ny, double dx, double dy, const std::vector<double> &x,
+					  const std::vector<double> &y, const std::vector<double> &w,
+					  std::vector<double> &re, std::vector<double> &im)
+{
+  re.assign(nx*ny, 0.0);
+  im.assign(nx*ny, 0.0);
+  for (int ix=0; ix<nx; ix++) for (int iy=0; iy<ny; iy++) {
+    double kx = ((ix > nx/2) ? ix-nx : ix)/(nx*dx), ky = ((iy > ny/2) ? iy-ny : iy)/(ny*dy);
+    for (size_t j=0; j<x.size(); j++) {
+      double phase = -2.0*M_PI*(kx*x[j]+ky*y[j]);
+      re[ix*ny+iy] += w[j]*cos(phase);
+      im[ix*ny+iy] += w[j]*sin(phase);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testDirectSum)
+{
+  int nx = 16, ny = 12;
+  double dx = 0.3, dy = 0.25;
+  std::vector<double> x, y, w, re, im;
+  // points anywhere, also outside of the cell and close to its borders
+  srand(3);
+  for (int j=0; j<25; j++) {
+    x.push_back((2.0*rand()/RAND_MAX-0.5)*nx*dx);
+    y.push_back((2.0*rand()/RAND_MAX-0.5)*ny*dy);
+    w.push_back(0.5+(double)rand()/RAND_MAX);
+  }
+  x[0] = 0.0;
+  y[0] = ny*dy-1e-6;
+  directSum(nx, ny, dx, dy, x, y, w, re, im);
+
+  StructureFactor sf(nx, ny, dx, dy);
+  for (size_t j=0; j<x.size(); j++) sf.Add(x[j], y[j], w[j]);
+  const fftwf_complex *s = sf.Transform();
+  double err = 0, norm = 0;
+  for (int i=0; i<nx*ny; i++) {
+    err += (s[i][0]-re[i])*(s[i][0]-re[i])+(s[i][1]-im[i])*(s[i][1]-im[i]);
+    norm += re[i]*re[i]+im[i]*im[i];
+  }
+  BOOST_CHECK(sqrt(err/norm) < 1e-5);
+}
+
+BOOST_AUTO_TEST_CASE (testClear)
+{
+  StructureFactor sf(8, 8, 0.2, 0.2);
+  sf.Add(0.3, 0.7, 2.0);
+  sf.Transform();
+  // a point at the origin has S(k) = w everywhere
+  sf.Clear();
+  sf.Add(0.0, 0.0, 1.5);
+  const fftwf_complex *s = sf.Transform();
+  for (int i=0; i<64; i++) {
+    BOOST_CHECK_CLOSE(s[i][0], 1.5, 1e-3);
+    BOOST_CHECK_SMALL(s[i][1], 1e-5f);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
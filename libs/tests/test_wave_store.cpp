@@ -0,0 +1,67 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdio.h>
+#include <string.h>
+#include "wave_store.h"
+
+BOOST_AUTO_TEST_SUITE (TestWaveStore)
+
+// writes a different value into every wave and checks that they all survived
+static void checkWaves(WaveStore &store, int firstPixel, int pixels, int slots)
+{
+  int slot, pixel, value;
+  for (slot=0; slot<slots; slot++) for (pixel=firstPixel; pixel<firstPixel+pixels; pixel++) {
+    value = slot*1000+pixel;
+    memcpy(store.Data(slot, pixel), &value, sizeof(int));
+    memset(store.Data(slot, pixel)+sizeof(int), slot, store.WaveBytes()-sizeof(int));
+  }
+  for (slot=0; slot<slots; slot++) for (pixel=firstPixel; pixel<firstPixel+pixels; pixel++) {
+    memcpy(&value, store.Data(slot, pixel), sizeof(int));
+    BOOST_CHECK_EQUAL(value, slot*1000+pixel);
+    BOOST_CHECK_EQUAL(store.Data(slot, pixel)[store.WaveBytes()-1], slot);
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testMemory)
+{
+  WaveStore store(64, 10, 20, 2, 1.0, NULL);
+  BOOST_CHECK(!store.Mapped());
+  BOOST_CHECK_EQUAL(store.Bytes(), 64u*20*2);
+  checkWaves(store, 10, 20, 2);
+}
+
+BOOST_AUTO_TEST_CASE (testSpill)
+{
+  const char *fileName = "test_wave_store.tmp";
+  {
+    // 2 MB of waves do not fit into 1 MB
+    WaveStore store(4096, 0, 256, 2, 1.0, fileName);
+    BOOST_CHECK(store.Mapped());
+    checkWaves(store, 0, 256, 2);
+  }
+  // the spill file is removed with the store
+  BOOST_CHECK(fopen(fileName, "r") == NULL);
+}
+
+BOOST_AUTO_TEST_CASE (testPersistent)
+{
+  const char *fileName = "test_wave_store_persistent.tmp";
+  int value = 4711;
+  {
+    WaveStore store(64, 0, 8, 2, 1.0, fileName, true);
+    BOOST_CHECK(store.Mapped());
+    memcpy(store.Data(1, 5), &value, sizeof(int));
+    store.Sync();
+  }
+  {
+    // a restarted simulation finds the waves again
+    WaveStore store(64, 0, 8, 2, 1.0, fileName, true);
+    value = 0;
+    memcpy(&value, store.Data(1, 5), sizeof(int));
+    BOOST_CHECK_EQUAL(value, 4711);
+    store.SetPersistent(false);
+  }
+  BOOST_CHECK(fopen(fileName, "r") == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
@@ -0,0 +1,129 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdexcept>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "wave_store.h"
+
+WaveStore::WaveStore(size_t waveBytes, int firstPixel, int pixels, int slots, 
+					 double memoryLimitMB, const char *spillFile, bool persistent) :
+m_waveBytes(waveBytes),
+m_bytes(waveBytes*(size_t)pixels*(size_t)slots),
+m_firstPixel(firstPixel),
+m_pixels(pixels),
+m_slots(slots),
+m_data(NULL),
+m_mapped(false),
+m_persistent(persistent),
+m_fileName(spillFile != NULL ? spillFile : "")
+#ifdef _WIN32
+, m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+#else
+, m_fd(-1)
+#endif
+{
+	if (memoryLimitMB <= 0) memoryLimitMB = PhysicalMemoryMB()/4;
+	if (m_bytes == 0) return;
+	if (persistent || ((double)m_bytes > memoryLimitMB*1024.0*1024.0)) {
+		if (m_fileName.empty())
+			throw std::runtime_error("WaveStore: the waves do not fit into memory, but there is no spill file");
+		Map();
+	}
+	else {
+		m_data = (char *)malloc(m_bytes);
+		if (m_data == NULL) throw std::runtime_error("WaveStore: could not allocate memory");
+	}
+}
+
+WaveStore::~WaveStore()
+{
+	if (!m_mapped) {
+		free(m_data);
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(m_data);
+	CloseHandle(m_mapping);
+	CloseHandle(m_file);
+#else
+	munmap(m_data, m_bytes);
+	close(m_fd);
+#endif
+	if (!m_persistent) remove(m_fileName.c_str());
+}
+
+/* maps the spill file, which keeps its contents, if it exists already */
+void WaveStore::Map()
+{
+#ifdef _WIN32
+	m_file = CreateFileA(m_fileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, 
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_file == INVALID_HANDLE_VALUE) 
+		throw std::runtime_error("WaveStore: could not open spill file "+m_fileName);
+	m_mapping = CreateFileMapping(m_file, NULL, PAGE_READWRITE, 
+		(DWORD)((unsigned long long)m_bytes >> 32), (DWORD)(m_bytes & 0xffffffff), NULL);
+	if (m_mapping == NULL) 
+		throw std::runtime_error("WaveStore: could not map spill file "+m_fileName);
+	m_data = (char *)MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, m_bytes);
+	if (m_data == NULL) 
+		throw std::runtime_error("WaveStore: could not map spill file "+m_fileName);
+#else
+	m_fd = open(m_fileName.c_str(), O_RDWR | O_CREAT, 0644);
+	if (m_fd < 0) 
+		throw std::runtime_error("WaveStore: could not open spill file "+m_fileName);
+	if (ftruncate(m_fd, (off_t)m_bytes) != 0) 
+		throw std::runtime_error("WaveStore: could not resize spill file "+m_fileName);
+	m_data = (char *)mmap(NULL, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (m_data == (char *)MAP_FAILED) {
+		m_data = NULL;
+		throw std::runtime_error("WaveStore: could not map spill file "+m_fileName);
+	}
+#endif
+	m_mapped = true;
+}
+
+void WaveStore::Sync()
+{
+	if (!m_mapped) return;
+#ifdef _WIN32
+	FlushViewOfFile(m_data, 0);
+	FlushFileBuffers(m_file);
+#else
+	msync(m_data, m_bytes, MS_SYNC);
+#endif
+}
+
+double WaveStore::PhysicalMemoryMB()
+{
+#ifdef _WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	GlobalMemoryStatusEx(&status);
+	return (double)status.ullTotalPhys/(1024.0*1024.0);
+#else
+	return (double)sysconf(_SC_PHYS_PAGES)*(double)sysconf(_SC_PAGE_SIZE)/(1024.0*1024.0);
+#endif
+}
@@ -0,0 +1,80 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WAVE_STORE_H
+#define WAVE_STORE_H
+
+#include <stddef.h>
+#include <string>
+#include "boost/shared_ptr.hpp"
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Keeps the wave functions of all pixels of a STEM scan between the
+// slabs of a specimen, in slots (e.g. one for the waves of even slabs 
+// and one for those of odd slabs, so that the input of a slab is not 
+// overwritten while it is computed).  The waves are kept in memory, if
+// they fit into memoryLimitMB, or else in one memory-mapped spill file.
+// Data() points right into the store in both cases, so that a wave is
+// copied once to and from the store, without any file access of its 
+// own.  A persistent store is always mapped and keeps its file, so 
+// that a restarted simulation finds the waves again (see Sync()).
+class WaveStore
+{
+public:
+	// pixels firstPixel .. firstPixel+pixels-1, waveBytes bytes per wave.
+	// memoryLimitMB <= 0 uses a quarter of the physical memory.
+	WaveStore(size_t waveBytes, int firstPixel, int pixels, int slots, 
+		double memoryLimitMB, const char *spillFile, bool persistent=false);
+	~WaveStore();
+
+	// the wave of pixel in slot
+	char *Data(int slot, int pixel) 
+	{ 
+		return m_data + ((size_t)slot*m_pixels + (pixel-m_firstPixel))*m_waveBytes; 
+	}
+	size_t WaveBytes() const { return m_waveBytes; }
+	size_t Bytes() const { return m_bytes; }
+	bool Mapped() const { return m_mapped; }
+	// writes the waves of a mapped store to its file
+	void Sync();
+	// a store that is no longer persistent removes its file when it is deleted
+	void SetPersistent(bool persistent) { m_persistent = persistent; }
+
+	static double PhysicalMemoryMB();
+
+private:
+	void Map();
+
+	size_t m_waveBytes, m_bytes;
+	int m_firstPixel, m_pixels, m_slots;
+	char *m_data;
+	bool m_mapped, m_persistent;
+	std::string m_fileName;
+#ifdef _WIN32
+	HANDLE m_file, m_mapping;
+#else
+	int m_fd;
+#endif
+};
+
+typedef boost::shared_ptr<WaveStore> WaveStorePtr;
+
+#endif
@@ -244,11 +244,11 @@ void make3DSlicesFT(MULS *muls) {
   /*******************************************************
    * initializing  cz, and trans
    *************************************************************/
-  if(muls->trans==NULL) {
+  if(muls->trans.Empty()) {
     printf("make3DSlicesFT: Error, trans not allocated!\n");
     exit(0);
   }
-  memset(muls->trans[0][0],0,Nzp*Nxp*Nyp*sizeof(fftw_complex));
+  memset(muls->trans.Data(),0,Nzp*Nxp*Nyp*sizeof(fftw_complex));
   if (muls->cz == NULL) muls->cz = float1D(Nzp,"cz");
   for (i=0;i<Nzp;i++) muls->cz[i] = muls->sliceThickness;  					
   
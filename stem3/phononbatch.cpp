@@ -0,0 +1,170 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#include "phononbatch.h"
+#include "readparams.h"
+#include "stemlib.h"
+#include "customslice.h"
+#include "wave_store.h"
+
+#define BUF_LEN 256
+
+PhononConfigPtr newPhononConfig(MULS *muls, bool ownTrans)
+{
+	PhononConfigPtr config = PhononConfigPtr(new PhononConfig);
+	int series;
+
+	config->run = 0;
+	config->wave = WavePtr(new WAVEFUNC(muls->nx, muls->ny, muls->resolutionX, muls->resolutionY));
+	if (muls->precision == PRECISION_DOUBLE) config->wave->UseDouble();
+	config->wave->config = config.get();
+	if (ownTrans) config->trans.Resize(muls->trans.Nz(), muls->trans.Nx(), muls->trans.Ny(), "trans");
+	if ((muls->mode == CBED) && (muls->saveLevel > 0)) {
+		series = detectorSlice(muls, muls->slices*muls->cellDiv-1)+1;
+		config->diffSeries.Resize(series, muls->nx, muls->ny, "diffSeries");
+		config->diffSeriesSet.assign(series, 0);
+	}
+	return config;
+}
+
+int phononBatchSize(MULS *muls)
+{
+	char buf[BUF_LEN];
+	int batchSize, sequences=0, repeat1=1, repeat2=1;
+	double configMB, memoryMB;
+
+	batchSize = (muls->phononBatch > 0) ? muls->phononBatch : omp_get_max_threads();
+	if (batchSize > muls->avgRuns) batchSize = muls->avgRuns;
+	if (batchSize < 2) return 1;
+	if (muls->sliceRing > 0) {
+		printf("Phonon batches need the whole slab at once (no slice ring), the runs are done one after another\n");
+		return 1;
+	}
+
+	resetParamFile();
+	while (readparam("sequence: ",buf,0)) {
+		sequences++;
+		sscanf(buf,"%d %d",&repeat1,&repeat2);
+	}
+	if ((sequences != 1) || (repeat2*muls->cellDiv > 1) || muls->lbeams) {
+		printf("Phonon batches need a single slab and no pendelloesung plot, the runs are done one after another\n");
+		return 1;
+	}
+
+	/* transmission function, wave function (in both precisions), 
+	 * diffraction pattern and its average, and the CBED series */
+	configMB = muls->trans.Size()*sizeof(muls->trans.Data()[0]) + 
+		(double)muls->nx*muls->ny*(sizeof(fftwf_complex)+2*sizeof(float_tt));
+	if (muls->precision == PRECISION_DOUBLE) configMB += (double)muls->nx*muls->ny*sizeof(fftw_complex);
+	if ((muls->mode == CBED) && (muls->saveLevel > 0)) 
+		configMB += (double)(detectorSlice(muls, muls->slices*muls->cellDiv-1)+1)*muls->nx*muls->ny*sizeof(float_tt);
+	configMB /= 1024.0*1024.0;
+	memoryMB = (muls->phononBatchMB > 0) ? muls->phononBatchMB : WaveStore::PhysicalMemoryMB()/4;
+	if (2*batchSize*configMB > memoryMB) batchSize = (int)(memoryMB/(2*configMB));
+	if (batchSize < 2) {
+		printf("Phonon batches do not fit into %g MB (%g MB per configuration), the runs are done one after another\n",
+			memoryMB,configMB);
+		return 1;
+	}
+	if (muls->printLevel > 0)
+		printf("Phonon batches of %d configurations (%.1f MB)\n",batchSize,2*batchSize*configMB);
+	return batchSize;
+}
+
+/* the incident wave and potential of the configuration of run, built 
+ * into muls->trans and then exchanged with that of the configuration.  
+ * The propagators are the same for all configurations, they are made 
+ * once by runPhononBatches(), so that the threads propagating the 
+ * current batch can use them while the next one is built. */
+static void buildPhononConfig(MULS *muls, PhononConfig &config, int run, PhononStep prepare)
+{
+	char buf[BUF_LEN];
+
+	config.run = run;
+	muls->avgCount = run;
+	std::fill(config.diffSeriesSet.begin(), config.diffSeriesSet.end(), 0);
+	prepare(config);
+
+	resetParamFile();
+	readparam("sequence: ",buf,0);
+	muls->mulsRepeat1 = 1;
+	sscanf(buf,"%d",&muls->mulsRepeat1);
+	muls->mulsRepeat2 = 1;
+	sprintf(muls->cin2,"%d",muls->mulsRepeat1);
+	muls->totalSliceCount = 0;
+	if ((muls->mode == CBED) && (muls->scatFactor == CUSTOM))
+		make3DSlicesFT(muls);
+	else
+		make3DSlices(muls,muls->slices,muls->atomPosFile,NULL);
+	makeTransmission(muls,muls->slices);
+	muls->trans.Swap(config.trans);
+}
+
+void runPhononBatches(MULS *muls, int batchSize, PhononStep prepare, PhononStep reduce)
+{
+	std::vector<PhononConfigPtr> current, next;
+	int i, k, th, first, count, nextCount;
+	double timer;
+
+	for (i=0; i<batchSize; i++) {
+		current.push_back(newPhononConfig(muls, true));
+		next.push_back(newPhononConfig(muls, true));
+	}
+	muls->saveFlag = 0;
+
+	count = batchSize;
+	for (i=0; i<count; i++) buildPhononConfig(muls, *current[i], i, prepare);
+	initPropagators(muls);
+	for (first=0; count>0; first+=count, count=nextCount) {
+		nextCount = muls->avgRuns-first-count;
+		if (nextCount > batchSize) nextCount = batchSize;
+		if (nextCount < 0) nextCount = 0;
+
+		/* the configurations are handed out one by one, the master 
+		 * thread joins in when the next batch is built */
+		k = 0;
+#pragma omp parallel private(i, th, timer) shared(muls, current, next, first, count, nextCount, k, prepare)
+		{
+			th = omp_get_thread_num();
+			if (th == 0) 
+				for (i=0; i<nextCount; i++) buildPhononConfig(muls, *next[i], first+count+i, prepare);
+			while (1) {
+#pragma omp critical(phononBatch)
+				i = k++;
+				if (i >= count) break;
+				timer = omp_get_wtime();
+				runMulsSTEM(muls, current[i]->wave);
+				if (muls->printLevel > 0)
+					printf("Run %d: t=%gA, int.=%g time: %gsec\n",current[i]->run,
+						current[i]->wave->thickness,current[i]->wave->intIntensity,omp_get_wtime()-timer);
+			}
+		}
+
+		for (i=0; i<count; i++) {
+			muls->avgCount = current[i]->run;
+			reduce(*current[i]);
+		}
+		current.swap(next);
+	}
+}
@@ -0,0 +1,67 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PHONONBATCH_H
+#define PHONONBATCH_H
+
+#include <vector>
+#include "data_containers.h"
+
+/* A frozen phonon configuration in CBED and TEM mode: the wave function 
+ * of one run, and what the run keeps of its own while it is propagated 
+ * next to others ("phonon batch:").  The configurations of a batch are 
+ * built one after another, so that they are the same as in a serial run,
+ * but propagated at the same time, each through its own transmission 
+ * function.  Their results are averaged in the order of the runs.
+ * STEM has no phonon batches, the pixels of its scan already keep all 
+ * threads busy with one configuration.
+ */
+struct PhononConfig {
+	int run;                    // the frozen phonon run (muls->avgCount)
+	WavePtr wave;               // wave->config points back here
+#if FLOAT_PRECISION == 1
+	Array3D<fftwf_complex> trans;  // empty: muls->trans
+#else
+	Array3D<fftw_complex> trans;
+#endif
+	// CBED: the diffraction pattern of each output thickness, see collectIntensity()
+	Array3D<float_tt> diffSeries;
+	std::vector<unsigned char> diffSeriesSet;
+};
+
+typedef boost::shared_ptr<PhononConfig> PhononConfigPtr;
+typedef void (*PhononStep)(PhononConfig &config);
+
+/* a configuration with a wave function, the diffraction series in CBED 
+ * mode, and, for phonon batches, its own transmission function */
+PhononConfigPtr newPhononConfig(MULS *muls, bool ownTrans);
+/* the number of configurations per batch, 1: the runs are done one 
+ * after another.  Batches need a single slab and no pendelloesung plot; 
+ * two of them (the one in propagation and the next one) must fit into 
+ * muls->phononBatchMB. */
+int phononBatchSize(MULS *muls);
+/* does all frozen phonon runs in batches of batchSize.  prepare() makes 
+ * the incident wave of a configuration before its potential is built, 
+ * reduce() adds the results of a propagated configuration to the 
+ * averages.  Both are called in the order of the runs, with 
+ * muls->avgCount set to the run.  While a batch is propagated, the 
+ * master thread builds the next one. */
+void runPhononBatches(MULS *muls, int batchSize, PhononStep prepare, PhononStep reduce);
+
+#endif
@@ -28,6 +28,8 @@ QSTEM - image simulation for TEM/STEM/CBED
 #define _CRTDBG_MAP_ALLOC
 #include <stdio.h>	/* ANSI C libraries */
 #include <stdlib.h>
+#include <iostream>
+#include <algorithm>
 #ifdef _WIN32
 #if _DEBUG
 #include <crtdbg.h>
@@ -61,6 +63,14 @@ QSTEM - image simulation for TEM/STEM/CBED
 // #include "weblib.h"
 #include "customslice.h"
 #include "data_containers.h"
+#include "fftw_plans.h"
+#include "scan_scheduler.h"
+#include "stemmpi.h"
+#include "stemcheckpoint.h"
+#include "wave_store.h"
+#include "diff_accumulator.h"
+#include "numa_layout.h"
+#include "phononbatch.h"
 
 #define NCINMAX 1024
 #define NPARAM	64    /* number of parameters */
@@ -97,7 +107,13 @@ void readFile();
 void displayParams();
 
 void usage() {
-	printf("usage: stem [input file='stem.dat']\n\n");
+	printf("usage: stem [input file='stem.dat'] [--shard i/N] [--resume]\n\n");
+	printf("  --shard i/N  compute only the i-th of N parts (i = 0 .. N-1) of the\n"
+		   "               STEM scan rows; combine the parts with stem3-merge\n\n");
+	printf("  --resume     continue a STEM simulation from its last checkpoint\n"
+		   "               (see 'checkpoint interval:')\n\n");
+	printf("  with MPI:    mpirun -np P stem [input file] runs STEM on P processes,\n"
+		   "               see 'phonon groups:'\n\n");
 }
 
 
@@ -109,11 +125,12 @@ void usage() {
 
 
 int main(int argc, char *argv[]) {
-	int i; 
+	int i, shardIndex = 0, shardCount = 0; 
 	double timerTot;
 	char fileName[512]; 
 	char cinTemp[BUF_LEN];
 
+	mpiInit(&argc, &argv, &muls.mpiRank, &muls.mpiSize);
 	timerTot = cputim();
 	for (i=0;i<BUF_LEN;i++)
 		cinTemp[i] = 0;
@@ -126,10 +143,17 @@ int main(int argc, char *argv[]) {
 	/*************************************************************
 	* read in the parameters
 	************************************************************/  
-	if (argc < 2)
-		sprintf(fileName,"stem.dat");
-	else
-		strcpy(fileName,argv[1]);
+	sprintf(fileName,"stem.dat");
+	for (i=1; i<argc; i++) {
+		if (strcmp(argv[i],"--shard") == 0) {
+			if ((i+1 >= argc) || (sscanf(argv[++i],"%d/%d",&shardIndex,&shardCount) != 2)) {
+				usage();
+				exit(0);
+			}
+		}
+		else if (strcmp(argv[i],"--resume") == 0) muls.resume = 1;
+		else strcpy(fileName,argv[i]);
+	}
 	if (parOpen(fileName) == 0) 
 	{
 		printf("could not open input file %s!\n",fileName);
@@ -137,8 +161,29 @@ int main(int argc, char *argv[]) {
 		exit(0);
 	}
 	readFile();
+	// the command line overrides "scan shard:" of the input file
+	if (shardCount > 0) {
+		muls.shardIndex = shardIndex;
+		muls.shardCount = shardCount;
+	}
+	if ((muls.shardCount < 1) || (muls.shardIndex < 0) || (muls.shardIndex >= muls.shardCount)) {
+		printf("Invalid scan shard %d/%d, must be i/N with 0 <= i < N\n",muls.shardIndex,muls.shardCount);
+		exit(0);
+	}
+	mpiSetupSTEM(&muls);
+	if ((muls.phononGroups > 1) && (muls.saveLevel > 0) && (muls.mpiRank == 0))
+		printf("Warning: the diffraction patterns diffAvg_*.img only average the runs of phonon group 0\n");
+	if ((muls.mpiSize > 1) && (muls.mode != STEM)) {
+		if (muls.mpiRank == 0) printf("Only STEM runs on several MPI processes, using rank 0\n");
+		else {
+			mpiFinalize();
+			return 0;
+		}
+	}
 
 	displayParams();
+	// the output folder exists before any process writes to it
+	if (muls.mode == STEM) mpiBarrier();
 #ifdef _OPENMP
 	omp_set_dynamic(1);
 #endif
@@ -167,8 +212,11 @@ int main(int argc, char *argv[]) {
 	  default:
 		  printf("Mode not supported\n");
 	}
+	// keep the plans of the wave functions for the next run:
+	if ((muls.wisdomFile[0] != '\0') && (muls.mpiRank == 0)) saveFFTWisdom(muls.wisdomFile);
 
 	parClose();
+	mpiFinalize();
 #if _DEBUG
 	_CrtDumpMemoryLeaks();
 #endif
@@ -218,7 +266,6 @@ void initMuls() {
 	muls.tomoCount = 0;  // indicate: NO Tomography simulation.
 
 	/* make multislice read the inout files and assign transr and transi: */
-	muls.trans = NULL;
 	muls.cz = NULL;  // (real *)malloc(muls.slices*sizeof(real));
 
 	muls.onlyFresnel = 0;
@@ -346,6 +393,10 @@ void displayParams() {
 	printf("*****************************************************\n");
 	printf("* Print level:          %d\n",muls.printLevel);
 	printf("* Save level:           %d\n",muls.saveLevel);
+	printf("* Slice engine:         %s%s\n",(muls.sliceEngine == SLICE_ENGINE_FUSED) ? "fused" : "reference",
+		((muls.sliceEngine == SLICE_ENGINE_FUSED) && muls.pruneFFT && (muls.precision == PRECISION_SINGLE)) ? 
+		" (band limited FFTs)" : "");
+	printf("* Precision:            %s\n",(muls.precision == PRECISION_DOUBLE) ? "double" : "single");
 	printf("* Input file:           %s\n",muls.atomPosFile);
 	if (muls.savePotential)
 		printf("* Potential file name:  %s\n",muls.fileBase);
@@ -389,7 +440,10 @@ void displayParams() {
 
 	printf("* Potential:            ");
 	if (muls.potential3D) printf("3D"); else printf("2D");
-	if (muls.fftpotential) printf(" (fast method)\n"); else printf(" (slow method)\n");	
+	if (muls.recipPotential) printf(" (reciprocal space method)\n");
+	else if (muls.fftpotential) printf(" (fast method)\n"); else printf(" (slow method)\n");	
+	if (!muls.fftpotential && !muls.recipPotential)
+		printf("* Potential cache:      %s\n",(muls.potCacheFolder[0] != '\0') ? muls.potCacheFolder : ".");
 	printf("* Pot. array offset:    (%g,%g,%g)A\n",muls.potOffsetX,muls.potOffsetY,muls.czOffset);
 	printf("* Potential periodic:   (x,y): %s, z: %s\n",
 		(muls.nonPeriod) ? "no" : "yes",(muls.nonPeriodZ) ? "no" : "yes");
@@ -449,6 +503,19 @@ void displayParams() {
 		printf("* TDS:                  yes (%d runs)\n",muls.avgRuns);
 	else
 		printf("* TDS:                  no\n"); 
+	if (muls.phononSeed != 0)
+		printf("* Phonon seed:          %ld\n",muls.phononSeed);
+	if ((muls.phononBatch != 1) && ((muls.mode == CBED) || (muls.mode == TEM)))
+		printf("* Phonon batch:         %d configurations at a time (0: one per thread)\n",muls.phononBatch);
+	if ((muls.waveThreads > 0) && (muls.mode != STEM))
+		printf("* Wave threads:         %d threads per wave function\n",muls.waveThreads);
+	if (muls.potThreads > 0)
+		printf("* Potential threads:    %d threads add the atoms to the slices\n",muls.potThreads);
+	if (muls.sliceRing > 0)
+		printf("* Slice ring:           %d slices built while the previous %d are propagated\n",muls.sliceRing,muls.sliceRing);
+	if (muls.mpiSize > 1)
+		printf("* MPI processes:        %d (%d phonon groups of %d)\n",
+			muls.mpiSize,muls.phononGroups,muls.rowRanks);
 	if (muls.imageGamma == 0)
 		printf("* Gamma for diff. patt: logarithmic\n");
 	else
@@ -457,14 +524,14 @@ void displayParams() {
 	/**********************************************************
 	* FFTW specific data structures (stores in row major order)
 	*/
-	if (fftMeasureFlag == FFTW_MEASURE)
+	if (fftMeasureFlag != FFTW_ESTIMATE)
 		printf("* Probe array:          %d x %d pixels (optimized)\n",muls.nx,muls.ny);
 	else
 		printf("* Probe array:          %d x %d pixels (estimated)\n",muls.nx,muls.ny);
 	printf("*                       %g x %gA\n",
 		muls.nx*muls.resolutionX,muls.ny*muls.resolutionY);
 
-	if (fftMeasureFlag == FFTW_MEASURE)
+	if (fftMeasureFlag != FFTW_ESTIMATE)
 		printf("* Potential array:      %d x %d (optimized)\n",muls.potNx,muls.potNy);
 	else
 		printf("* Potential array:      %d x %d (estimated)\n",muls.potNx,muls.potNy);
@@ -504,6 +571,27 @@ void displayParams() {
 		printf("* Scan window:          (%g,%g) to (%g,%g)A, %d x %d = %d pixels\n",
 			muls.scanXStart,muls.scanYStart,muls.scanXStop,muls.scanYStop,
 			muls.scanXN,muls.scanYN,muls.scanXN*muls.scanYN);
+		printf("* Scan batch size:      %d probe positions per thread\n",muls.scanBatch);
+		if (muls.scanTileSize > 0)
+			printf("* Scan tile size:       %d x %d pixels\n",muls.scanTileSize,muls.scanTileSize);
+		else
+			printf("* Scan tile size:       automatic\n");
+		if (muls.shardCount > 1) {
+			int ixStart, ixStop;
+			scanShardRows(muls.shardIndex,muls.shardCount,muls.scanXN,ixStart,ixStop);
+			printf("* Scan shard:           %d of %d (scan rows %d to %d)\n",muls.shardIndex,muls.shardCount,ixStart,ixStop-1);
+		}
+		printf("* Sub-pixel scan:       %s\n",muls.subpixelScan ? "yes" : "no (positions rounded down to pixels)");
+		if (muls.waveStoreMB > 0)
+			printf("* Wave store:           %g MB in memory, then %s/\n",muls.waveStoreMB,
+				(muls.waveStoreFolder[0] != '\0') ? muls.waveStoreFolder : muls.folder);
+		if (muls.checkpointInterval > 0)
+			printf("* Checkpoints:          every %g sec%s\n",muls.checkpointInterval,muls.resume ? ", resuming" : "");
+		else if (muls.resume)
+			printf("* Checkpoints:          none, but resuming\n");
+		if (muls.threadPinning != PIN_NONE)
+			printf("* Thread pinning:       %s%s\n",(muls.threadPinning == PIN_CORES) ? "cores" : "NUMA nodes",
+				muls.replicateTrans ? ", one copy of the potential per node" : "");
 	} /* end of if mode == STEM */
 
 	/***********************************************************************
@@ -615,7 +703,6 @@ void readFile() {
 	float ax,by,c;
 	char buf[BUF_LEN],*strPtr;
 	int i,ix;
-	int potDimensions[2];
 	long ltime;
 	unsigned long iseed;
 	double dE_E0,x,y,dx,dy;
@@ -642,6 +729,46 @@ void readFile() {
 	if (readparam("print level:",buf,1)) sscanf(buf,"%d",&(muls.printLevel));
 	muls.saveLevel = 0;
 	if (readparam("save level:",buf,1)) sscanf(buf,"%d",&(muls.saveLevel));
+	muls.sliceEngine = SLICE_ENGINE_FUSED;
+	if (readparam("slice engine:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		if (tolower(answer[0]) == (int)'r') muls.sliceEngine = SLICE_ENGINE_REFERENCE;
+	}
+	/* precision of the wave function during propagation: single (default) or double */
+	muls.precision = PRECISION_SINGLE;
+	if (readparam("precision:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		if (tolower(answer[0]) == (int)'d') muls.precision = PRECISION_DOUBLE;
+	}
+	/* FFTW planning: estimate (default), measure or patient.  With a wisdom file,
+	* the plans only need to be measured once per machine. */
+	fftMeasureFlag = FFTW_ESTIMATE;
+	if (readparam("fft plan rigor:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		if (tolower(answer[0]) == (int)'m') fftMeasureFlag = FFTW_MEASURE;
+		else if (tolower(answer[0]) == (int)'p') fftMeasureFlag = FFTW_PATIENT;
+	}
+	setFFTPlanRigor(fftMeasureFlag);
+	muls.wisdomFile[0] = '\0';
+	if (fftMeasureFlag != FFTW_ESTIMATE) sprintf(muls.wisdomFile,"qstem_fftw.wisdom");
+	if (readparam("fftw wisdom:",buf,1)) sscanf(buf,"%s",muls.wisdomFile);
+	// TEM, CBED, NBED: threads working on the single wave function, 0: all (see initWaveThreads())
+	muls.waveThreads = 0;
+	if (readparam("wave threads:",buf,1)) sscanf(buf,"%d",&(muls.waveThreads));
+	muls.potThreads = 0;
+	if (readparam("potential threads:",buf,1)) sscanf(buf,"%d",&(muls.potThreads));
+	// TEM, CBED: slices built at a time while the previous ones are propagated, 0: all (see runMulsSTEMRing())
+	muls.sliceRing = 0;
+	if (readparam("slice ring:",buf,1)) sscanf(buf,"%d",&(muls.sliceRing));
+	if (muls.wisdomFile[0] != '\0') {
+		if ((loadFFTWisdom(muls.wisdomFile) > 0) && (muls.printLevel > 1))
+			printf("Read FFTW wisdom from %s\n",muls.wisdomFile);
+	}
+	muls.pruneFFT = 1;
+	if (readparam("pruned fft:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		muls.pruneFFT = (tolower(answer[0]) == (int)'y');
+	}
 
 
 	/************************************************************************
@@ -768,6 +895,18 @@ void readFile() {
 		sscanf(buf,"%s",muls.phononFile);
 		muls.Einstein = 0;
 	}
+	// fixed seed for the random displacements (0: from the time)
+	muls.phononSeed = 0;
+	if (readparam("phonon seed:",buf,1)) sscanf(buf,"%ld",&(muls.phononSeed));
+	// number of groups of MPI processes that share the TDS runs, see mpiSetupSTEM()
+	muls.phononGroups = 1;
+	if (readparam("phonon groups:",buf,1)) sscanf(buf,"%d",&(muls.phononGroups));
+	// CBED, TEM: configurations propagated at the same time (0: one per thread), and 
+	// the memory (MB) for them, 0: a quarter of the physical memory (see phononbatch.h)
+	muls.phononBatch = 1;
+	if (readparam("phonon batch:",buf,1)) sscanf(buf,"%d",&(muls.phononBatch));
+	muls.phononBatchMB = 0;
+	if (readparam("phonon batch memory:",buf,1)) sscanf(buf,"%lf",&(muls.phononBatchMB));
 
 	/**********************************************************************
 	* Read the atomic model positions !!!
@@ -1005,6 +1144,14 @@ void readFile() {
 		sscanf(buf,"%s",answer);
 		muls.fftpotential = (tolower(answer[0]) == (int)'y');
 	}
+	muls.recipPotential = 0;
+	if (readparam("reciprocal potential:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		muls.recipPotential = (tolower(answer[0]) == (int)'y');
+	}
+	muls.potCacheFolder[0] = '\0';  // the current folder
+	if (readparam("potential cache folder:",buf,1)) 
+		sscanf(buf,"%s",muls.potCacheFolder);
 	muls.potential3D = 1;
 	if (readparam("potential3D:",buf,1)) {
 		sscanf(buf,"%s",answer);
@@ -1028,6 +1175,16 @@ void readFile() {
 	muls.scanYN = 1;
 	muls.scanXStop = muls.scanXStart;
 	muls.scanYStop = muls.scanYStart;
+	muls.scanBatch = 1;
+	muls.subpixelScan = 1;
+	muls.scanTileSize = 0;
+	muls.shardIndex = 0;
+	muls.shardCount = 1;
+	muls.checkpointInterval = 0;
+	muls.waveStoreMB = 0;
+	muls.waveStoreFolder[0] = '\0';  // the output folder
+	muls.threadPinning = PIN_NONE;
+	muls.replicateTrans = 0;
 
 
 	switch (muls.mode) {
@@ -1073,6 +1230,52 @@ void readFile() {
 		muls.displayProgInterval = muls.scanYN*muls.scanYN;
 		if (readparam("propagation progress interval:",buf,1)) 
 			sscanf(buf,"%d",&(muls.displayProgInterval));
+		// number of probe positions that each thread propagates together:
+		if (readparam("scan batch size:",buf,1)) 
+			sscanf(buf,"%d",&(muls.scanBatch));
+		if (muls.scanBatch < 1) muls.scanBatch = 1;
+		if ((muls.scanBatch > 1) && (muls.precision == PRECISION_DOUBLE)) {
+			printf("Scan batches are only supported in single precision, using scan batch size 1\n");
+			muls.scanBatch = 1;
+		}
+		if ((muls.scanBatch > 1) && (muls.sliceEngine == SLICE_ENGINE_REFERENCE)) {
+			printf("Scan batches use the fused slice engine, using scan batch size 1\n");
+			muls.scanBatch = 1;
+		}
+		// edge length of the tiles of the scan handed to the threads, 0: automatic
+		if (readparam("scan tile size:",buf,1)) 
+			sscanf(buf,"%d",&(muls.scanTileSize));
+		// compute only part of the scan rows, e.g. "scan shard: 0/4", see scanShardRows():
+		if (readparam("scan shard:",buf,1)) 
+			sscanf(buf,"%d%*[ /]%d",&(muls.shardIndex),&(muls.shardCount));
+		// wall-clock seconds between checkpoints for stem3 --resume, 0: no checkpoints
+		if (readparam("checkpoint interval:",buf,1)) 
+			sscanf(buf,"%lf",&(muls.checkpointInterval));
+		// memory (MB) for the exit waves between slabs and, separately, for the averaged 
+		// diffraction patterns, 0: a quarter of the physical memory; more go to a mapped 
+		// file in the wave store folder (e.g. a local scratch disk)
+		if (readparam("wave store memory:",buf,1)) 
+			sscanf(buf,"%lf",&(muls.waveStoreMB));
+		if (readparam("wave store folder:",buf,1)) 
+			sscanf(buf,"%s",muls.waveStoreFolder);
+		// place the probe at fractional scan positions (see probeShift()):
+		if (readparam("subpixel scan:",buf,1)) {
+			sscanf(buf,"%s",answer);
+			muls.subpixelScan = (tolower(answer[0]) == (int)'y');
+		}
+		// bind the threads to the cpus of their NUMA node: none, cores or nodes (see numa_layout.h)
+		if (readparam("thread pinning:",buf,1)) {
+			sscanf(buf,"%s",answer);
+			if (tolower(answer[0]) == (int)'c') muls.threadPinning = PIN_CORES;
+			else if (tolower(answer[0]) == (int)'n' && tolower(answer[1]) == (int)'o' && 
+				tolower(answer[2]) == (int)'d') muls.threadPinning = PIN_NODES;
+		}
+		// one copy of the transmission functions per NUMA node, read by the threads of that node
+		if (readparam("trans replicas:",buf,1)) {
+			sscanf(buf,"%s",answer);
+			muls.replicateTrans = (tolower(answer[0]) == (int)'y');
+		}
+		if (muls.replicateTrans && (muls.threadPinning == PIN_NONE)) muls.threadPinning = PIN_NODES;
 	}
 	muls.displayPotCalcInterval = 100000; // RAM: default, but normally read-in by .CFG file in next code fragment
 	if ( readparam( "potential progress interval:", buf, 1 ) )
@@ -1524,33 +1727,35 @@ void readFile() {
 		printf( "DEBUG: tilt/tds default filename made = %s \n", muls.cfgFile );
 	}
 
+	/* with a slice ring, trans only holds the slices of one window of the slab */
+	if (muls.sliceRing >= muls.slices) muls.sliceRing = 0;
+	if ((muls.sliceRing > 0) && (muls.mode != TEM) && (muls.mode != CBED)) {
+		printf("The slice ring is only used in TEM and CBED mode\n");
+		muls.sliceRing = 0;
+	}
+	if ((muls.sliceRing > 0) && (muls.mode == CBED) && (muls.scatFactor == CUSTOM)) {
+		printf("The custom slices are built at once, no slice ring\n");
+		muls.sliceRing = 0;
+	}
+	if (muls.sliceRing < 0) muls.sliceRing = 0;
+	i = (muls.sliceRing > 0) ? muls.sliceRing : muls.slices;
+
 	/* allocate memory for wave function */
 
-	potDimensions[0] = muls.potNx;
-	potDimensions[1] = muls.potNy;
-#if FLOAT_PRECISION == 1
-	muls.trans = complex3Df(muls.slices,muls.potNx,muls.potNy,"trans");
+	muls.trans.Resize(i,muls.potNx,muls.potNy,"trans");
 	// printf("allocated trans %d %d %d\n",muls.slices,muls.potNx,muls.potNy);
-	muls.fftPlanPotForw = fftwf_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_FORWARD, fftMeasureFlag);
-	muls.fftPlanPotInv = fftwf_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_BACKWARD, fftMeasureFlag);
+#if FLOAT_PRECISION == 1
+	muls.fftPlanPotForw = getFFTPlanf(muls.potNx,muls.potNy,i,FFTW_FORWARD,muls.trans.Data());
+	muls.fftPlanPotInv = getFFTPlanf(muls.potNx,muls.potNy,i,FFTW_BACKWARD,muls.trans.Data());
 #else
-
-	muls.trans = complex3D(muls.slices,muls.potNx,muls.potNy,"trans");
-	muls.fftPlanPotForw = fftw_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_FORWARD, fftMeasureFlag);
-	muls.fftPlanPotInv = fftw_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_BACKWARD, fftMeasureFlag);
+	muls.fftPlanPotForw = getFFTPlan(muls.potNx,muls.potNy,i,FFTW_FORWARD,muls.trans.Data());
+	muls.fftPlanPotInv = getFFTPlan(muls.potNx,muls.potNy,i,FFTW_BACKWARD,muls.trans.Data());
 #endif
 
 	////////////////////////////////////
 	if (muls.printLevel >= 4) 
-		printf("Memory for transmission function (%d x %d x %d) allocated and plans initiated\n",muls.slices,muls.potNx,muls.potNy);
+		printf("Memory for transmission function (%d x %d x %d) allocated and plans initiated\n",i,muls.potNx,muls.potNy);
+	if ((muls.wisdomFile[0] != '\0') && (muls.mpiRank == 0)) saveFFTWisdom(muls.wisdomFile);
 
 
 	// printf("%d %d %d %d\n",muls.nx,muls.ny,sizeof(fftw_complex),(int)(&muls.wave[2][2])-(int)(&muls.wave[2][1]));
@@ -1704,6 +1909,21 @@ void doMSCBED() {
 
 }
 
+/************************************************************************
+* initWaveThreads() - sets the number of threads working on one wave 
+* function (FFTs and kernels, see setWaveThreads()) in the single wave 
+* modes: "wave threads:" or else all threads of the machine.  If 
+* parallelWaves > 1 wave functions are propagated at the same time 
+* (phonon batches), every thread works on a wave function of its own.
+***********************************************************************/
+static void initWaveThreads(int parallelWaves) {
+	int threads = 1;
+
+	if (parallelWaves <= 1) threads = (muls.waveThreads > 0) ? muls.waveThreads : omp_get_max_threads();
+	setWaveThreads(threads);
+	if (muls.printLevel > 1) printf("Using %d thread%s per wave function\n",threads,(threads > 1) ? "s" : "");
+}
+
 /************************************************************************
 * doNBED performs a NBED calculation
 *  -- added by Robert A. McLeod 04 April 2014
@@ -1731,10 +1951,13 @@ void doNBED()
 	int oldMulsRepeat1 = 1;
 	int oldMulsRepeat2 = 1;
 	long iseed = 0;
-	WavePtr wave = WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY));
+	WavePtr wave;
 	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls.nx, muls.ny, t, muls.resolutionX, muls.resolutionY));
 	std::vector<double> params(2);
 
+	initWaveThreads(1);
+	wave = WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY));
+
 	//printf("Debug doNBED: wavefile: %s\n",muls.fileWaveIn);
 
 	// Try and test 
@@ -1748,6 +1971,7 @@ void doNBED()
 	//printf("Debug doNBED3 \n");
 
 	muls.chisq = std::vector<double>(muls.avgRuns);
+	if (muls.precision == PRECISION_DOUBLE) wave->UseDouble();
 
 	if (iseed == 0) iseed = -(long)time(NULL);
 
@@ -1787,10 +2011,8 @@ void doNBED()
 
 
 		// RAM: This is where I need to remove the existing STEM probe and in the future add some circular shift and crop?
-		// RAM: made a new function in stemlib, probeShiftAndCrop(&muls, wave, muls.scanXStart - muls.potOffsetX, muls.scanYStart - muls.potOffsetY)
 		// probe(&muls, wave, muls.scanXStart - muls.potOffsetX, muls.scanYStart - muls.potOffsetY);
-		probeShiftAndCrop(&muls, wave, muls.scanXStart - muls.potOffsetX, muls.scanYStart - muls.potOffsetY, muls.nx, muls.ny);
-		// RAM: function is empty for now (returns wave)
+		// The wave read from muls.fileWaveIn is used as it is (probeShift() only shifts the cached STEM probe).
 
 		if (muls.saveLevel > 2) 
 		{
@@ -2043,26 +2265,195 @@ void doNBED()
 /************************************************************************
 * doCBED performs a CBED calculation
 *
+* Each frozen phonon run makes the incident probe (prepareCBEDRun()), 
+* propagates it through the specimen and adds the diffraction patterns 
+* to the averages (reduceCBEDRun()).  With phonon batches (see 
+* phononbatch.h), several runs are propagated at the same time.
 ***********************************************************************/
 
+static long cbedSeed = 0;                  /* source position of the probe */
+static double probeCenterX,probeCenterY;
+static real **avgPendelloesung = NULL;
+static WavePtr avgWave;                    /* avgArray: the diffraction pattern averaged over the runs */
+
+static void prepareCBEDRun(PhononConfig &config) {
+	double probeOffsetX,probeOffsetY;
+	char buf[BUF_LEN],systStr[64];
+	FILE *fpPos;
+	WavePtr wave = config.wave;
+
+	/* make incident probe wave function with probe exactly in the center */
+	/* if the potential array is not big enough, the probe can 
+	* then also be adjusted, so that it is off-center
+	*/
+	probeOffsetX = muls.sourceRadius*gasdev(&cbedSeed)*SQRT_2;
+	probeOffsetY = muls.sourceRadius*gasdev(&cbedSeed)*SQRT_2;
+	muls.scanXStart = probeCenterX+probeOffsetX;
+	muls.scanYStart = probeCenterY+probeOffsetY;
+	probe(&muls, wave,muls.scanXStart-muls.potOffsetX,muls.scanYStart-muls.potOffsetY);
+	if (muls.saveLevel > 2) {
+		sprintf(systStr,"%s/wave_probe.img",muls.folder);
+		wave->WriteWave(systStr);
+	} 	
+	// printf("Probe: (%g, %g)\n",muls.scanXStart,muls.scanYStart);
+
+	if (muls.sourceRadius > 0) {
+		if (muls.avgCount == 0) fpPos = fopen("probepos.dat","w");
+		else fpPos = fopen("probepos.dat","a");
+		if (fpPos == NULL) {
+			printf("Was unable to open file probepos.dat for writing\n");
+		}
+		else {
+			fprintf(fpPos,"%g %g\n",muls.scanXStart,muls.scanYStart);
+			fclose(fpPos);
+		}
+	}
+
+	if ((muls.showProbe) && (muls.avgCount == 0)) {
+#ifndef WIN32
+		//probePlot(&muls);
+		sprintf(buf,"ee %s/probePlot_0.jpg &",muls.folder);
+		system(buf);
+#endif
+	}
+}
+
+static void reduceCBEDRun(PhononConfig &config) {
+	int ix,iy,t;
+	FILE *avgFp, *fpCBED;
+	char avgName[256],systStr[512];
+	real tAvg;
+	std::vector<double> params(2);
+	WavePtr wave = config.wave;
+
+	/***************** Only if Save level > 2: ****************/
+	if ((muls.avgCount == 0) && (muls.saveLevel > 2)) {
+		sprintf(systStr,"%s/wave_final.img",muls.folder);
+		wave->WriteWave(systStr);
+	} 	
+
+	/* the diffraction pattern of the exit wave is in wave->diffpat, 
+	 * see collectIntensity() */
+	if (muls.avgCount == 0) {
+		memcpy((void *)avgWave->avgArray[0],(void *)wave->diffpat[0],
+			(size_t)(muls.nx*muls.ny*sizeof(float_tt)));
+		/* the first run is the average so far */
+		sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
+		wave->WriteDiffPat(avgName);
+		if (muls.lbeams) {
+			for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
+				for (ix=0;ix<muls.nbout;ix++) {
+					avgPendelloesung[ix][iy] = muls.pendelloesung[ix][iy];
+				}
+			}
+		}
+	} // of if muls.avgCount == 0 ...
+	else {
+		muls.chisq[muls.avgCount-1] = 0.0;
+		for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
+			tAvg = ((real)muls.avgCount*avgWave->avgArray[ix][iy]+
+				wave->diffpat[ix][iy])/((real)(muls.avgCount+1));
+			muls.chisq[muls.avgCount-1] += (avgWave->avgArray[ix][iy]-tAvg)*(avgWave->avgArray[ix][iy]-tAvg);
+			avgWave->avgArray[ix][iy] = tAvg;
+
+		}
+		muls.chisq[muls.avgCount-1] = muls.chisq[muls.avgCount-1]/(double)(muls.nx*muls.ny);
+		sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
+		params[0] = muls.tomoTilt;
+		params[1] = 1.0/wavelength(muls.v0);
+		avgWave->WriteAvgArray(avgName,"Averaged Diffraction pattern, unit: 1/A",params);
+
+		muls.storeSeries = 1;
+		if (muls.saveLevel == 0)	muls.storeSeries = 0;
+		else if (muls.avgCount % muls.saveLevel != 0) muls.storeSeries = 0;
+
+		if (muls.storeSeries == 0) {
+			// printf("Removing old file \n");
+			sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount);
+			sprintf(systStr,"rm %s",avgName);
+			system(systStr);
+		}
+
+		/* write the data to a file */
+		if (muls.saveFlag >-1) {
+			sprintf(systStr,"%s/avgresults.dat",muls.folder);
+			if ((avgFp = fopen(systStr,"w")) == NULL )
+				printf("Sorry, could not open data file for averaging\n");
+			else {
+				for (ix =0;ix<muls.avgCount;ix++) {
+					fprintf(avgFp,"%d %g\n",ix+1,muls.chisq[ix]);
+				}
+				fclose(avgFp);
+			}
+		}
+		/*************************************************************/
+
+		/***********************************************************
+		* Average over the pendelloesung plot as well
+		*/
+		if (muls.lbeams) {
+			for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
+				for (ix=0;ix<muls.nbout;ix++) {
+					avgPendelloesung[ix][iy] = 
+						((real)muls.avgCount*avgPendelloesung[ix][iy]+
+						muls.pendelloesung[ix][iy])/(real)(muls.avgCount+1);
+				}
+			}
+		}
+	} /* else ... if avgCount was greater than 0 */
+
+	/* the diffraction patterns of the output thicknesses (wave is not 
+	 * needed anymore) */
+	for (t=0; t<(int)config.diffSeriesSet.size(); t++) {
+		if (!config.diffSeriesSet[t]) continue;
+		memcpy(wave->diffpat.Data(), config.diffSeries.Slice(t), wave->diffpat.Size()*sizeof(float_tt));
+		averageCBEDPattern(&muls, wave, t);
+	}
+
+	if (muls.lbeams) {
+		/**************************************************************
+		* The diffraction spot intensities of the selected 
+		* diffraction spots are now stored in the 2 dimensional array
+		* muls.pendelloesung[beam][slice].
+		* We can write the array to a file and display it, just for 
+		* demonstration purposes
+		*************************************************************/
+		sprintf(systStr,"%s/pendelloesung.dat",muls.folder);
+		if ( (fpCBED = fopen( systStr, "w" )) != NULL ) {
+			printf("Writing Pendelloesung data\n");
+			for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
+				/* write the thicknes in the first column of the file */
+				fprintf( fpCBED, "%g", iy*muls.c / ((float)(muls.slices*muls.cellDiv)) );
+				/* write the beam intensities in the following columns */
+				for (ix=0;ix<muls.nbout;ix++) {
+					fprintf( fpCBED, "\t%g", avgPendelloesung[ix][iy] );
+				}
+				/* close the line, and start a new one for the next set of
+				* intensities
+				*/
+				fprintf( fpCBED, "\n" );
+			}
+			fclose( fpCBED );
+		}
+		else {
+			printf("Could not open file for pendelloesung plot\n");
+		}  
+	} /* end of if lbemas ... */
+	displayProgress(1);
+}
+
 void doCBED() {
-	int ix,iy,i,pCount,result;
-	FILE *avgFp, *fpCBED, *fpPos = 0, *fpTest = 0;
-	double timer,timerTot;
-	double probeCenterX,probeCenterY,probeOffsetX,probeOffsetY;
-	char buf[BUF_LEN],avgName[32],systStr[64];
-	real t=0;
-	real **avgPendelloesung = NULL;
+	int i,pCount,result,batchSize;
+	double timer;
+	char buf[BUF_LEN];
 	int oldMulsRepeat1 = 1;
 	int oldMulsRepeat2 = 1;
-	long iseed=0;
-	WavePtr wave = WavePtr(new WAVEFUNC(muls.nx,muls.ny, muls.resolutionX, muls.resolutionY));
-	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls.nx, muls.ny, t, muls.resolutionX, muls.resolutionY));
-	std::vector<double> params(2);
+	PhononConfigPtr config;
+	WavePtr wave;
 
 	muls.chisq = std::vector<double>(muls.avgRuns);
-
-	if (iseed == 0) iseed = -(long) time( NULL );
+	cbedSeed = -(long) time( NULL );
+	avgWave = WavePtr(new WAVEFUNC(muls.nx,muls.ny, muls.resolutionX, muls.resolutionY));
 
 	if (muls.lbeams) {
 		muls.pendelloesung = NULL;
@@ -2075,60 +2466,29 @@ void doCBED() {
 	probeCenterX = muls.scanXStart;
 	probeCenterY = muls.scanYStart;
 
-	timerTot = 0; /* cputim();*/
 	displayProgress(-1);
 
+	batchSize = phononBatchSize(&muls);
+	initWaveThreads(batchSize);
+	if (batchSize > 1) {
+		runPhononBatches(&muls, batchSize, prepareCBEDRun, reduceCBEDRun);
+		return;
+	}
+
+	config = newPhononConfig(&muls, false);
+	wave = config->wave;
 	for (muls.avgCount = 0;muls.avgCount < muls.avgRuns;muls.avgCount++) {
 		muls.totalSliceCount = 0;
 		pCount = 0;
+		config->run = muls.avgCount;
+		std::fill(config->diffSeriesSet.begin(), config->diffSeriesSet.end(), 0);
 		/* make sure we start at the beginning of the file 
 		so we won't miss any line that contains a sequence,
 		because we will not do any EOF wrapping
 		*/
 		resetParamFile();
 
-		/* probe(&muls,xpos,ypos); */
-		/* make incident probe wave function with probe exactly in the center */
-		/* if the potential array is not big enough, the probe can 
-		* then also be adjusted, so that it is off-center
-		*/
-
-		probeOffsetX = muls.sourceRadius*gasdev(&iseed)*SQRT_2;
-		probeOffsetY = muls.sourceRadius*gasdev(&iseed)*SQRT_2;
-		muls.scanXStart = probeCenterX+probeOffsetX;
-		muls.scanYStart = probeCenterY+probeOffsetY;
-		probe(&muls, wave,muls.scanXStart-muls.potOffsetX,muls.scanYStart-muls.potOffsetY);
-		if (muls.saveLevel > 2) {
-			sprintf(systStr,"%s/wave_probe.img",muls.folder);
-			wave->WriteWave(systStr);
-		} 	
-		// printf("Probe: (%g, %g)\n",muls.scanXStart,muls.scanYStart);
-		/*****************************************************************
-		* For debugging only!!!
-		*
-		muls->WriteWave("probe.img")
-		*****************************************************************/
-
-
-		if (muls.sourceRadius > 0) {
-			if (muls.avgCount == 0) fpPos = fopen("probepos.dat","w");
-			else fpPos = fopen("probepos.dat","a");
-			if (fpPos == NULL) {
-				printf("Was unable to open file probepos.dat for writing\n");
-			}
-			else {
-				fprintf(fpPos,"%g %g\n",muls.scanXStart,muls.scanYStart);
-				fclose(fpPos);
-			}
-		}
-
-		if ((muls.showProbe) && (muls.avgCount == 0)) {
-#ifndef WIN32
-			//probePlot(&muls);
-			sprintf(buf,"ee %s/probePlot_0.jpg &",muls.folder);
-			system(buf);
-#endif
-		}
+		prepareCBEDRun(*config);
 		//muls.nslic0 = 0;
 
 		result = readparam("sequence: ",buf,0);
@@ -2173,7 +2533,7 @@ void doCBED() {
 			*make3DSlicesFFT(&muls,muls.slices,atomPosFile,NULL);
 			*exit(0);
 			************************************************/
-			if (muls.equalDivs) {
+			if (muls.equalDivs && !muls.sliceRing) {
 				if (muls.scatFactor == CUSTOM)
 					make3DSlicesFT(&muls);
 				else
@@ -2191,7 +2551,7 @@ void doCBED() {
 				/*******************************************************
 				* build the potential slices from atomic configuration
 				******************************************************/
-				if (!muls.equalDivs) {
+				if (!muls.equalDivs && !muls.sliceRing) {
 					if (muls.scatFactor == CUSTOM)
 						make3DSlicesFT(&muls);
 					else
@@ -2201,16 +2561,13 @@ void doCBED() {
 
 				timer = cputim();
 				// what probe should runMulsSTEM use here?
-				runMulsSTEM(&muls,wave); 
+				// (with a slice ring the slices are built while they are propagated)
+				if (muls.sliceRing) runMulsSTEMRing(&muls,*config,(pCount == 0) || !muls.equalDivs);
+				else runMulsSTEM(&muls,wave); 
 
 				printf("Thickness: %gA, int.=%g, time: %gsec\n",
 					wave->thickness,wave->intIntensity,cputim()-timer);
 
-				/***************** Only if Save level > 2: ****************/
-				if ((muls.avgCount == 0) && (muls.saveLevel > 2)) {
-					sprintf(systStr,"%s/wave_final.img",muls.folder);
-					wave->WriteWave(systStr);
-				} 	
 #ifdef VIB_IMAGE_TEST_CBED
 				wave->WriteWave(sysStr)
 #endif 
@@ -2221,156 +2578,262 @@ void doCBED() {
 		}
 		/*    printf("Total CPU time = %f sec.\n", cputim()-timerTot ); */
 
-		sprintf(avgName,"%s/diff.img",muls.folder);
-		// TODO: Why are we reading in a DP at this point?  Do we have one yet?  
-		//     What happens if it isn't there?
-		// RAM: fix to CBED code as well.  In the future doCBED and doNBED should be merged (pending C++ refactor)
-		fpTest = fopen(avgName, "rb");
-		if (fpTest != NULL)
-		{
-			printf("DEBUG doCBED: Found filename %s \n", avgName);
-			fclose(fpTest); // close file handle before opening it again in data_container.cpp
-			wave->ReadDiffPat(avgName);
+		reduceCBEDRun(*config);
+	} /* end of for muls.avgCount=0.. */
+}
+/************************************************************************
+* End of doCBED()
+***********************************************************************/
+
+/************************************************************************
+* doTEM performs a TEM calculation (with through focus reconstruction)
+*
+* As in doCBED(), each run makes the incident wave (prepareTEMRun()), 
+* propagates it, and adds its diffraction pattern and image to the 
+* averages (reduceTEMRun()), several runs at the same time with phonon 
+* batches.
+***********************************************************************/
+
+static fftwf_complex **imageWave = NULL;
+
+static void prepareTEMRun(PhononConfig &config) {
+	const double pi=3.1415926535897;
+	int ix,iy;
+	double x,y,ktx,kty;
+	WavePtr wave = config.wave;
+
+	// produce an incident plane wave:
+	if ((muls.btiltx == 0) && (muls.btilty == 0)) {
+		for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
+			wave->wave[ix][iy][0] = 1;	wave->wave[ix][iy][1] = 0;
 		}
-		else
-		{
-			printf("DEBUG doCBED: Did not find filename %s \n", avgName);
-			wave->WriteDiffPat(avgName, "DEBUG Wave intensity");
+	}
+	else {
+		// produce a tilted wave function (btiltx,btilty):
+		ktx = 2.0*pi*sin(muls.btiltx)/wavelength(muls.v0);
+		kty = 2.0*pi*sin(muls.btilty)/wavelength(muls.v0);
+		for (ix=0;ix<muls.nx;ix++) {
+			x = muls.resolutionX*(ix-muls.nx/2);
+			for (iy=0;iy<muls.ny;iy++) {
+				y = muls.resolutionY*(ix-muls.nx/2);
+				wave->wave[ix][iy][0] = (float)cos(ktx*x+kty*y);	
+				wave->wave[ix][iy][1] = (float)sin(ktx*x+kty*y);
+			}
 		}
-		// RAM: old code
-		//wave->ReadDiffPat(avgName);
+	}
+}
 
-		if (muls.avgCount == 0) {
-			memcpy((void *)wave->avgArray[0],(void *)wave->diffpat[0],
-				(size_t)(muls.nx*muls.ny*sizeof(float_tt)));
-			/* move the averaged (raw data) file to the target directory as well */
-			sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
-			sprintf(systStr,"mv %s/diff.img %s",muls.folder,avgName);
-			system(systStr);
-			if (muls.lbeams) {
-				for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
-					for (ix=0;ix<muls.nbout;ix++) {
-						avgPendelloesung[ix][iy] = muls.pendelloesung[ix][iy];
-					}
+static void reduceTEMRun(PhononConfig &config) {
+	const double pi=3.1415926535897;
+	int ix,iy;
+	FILE *avgFp,*fpTEM;
+	double x,y,ktx,kty;
+	char avgName[256],systStr[512];
+	char *comment;
+	real t;
+	WavePtr wave = config.wave;
+
+	/***************** FOR DEBUGGING ****************/		
+	if ((muls.avgCount == 0) && (muls.saveLevel >=0)) {
+		if (muls.tds) comment = "Test wave function for run 0";
+		else comment = "Exit face wave function for no TDS";
+		sprintf(systStr,"%s/wave.img",muls.folder);
+		if ((muls.tiltBack) && ((muls.btiltx != 0) || (muls.btilty != 0))) {
+			ktx = -2.0*pi*sin(muls.btiltx)/wavelength(muls.v0);
+			kty = -2.0*pi*sin(muls.btilty)/wavelength(muls.v0);
+			for (ix=0;ix<muls.nx;ix++) {
+				x = muls.resolutionX*(ix-muls.nx/2);
+				for (iy=0;iy<muls.ny;iy++) {
+					y = muls.resolutionY*(ix-muls.nx/2);
+					wave->wave[ix][iy][0] *= cos(ktx*x+kty*y);	
+					wave->wave[ix][iy][1] *= sin(ktx*x+kty*y);
 				}
 			}
-		} // of if muls.avgCount == 0 ...
-		else {
-			muls.chisq[muls.avgCount-1] = 0.0;
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				t = ((real)muls.avgCount*wave->avgArray[ix][iy]+
-					wave->diffpat[ix][iy])/((real)(muls.avgCount+1));
-				muls.chisq[muls.avgCount-1] += (wave->avgArray[ix][iy]-t)*(wave->avgArray[ix][iy]-t);
-				wave->avgArray[ix][iy] = t;
+			if (muls.printLevel > 1) printf("** Applied beam tilt compensation **\n");
+		}
 
+		wave->WriteWave(systStr, comment);
+	}	
+
+	/////////////////////////////////////////////////////////////////////////////
+	// finished propagating through whole sample, we're at the exit surface now.
+	// This means the wave function is used for nothing else than producing image(s)
+	// and diffraction patterns.  The diffraction pattern is in wave->diffpat, 
+	// see collectIntensity().
+	//////////////////////////////////////////////////////////////////////////////
+
+	if (imageWave == NULL) imageWave = complex2Df(muls.nx,muls.ny,"imageWave");
+	if (muls.avgCount == 0) {
+		/***********************************************************
+		* Save the diffraction pattern
+		**********************************************************/	
+		memcpy((void *)avgWave->avgArray[0],(void *)wave->diffpat[0],(size_t)(muls.nx*muls.ny*sizeof(real)));
+		sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
+		wave->WriteDiffPat(avgName);
+		/***********************************************************
+		* Save the Pendelloesung Plot
+		**********************************************************/	
+		if (muls.lbeams) {
+			for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
+				for (ix=0;ix<muls.nbout;ix++) {
+					avgPendelloesung[ix][iy] = muls.pendelloesung[ix][iy];
+				}
 			}
-			muls.chisq[muls.avgCount-1] = muls.chisq[muls.avgCount-1]/(double)(muls.nx*muls.ny);
-			sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
-			params[0] = muls.tomoTilt;
-			params[1] = 1.0/wavelength(muls.v0);
-			wave->WriteAvgArray(avgName,"Averaged Diffraction pattern, unit: 1/A",params);
-
-			muls.storeSeries = 1;
-			if (muls.saveLevel == 0)	muls.storeSeries = 0;
-			else if (muls.avgCount % muls.saveLevel != 0) muls.storeSeries = 0;
+		}
+		/***********************************************************
+		* Save the defocused image, we can do with the wave what 
+		* we want, since it is not used after this anymore. 
+		* We will therefore multiply with the transfer function for
+		* all the different defoci, inverse FFT and save each image.
+		* diffArray will be overwritten with the image.
+		**********************************************************/ 
+		// multiply wave (in rec. space) with transfer function and write result to imagewave
+		fftwf_execute_dft(wave->fftPlanWaveForw,wave->wave.Data(),wave->wave.Data());
+		for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
+			// here, we apply the CTF:
+			imageWave[ix][iy][0] = wave->wave[ix][iy][0];
+			imageWave[ix][iy][1] = wave->wave[ix][iy][1];
+		}
+		fftwf_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
+		// get the amplitude squared:
+		for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
+			wave->diffpat[ix][iy] = imageWave[ix][iy][0]*imageWave[ix][iy][0]+imageWave[ix][iy][1]*imageWave[ix][iy][1];
+		}
+		sprintf(avgName,"%s/waveIntensity.img",muls.folder);
+		wave->WriteDiffPat(avgName, "Wave intensity");
+		// the later runs are averaged into image.img
+		sprintf(avgName,"%s/image.img",muls.folder);
+		wave->WriteDiffPat(avgName, "Image intensity");
+		// End of Image writing (if avgCount = 0)
+		//////////////////////////////////////////////////////////////////////
+
+	} // of if muls.avgCount == 0 ...
+	else {
+		/* 	 readRealImage_old(avgArray,muls.nx,muls.ny,&t,"diffAvg.img"); */
+		muls.chisq[muls.avgCount-1] = 0.0;
+		for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
+			t = ((real)muls.avgCount*avgWave->avgArray[ix][iy]+
+				wave->diffpat[ix][iy])/((real)(muls.avgCount+1));
+			muls.chisq[muls.avgCount-1] += (avgWave->avgArray[ix][iy]-t)*(avgWave->avgArray[ix][iy]-t);
+			avgWave->avgArray[ix][iy] = t;
+		}
+		muls.chisq[muls.avgCount-1] = muls.chisq[muls.avgCount-1]/(double)(muls.nx*muls.ny);
+		sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
+		avgWave->WriteAvgArray(avgName, "Diffraction pattern");
 
-			if (muls.storeSeries == 0) {
-				// printf("Removing old file \n");
-				sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount);
-				sprintf(systStr,"rm %s",avgName);
-				system(systStr);
+		/* write the data to a file */
+		if ((avgFp = fopen("avgresults.dat","w")) == NULL )
+			printf("Sorry, could not open data file for averaging\n");
+		else {
+			for (ix =0;ix<muls.avgCount;ix++) {
+				fprintf(avgFp,"%d %g\n",ix+1,muls.chisq[ix]);
 			}
+			fclose(avgFp);
+		}
+		/*************************************************************/
 
-			/* write the data to a file */
-			if (muls.saveFlag >-1) {
-				sprintf(systStr,"%s/avgresults.dat",muls.folder);
-				if ((avgFp = fopen(systStr,"w")) == NULL )
-					printf("Sorry, could not open data file for averaging\n");
-				else {
-					for (ix =0;ix<muls.avgCount;ix++) {
-						fprintf(avgFp,"%d %g\n",ix+1,muls.chisq[ix]);
-					}
-					fclose(avgFp);
+		/***********************************************************
+		* Average over the pendelloesung plot as well
+		*/
+		if (muls.lbeams) {
+			for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
+				for (ix=0;ix<muls.nbout;ix++) {
+					avgPendelloesung[ix][iy] = 
+						((real)muls.avgCount*avgPendelloesung[ix][iy]+
+						muls.pendelloesung[ix][iy])/(real)(muls.avgCount+1);
 				}
 			}
-			/*************************************************************/
+		}
+		/***********************************************************
+		* Save the defocused image, we can do with the wave what 
+		* we want, since it is not used after this anymore. 
+		* We will therefore multiply with the transfer function for
+		* all the different defoci, inverse FFT and save each image.
+		* diffArray will be overwritten with the image.
+		**********************************************************/ 
+		// multiply wave (in rec. space) with transfer function and write result to imagewave
+#if FLOAT_PRECISION == 1
+		fftwf_execute_dft(wave->fftPlanWaveForw,wave->wave.Data(),wave->wave.Data());
+#elif FLOAT_PRECISION == 2
+		fftw_execute_dft(wave->fftPlanWaveForw,wave->wave.Data(),wave->wave.Data());
+#endif
 
-			/***********************************************************
-			* Average over the pendelloesung plot as well
-			*/
-			if (muls.lbeams) {
-				for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
-					for (ix=0;ix<muls.nbout;ix++) {
-						avgPendelloesung[ix][iy] = 
-							((real)muls.avgCount*avgPendelloesung[ix][iy]+
-							muls.pendelloesung[ix][iy])/(real)(muls.avgCount+1);
-					}
-				}
-			}
-		} /* else ... if avgCount was greater than 0 */
+		for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
+			imageWave[ix][iy][0] = wave->wave[ix][iy][0];
+			imageWave[ix][iy][1] = wave->wave[ix][iy][1];
+		}
+#if FLOAT_PRECISION == 1
+		fftwf_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
+#elif FLOAT_PRECISION == 2
+		fftw_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
+#endif
 
-		if (muls.lbeams) {
-			/**************************************************************
-			* The diffraction spot intensities of the selected 
-			* diffraction spots are now stored in the 2 dimensional array
-			* muls.pendelloesung[beam][slice].
-			* We can write the array to a file and display it, just for 
-			* demonstration purposes
-			*************************************************************/
-			sprintf(systStr,"%s/pendelloesung.dat",muls.folder);
-			if ( (fpCBED = fopen( systStr, "w" )) != NULL ) {
-				printf("Writing Pendelloesung data\n");
-				for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
-					/* write the thicknes in the first column of the file */
-					fprintf( fpCBED, "%g", iy*muls.c / ((float)(muls.slices*muls.cellDiv)) );
-					/* write the beam intensities in the following columns */
-					for (ix=0;ix<muls.nbout;ix++) {
-						fprintf( fpCBED, "\t%g", avgPendelloesung[ix][iy] );
-					}
-					/* close the line, and start a new one for the next set of
-					* intensities
-					*/
-					fprintf( fpCBED, "\n" );
+		// save the amplitude squared:
+		sprintf(avgName,"%s/image.img",muls.folder); 
+		wave->ReadDiffPat(avgName);
+		for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
+			t = ((real)muls.avgCount*wave->diffpat[ix][iy]+
+				imageWave[ix][iy][0]*imageWave[ix][iy][0]+imageWave[ix][iy][1]*imageWave[ix][iy][1])/(real)(muls.avgCount+1);
+			wave->diffpat[ix][iy] = t;
+		}
+		wave->WriteDiffPat(avgName, "Image intensity");
+		// End of Image writing (if avgCount > 0)
+		//////////////////////////////////////////////////////////////////////
+
+	} /* else ... if avgCount was greater than 0 */
+
+
+	/////////////////////////////////////////////////////
+	// Save the Pendelloesung plot:
+	if (muls.lbeams) {
+		/**************************************************************
+		* The diffraction spot intensities of the selected 
+		* diffraction spots are now stored in the 2 dimensional array
+		* muls.pendelloesung[beam][slice].
+		* We can write the array to a file and display it, just for 
+		* demonstration purposes
+		*************************************************************/
+		sprintf(avgName,"%s/pendelloesung.dat",muls.folder);
+		if ( (fpTEM = fopen( avgName, "w" )) != NULL ) {
+			printf("Writing Pendelloesung data\n");
+			for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
+				/* write the thicknes in the first column of the file */
+				fprintf( fpTEM, "%g", iy*muls.c / ((float)(muls.slices*muls.cellDiv)) );
+				/* write the beam intensities in the following columns */
+				for (ix=0;ix<muls.nbout;ix++) {
+					// store the AMPLITUDE:
+					fprintf( fpTEM, "\t%g", sqrt( avgPendelloesung[ix][iy] / (muls.nx*muls.ny) ) );
 				}
-				fclose( fpCBED );
+				/* close the line, and start a new one for the next set of
+				* intensities
+				*/
+				fprintf( fpTEM, "\n" );
 			}
-			else {
-				printf("Could not open file for pendelloesung plot\n");
-			}  
-		} /* end of if lbemas ... */
-		displayProgress(1);
-	} /* end of for muls.avgCount=0.. */
-	//delete(wave);
+			fclose( fpTEM );
+		}
+		else {
+			printf("Could not open file for pendelloesung plot\n");
+		}	
+	} /* end of if lbemas ... */		 
+	displayProgress(1);
 }
-/************************************************************************
-* End of doCBED()
-***********************************************************************/
-
-/************************************************************************
-* doTEM performs a TEM calculation (with through focus reconstruction)
-*
-***********************************************************************/
 
 void doTEM() {
-	const double pi=3.1415926535897;
-	int ix,iy,i,pCount,result;
-	FILE *avgFp,*fpTEM; // *fpPos=0;
-	double timer,timerTot;
-	double x,y,ktx,kty;
-	char buf[BUF_LEN],avgName[256],systStr[512];
-	char *comment;
-	real t;
-	real **avgPendelloesung = NULL;
+	int i,pCount,result,batchSize;
+	double timer;
+	char buf[BUF_LEN];
 	int oldMulsRepeat1 = 1;
 	int oldMulsRepeat2 = 1;
-	long iseed=0;
+	PhononConfigPtr config;
+	WavePtr wave;
+#ifdef VIB_IMAGE_TEST  // doTEM
+	char systStr[512];
+	char *comment;
 	std::vector<double> params;
-	WavePtr wave = WavePtr(new WAVEFUNC(muls.nx,muls.ny,muls.resolutionX,muls.resolutionY));
-	fftwf_complex **imageWave = NULL;
-
-	if (iseed == 0) iseed = -(long) time( NULL );
+#endif
 
 	muls.chisq=std::vector<double>(muls.avgRuns);
+	avgWave = WavePtr(new WAVEFUNC(muls.nx,muls.ny,muls.resolutionX,muls.resolutionY));
 
 	if (muls.lbeams) {
 		muls.pendelloesung = NULL;
@@ -2381,10 +2844,20 @@ void doTEM() {
 		}	  
 	}
 
-	timerTot = 0; /* cputim();*/
 	displayProgress(-1);
+
+	batchSize = phononBatchSize(&muls);
+	initWaveThreads(batchSize);
+	if (batchSize > 1) {
+		runPhononBatches(&muls, batchSize, prepareTEMRun, reduceTEMRun);
+		return;
+	}
+
+	config = newPhononConfig(&muls, false);
+	wave = config->wave;
 	for (muls.avgCount = 0;muls.avgCount < muls.avgRuns;muls.avgCount++) {
 		muls.totalSliceCount = 0;
+		config->run = muls.avgCount;
 
 		pCount = 0;
 		resetParamFile();
@@ -2399,25 +2872,7 @@ void doTEM() {
 		// probe(&muls,muls.scanXStart,muls.scanYStart);
 
 		//muls.nslic0 = 0;
-		// produce an incident plane wave:
-		if ((muls.btiltx == 0) && (muls.btilty == 0)) {
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				wave->wave[ix][iy][0] = 1;	wave->wave[ix][iy][1] = 0;
-			}
-		}
-		else {
-			// produce a tilted wave function (btiltx,btilty):
-			ktx = 2.0*pi*sin(muls.btiltx)/wavelength(muls.v0);
-			kty = 2.0*pi*sin(muls.btilty)/wavelength(muls.v0);
-			for (ix=0;ix<muls.nx;ix++) {
-				x = muls.resolutionX*(ix-muls.nx/2);
-				for (iy=0;iy<muls.ny;iy++) {
-					y = muls.resolutionY*(ix-muls.nx/2);
-					wave->wave[ix][iy][0] = (float)cos(ktx*x+kty*y);	
-					wave->wave[ix][iy][1] = (float)sin(ktx*x+kty*y);
-				}
-			}
-		}
+		prepareTEMRun(*config);
 
 		result = readparam("sequence: ",buf,0);
 		while (result) {
@@ -2460,7 +2915,7 @@ void doTEM() {
 			*make3DSlicesFFT(&muls,muls.slices,atomPosFile,NULL);
 			*exit(0);
 			************************************************/
-			if (muls.equalDivs) {
+			if (muls.equalDivs && !muls.sliceRing) {
 				if (muls.printLevel > 1) printf("found equal unit cell divisions\n");
 				make3DSlices(&muls,muls.slices,muls.atomPosFile,NULL);
 				initSTEMSlices(&muls,muls.slices);
@@ -2476,13 +2931,15 @@ void doTEM() {
 				* build the potential slices from atomic configuration
 				******************************************************/
 				// if ((muls.tds) || (muls.nCellZ % muls.cellDiv != 0)) {
-				if (!muls.equalDivs) {
+				if (!muls.equalDivs && !muls.sliceRing) {
 					make3DSlices(&muls,muls.slices,muls.atomPosFile,NULL);
 					initSTEMSlices(&muls,muls.slices);
 				}
 
 				timer = cputim();
-				runMulsSTEM(&muls,wave); 
+				// with a slice ring the slices are built while they are propagated
+				if (muls.sliceRing) runMulsSTEMRing(&muls,*config,(pCount == 0) || !muls.equalDivs);
+				else runMulsSTEM(&muls,wave); 
 				muls.totalSliceCount += muls.slices;
 
 				if (muls.printLevel > 0) {
@@ -2490,27 +2947,6 @@ void doTEM() {
 						wave->thickness,wave->intIntensity,cputim()-timer,muls.avgCount);
 				}
 
-				/***************** FOR DEBUGGING ****************/		
-				if ((muls.avgCount == 0) && (muls.saveLevel >=0) && (pCount+1==muls.mulsRepeat2*muls.cellDiv)) {
-					if (muls.tds) comment = "Test wave function for run 0";
-					else comment = "Exit face wave function for no TDS";
-					sprintf(systStr,"%s/wave.img",muls.folder);
-					if ((muls.tiltBack) && ((muls.btiltx != 0) || (muls.btilty != 0))) {
-						ktx = -2.0*pi*sin(muls.btiltx)/wavelength(muls.v0);
-						kty = -2.0*pi*sin(muls.btilty)/wavelength(muls.v0);
-						for (ix=0;ix<muls.nx;ix++) {
-							x = muls.resolutionX*(ix-muls.nx/2);
-							for (iy=0;iy<muls.ny;iy++) {
-								y = muls.resolutionY*(ix-muls.nx/2);
-								wave->wave[ix][iy][0] *= cos(ktx*x+kty*y);	
-								wave->wave[ix][iy][1] *= sin(ktx*x+kty*y);
-							}
-						}
-						if (muls.printLevel > 1) printf("** Applied beam tilt compensation **\n");
-					}
-
-					wave->WriteWave(systStr, comment);
-				}	
 #ifdef VIB_IMAGE_TEST  // doTEM
 				if ((muls.tds) && (muls.saveLevel > 2)) {
 					sprintf(systStr,"%s/wave_%d.img",muls.folder,muls.avgCount);
@@ -2536,224 +2972,301 @@ void doTEM() {
 			} 
 			result = readparam("sequence: ",buf,0);
 		} 
-		/////////////////////////////////////////////////////////////////////////////
-		// finished propagating through whole sample, we're at the exit surface now.
-		// This means the wave function is used for nothing else than producing image(s)
-		// and diffraction patterns.
-		//////////////////////////////////////////////////////////////////////////////
-
-		sprintf(avgName,"%s/diff.img",muls.folder);
+		reduceTEMRun(*config);
+	} /* end of for muls.avgCount=0.. */  
+}
+/************************************************************************
+* end of doTEM
+***********************************************************************/
 
-		wave->ReadDiffPat(avgName);
 
-		if (muls.avgCount == 0) {
-			/***********************************************************
-			* Save the diffraction pattern
-			**********************************************************/	
-			memcpy((void *)wave->avgArray[0],(void *)wave->diffpat[0],(size_t)(muls.nx*muls.ny*sizeof(real)));
-			/* move the averaged (raw data) file to the target directory as well */
-#ifndef WIN32
-			sprintf(avgName,"diffAvg_%d.img",muls.avgCount+1);
-			sprintf(systStr,"mv %s/diff.img %s/%s",muls.folder,muls.folder,avgName);
-			system(systStr);
-#else
-			sprintf(avgName,"diffAvg_%d.img",muls.avgCount+1);
-			sprintf(systStr,"move %s\\diff.img %s/%s",muls.folder,muls.folder,avgName);
-			// system(systStr);
-#endif
-			/***********************************************************
-			* Save the Pendelloesung Plot
-			**********************************************************/	
-			if (muls.lbeams) {
-				for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
-					for (ix=0;ix<muls.nbout;ix++) {
-						avgPendelloesung[ix][iy] = muls.pendelloesung[ix][iy];
-					}
-				}
-			}
-			/***********************************************************
-			* Save the defocused image, we can do with the wave what 
-			* we want, since it is not used after this anymore. 
-			* We will therefore multiply with the transfer function for
-			* all the different defoci, inverse FFT and save each image.
-			* diffArray will be overwritten with the image.
-			**********************************************************/ 
-			if (imageWave == NULL) imageWave = complex2Df(muls.nx,muls.ny,"imageWave");
-			// multiply wave (in rec. space) with transfer function and write result to imagewave
-			fftwf_execute(wave->fftPlanWaveForw);
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				// here, we apply the CTF:
-				imageWave[ix][iy][0] = wave->wave[ix][iy][0];
-				imageWave[ix][iy][1] = wave->wave[ix][iy][1];
-			}
-			fftwf_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
-			// get the amplitude squared:
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				wave->diffpat[ix][iy] = imageWave[ix][iy][0]*imageWave[ix][iy][0]+imageWave[ix][iy][1]*imageWave[ix][iy][1];
-			}
-			sprintf(avgName,"%s/waveIntensity.img",muls.folder);
-			wave->WriteDiffPat(avgName, "Wave intensity");
-			// End of Image writing (if avgCount = 0)
-			//////////////////////////////////////////////////////////////////////
 
-		} // of if muls.avgCount == 0 ...
-		else {
-			/* 	 readRealImage_old(avgArray,muls.nx,muls.ny,&t,"diffAvg.img"); */
-			muls.chisq[muls.avgCount-1] = 0.0;
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				t = ((real)muls.avgCount*wave->avgArray[ix][iy]+
-					wave->diffpat[ix][iy])/((real)(muls.avgCount+1));
-				muls.chisq[muls.avgCount-1] += (wave->avgArray[ix][iy]-t)*(wave->avgArray[ix][iy]-t);
-				wave->avgArray[ix][iy] = t;
-			}
-			muls.chisq[muls.avgCount-1] = muls.chisq[muls.avgCount-1]/(double)(muls.nx*muls.ny);
-			sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
-			wave->WriteAvgArray(avgName, "Diffraction pattern");
-
-			/* write the data to a file */
-			if ((avgFp = fopen("avgresults.dat","w")) == NULL )
-				printf("Sorry, could not open data file for averaging\n");
-			else {
-				for (ix =0;ix<muls.avgCount;ix++) {
-					fprintf(avgFp,"%d %g\n",ix+1,muls.chisq[ix]);
-				}
-				fclose(avgFp);
-			}
-			/*************************************************************/
+/************************************************************************
+* doSTEM performs a STEM calculation
+*
+***********************************************************************/
 
-			/***********************************************************
-			* Average over the pendelloesung plot as well
-			*/
-			if (muls.lbeams) {
-				for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
-					for (ix=0;ix<muls.nbout;ix++) {
-						avgPendelloesung[ix][iy] = 
-							((real)muls.avgCount*avgPendelloesung[ix][iy]+
-							muls.pendelloesung[ix][iy])/(real)(muls.avgCount+1);
-					}
-				}
-			}
-			/***********************************************************
-			* Save the defocused image, we can do with the wave what 
-			* we want, since it is not used after this anymore. 
-			* We will therefore multiply with the transfer function for
-			* all the different defoci, inverse FFT and save each image.
-			* diffArray will be overwritten with the image.
-			**********************************************************/ 
-			if (imageWave == NULL) imageWave = complex2Df(muls.nx,muls.ny,"imageWave");
-			// multiply wave (in rec. space) with transfer function and write result to imagewave
-#if FLOAT_PRECISION == 1
-			fftwf_execute(wave->fftPlanWaveForw);
-#elif FLOAT_PRECISION == 2
-			fftw_execute(wave->fftPlanWaveForw);
-#endif
+/************************************************************************
+* initSTEMPixel() prepares wave for the scan pixel (ix,iy): creates the
+* incident probe (first slab) or reads the wave function stored at the
+* end of the previous slab, and sets the position of the probe.
+***********************************************************************/
+void initSTEMPixel(WavePtr wave, int ix, int iy, int pCount) {
+	double posX, posY, fracX, fracY;
+	//printf("Scanning: %d %d %d %d\n",ix,iy,pCount,muls.nx);
+
+	/* scan position in pixels of the potential; the probe window is 
+	 * placed at the integer part, the probe shifted by the fraction
+	 * within it (see probeShift()).  Fractions within 1e-3 of a pixel 
+	 * are rounded, so that integer scan steps stay exact.
+	 */
+	posX = (float)(ix*(muls.scanXStop-muls.scanXStart)/((float)muls.scanXN*muls.resolutionX));
+	posY = (float)(iy*(muls.scanYStop-muls.scanYStart)/((float)muls.scanYN*muls.resolutionY));
+	wave->iPosX = (int)posX;
+	wave->iPosY = (int)posY;
+	fracX = posX-wave->iPosX;
+	fracY = posY-wave->iPosY;
+	if (fracX > 1.0-1e-3) { wave->iPosX++; fracX = 0.0; }
+	if (fracY > 1.0-1e-3) { wave->iPosY++; fracY = 0.0; }
+	if ((fracX < 1e-3) || (!muls.subpixelScan)) fracX = 0.0;
+	if ((fracY < 1e-3) || (!muls.subpixelScan)) fracY = 0.0;
+	/* the potential is periodic, so wrap around rather than clamp */
+	wave->iPosX %= muls.potNx;
+	wave->iPosY %= muls.potNy;
+
+	/* if this is run=0, copy the inc. probe wave function (see updateProbeCache()) */
+	if (pCount == 0) 
+	{
+		if ((fracX == 0.0) && (fracY == 0.0))
+			memcpy(wave->wave.Data(), muls.probeCache->wave.Data(), wave->wave.Size()*sizeof(wave->wave.Data()[0]));
+		else
+			probeShift(&muls, wave, fracX*muls.resolutionX, fracY*muls.resolutionY);
 
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				imageWave[ix][iy][0] = wave->wave[ix][iy][0];
-				imageWave[ix][iy][1] = wave->wave[ix][iy][1];
-			}
-#if FLOAT_PRECISION == 1
-			fftwf_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
-#elif FLOAT_PRECISION == 2
-			fftw_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
-#endif
+		// TODO: modifying shared value from multiple threads?
+		//muls.nslic0 = 0;
+		//wave->thickness = 0.0;
+	}
+	else 
+	{
+		/* continue with the exit wave of the slab before, see finishSTEMPixel() */
+		memcpy(wave->wave.Data(), muls.waveStore->Data((pCount-1) % 2, ix*muls.scanYN+iy), 
+			muls.waveStore->WaveBytes());
+		// TODO: modifying shared value from multiple threads?
+		//muls.nslic0 = pCount;
+	}
+	/* run multislice algorithm
+	   and save exit wave function for this position 
+	   (done by runMulsSTEM, with saveLevel > 1), 
+	   but we need to define the file name */
+	sprintf(wave->fileout,"%s/mulswav_%d_%d.img",muls.folder,ix,iy);
+	muls.saveFlag = 1;
+
+	// MCS - update the probe wavefunction with its position
+	wave->detPosX=ix;
+	wave->detPosY=iy;
+}
 
-			// save the amplitude squared:
-			sprintf(avgName,"%s/image.img",muls.folder); 
-			wave->ReadDiffPat(avgName);
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				t = ((real)muls.avgCount*wave->diffpat[ix][iy]+
-					imageWave[ix][iy][0]*imageWave[ix][iy][0]+imageWave[ix][iy][1]*imageWave[ix][iy][1])/(real)(muls.avgCount+1);
-				wave->diffpat[ix][iy] = t;
-			}
-			wave->WriteDiffPat(avgName, "Image intensity");
-			// End of Image writing (if avgCount > 0)
-			//////////////////////////////////////////////////////////////////////
+/************************************************************************
+* finishSTEMPixel() adds the results of the multislice run for the 
+* scan pixel of wave to the collected intensity and, after the last
+* slab, to the averaged diffraction pattern.  chisq is the contribution 
+* of the pixel, see doSTEM().
+***********************************************************************/
+void finishSTEMPixel(WavePtr wave, int pCount, int picts, double *collectedIntensity, double *chisq) {
+	double change;
 
-		} /* else ... if avgCount was greater than 0 */
+	#pragma omp atomic
+	*collectedIntensity += wave->intIntensity;
 
+	/* the exit wave is the incident wave of the next slab.  Even and odd 
+	 * slabs use different slots, so that the input of a slab is still 
+	 * there, if it is redone after a restart. */
+	if (pCount < picts-1)
+		memcpy(muls.waveStore->Data(pCount % 2, wave->detPosX*muls.scanYN+wave->detPosY), 
+			wave->wave.Data(), muls.waveStore->WaveBytes());
 
-		/////////////////////////////////////////////////////
-		// Save the Pendelloesung plot:
-		if (muls.lbeams) {
-			/**************************************************************
-			* The diffraction spot intensities of the selected 
-			* diffraction spots are now stored in the 2 dimensional array
-			* muls.pendelloesung[beam][slice].
-			* We can write the array to a file and display it, just for 
-			* demonstration purposes
-			*************************************************************/
-			sprintf(avgName,"%s/pendelloesung.dat",muls.folder);
-			if ( (fpTEM = fopen( avgName, "w" )) != NULL ) {
-				printf("Writing Pendelloesung data\n");
-				for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
-					/* write the thicknes in the first column of the file */
-					fprintf( fpTEM, "%g", iy*muls.c / ((float)(muls.slices*muls.cellDiv)) );
-					/* write the beam intensities in the following columns */
-					for (ix=0;ix<muls.nbout;ix++) {
-						// store the AMPLITUDE:
-						fprintf( fpTEM, "\t%g", sqrt( avgPendelloesung[ix][iy] / (muls.nx*muls.ny) ) );
-					}
-					/* close the line, and start a new one for the next set of
-					* intensities
-					*/
-					fprintf( fpTEM, "\n" );
-				}
-				fclose( fpTEM );
-			}
-			else {
-				printf("Could not open file for pendelloesung plot\n");
-			}	
-		} /* end of if lbemas ... */		 
-		displayProgress(1);
-	} /* end of for muls.avgCount=0.. */  
+	/***************************************************************
+	* After the last slab, the diffraction pattern in wave->diffpat 
+	* is added to the average of its pixel.  The averages are only 
+	* written at the end, see saveSTEMDiffAvg().  With several MPI 
+	* phonon groups, they are those of the configurations of group 0.
+	***************************************************************/
+	if ((pCount == picts-1) && muls.diffAvg) {
+		change = muls.diffAvg->Add(wave->detPosX*muls.scanYN+wave->detPosY, muls.avgCount, wave->diffpat.Data());
+		if (muls.avgCount > 1) *chisq += change;
+	}
 }
+
 /************************************************************************
-* end of doTEM
+* saveSTEMDiffAvg() writes the averaged diffraction patterns of the 
+* scan rows ixStart .. ixStop-1 to diffAvg_ix_iy.img, the parameter is 
+* the number of runs in the average.  With saveLevel > 1, the variances 
+* go to diffVar_ix_iy.img.
 ***********************************************************************/
+static void saveSTEMDiffAvg(WavePtr wave, int ixStart, int ixStop) {
+	int ix,iy,pixel;
+	std::vector<double> params(1);
+
+	for (ix=ixStart; ix<ixStop; ix++) for (iy=0; iy<muls.scanYN; iy++) {
+		pixel = ix*muls.scanYN+iy;
+		params[0] = muls.diffAvg->Runs(pixel);
+		memcpy(wave->avgArray.Data(), muls.diffAvg->Mean(pixel), wave->avgArray.Size()*sizeof(float_tt));
+		sprintf(wave->avgName,"%s/diffAvg_%d_%d.img",muls.folder,ix,iy);
+		wave->WriteAvgArray(wave->avgName, "Average Array", params);
+		if (muls.saveLevel > 1) {
+			muls.diffAvg->Variance(pixel, wave->avgArray.Data());
+			sprintf(wave->avgName,"%s/diffVar_%d_%d.img",muls.folder,ix,iy);
+			wave->WriteAvgArray(wave->avgName, "Variance of the diffraction pattern", params);
+		}
+	}
+}
 
+/*****  buildSTEMPotential *******/
+// Builds the potential slices for the next slab and keeps what a 
+//   checkpoint needs to build them again.  When resuming, the potential 
+//   is built from the atoms of the checkpoint, and the random numbers 
+//   continue from where they were.
+static void buildSTEMPotential(STEMCheckpoint &ck, int resuming) {
+	if (resuming) {
+		muls.divCount = ck.divCount;
+		muls.natom = (int)ck.atoms.size();
+		muls.atoms = &ck.atoms[0];
+		muls.keepAtoms = 1;
+	}
+	ck.divCount = muls.divCount;
+	make3DSlices(&muls, muls.slices, muls.atomPosFile, NULL);
+	initSTEMSlices(&muls, muls.slices);
+	updateTransReplicas(&muls);
+	muls.keepAtoms = 0;
+	if (resuming) setRandomState(&muls, ck.randomState);
+	else getRandomState(ck.randomState);
+}
 
+/*****  storeExists *******/
+// A resumed simulation continues with the stores of the checkpoint, 
+//   they must not be created anew.
+static int storeExists(const char *fileName) {
+	FILE *fp;
 
-/************************************************************************
-* doSTEM performs a STEM calculation
-*
-***********************************************************************/
+	if ((fp = fopen(fileName,"rb")) == NULL) return 0;
+	fclose(fp);
+	return 1;
+}
+
+/*****  allocateSTEMWaves *******/
+// Allocates the wave function (or the batch of wave functions) of 
+//   thread th.  With thread pinning, the threads call this themselves, 
+//   so that their wave functions are placed on their NUMA node.
+static void allocateSTEMWaves(std::vector<WavePtr> &waves, std::vector<WaveBatchPtr> &batches, int th) {
+	int k, node;
+
+	node = muls.numa ? muls.numa->ThreadNode(th) : 0;
+	if (muls.scanBatch > 1) {
+		batches[th] = WaveBatchPtr(new WAVEBATCH(muls.scanBatch, muls.nx, muls.ny, muls.resolutionX, muls.resolutionY));
+		for (k=0; k<batches[th]->K; k++) batches[th]->waves[k]->numaNode = node;
+	}
+	else {
+		waves[th] = WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY));
+		if (muls.precision == PRECISION_DOUBLE) waves[th]->UseDouble();
+		waves[th]->numaNode = node;
+	}
+}
 
 void doSTEM() {
-	int ix=0,iy=0,i,pCount,picts,ixa,iya,totalRuns;
-	double timer, total_time=0;
-	char buf[BUF_LEN];
-	real t;
-	static real **avgArray=NULL;
+	int ix=0,iy=0,i,k,k0,th,pCount,picts,totalRuns,nextProgress;
+	int ixStart,ixStop,scanPixels,run,seq,resuming,checkpointDue;
+	double timer, scanTime, lastCheckpoint;
+	char buf[BUF_LEN], storeName[1024];
 	double collectedIntensity;
 
 	std::vector<WavePtr> waves;
 	WavePtr wave;
-
-	//pre-allocate several waves (enough for one row of the scan.  
-	for (int th=0; th<omp_get_max_threads(); th++)
-	{
-		waves.push_back(WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY)));
+	std::vector<WaveBatchPtr> batches;
+	WaveBatchPtr batch;
+	ScanSchedulerPtr scheduler;
+	ScanTile tile;
+	STEMCheckpoint ck;
+	std::vector<std::vector<int> > todo(omp_get_max_threads());
+	std::vector<double> chisqPixel;
+
+	// the threads propagate different probe positions, one thread per wave function:
+	setWaveThreads(1);
+
+	/* with thread pinning, the threads are spread over the NUMA nodes */
+	if ((muls.threadPinning != PIN_NONE) && (!muls.numa)) {
+		muls.numa = NumaLayoutPtr(new NumaLayout(omp_get_max_threads(), muls.threadPinning));
+		if (muls.printLevel > 0)
+			printf("%d threads pinned to the %s of %d NUMA node(s)\n",omp_get_max_threads(),
+				(muls.threadPinning == PIN_CORES) ? "cores" : "cpus",muls.numa->Nodes());
+	}
+
+	/* pre-allocate the wave functions of all threads.  Those of thread 0 
+	 * come first, they create the FFT plans the others find in the plan cache. */
+	if (muls.scanBatch > 1) batches.resize(omp_get_max_threads());
+	else waves.resize(omp_get_max_threads());
+	allocateSTEMWaves(waves, batches, 0);
+	if (muls.numa) {
+#pragma omp parallel private(th) shared(muls, waves, batches) default(none)
+		{
+			th = omp_get_thread_num();
+			muls.numa->Pin(th);
+			if (th > 0) allocateSTEMWaves(waves, batches, th);
+		}
 	}
+	for (th=1; th<omp_get_max_threads(); th++) 
+		if ((muls.scanBatch > 1) ? !batches[th] : !waves[th]) allocateSTEMWaves(waves, batches, th);
+
+	/* only the scan rows ixStart .. ixStop-1 of this shard are computed.  
+	 * The MPI processes of a phonon group split them again (see mpiSetupSTEM()). */
+	scanShardRows(muls.shardIndex*muls.rowRanks+muls.rowRank, muls.shardCount*muls.rowRanks, 
+		muls.scanXN, ixStart, ixStop);
+	scanPixels = (ixStop-ixStart)*muls.scanYN;
+	chisqPixel.resize(scanPixels);
+	scheduler = ScanSchedulerPtr(new ScanScheduler(muls.scanXN, muls.scanYN, muls.scanTileSize, omp_get_max_threads(), ixStart, ixStop));
 
 	muls.chisq = std::vector<double>(muls.avgRuns);
 	totalRuns = muls.avgRuns;
 	timer = cputim();
 
+	/* continue where the last checkpoint left off */
+	ck.run = 0;
+	ck.done.assign(muls.scanXN*muls.scanYN, 0);
+	resuming = 0;
+	if (muls.resume) {
+		resuming = readCheckpoint(&muls, ck);
+		if (resuming) 
+			printf("Resuming from checkpoint: run %d, slab %d, %d pixels done\n",ck.run,ck.slab,
+				(int)std::count(ck.done.begin(),ck.done.end(),1));
+		else
+			printf("No checkpoint found, starting from the beginning\n");
+	}
+	lastCheckpoint = omp_get_wtime();
+
+	/* the averaged diffraction patterns of all pixels are kept in memory 
+	 * (or a mapped file) and only written at the end.  With checkpoints, 
+	 * they are in the file, so that a restart continues with them.  A 
+	 * resumed simulation needs that file, even without new checkpoints. */
+	if ((muls.saveLevel > 0) && (muls.phononGroup == 0)) {
+		processFileName(&muls, (muls.waveStoreFolder[0] != '\0') ? muls.waveStoreFolder : muls.folder, 
+			"diffavg", ".store", storeName, sizeof(storeName));
+		if (resuming && !storeExists(storeName)) {
+			printf("Cannot resume: the averaged diffraction patterns %s are missing\n",storeName);
+			exit(0);
+		}
+		try {
+			muls.diffAvg = DiffAccumulatorPtr(new DiffAccumulator(muls.nx, muls.ny, ixStart*muls.scanYN, scanPixels, 
+				muls.waveStoreMB, storeName, (muls.checkpointInterval > 0) || resuming, resuming != 0));
+		}
+		catch (std::exception &e) {
+			printf("%s\n", e.what());
+			exit(0);
+		}
+		if (muls.printLevel > 0)
+			printf("Diffraction patterns of %d pixels (%.1f MB) averaged %s%s\n", scanPixels, 
+				muls.diffAvg->Store()->Bytes()/(1024.0*1024.0), 
+				muls.diffAvg->Store()->Mapped() ? "in " : "in memory", muls.diffAvg->Store()->Mapped() ? storeName : "");
+	}
+
 	/* average over several runs of for TDS */
 	displayProgress(-1);
 
-	for (muls.avgCount = 0;muls.avgCount < totalRuns; muls.avgCount++) {
-		total_time = 0;
-		collectedIntensity = 0;
-		muls.totalSliceCount = 0;
-		muls.dE_E = muls.dE_EArray[muls.avgCount];
+	/* phonon group g does the runs g, g+phononGroups, ..., and counts 
+	 * them in muls.avgCount */
+	muls.avgCount = ck.run;
+	for (run = muls.phononGroup+muls.avgCount*muls.phononGroups; run < totalRuns; run += muls.phononGroups, muls.avgCount++) {
+		collectedIntensity = resuming ? ck.collectedIntensity : 0;
+		muls.totalSliceCount = resuming ? ck.totalSliceCount : 0;
+		muls.dE_E = muls.dE_EArray[run];
+		/* the detector images are running averages over the runs so far */
+		for (k=0; k<(int)muls.detectors.size(); k++) 
+			for (i=0; i<muls.detectorNum; i++) muls.detectors[k][i]->Navg = muls.avgCount;
 
 
 		/****************************************
 		* do the (big) loop
 		*****************************************/
 		pCount = 0;
+		seq = -1;
 		/* make sure we start at the beginning of the file 
 		so we won't miss any line that contains a sequence,
 		because we will not do any EOF wrapping
@@ -2767,6 +3280,9 @@ void doSTEM() {
 					printf("Can only work with old stacking sequence\n");
 					break;
 			}
+			// sequences finished before the checkpoint are skipped
+			seq++;
+			if (resuming && (seq < ck.sequence)) continue;
 
 			// printf("Stacking sequence: %s\n",buf);
 
@@ -2792,160 +3308,186 @@ void doSTEM() {
 			}
 			picts *= muls.cellDiv;
 
+			/* the exit waves are kept in memory (or a mapped file) between 
+			 * the slabs, see finishSTEMPixel().  With checkpoints, they must 
+			 * survive a restart, so they are always in the file.  A slab 
+			 * resumed in the middle continues with the waves of that file. */
+			if ((picts > 1) && (muls.waveStore == NULL)) {
+				wave = (muls.scanBatch > 1) ? batches[0]->waves[0] : waves[0];
+				processFileName(&muls, (muls.waveStoreFolder[0] != '\0') ? muls.waveStoreFolder : muls.folder, 
+					"mulswav", ".store", storeName, sizeof(storeName));
+				if (resuming && (ck.slab > 0) && !storeExists(storeName)) {
+					printf("Cannot resume at slab %d: the exit waves %s are missing\n",ck.slab,storeName);
+					exit(0);
+				}
+				try {
+					muls.waveStore = WaveStorePtr(new WaveStore(wave->wave.Size()*sizeof(wave->wave.Data()[0]), 
+						ixStart*muls.scanYN, scanPixels, 2, muls.waveStoreMB, storeName, 
+						(muls.checkpointInterval > 0) || resuming));
+				}
+				catch (std::exception &e) {
+					printf("%s\n", e.what());
+					exit(0);
+				}
+				if (muls.printLevel > 0)
+					printf("Exit waves of %d pixels (%.1f MB) kept %s%s\n", scanPixels, 
+						muls.waveStore->Bytes()/(1024.0*1024.0), 
+						muls.waveStore->Mapped() ? "in " : "in memory", muls.waveStore->Mapped() ? storeName : "");
+			}
+
 			if (muls.equalDivs) {
-				make3DSlices(&muls, muls.slices, muls.atomPosFile, NULL);
-				initSTEMSlices(&muls, muls.slices);
+				buildSTEMPotential(ck, resuming);
 				timer = cputim();
 			}
 
 			/****************************************
 			* do the (small) loop over slabs
 			*****************************************/
-			for (pCount=0;pCount<picts;pCount++) {
+			for (pCount=(resuming ? ck.slab : 0);pCount<picts;pCount++) {
 				/*******************************************************
 				* build the potential slices from atomic configuration
 				******************************************************/
 				if (!muls.equalDivs) {
-					make3DSlices(&muls,muls.slices,muls.atomPosFile,NULL);
-					initSTEMSlices(&muls,muls.slices);
+					buildSTEMPotential(ck, resuming);
 					timer = cputim();
 				}
 
-				muls.complete_pixels=0;
+				/* the incident probe is the same for all pixels */
+				if (pCount == 0) updateProbeCache(&muls);
+
+				/* a new slab starts with a checkpoint, because its exit waves 
+				 * replace those of the slab before last (see initSTEMPixel()) */
+				ck.run = muls.avgCount;
+				ck.sequence = seq;
+				ck.slab = pCount;
+				ck.totalSliceCount = muls.totalSliceCount;
+				ck.collectedIntensity = collectedIntensity;
+				if (!resuming) {
+					ck.done.assign(muls.scanXN*muls.scanYN, 0);
+					if (muls.checkpointInterval > 0) {
+						if (muls.waveStore) muls.waveStore->Sync();
+						if (muls.diffAvg) muls.diffAvg->Store()->Sync();
+						writeCheckpoint(&muls, ck);
+						lastCheckpoint = omp_get_wtime();
+					}
+				}
+				resuming = 0;
+
+				scheduler->Reset();
+				nextProgress = muls.displayProgInterval;
+				scanTime = omp_get_wtime();
 				/**************************************************
-				* scan through the different probe positions
+				* scan through the different probe positions, tile 
+				* by tile (see ScanScheduler).  Batches of scanBatch 
+				* neighboring probe positions of a tile are propagated 
+				* together.  When a checkpoint is due, the threads 
+				* leave the parallel region after their current tile, 
+				* so that the checkpoint is consistent, and continue
+				* with the remaining tiles afterwards.
 				*************************************************/
+				do {
+					checkpointDue = 0;
+					std::fill(chisqPixel.begin(), chisqPixel.end(), 0.0);
 				// default(none) forces us to specify all of the variables that are used in the parallel section.  
 				//    Otherwise, they are implicitly shared (and this was cause of several bugs.)
 #pragma omp parallel \
-	private(ix, iy, ixa, iya, wave, t, timer) \
-	shared(pCount, picts, muls, collectedIntensity, total_time, waves) \
+	private(ix, iy, k, k0, th, tile, batch, wave, timer) \
+	shared(pCount, picts, muls, collectedIntensity, batches, waves, scheduler, nextProgress, scanPixels, \
+		ck, todo, checkpointDue, lastCheckpoint, chisqPixel, ixStart) \
 	default(none)
-#pragma omp for
-				for (i=0; i < (muls.scanXN * muls.scanYN); i++)
 				{
-					timer=cputim();
-					ix = i / muls.scanYN;
-					iy = i % muls.scanYN;
-
-					wave = waves[omp_get_thread_num()];
-							
-					//printf("Scanning: %d %d %d %d\n",ix,iy,pCount,muls.nx);
-
-					/* if this is run=0, create the inc. probe wave function */
-					if (pCount == 0) 
-					{
-						probe(&muls, wave, muls.nx/2*muls.resolutionX, muls.ny/2*muls.resolutionY);
-
-						// TODO: modifying shared value from multiple threads?
-						//muls.nslic0 = 0;
-						//wave->thickness = 0.0;
-					}
-                                          
-					else 
-					{
-						/* load incident wave function and then propagate it */
-						sprintf(wave->fileStart, "%s/mulswav_%d_%d.img", muls.folder, ix, iy);
-						readStartWave(wave);  /* this also sets the thickness!!! */
-						// TODO: modifying shared value from multiple threads?
-						//muls.nslic0 = pCount;
-					}
-					/* run multislice algorithm
-					   and save exit wave function for this position 
-					   (done by runMulsSTEM), 
-					   but we need to define the file name */
-					sprintf(wave->fileout,"%s/mulswav_%d_%d.img",muls.folder,ix,iy);
-					muls.saveFlag = 1;
-
-					wave->iPosX =(int)(ix*(muls.scanXStop-muls.scanXStart)/
-									  ((float)muls.scanXN*muls.resolutionX));
-					wave->iPosY = (int)(iy*(muls.scanYStop-muls.scanYStart)/
-									   ((float)muls.scanYN*muls.resolutionY));
-					if (wave->iPosX > muls.potNx-muls.nx)
-					{
-						wave->iPosX = muls.potNx-muls.nx;  
-					}
-					if (wave->iPosY > muls.potNy-muls.ny)
-					{
-						wave->iPosY = muls.potNy-muls.ny;
-					}
-
-					// MCS - update the probe wavefunction with its position
-					wave->detPosX=ix;
-					wave->detPosY=iy;
-
-					runMulsSTEM(&muls,wave); 
-
-
-					/***************************************************************
-					* In order to save some disk space we will add the diffraction 
-					* patterns to their averages now.  The diffraction pattern 
-					* should be stored in wave->diffpat (which each thread has independently), 
-					* if collectIntensity() has been executed correctly.
-					***************************************************************/
-
-					#pragma omp atomic
-					collectedIntensity += wave->intIntensity;
-
-					if (pCount == picts-1)  /* if this is the last slice ... */
+					th = omp_get_thread_num();
+					if (muls.numa) muls.numa->Pin(th);
+					while (!checkpointDue && scheduler->Next(th, tile))
 					{
-						sprintf(wave->avgName,"%s/diffAvg_%d_%d.img",muls.folder,ix,iy);
-						// printf("Will copy to avgArray %d %d (%d, %d)\n",muls.nx, muls.ny,(int)(muls.diffpat),(int)avgArray);	
-
-						if (muls.saveLevel > 0) 
+						timer=cputim();
+						/* pixels finished before a restart are skipped */
+						todo[th].clear();
+						for (k=0; k < tile.Pixels(); k++)
+						{
+							tile.Pixel(k, ix, iy);
+							if (!ck.done[ix*muls.scanYN+iy]) todo[th].push_back(ix*muls.scanYN+iy);
+						}
+						if (muls.scanBatch > 1) 
 						{
-							if (muls.avgCount == 0)  
+							batch = batches[th];
+							for (k0=0; k0 < (int)todo[th].size(); k0 += muls.scanBatch)
 							{
-								// initialize the avgArray from the diffpat
-								for (ixa=0;ixa<muls.nx;ixa++) 
+								batch->count = (int)todo[th].size()-k0;
+								if (batch->count > muls.scanBatch) batch->count = muls.scanBatch;
+								for (k=0; k<batch->count; k++) 
 								{
-									for (iya=0;iya<muls.ny;iya++)
-									{
-										wave->avgArray[ixa][iya]=wave->diffpat[ixa][iya];
-									}
+									ix = todo[th][k0+k]/muls.scanYN;
+									iy = todo[th][k0+k]%muls.scanYN;
+									initSTEMPixel(batch->waves[k], ix, iy, pCount);
 								}
-							}
-							else 
-							{
-								// printf("Will read image %d %d\n",muls.nx, muls.ny);	
-								wave->ReadAvgArray(wave->avgName);
-								for (ixa=0;ixa<muls.nx;ixa++) for (iya=0;iya<muls.ny;iya++) {
-									t = ((real)muls.avgCount * wave->avgArray[ixa][iya] +
-										wave->diffpat[ixa][iya]) / ((real)(muls.avgCount + 1));
-									if (muls.avgCount>1)
-									{
-										#pragma omp atomic
-										muls.chisq[muls.avgCount-1] += (wave->avgArray[ixa][iya]-t)*
-											(wave->avgArray[ixa][iya]-t);
-									}
-									wave->avgArray[ixa][iya] = t;
+								runMulsSTEMBatch(&muls,batch);
+								for (k=0; k<batch->count; k++) 
+								{
+									finishSTEMPixel(batch->waves[k], pCount, picts, &collectedIntensity, 
+										&chisqPixel[todo[th][k0+k]-ixStart*muls.scanYN]);
+									ck.done[todo[th][k0+k]] = 1;
 								}
 							}
-							// Write the array to a file, resize and crop it, 
-							wave->WriteAvgArray(wave->avgName);
-							}	
-							else {
-								if (muls.avgCount > 0)	muls.chisq[muls.avgCount-1] = 0.0;
+							wave = batch->waves[0];
+						}
+						else 
+						{
+							wave = waves[th];
+							for (k=0; k < (int)todo[th].size(); k++)
+							{
+								ix = todo[th][k]/muls.scanYN;
+								iy = todo[th][k]%muls.scanYN;
+								initSTEMPixel(wave, ix, iy, pCount);
+								runMulsSTEM(&muls,wave); 
+								finishSTEMPixel(wave, pCount, picts, &collectedIntensity, 
+									&chisqPixel[todo[th][k]-ixStart*muls.scanYN]);
+								ck.done[todo[th][k]] = 1;
 							}
-					} /* end of if pCount == picts, i.e. conditional code, if this
-						  * was the last slice
-						  */
-
-					#pragma omp atomic
-					++muls.complete_pixels;
+						}
+						scheduler->Done(th, tile.Pixels(), cputim()-timer);
 
-					if (muls.displayProgInterval > 0) if ((muls.complete_pixels) % muls.displayProgInterval == 0) 
-					{
-						#pragma omp atomic
-						total_time += cputim()-timer;
-						printf("Pixels complete: (%d/%d), int.=%.3f, avg time per pixel: %.2fsec\n",
-							muls.complete_pixels, muls.scanXN*muls.scanYN, wave->intIntensity,
-							(total_time)/muls.complete_pixels);
-						timer=cputim();
+						/* only the master thread reports and decides about 
+						 * checkpoints, so that nothing but the counters of 
+						 * each thread has to be updated */
+						if ((th == 0) && (muls.displayProgInterval > 0) && (scheduler->PixelsDone() >= nextProgress)) 
+						{
+							k = scheduler->PixelsDone();
+							printf("Pixels complete: (%d/%d), int.=%.3f, avg time per pixel: %.2fsec\n",
+								k, scanPixels, wave->intIntensity, scheduler->TimeDone()/k);
+							while (nextProgress <= k) nextProgress += muls.displayProgInterval;
+						}
+						if ((th == 0) && (muls.checkpointInterval > 0) && 
+							(omp_get_wtime()-lastCheckpoint >= muls.checkpointInterval))
+							checkpointDue = 1;
+						#pragma omp flush(checkpointDue)
+					} /* end of looping through tiles of STEM image pixels */
+				}
+					/* the detector intensities of the pixels just done are added 
+					 * to the images, and their chisq in scan order, so that neither
+					 * depends on which thread did which tile */
+					addDetectorPasses(&muls);
+					if (muls.avgCount > 1) 
+						for (k=0; k<scanPixels; k++) 
+							muls.chisq[muls.avgCount-1] += chisqPixel[k];
+					if (checkpointDue) {
+						ck.collectedIntensity = collectedIntensity;
+						if (muls.waveStore) muls.waveStore->Sync();
+						if (muls.diffAvg) muls.diffAvg->Store()->Sync();
+						writeCheckpoint(&muls, ck);
+						lastCheckpoint = omp_get_wtime();
 					}
-				} /* end of looping through STEM image pixels */
-				/* save STEM images in img files */
-				saveSTEMImages(&muls);
+				} while (checkpointDue);
+				muls.complete_pixels = scheduler->PixelsDone();
+				scanTime = omp_get_wtime()-scanTime;
+				if (muls.printLevel > 0)
+					printf("Slab %d: %d pixels in %.2f sec (%.1f pixels/sec, batch size %d, %d tiles, %d steals)\n",
+						pCount, scanPixels, scanTime, 
+						(scanTime > 0) ? scanPixels/scanTime : 0.0, muls.scanBatch,
+						(int)scheduler->tiles.size(), scheduler->Steals());
+				/* save STEM images in img files.  With MPI, every process 
+				 * only has a part, which are combined after the last run. */
+				if (muls.mpiSize == 1) saveSTEMImages(&muls);
 				muls.totalSliceCount += muls.slices;
 			} /* end of loop through thickness (pCount) */
 		} /* end of  while (readparam("sequence: ",buf,0)) */
@@ -2954,9 +3496,31 @@ void doSTEM() {
 		/*************************************************************/
 		if (muls.avgCount>1)
 			muls.chisq[muls.avgCount-1] = muls.chisq[muls.avgCount-1]/(double)(muls.nx*muls.ny);
-		muls.intIntensity = collectedIntensity/(muls.scanXN*muls.scanYN);
+		muls.intIntensity = collectedIntensity/(scanPixels > 0 ? scanPixels : 1);
 		displayProgress(1);
 	} /* end of loop over muls.avgCount */
 
+	if (muls.mpiSize > 1) {
+		mpiReduceSTEM(&muls);
+		if (muls.mpiRank == 0) {
+			muls.avgCount = totalRuns-1;
+			saveSTEMImages(&muls);
+		}
+	}
+	if (muls.diffAvg) {
+		saveSTEMDiffAvg((muls.scanBatch > 1) ? batches[0]->waves[0] : waves[0], ixStart, ixStop);
+		muls.diffAvg->Store()->SetPersistent(false);
+		muls.diffAvg.reset();
+	}
+	// the simulation is complete, nothing to resume
+	if ((muls.checkpointInterval > 0) || muls.resume) removeCheckpoint(&muls);
+	if (muls.waveStore) muls.waveStore->SetPersistent(false);
+	muls.waveStore.reset();
+
+	/* the threads may run on all cpus of the process again */
+	if (muls.numa) {
+#pragma omp parallel shared(muls) default(none)
+		muls.numa->Unpin();
+	}
 }
 
@@ -0,0 +1,206 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stemcheckpoint.h"
+
+#define CHECKPOINT_MAGIC "QSTEMCKP"
+#define CHECKPOINT_VERSION 1
+/* number of ints identifying the simulation and the position in it */
+#define CHECKPOINT_NHEADER 17
+
+void processFileName(MULS *muls, const char *folder, const char *base, const char *ext, 
+					 char *fileName, size_t size)
+{
+	char shard[64] = "", rank[32] = "";
+	int len;
+
+	if (muls->shardCount > 1) 
+		snprintf(shard,sizeof(shard),"_shard%dof%d",muls->shardIndex,muls->shardCount);
+	if (muls->mpiSize > 1) 
+		snprintf(rank,sizeof(rank),"_rank%d",muls->mpiRank);
+	len = snprintf(fileName,size,"%s/%s%s%s%s",folder,base,shard,rank,ext);
+	if ((len < 0) || (len >= (int)size)) {
+		printf("File name %s/%s%s too long - exit!\n",folder,base,ext);
+		exit(0);
+	}
+}
+
+void checkpointFileName(MULS *muls, char *fileName, size_t size)
+{
+	processFileName(muls,muls->folder,"stem_checkpoint",".dat",fileName,size);
+}
+
+/* the simulation a checkpoint belongs to, followed by the position in it */
+static void checkpointHeader(MULS *muls, STEMCheckpoint &ck, int *header)
+{
+	header[0]  = CHECKPOINT_VERSION;
+	header[1]  = (int)sizeof(float_tt);
+	header[2]  = muls->scanXN;
+	header[3]  = muls->scanYN;
+	header[4]  = muls->detectorNum;
+	header[5]  = (int)muls->detectors.size();
+	header[6]  = muls->avgRuns;
+	header[7]  = muls->shardIndex;
+	header[8]  = muls->shardCount;
+	header[9]  = muls->mpiRank;
+	header[10] = muls->mpiSize;
+	header[11] = muls->phononGroups;
+	header[12] = ck.run;
+	header[13] = ck.sequence;
+	header[14] = ck.slab;
+	header[15] = ck.totalSliceCount;
+	header[16] = ck.divCount;
+}
+
+/****************************************************************
+* writeCheckpoint() 
+* The done flags are stored as a bitmap.  The file is written 
+* under a temporary name first, so that a crash while writing 
+* leaves the previous checkpoint intact.
+****************************************************************/
+int writeCheckpoint(MULS *muls, STEMCheckpoint &ck)
+{
+	char fileName[512], tmpName[512];
+	int header[CHECKPOINT_NHEADER];
+	int t, i, n, count, ok;
+	std::vector<unsigned char> bits;
+	FILE *fp;
+
+	checkpointFileName(muls,fileName,sizeof(fileName));
+	if (snprintf(tmpName,sizeof(tmpName),"%s.tmp",fileName) >= (int)sizeof(tmpName)) {
+		printf("Cannot write checkpoint file %s.tmp, the name is too long\n",fileName);
+		return 0;
+	}
+	if ((fp = fopen(tmpName,"wb")) == NULL) {
+		printf("Cannot write checkpoint file %s\n",tmpName);
+		return 0;
+	}
+	checkpointHeader(muls,ck,header);
+	n = muls->scanXN*muls->scanYN;
+	bits.assign((n+7)/8,0);
+	for (i=0; i<n; i++) if (ck.done[i]) bits[i/8] |= (unsigned char)(1 << (i%8));
+
+	ok = (fwrite(CHECKPOINT_MAGIC,1,8,fp) == 8);
+	ok = ok && (fwrite(header,sizeof(int),CHECKPOINT_NHEADER,fp) == CHECKPOINT_NHEADER);
+	ok = ok && (fwrite(&ck.collectedIntensity,sizeof(double),1,fp) == 1);
+	count = (int)ck.randomState.size();
+	ok = ok && (fwrite(&count,sizeof(int),1,fp) == 1);
+	ok = ok && (fwrite(&ck.randomState[0],sizeof(double),count,fp) == (size_t)count);
+	count = (int)muls->chisq.size();
+	ok = ok && (fwrite(&count,sizeof(int),1,fp) == 1);
+	ok = ok && (fwrite(&muls->chisq[0],sizeof(double),count,fp) == (size_t)count);
+	ok = ok && (fwrite(&bits[0],1,bits.size(),fp) == bits.size());
+	count = muls->natom;
+	ok = ok && (fwrite(&count,sizeof(int),1,fp) == 1);
+	ok = ok && (fwrite(muls->atoms,sizeof(atom),count,fp) == (size_t)count);
+	for (t=0; t<(int)muls->detectors.size(); t++) for (i=0; i<muls->detectorNum; i++) {
+		DetectorPtr det = muls->detectors[t][i];
+		ok = ok && (fwrite(&det->Navg,sizeof(int),1,fp) == 1);
+		ok = ok && (fwrite(det->image.Data(),sizeof(float_tt),n,fp) == (size_t)n);
+		ok = ok && (fwrite(det->image2.Data(),sizeof(float_tt),n,fp) == (size_t)n);
+	}
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok) {
+		printf("Error while writing checkpoint file %s\n",tmpName);
+		remove(tmpName);
+		return 0;
+	}
+#ifdef WIN32
+	// rename() does not replace existing files on Windows
+	remove(fileName);
+#endif
+	if (rename(tmpName,fileName) != 0) {
+		printf("Cannot rename %s to %s\n",tmpName,fileName);
+		return 0;
+	}
+	if (muls->printLevel > 1)
+		printf("Wrote checkpoint %s (run %d, slab %d)\n",fileName,ck.run,ck.slab);
+	return 1;
+}
+
+int readCheckpoint(MULS *muls, STEMCheckpoint &ck)
+{
+	char fileName[512], magic[8];
+	int header[CHECKPOINT_NHEADER], expected[CHECKPOINT_NHEADER];
+	int t, i, n, count, ok;
+	std::vector<unsigned char> bits;
+	FILE *fp;
+
+	checkpointFileName(muls,fileName,sizeof(fileName));
+	if ((fp = fopen(fileName,"rb")) == NULL) return 0;
+
+	ok = (fread(magic,1,8,fp) == 8) && (strncmp(magic,CHECKPOINT_MAGIC,8) == 0);
+	ok = ok && (fread(header,sizeof(int),CHECKPOINT_NHEADER,fp) == CHECKPOINT_NHEADER);
+	if (ok) {
+		ck.run = header[12];
+		ck.sequence = header[13];
+		ck.slab = header[14];
+		ck.totalSliceCount = header[15];
+		ck.divCount = header[16];
+		checkpointHeader(muls,ck,expected);
+		if (memcmp(header,expected,12*sizeof(int)) != 0) {
+			printf("Checkpoint %s was written by a different simulation (scan, detectors, runs or processes)\n",
+				fileName);
+			fclose(fp);
+			exit(0);
+		}
+	}
+	ok = ok && (fread(&ck.collectedIntensity,sizeof(double),1,fp) == 1);
+	ok = ok && (fread(&count,sizeof(int),1,fp) == 1) && (count > 0) && (count < 1024);
+	if (ok) {
+		ck.randomState.resize(count);
+		ok = (fread(&ck.randomState[0],sizeof(double),count,fp) == (size_t)count);
+	}
+	ok = ok && (fread(&count,sizeof(int),1,fp) == 1) && (count == (int)muls->chisq.size());
+	ok = ok && (fread(&muls->chisq[0],sizeof(double),count,fp) == (size_t)count);
+	n = muls->scanXN*muls->scanYN;
+	bits.resize((n+7)/8);
+	ok = ok && (fread(&bits[0],1,bits.size(),fp) == bits.size());
+	ok = ok && (fread(&count,sizeof(int),1,fp) == 1) && (count > 0);
+	if (ok) {
+		ck.atoms.resize(count);
+		ok = (fread(&ck.atoms[0],sizeof(atom),count,fp) == (size_t)count);
+	}
+	for (t=0; t<(int)muls->detectors.size(); t++) for (i=0; i<muls->detectorNum; i++) {
+		DetectorPtr det = muls->detectors[t][i];
+		ok = ok && (fread(&det->Navg,sizeof(int),1,fp) == 1);
+		ok = ok && (fread(det->image.Data(),sizeof(float_tt),n,fp) == (size_t)n);
+		ok = ok && (fread(det->image2.Data(),sizeof(float_tt),n,fp) == (size_t)n);
+	}
+	fclose(fp);
+	if (!ok) {
+		printf("Checkpoint file %s is damaged\n",fileName);
+		exit(0);
+	}
+	ck.done.resize(n);
+	for (i=0; i<n; i++) ck.done[i] = (bits[i/8] >> (i%8)) & 1;
+	return 1;
+}
+
+void removeCheckpoint(MULS *muls)
+{
+	char fileName[512];
+
+	checkpointFileName(muls,fileName,sizeof(fileName));
+	remove(fileName);
+}
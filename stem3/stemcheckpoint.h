@@ -0,0 +1,59 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STEMCHECKPOINT_H
+#define STEMCHECKPOINT_H
+
+#include <vector>
+#include "data_containers.h"
+
+/* Checkpoints of doSTEM() ("checkpoint interval:", stem3 --resume).
+ * Besides the fields below, a checkpoint holds the images and Navg 
+ * of all detectors and muls->chisq.  Every process (shard, MPI rank) 
+ * has its own checkpoint file in the output folder.  The atoms are 
+ * kept, because the later subdivisions of a unit cell (and the first 
+ * run) do not draw a new configuration, which could be repeated.
+ */
+struct STEMCheckpoint {
+	int run;              // muls->avgCount of the run in progress
+	int sequence;         // index of the "sequence:" line in progress
+	int slab;             // the slab (pCount) in progress
+	int totalSliceCount;
+	int divCount;         // muls->divCount before the potential of the slab was built
+	double collectedIntensity;
+	std::vector<double> randomState;  // after the potential of the slab was built, see getRandomState()
+	std::vector<unsigned char> done;  // scanXN*scanYN flags of the pixels finished in this slab
+	std::vector<atom> atoms;          // the configuration of the run (read only, written from muls->atoms)
+};
+
+/* <folder>/<base>, followed by the shard and MPI rank of this process,
+ * if there are several, and ext.  Exits if that does not fit into the 
+ * size bytes of fileName. */
+void processFileName(MULS *muls, const char *folder, const char *base, const char *ext, 
+					 char *fileName, size_t size);
+void checkpointFileName(MULS *muls, char *fileName, size_t size);
+/* writes the checkpoint atomically (to a temporary file, which is then 
+ * renamed), returns 0 if that failed */
+int writeCheckpoint(MULS *muls, STEMCheckpoint &ck);
+/* returns 0 if there is no checkpoint, exits if it belongs to a different 
+ * simulation, and restores the detectors and chisq otherwise */
+int readCheckpoint(MULS *muls, STEMCheckpoint &ck);
+void removeCheckpoint(MULS *muls);
+
+#endif
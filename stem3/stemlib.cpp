@@ -22,6 +22,9 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <stdexcept>
+#include <algorithm>
+#include <map>
 
 #include "stemlib.h"
 #include "memory_fftw3.h"	/* memory allocation routines */
@@ -29,6 +32,12 @@ QSTEM - image simulation for TEM/STEM/CBED
 // #include "tiffsubs.h"
 #include "imagelib_fftw3.h"
 #include "fileio_fftw3.h"
+#include "detector_map.h"
+#include "scan_scheduler.h"
+#include "phononbatch.h"
+#include "numa_layout.h"
+#include "potential_cache.h"
+#include "structure_factor.h"
 // #include "floatdef.h"
 // #include "imagelib.h"
 
@@ -141,236 +150,1248 @@ double scatPar[N_ELEM][N_SF] = {{0.0000,0.0500,0.1000,0.1500,0.2000,0.2500,0.300
 0.0957,0.0727,0.0569,0.0369,0.0258,0,0,0}};
 #endif  // USE_REZ_SFACTS
 /****************************************************************************
-* function: atomBoxLookUp
+* The atom boxes of the real space potential lookup (one per element and
+* Debye-Waller factor), with their sampling boxDx, boxDy, boxDz and size 
+* boxNx x boxNy x boxNz, and the cache folder ("potential cache folder:")
+* they are kept in.
+***************************************************************************/
+typedef std::pair<int,double> atomBoxIndex;
+static std::map<atomBoxIndex,atomBox> atomBoxes;
+static int boxNx,boxNy,boxNz;
+static double boxDx,boxDy,boxDz;
+static double maxRadius2;
+static PotentialCachePtr potCache;
+
+/* linear interpolation of a table of values v, d apart, 0 beyond the table */
+static inline double tableValue(const std::vector<double> &v,double d,double x) {
+	int i = (int)(x/d);
+	if (i >= (int)v.size()-1) return 0.0;
+	x = x/d-(double)i;
+	return (1.0-x)*v[i]+x*v[i+1];
+}
+
+/* the same for a table of an odd function of x >= 0, which is constant beyond the table */
+static inline double oddTableValue(const std::vector<double> &v,double d,double x) {
+	double y = fabs(x);
+	y = (y >= d*(double)(v.size()-1)) ? v[v.size()-1] : tableValue(v,d,y);
+	return (x < 0) ? -y : y;
+}
+
+/****************************************************************************
+* function: createAtomBox
 *
-* Znum = element
-* x,y,z = real space position (in A)
-* B = Debye-Waller factor, B=8 pi^2 <u^2>
+* Computes the real space potential of element Znum for the Debye-Waller
+* factor aBox->B in its box of aBox->nx x ny x nz samples, aBox->dx, dy, dz
+* apart.  The potential is made from the same scattering factors scatPar
+* (tabulated for s = k/2) and in the same units as the fft potential of 
+* make3DSlices(): the radial potential is the 3D fourier transform of 
+* f(k/2)exp(-B k^2/4), V(r) = 2/r int_0^kmax k f(k/2) exp(-B k^2/4) sin(2 pi k r) dk,
+* cut off at atomRadius.  A 2D box holds its projection, a 3D box its integral over
+* a slice of thickness sliceThickness at the distance iz*dz from the atom.
 ***************************************************************************/
-void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,double z,double B) {
-	static int boxNx,boxNy,boxNz;
-	static double dx,dy,dz,ddx,ddy,ddz;
-	static atomBox *aBox = NULL;
-	static int ix,iy,iz; // idz, intSteps;
-	// static double x2,y2,z2,r2;
-	// static int avgSteps,maxSteps,stepCount,maxStepCount;
-	static double maxRadius2;
-	static char fileName[256],systStr[256];
-	static fftw_complex sum;
-	static int tZ, tnx, tny, tnz, tzOversample;  
-	static double tdx, tdy, tdz, tv0, tB;
-	FILE *fpBox;
-	int numRead = 0,dummy;
+void createAtomBox(MULS *muls, int Znum, atomBox *aBox) {
+	std::vector<double> splinb(N_SF),splinc(N_SF),splind(N_SF);
+	std::vector<double> fk,vr,g;
+	double kmax,dk,k,dr,r,rmax,dz,zmax,z,rho2,h,sum,v,vPrev;
+	int nk,nr,nz,ix,iy,iz,i,j;
+
+	if ((Znum < 1) || (Znum >= N_ELEM)) {
+		printf("createAtomBox: no scattering factors for Z=%d - exit!\n",Znum);
+		exit(0);
+	}
+	splinh(scatPar[0],scatPar[Znum],&splinb[0],&splinc[0],&splind[0],N_SF);
+
+	/* k*f(k/2)*exp(-B k^2/4) for Simpson's rule, up to the last tabulated s */
+	kmax = 2.0*scatPar[0][N_SF-4];
+	nk = 2*(int)ceil(kmax/0.004);
+	dk = kmax/(double)nk;
+	fk.resize(nk+1);
+	for (j=0;j<=nk;j++) {
+		k = (double)j*dk;
+		fk[j] = ((j == 0) || (j == nk) ? 1.0 : (j % 2 ? 4.0 : 2.0))*dk/3.0*k*
+			seval(scatPar[0],scatPar[Znum],&splinb[0],&splinc[0],&splind[0],N_SF,0.5*k)*exp(-0.25*aBox->B*k*k);
+	}
 
+	/* the radial potential on a grid much finer than the box */
+	dr = aBox->dx < aBox->dy ? aBox->dx : aBox->dy;
+	if ((muls->potential3D) && (aBox->dz < dr)) dr = aBox->dz;
+	dr *= 0.25;
+	rmax = muls->atomRadius;
+	nr = (int)(rmax/dr)+1;
+	vr.assign(nr+1,0.0);
+	for (i=0;i<nr;i++) {
+		r = (double)i*dr;
+		for (sum=0,j=0;j<=nk;j++) {
+			k = (double)j*dk;
+			sum += (i == 0) ? fk[j]*2.0*PI*k : fk[j]*sin(2.0*PI*k*r)/r;
+		}
+		vr[i] = 2.0*sum;
+	}
 
-	(*vlu)[0] = 0.0;
-	(*vlu)[1] = 0.0;
+	/* g(u) = int_0^u V(sqrt(rho^2+z^2)) dz, and a box sample is g(z+h)-g(z-h) */
+	h = 0.5*muls->sliceThickness;
+	nz = muls->potential3D ? aBox->nz : 1;
+	zmax = muls->potential3D ? (double)(nz-1)*aBox->dz+h : rmax;
+	dz = dr;
+	g.resize((int)(zmax/dz)+3);
+	aBox->rpotential = float3D(nz,aBox->nx,aBox->ny,"atomBox");
+	for (ix=0;ix<aBox->nx;ix++) for (iy=0;iy<aBox->ny;iy++) {
+		rho2 = (double)ix*aBox->dx*(double)ix*aBox->dx+(double)iy*aBox->dy*(double)iy*aBox->dy;
+		g[0] = 0.0;
+		vPrev = tableValue(vr,dr,sqrt(rho2));
+		for (j=1;j<(int)g.size();j++) {
+			z = (double)j*dz;
+			v = tableValue(vr,dr,sqrt(rho2+z*z));
+			g[j] = g[j-1]+0.5*dz*(vPrev+v);
+			vPrev = v;
+		}
+		if (!muls->potential3D) {
+			aBox->rpotential[0][ix][iy] = (float_tt)(2.0*g[g.size()-1]);
+			continue;
+		}
+		for (iz=0;iz<nz;iz++) {
+			z = (double)iz*aBox->dz;
+			aBox->rpotential[iz][ix][iy] = (float_tt)(oddTableValue(g,dz,z+h)-oddTableValue(g,dz,z-h));
+		}
+	}
+}
 
-	/* initialize all the atoms to non-used */
-	if (aBox == NULL) {
-		aBox = (atomBox *)malloc(sizeof(atomBox)*(NZMAX+1));
-		for (ix=0;ix<=NZMAX;ix++) {
-			aBox[ix].potential = NULL;
-			aBox[ix].rpotential = NULL;
-			aBox[ix].B = -1.0;
-		}
-		dx = (*muls).resolutionX;    ddx = dx/(double)OVERSAMPLING;
-		dy = (*muls).resolutionY;    ddy = dy/(double)OVERSAMPLING;
-		dz = (*muls).sliceThickness; ddz = dz/(double)OVERSAMPLINGZ;
+/****************************************************************************
+* function: getAtomBox
+*
+* Returns the atom box of element Znum for the Debye-Waller factor B, 
+* B=8 pi^2 <u^2>.  The box is mapped from the potential cache, or computed
+* by createAtomBox() and stored in the cache, if this has not been done 
+* for these parameters yet.  Each box is made once and kept for the
+* whole run; only looking up boxes that exist is safe in several threads.
+***************************************************************************/
+static atomBox *getAtomBox(MULS *muls,int Znum,double B) {
+	std::map<atomBoxIndex,atomBox>::iterator it;
+	atomBox *box;
+	AtomBoxKey key;
+	const float *values;
+	int i,iz;
+
+	if ((it = atomBoxes.find(atomBoxIndex(Znum,B))) != atomBoxes.end()) 
+		return &it->second;
+
+	if (!potCache) {
+		boxDx = (*muls).resolutionX/(double)OVERSAMPLING;
+		boxDy = (*muls).resolutionY/(double)OVERSAMPLING;
+		boxDz = (*muls).sliceThickness/(double)OVERSAMPLINGZ;
 		maxRadius2 = (*muls).atomRadius*(*muls).atomRadius;
 		/* For now we don't care, if the box has only small 
 		* prime factors, because we will not fourier transform it
 		* especially not very often.
 		*/
-		boxNx = (int)((*muls).atomRadius/ddx+2.0);  
-		boxNy = (int)((*muls).atomRadius/ddy+2.0);  
-		boxNz = (int)((*muls).atomRadius/ddz+2.0);     
+		boxNx = (int)((*muls).atomRadius/boxDx+2.0);  
+		boxNy = (int)((*muls).atomRadius/boxDy+2.0);  
+		boxNz = (int)((*muls).atomRadius/boxDz+2.0);     
 		if ((*muls).potential3D == 0)
 			boxNz = 1;
+		potCache = PotentialCachePtr(new PotentialCache(muls->potCacheFolder));
 
 		if (muls->printLevel > 2)
 			printf("Atombox has real space resolution of %g x %g x %gA (%d x %d x %d pixels)\n",
-			ddx,ddy,ddz,boxNx,boxNy,boxNz);
+			boxDx,boxDy,boxDz,boxNx,boxNy,boxNz);
 	}
-	// printf("Debugging: %d %g %g: %g\n",Znum,aBox[Znum].B,B,fabs(aBox[Znum].B - B));
 
 	/* Creating/Reading a atombox for every new kind of atom, but only as needed */
-	if (fabs(aBox[Znum].B - B) > 1e-6) {
-		//  printf("Debugging 1 (%d: %.7g-%.7g= %.7g), %d\n",
-		//	   Znum,aBox[Znum].B,B,fabs(aBox[Znum].B - B),fabs(aBox[Znum].B - B) > 1e-6);
-		aBox[Znum].B = B;
-		/* Open the file with the projected potential for this particular element
-		*/
-		sprintf(fileName,"potential_%d_B%d.prj",Znum,(int)(100.0*B));
-		if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
-			sprintf(systStr,"scatpot %s %d %g %d %d %d %g %g %g %d %g",
-				fileName,Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
-			if (muls->printLevel > 2) {
-				printf("Could not find precalculated potential for Z=%d,"
-					" will calculate now.\n",Znum);
-				printf("Calling: %s\n",systStr);
-			}
-			system(systStr);
-			for (dummy=0;dummy < 10000;dummy++);
-			if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
-				if (muls->printLevel >0)
-					printf("cannot calculate projected potential using scatpot - exit!\n");
-				exit(0);
-			}  
-
-		}
-		fgets( systStr, 250, fpBox );
-		sscanf(systStr,"%d %le %d %d %d %le %le %le %d %le\n",
-			&tZ, &tB, &tnx, &tny, &tnz, &tdx, &tdy, &tdz, &tzOversample, &tv0);
-		/* If the parameters in the file don't match the current ones,
-		* we need to create a new potential file
-		*/
-		if ((tZ != Znum) || (fabs(tB-B)>1e-6) || (tnx != boxNx) || (tny != boxNy) || (tnz != boxNz) ||
-			(fabs(tdx-ddx) > 1e-5) || (fabs(tdy-ddy) > 1e-5) || (fabs(tdz-ddz) > 1e-5) || 
-			(tzOversample != OVERSAMPLINGZ) || (tv0 != muls->v0)) {
-				if (muls->printLevel > 2) {
-					printf("Potential input file %s has the wrong parameters\n",fileName);
-					printf("Parameters:\n"
-						"file:    Z=%d, B=%.3f A^2 (%d, %d, %d) (%.7f, %.7f %.7f) nsz=%d V=%g\n"
-						"program: Z=%d, B=%.3f A^2 (%d, %d, %d) (%.7f, %.7f %.7f) nsz=%d V=%g\n"
-						"will create new potential file, please wait ...\n",
-						tZ,tB,tnx,tny,tnz,tdx,tdy,tdz,tzOversample,tv0,
-						Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
-					/* printf("%d %d %d %d %d %d %d %d %d %d\n",
-					(tZ != Znum),(tB != B),(tnx != boxNx),(tny != boxNy),(tnz != boxNz),
-					(fabs(tdx-ddx) > 1e-5),(fabs(tdy-ddy) > 1e-5),(fabs(tdz-ddz) > 1e-5), 
-					(tzOversample != OVERSAMPLINGZ),(tv0 != muls->v0));
-					*/
-				}
-				/* Close the old file, Create a new potential file now 
-				*/
-				fclose( fpBox );
-				sprintf(systStr,"scatpot %s %d %g %d %d %d %g %g %g %d %g",
-					fileName,Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
-				system(systStr);
-				if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
-					if (muls->printLevel >0)
-						printf("cannot calculate projected potential using scatpot - exit!\n");
-					exit(0);
-				}  
-				fgets( systStr, 250, fpBox );
-		}
-
-		/* Finally we can read in the projected potential
-		*/
-		if (B == 0) {
-			aBox[Znum].rpotential = float3D(boxNz,boxNx,boxNy,"atomBox");
-			numRead = fread(aBox[Znum].rpotential[0][0],sizeof(real),
-				(size_t)(boxNx*boxNy*boxNz), fpBox );
-		}
-		else {
-#if FLOAT_PRECISION == 1
-			aBox[Znum].potential = complex3Df(boxNz,boxNx,boxNy,"atomBox");
-			numRead = fread(aBox[Znum].potential[0][0],sizeof(fftwf_complex),
-				(size_t)(boxNx*boxNy*boxNz), fpBox );
-#else
-			aBox[Znum].potential = complex3D(boxNz,boxNx,boxNy,"atomBox");
-			numRead = fread(aBox[Znum].potential[0][0],sizeof(fftw_complex),
-				(size_t)(boxNx*boxNy*boxNz),fpBox);	
-#endif
-		}
-
-		/* writeImage_old(aBox[Znum].potential[0],boxNx,boxNy, 0.0,"potential.img");
-		system("showimage potential.img");
-		*/
-		fclose( fpBox );
-
-		if (numRead == boxNx*boxNy*boxNz) {
+	box = &atomBoxes[atomBoxIndex(Znum,B)];
+	box->used = 1;
+	box->potential = NULL;
+	box->B = B;
+	box->nx = boxNx;
+	box->ny = boxNy;
+	box->nz = boxNz;
+	box->dx = boxDx;
+	box->dy = boxDy;
+	box->dz = boxDz;
+	key.Z = Znum;
+	key.B = B;
+	key.nx = boxNx;
+	key.ny = boxNy;
+	key.nz = boxNz;
+	key.dx = boxDx;
+	key.dy = boxDy;
+	key.dz = boxDz;
+	key.zOversample = OVERSAMPLINGZ;
+	key.v0 = muls->v0;
+	key.scatFactors = USE_REZ_SFACTS;
+	key.radius = muls->atomRadius;
+
+	if ((values = potCache->Load(key)) != NULL) {
+		/* point right into the mapped cache file */
+		box->rpotential = (float_tt ***)malloc(boxNz*sizeof(float_tt **));
+		box->rpotential[0] = (float_tt **)malloc(boxNz*boxNx*sizeof(float_tt *));
+		for (i=0;i<boxNz*boxNx;i++) 
+			box->rpotential[0][i] = (float_tt *)values+(size_t)i*boxNy;
+		for (iz=1;iz<boxNz;iz++) 
+			box->rpotential[iz] = box->rpotential[0]+iz*boxNx;
+		if (muls->printLevel > 1)
+			printf("Read the potential of Z=%d from %s\n",Znum,potCache->FileName(key).c_str());
+	}
+	else {
+		if (muls->printLevel > 2) 
+			printf("Could not find precalculated potential for Z=%d, will calculate now.\n",Znum);
+		createAtomBox(muls,Znum,box);
+		try {
+			potCache->Store(key,box->rpotential[0][0]);
 			if (muls->printLevel > 1)
-				printf("Sucessfully read in the projected potential\n");
+				printf("Wrote the potential of Z=%d to %s\n",Znum,potCache->FileName(key).c_str());
 		}
-		else {
+		catch (std::runtime_error &e) {
 			if (muls->printLevel > 0)
-				printf("error while reading potential file %s: read %d of %d values\n",
-				fileName,numRead,boxNx*boxNy*boxNz);
-			exit(0);
+				printf("%s - the potential of Z=%d will not be cached\n",e.what(),Znum);
 		}
 	}
 
-	/***************************************************************
-	* Do the trilinear interpolation
-	*/
-	sum[0] = 0.0;
-	sum[1] = 0.0;
+	return box;
+}
+
+/****************************************************************************
+* function: atomBoxValue
+*
+* Trilinear interpolation of the potential in an atom box at the 
+* sample (ix,iy,iz) plus the offsets (dx,dy,dz), which are not 
+* normalized by the box sampling.
+***************************************************************************/
+static inline double atomBoxValue(const atomBox *box,int potential3D,
+								  int ix,int iy,int iz,double dx,double dy,double dz) {
+	if (potential3D) {
+		return (1.0-dz)*((1.0-dy)*((1.0-dx)*box->rpotential[iz][ix][iy]+
+			dx*box->rpotential[iz][ix+1][iy])+
+			dy*((1.0-dx)*box->rpotential[iz][ix][iy+1]+
+			dx*box->rpotential[iz][ix+1][iy+1]))+
+			dz*((1.0-dy)*((1.0-dx)*box->rpotential[iz+1][ix][iy]+
+			dx*box->rpotential[iz+1][ix+1][iy])+
+			dy*((1.0-dx)*box->rpotential[iz+1][ix][iy+1]+
+			dx*box->rpotential[iz+1][ix+1][iy+1]));
+	}
+	return (1.0-dy)*((1.0-dx)*box->rpotential[0][ix][iy]+
+		dx*box->rpotential[0][ix+1][iy])+
+		dy*((1.0-dx)*box->rpotential[0][ix][iy+1]+
+		dx*box->rpotential[0][ix+1][iy+1]);
+}
+
+/****************************************************************************
+* function: atomBoxLookUp
+*
+* Znum = element
+* x,y,z = real space position (in A)
+* B = Debye-Waller factor, B=8 pi^2 <u^2>
+***************************************************************************/
+void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,double z,double B) {
+	atomBox *box;
+	double dx,dy,dz;
+	int ix,iy,iz;
+
+	(*vlu)[0] = 0.0;
+	(*vlu)[1] = 0.0;
+
+	box = getAtomBox(muls,Znum,B);
 	if (x*x+y*y+z*z > maxRadius2) {
 		return;
 	}
 	x = fabs(x);
 	y = fabs(y);
 	z = fabs(z);
-	ix = (int)(x/ddx);
-	iy = (int)(y/ddy);
-	iz = (int)(z/ddz);
-	dx = x-(double)ix*ddx;
-	dy = y-(double)iy*ddy;
-	dz = z-(double)iz*ddz;
+	ix = (int)(x/boxDx);
+	iy = (int)(y/boxDy);
+	iz = (int)(z/boxDz);
+	dx = x-(double)ix*boxDx;
+	dy = y-(double)iy*boxDy;
+	dz = z-(double)iz*boxDz;
 	if ((dx < 0) || (dy<0) || (dz<0)) {
-		/* printf("Warning, dx(%g), dy(%g), dz(%g) < 0, (x=%g, y=%g, z=%g)\n",dx,dy,dz,x,y,z);
-		*/
 		if (dx < 0) dx = 0.0;
 		if (dy < 0) dy = 0.0;
 		if (dz < 0) dz = 0.0;
 	}
+	(*vlu)[0] = atomBoxValue(box,muls->potential3D,ix,iy,iz,dx,dy,dz);
+}
+
+/*****************************************************
+* The samples of an atom box along one axis of the footprint
+* of an atom: for every pixel (or slice) the distance x from
+* the atom center, the box sample i and offset dx (see 
+* atomBoxValue()), and the index ip in trans, wrapped 
+* into the periodic range.
+****************************************************/
+typedef struct {
+	double x,dx;
+	int i,ip;
+} boxAxis;
+
+static void atomBoxAxis(boxAxis *axis,int iAtom,int iRad,double offset,double d,
+						double atomPos,double boxD,int n) {
+	double x;
+	int k;
+
+	for (k=-iRad;k<=iRad;k++,axis++) {
+		axis->x = ((double)(iAtom+k)+offset)*d-atomPos;
+		x = fabs(axis->x);
+		axis->i = (int)(x/boxD);
+		axis->dx = x-(double)axis->i*boxD;
+		if (axis->dx < 0) axis->dx = 0.0;
+		axis->ip = ((iAtom+k) % n + n) % n;	/* shift into the positive range */
+	}
+}
+
+/* the axes of the footprint of an atom.  Every thread keeps its own, 
+ * so that they are allocated once and not for every atom. */
+typedef struct {
+	std::vector<boxAxis> x,y,z;
+} boxAxes;
+
+/*****************************************************
+* windowLayer() - the layer of muls->trans that holds slice iz 
+* of the slab, or -1 if trans does not hold it.  trans holds the
+* slices muls->sliceFirst .. muls->sliceFirst+trans.Nz()-1, i.e. 
+* all of them, unless the slices are built a few at a time (see 
+* makeSliceWindow()).
+****************************************************/
+static inline int windowLayer(MULS *muls,int iz) {
+	iz -= muls->sliceFirst;
+	return ((iz >= 0) && (iz < muls->trans.Nz())) ? iz : -1;
+}
+
+static inline void addWindowPotential(MULS *muls,int iz,int ix,int iy,double re,double im) {
+	if ((iz = windowLayer(muls,iz)) < 0) return;
+	muls->trans[iz][ix][iy][0] += re;
+	muls->trans[iz][ix][iy][1] += im;
+}
+
+/*****************************************************
+* addAtomPotential()
+*
+* Adds the potential of atoms[iatom] at the height atomZ 
+* within the current stack of slices (see make3DSlices()) 
+* to muls->trans, but only to the rows xLo <= ix < xHi.
+* Threads that own disjoint ranges of rows can therefore
+* add atoms at the same time, and every pixel still receives
+* its contributions in the order of the atoms.
+* The lookup tables of the atom must exist already when 
+* this is called by several threads (see initAtomPotentials()).
+* axes are the footprint axes of the calling thread.
+****************************************************/
+static void addAtomPotential(MULS *muls,int nlayer,atom *atoms,int iatom,real atomZ,int xLo,int xHi,
+							 boxAxes &axes) {
+	int iz,nx,ny,ix,iy,iax,iay,iaz,sliceStep;
+	int iAtomX,iAtomY,iAtomZ,iRadX,iRadY,iRadZ;
+	int iax0,iax1,iay0,iay1,iaz0,iaz1,nyAtBox,nyAtBox2,iOffsX,iOffsY,iOffsZ;
+	int nzSub,Nr,ir,Nz_lut;
+	int iOffsLimHi,iOffsLimLo,iOffsStep;
+	int iRadZmax,layer;
+	real dx,dy,atomX,atomY;
+	double z,r,ddx,ddy,ddr,dr,r2sqr,x2,y2,potVal,dOffsZ;
+	double atomRadius2;
+	float s11,s12,s21,s22;
+	fftwf_complex	*atPotPtr;
+	float *potPtr=NULL, *ptr;
+	fftw_complex dPot;
+	atomBox *box;
+	boxAxis *xs,*ys,*zs;
+#if Z_INTERPOLATION
+	double ddz;
+#endif
+#if USE_Q_POT_OFFSETS
+	fftwf_complex	*atPotOffsPtr;
+#endif
+
+	nx = muls->potNx;
+	ny = muls->potNy;
+	dx = (*muls).resolutionX;
+	dy = (*muls).resolutionY;
+	dr   = muls->resolutionX/OVERSAMP_X;  // define step width in which radial V(r,z) is defined 
+	iRadX = (int)ceil((*muls).atomRadius/dx);
+	iRadY = (int)ceil((*muls).atomRadius/dy);
+	iRadZ = (int)ceil((*muls).atomRadius/muls->sliceThickness);
+	atomRadius2 = (*muls).atomRadius * (*muls).atomRadius;
+	nyAtBox   = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
+	nyAtBox2  = 2*nyAtBox;
+	sliceStep = 2*muls->potNx*muls->potNy;
 
+	/* atom coordinates in cartesian coords
+	* The x- and y-position will be offset by the starting point
+	* of the actually needed array of projected potential
+	*/
+	atomX = atoms[iatom].x -(*muls).potOffsetX;
+	atomY = atoms[iatom].y -(*muls).potOffsetY;
+
+	/* so far we need periodicity in z-direction.
+	* This requirement can later be removed, if we 
+	* use some sort of residue slice which will contain the 
+	* proj. potential that we need to add to the first slice of
+	* the next stack of slices
+	*	
+	* 
+	*/
 
-	if ((*muls).potential3D) {
-		if (aBox[Znum].B > 0) {
-			sum[0] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz][ix][iy][0]+
-				dx*aBox[Znum].potential[iz][ix+1][iy][0])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz][ix][iy+1][0]+
-				dx*aBox[Znum].potential[iz][ix+1][iy+1][0]))+
-				dz*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy][0]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy][0])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy+1][0]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy+1][0]));
-			sum[1] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz][ix][iy][1]+
-				dx*aBox[Znum].potential[iz][ix+1][iy][1])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz][ix][iy+1][1]+
-				dx*aBox[Znum].potential[iz][ix+1][iy+1][1]))+
-				dz*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy][1]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy][1])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy+1][1]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy+1][1]));
+	/*************************************************************
+	* real space potential lookup table summation
+	************************************************************/
+	if (!muls->fftpotential) {
+		/* Warning: will assume constant slice thickness ! */
+		/* do not round here: atomX=0..dx -> iAtomX=0 */
+		iAtomX = (int)floor(atomX/dx);  
+		iAtomY = (int)floor(atomY/dy);
+		iAtomZ = (int)floor(atomZ/muls->cz[0]);
+
+		// printf("atomZ(%d)=%g(%d)\t",iatom,atomZ,iAtomZ);
+
+		/* The atom box of this element, and where the pixels of the footprint 
+		* of this atom sample it along x, y and z.  The pixels then only need 
+		* the interpolation (see atomBoxLookUp()).
+		*/
+		box = getAtomBox(muls,atoms[iatom].Znum,muls->tds ? 0 : atoms[iatom].dw);
+		iRadZmax = muls->potential3D ? (int)(sqrt(atomRadius2)/(*muls).cz[0]+1.0) : 0;
+		axes.x.resize(2*iRadX+1);
+		axes.y.resize(2*iRadY+1);
+		axes.z.resize(2*iRadZmax+1);
+		atomBoxAxis(&axes.x[0],iAtomX,iRadX,0.0,dx,atomX,boxDx,nx);
+		atomBoxAxis(&axes.y[0],iAtomY,iRadY,0.0,dy,atomY,boxDy,ny);
+		atomBoxAxis(&axes.z[0],iAtomZ,iRadZmax,0.5,(*muls).cz[0],atomZ,boxDz,nlayer);
+
+		for (iax = -iRadX;iax<=iRadX;iax++) {
+			if ((*muls).nonPeriod) {
+				if (iax+iAtomX < 0) {
+					iax = -iAtomX;
+					if (abs(iax)>iRadX) break;
+				} 
+				if (iax+iAtomX >= nx)	break;
+			}
+			xs = &axes.x[iax+iRadX];
+			ix = xs->ip;
+			if ((ix < xLo) || (ix >= xHi)) continue;
+			for (iay=-iRadY;iay<=iRadY;iay++) {
+				if ((*muls).nonPeriod) {
+					if (iay+iAtomY < 0) {
+						iay = -iAtomY;
+						if (abs(iay)>iRadY) break;
+					} 
+					if (iay+iAtomY >= ny)	break;
+				}
+				ys = &axes.y[iay+iRadY];
+				iy = ys->ip;
+				r2sqr = xs->x*xs->x + ys->x*ys->x;
+
+				if (r2sqr <= atomRadius2) {
+
+					if (muls->potential3D) {
+						/* calculate the range which we have left to cover with z-variation */
+						/* iRadZ is the number of slices (rounded up) that this atom
+						* will contribute to, given its current x,y-radius
+						*/ 
+						iRadZ = (int)(sqrt(atomRadius2-r2sqr)/(*muls).cz[0]+1.0);
+						/* loop through the slices that this atoms contributes to */
+						for (iaz=-iRadZ;iaz <=iRadZ;iaz++) {
+							if ((*muls).nonPeriodZ) {
+								if (iaz+iAtomZ < 0)  {
+									if (-iAtomZ <= iRadZ) iaz = -iAtomZ;
+									else break;
+									if (abs(iaz)>nlayer) break;
+								} 
+								if (iaz+iAtomZ >= nlayer)	break;
+							}
+							zs = &axes.z[iaz+iRadZmax];
+							/* x,y,z is the true vector from the atom center, 
+							* there is no potential beyond the atom radius
+							*/
+							if (r2sqr+zs->x*zs->x > atomRadius2) continue;
+							if ((iz = windowLayer(muls,zs->ip)) < 0) continue;
+							muls->trans[iz][ix][iy][0] += atomBoxValue(box,1,xs->i,ys->i,zs->i,xs->dx,ys->dx,zs->dx);
+						} /* end of for iaz=-iRadZ .. iRadZ */
+					} /* end of if potential3D */
+
+					/********************************************************************/ 
+
+					else { /* if 2D potential */
+						if ((*muls).nonPeriodZ) {
+							if (iAtomZ < 0)  break;			
+							if (iAtomZ >= nlayer)	break;	
+						}		 
+						iz = (iAtomZ+32*nlayer) % nlayer;	  /* shift into the positive range */
+						dPot[0] = atomBoxValue(box,0,xs->i,ys->i,0,xs->dx,ys->dx,0.0);
+						dPot[1] = 0.0;
+						z = (double)(iAtomZ+1)*(*muls).cz[0]-atomZ;
+
+						/* split the atom if it is close to the top edge of the slice */
+						if ((z<0.15*(*muls).cz[0]) && (iz >0)) {
+							addWindowPotential(muls,iz,ix,iy,0.5*dPot[0],0.5*dPot[1]);
+							addWindowPotential(muls,iz-1,ix,iy,0.5*dPot[0],0.5*dPot[1]);
+						}
+						/* split the atom if it is close to the bottom edge of the slice */
+						else {
+							if ((z>0.85*(*muls).cz[0]) && (iz < nlayer-1)) {
+								addWindowPotential(muls,iz,ix,iy,0.5*dPot[0],0.5*dPot[1]);
+								addWindowPotential(muls,iz+1,ix,iy,0.5*dPot[0],0.5*dPot[1]);
+							}
+							else addWindowPotential(muls,iz,ix,iy,dPot[0],dPot[1]);
+						}
+					}
+				}
+			}
 		}
+	}
+
+
+	/**************************************************************************
+	* Newer, even faster method based on FFT of tabulated scattering factors
+	**************************************************************************/ 
+	else {	/* fftpotential */
+		iAtomX = (int)floor(atomX/dx);	
+		iAtomY = (int)floor(atomY/dy);
+		if (muls->potential3D) atomZ+=muls->sliceThickness;  // why ??? !!!!!
+		// printf("%d: pos=[%d, %d, %.1f]\n",iatom,iAtomX,iAtomY,atomZ);
+		// atomZ is z-distance with respect to the start of the current stack of slices.
+		// ddz = atomZ-dz*iAtomZ;
+
+
+		/////////////////////////////////////////////////////////////////////////////
+		// if we need to cut away at the edges, i.e. non-periodic potential arrays:
+		if (muls->nonPeriod) {
+			if (muls->potential3D) {
+				iAtomZ = (int)floor(atomZ/muls->sliceThickness+0.5);
+				// printf("iAtomZ: %d\n",iAtomZ);
+
+				iax0 = iAtomX-iRadX <  0 ? 0 : iAtomX-iRadX;
+				iax1 = iAtomX+iRadX >= muls->potNx ? muls->potNx-1 : iAtomX+iRadX;
+				iay0 = iAtomY-iRadY <  0 ? 0 : iAtomY-iRadY;
+				iay1 = iAtomY+iRadY >= muls->potNy ? muls->potNy-1 : iAtomY+iRadY;
+				// if within the potential map range:
+				if ((iax0 <  muls->potNx) && (iax1 >= 0) && (iay0 <  muls->potNy) && (iay1 >= 0)) {
+
+
+					// define range of sampling from atomZ-/+atomRadius
+					iaz0 = iAtomZ-iRadZ <  0 ? -iAtomZ : -iRadZ;
+					iaz1 = iAtomZ+iRadZ >= muls->slices ?  muls->slices-iAtomZ-1 : iRadZ;
+					// iaz0 = 0;  iaz1 = 0;
+					// printf("iatomZ: %d, %d..%d cz=%g, %g (%d), dOffsZ=%g (%d)\n",iAtomZ,iaz0,iaz1,muls->sliceThickness,atomZ,(int)atomZ,(iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub,(int)(iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub+0.5);
+					if ((iAtomZ+iaz0 <	muls->slices) && (iAtomZ+iaz1 >= 0)) {
+						// retrieve the pointer for this atom
+						atPotPtr     = getAtomPotential3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut);
+#if USE_Q_POT_OFFSETS
+						// retrieve the pointer to the array of charge-dependent potential offset
+						// This function will return NULL; if the charge of this atom is zero:
+						atPotOffsPtr = getAtomPotentialOffset3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut,atoms[iatom].q);
+#endif // USE_Q_POT_OFFSETS
+						iOffsLimHi   =  Nr*(Nz_lut-1);
+						iOffsLimLo   = -Nr*(Nz_lut-1);
+						iOffsStep    = nzSub*Nr;
+
+						// Slices around the slice that this atom is located in must be affected by this atom:
+						// iaz must be relative to the first slice of the atom potential box.
+						for (iax=iax0; iax <= iax1; iax++) {
+							if ((iax < xLo) || (iax >= xHi)) continue;
+							potPtr = &(muls->trans[0][iax][iay0][0]);  // + the offset of the layer, see windowLayer()
+							// potPtr = &(muls->trans[iAtomZ-iaz0+iaz][iax][iay0][0]);
+							// printf("access: %d %d %d (%d)\n",iAtomZ+iaz0,iax,iay0,(int)potPtr);							
+
+							//////////////////////////////////////////////////////////////////////
+							// Computation of Radius must be made faster by using pre-calculated ddx
+							// and LUT for sqrt:
+							// use of sqrt slows down from 120sec to 180 sec.
+							x2 = iax*dx - atomX;  x2 *= x2;
+							for (iay=iay0; iay <= iay1; iay++) {
+								// printf("iax=%d, iay=%d\n",iax,iay); 
+								y2 = iay*dy - atomY;  y2 *= y2;
+								r = sqrt(x2+y2);
+								// r = (x2+y2);
+								ddr = r/dr;
+								ir	= (int)floor(ddr);
+								// add in different slices, once r has been defined
+								if (ir < Nr-1) {
+									ddr = ddr-(double)ir;
+									ptr = potPtr;
+									layer = iAtomZ+iaz0-muls->sliceFirst;
+
+									dOffsZ = (iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub;
+#if Z_INTERPOLATION
+									iOffsZ = (int)dOffsZ;
+									ddz    = fabs(dOffsZ - (double)iOffsZ);
+#else
+									iOffsZ = (int)(dOffsZ+0.5);
+#endif
+									iOffsZ *= Nr;
+
+									for (iaz=iaz0; iaz <= iaz1; iaz++) {
+										potVal = 0;
+										// iOffsZ = (int)(fabs(iAtomZ+iaz-atomZ/muls->sliceThickness)*nzSub+0.5);
+										if (iOffsZ < 0) {
+											if (iOffsZ > iOffsLimLo) {
+												// do the real part by linear interpolation in r-dimension:
+#if Z_INTERPOLATION
+												potVal = (1-ddz)*((1-ddr)*atPotPtr[ir-iOffsZ+Nr][0]+ddr*atPotPtr[ir+1-iOffsZ+Nr][0])+
+													ddz *((1-ddr)*atPotPtr[ir-iOffsZ   ][0]+ddr*atPotPtr[ir+1-iOffsZ   ][0]);
+#if USE_Q_POT_OFFSETS
+												// add the charge-dependent potential offset
+												if (atPotOffsPtr != NULL) {
+													potVal += atoms[iatom].q*((1-ddz)*((1-ddr)*atPotOffsPtr[ir-iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1-iOffsZ+Nr][0])+
+														ddz *((1-ddr)*atPotOffsPtr[ir-iOffsZ   ][0]+ddr*atPotOffsPtr[ir+1-iOffsZ   ][0]));		
+												}	
+#endif  // USE_Q_POT_OFFSETS
+#else   // Z_INTERPOLATION
+												potVal = (1-ddr)*atPotPtr[ir-iOffsZ+Nr][0]+ddr*atPotPtr[ir+1-iOffsZ+Nr][0];
+#if USE_Q_POT_OFFSETS
+												// add the charge-dependent potential offset
+												if (atPotOffsPtr != NULL) {
+													potVal += atoms[iatom].q*((1-ddr)*atPotOffsPtr[ir-iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1-iOffsZ+Nr][0]);
+												}	
+#endif  // USE_Q_POT_OFFSETS
+#endif  // Z_INTERPOLATION
+												// if (r < dr) printf("%d: iaz=%d,pot=%g,ddr=%g, iOffsZ=%d\n",iatom,iaz,potVal,ddr,iOffsZ);												
+											}
+										} // if iOffZ < 0
+										else {
+											// select the pointer to the right layer in the lookup box
+											// printf("%4d: iOffsZ: %d, iaz: %d (slice: %d, pos: %g [%d .. %d])\n",iatom,iOffsZ,iaz,iAtomZ+iaz,atomZ,iaz0,iaz1);
+											if (iOffsZ < iOffsLimHi) {
+												// do the real part by linear interpolation in r-dimension:
+#if Z_INTERPOLATION
+												potVal = (1-ddz)*((1-ddr)*atPotPtr[ir+iOffsZ][0]+ddr*atPotPtr[ir+1+iOffsZ][0])+
+													ddz *((1-ddr)*atPotPtr[ir+iOffsZ+Nr][0]+ddr*atPotPtr[ir+1+iOffsZ+Nr][0]);
+#if USE_Q_POT_OFFSETS
+												// add the charge-dependent potential offset
+												if (atPotOffsPtr != NULL) {
+													potVal += atoms[iatom].q*((1-ddz)*((1-ddr)*atPotOffsPtr[ir+iOffsZ][0]+ddr*atPotOffsPtr[ir+1+iOffsZ][0])+
+														ddz *((1-ddr)*atPotOffsPtr[ir+iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1+iOffsZ+Nr][0]));
+												}
+#endif  // USE_Q_POT_OFFSETS
+#else   // Z_INTERPOLATION
+												potVal = (1-ddr)*atPotPtr[ir+iOffsZ][0]+ddr*atPotPtr[ir+1+iOffsZ][0];
+#if USE_Q_POT_OFFSETS
+												// add the charge-dependent potential offset
+												if (atPotOffsPtr != NULL) {
+													potVal += atoms[iatom].q*((1-ddr)*atPotOffsPtr[ir+iOffsZ][0]+ddr*atPotOffsPtr[ir+1+iOffsZ][0]);												
+												}
+#endif  // USE_Q_POT_OFFSETS
+#endif  // Z_INTERPOLATION
+												// if (r < dr) printf("%d: iaz=%d,pot=%g,ddr=%g, iOffsZ=%d\n",iatom,iaz,potVal,ddr,iOffsZ);
+
+											}
+										} // if iOffsZ >=0
+										if ((layer >= 0) && (layer < muls->trans.Nz()))
+											ptr[(size_t)layer*sliceStep] += potVal;  // ptr = potPtr = muls->trans[0][...]
+
+										layer++;	// advance to the next slice
+										// add the remaining potential to the next slice:
+										// if (iaz < iaz1)	*ptr += (1-ddz)*potVal;
+										iOffsZ += iOffsStep;
+									} // end of iaz-loop
+								} // if ir < Nr
+								// advance pointer to next complex potential point:
+								potPtr+=2;
+								// make imaginary part zero for now
+								// *potPtr = 0;
+								// potPtr++;
+
+								// wrap around when end of y-line is reached:
+								// if (++iay % muls->potNy == 0) potPtr -= 2*muls->potNy;		
+							} // iay=iay0 .. iay1	  
+						} // iax=iax0 .. iax1
+					} // iaz0+iAtomZ < muls->slices
+					// dOffsZ = (iAtomZ-atomZ/muls->sliceThickness)*nzSub;
+					// printf("%5d (%2d): iAtomZ=%2d, offsZ=%g, diff=%g, (%g)\n",
+					//	  iatom,atoms[iatom].Znum,iAtomZ,dOffsZ,dOffsZ - (int)(dOffsZ+0.5),iAtomZ-atomZ/muls->sliceThickness);
+				} // if within bounds	
+			}  // muls->potential3D and non-periodic in x-y
+			////////////////////////////////////////////////////////////////////
+			// 2D potential calculation already seems to work!
+			// However, the potential is calculated wrongly, it is not integrated 
+			// in z-direction.	This must be done in the potential slice initialization
+			// procedure.
+			else {
+				iAtomZ = (int)floor(atomZ/muls->sliceThickness);
+				iax0 = iAtomX-iRadX <  0 ? 0 : iAtomX-iRadX;
+				iax1 = iAtomX+iRadX >= muls->potNx ? muls->potNx-1 : iAtomX+iRadX;
+				iay0 = iAtomY-iRadY <  0 ? 0 : iAtomY-iRadY;
+				iay1 = iAtomY+iRadY >= muls->potNy ? muls->potNy-1 : iAtomY+iRadY;
+				// if within the potential map range:
+				if ((iax0 <  muls->potNx) && (iax1 >= 0) && (iay0 <  muls->potNy) && (iay1 >= 0)) {
+					ddx = (-(double)iax0+(atomX/dx-(double)iRadX))*(double)OVERSAMP_X;
+					ddy = (-(double)iay0+(atomY/dy-(double)iRadY))*(double)OVERSAMP_X;
+					iOffsX = (int)floor(ddx);
+					iOffsY = (int)floor(ddy);
+					ddx -= (double)iOffsX;
+					ddy -= (double)iOffsY;
+					s11 = (1-ddx)*(1-ddy);
+					s12 = (1-ddx)*ddy;
+					s21 = ddx*(1-ddy);
+					s22 = ddx*ddy;
+					atPotPtr = getAtomPotential2D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw);
+					layer = windowLayer(muls,iAtomZ);
+
+					for (iax=iax0; iax < iax1; iax++) {
+						if ((iax < xLo) || (iax >= xHi) || (layer < 0)) continue;
+						// printf("(%d, %d): %d,%d\n",iax,nyAtBox,(iOffsX+OVERSAMP_X*(iax-iax0)),iOffsY+iay1-iay0);
+						// potPtr and ptr are of type (float *)
+						potPtr = &(muls->trans[layer][iax][iay0][0]);
+						ptr = &(atPotPtr[(iOffsX+OVERSAMP_X*(iax-iax0))*nyAtBox+iOffsY][0]);
+						for (iay=iay0; iay < iay1; iay++) {
+							*potPtr += s11*(*ptr)+s12*(*(ptr+2))+s21*(*(ptr+nyAtBox2))+s22*(*(ptr+nyAtBox2+2));
+
+							potPtr++;
+							// *potPtr = 0;
+							potPtr++;
+							ptr += 2*OVERSAMP_X;
+						}
+					}
+
+				}  // not muls->potential3D
+			}
+		} // end of if not periodic
+
+		/////////////////////////////////////////////////////////////////////////////
+		// if the potential array is periodic:
 		else {
-			sum[0] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox[Znum].rpotential[iz][ix][iy]+
-				dx*aBox[Znum].rpotential[iz][ix+1][iy])+
-				dy*((1.0-dx)*aBox[Znum].rpotential[iz][ix][iy+1]+
-				dx*aBox[Znum].rpotential[iz][ix+1][iy+1]))+
-				dz*((1.0-dy)*((1.0-dx)*aBox[Znum].rpotential[iz+1][ix][iy]+
-				dx*aBox[Znum].rpotential[iz+1][ix+1][iy])+
-				dy*((1.0-dx)*aBox[Znum].rpotential[iz+1][ix][iy+1]+
-				dx*aBox[Znum].rpotential[iz+1][ix+1][iy+1]));
+
+
+			// printf("Z=%d (z=%d), iOffs: %d, %d (%g, %g) %g, %g, %g %g, atom: %g, %g\n",
+			//		atoms[iatom].Znum,iAtomZ,iOffsX,iOffsY,ddx,ddy,s11,s12,s21,s22,atomX,atomY);
+			////////////////////////////////////////////////////////////////////
+			// add code here!
+			if (muls->potential3D) {
+				iAtomZ = (int)floor(atomZ/muls->sliceThickness+0.5);
+				iax0 = iAtomX-iRadX;
+				iax1 = iAtomX+iRadX; 
+				iay0 = iAtomY-iRadY;
+				iay1 = iAtomY+iRadY;
+
+				// define range of sampling from atomZ-/+atomRadius
+				iaz0 = iAtomZ-iRadZ <  0 ? -iAtomZ : -iRadZ;
+				iaz1 = iAtomZ+iRadZ >= muls->slices ?  muls->slices-iAtomZ-1 : iRadZ;
+				// if (iatom < 2) printf("iatomZ: %d, %d cz=%g, %g: %d, %d\n",iAtomZ,iaz0,muls->sliceThickness,atomZ,(int)(-2.5-atomZ),(int)(atomZ+2.5));
+				// printf("%d: iatomZ: %d, %d cz=%g, %g\n",iatom,iAtomZ,iaz0,muls->sliceThickness,atomZ);
+				if ((iAtomZ+iaz0 <  muls->slices) && (iAtomZ+iaz1 >= 0)) {
+					// retrieve the pointer for this atom
+					atPotPtr = getAtomPotential3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut);
+#if USE_Q_POT_OFFSETS
+					// retrieve the pointer to the array of charge-dependent potential offset
+					// This function will return NULL; if the charge of this atom is zero:
+					atPotOffsPtr = getAtomPotentialOffset3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut,atoms[iatom].q);
+#endif // USE_Q_POT_OFFSETS
+					iOffsLimHi =	Nr*(Nz_lut-1);
+					iOffsLimLo = -Nr*(Nz_lut-1);
+					iOffsStep  = nzSub*Nr;
+
+					// Slices around the slice that this atom is located in must be affected by this atom:
+					// iaz must be relative to the first slice of the atom potential box.
+					for (iax=iax0; iax < iax1; iax++) {
+						ix = (iax+2*muls->potNx) % muls->potNx;
+						if ((ix < xLo) || (ix >= xHi)) continue;
+						potPtr = &(muls->trans[0][ix][(iay0+2*muls->potNy) % muls->potNy][0]);
+						// potPtr = &(muls->trans[iAtomZ-iaz0+iaz][iax][iay0][0]);
+						x2 = iax*dx - atomX;	x2 *= x2;
+						for (iay=iay0; iay < iay1; ) {
+							// printf("iax=%d, iay=%d\n",iax,iay); 
+							y2 = iay*dy - atomY;	y2 *= y2;
+							r = sqrt(x2+y2);
+							ddr = r/dr;
+							ir  = (int)floor(ddr);
+							// add in different slices, once r has been defined
+							if (ir < Nr-1) {
+								ddr = ddr-(double)ir;
+								ptr = potPtr;
+								layer = iAtomZ+iaz0-muls->sliceFirst;
+								// Include interpolation in z-direction as well (may do it in a very smart way here !):
+
+								dOffsZ = (iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub;
+#if Z_INTERPOLATION
+								iOffsZ = (int)dOffsZ;
+								ddz	 = fabs(dOffsZ - (double)iOffsZ);
+#else  // Z_INTERPOLATION
+								iOffsZ = (int)(dOffsZ+0.5);
+#endif  // Z_INTERPOLATION
+								iOffsZ *= Nr;
+
+								for (iaz=iaz0; iaz <= iaz1; iaz++) {
+									potVal = 0;
+									// iOffsZ = (int)(fabs(iAtomZ+iaz-atomZ/muls->sliceThickness)*nzSub+0.5);
+									if (iOffsZ < 0) {
+										if (iOffsZ > iOffsLimLo) {
+											// do the real part by linear interpolation in r-dimension:
+#if Z_INTERPOLATION
+											potVal = (1-ddz)*((1-ddr)*atPotPtr[ir-iOffsZ+Nr][0]+ddr*atPotPtr[ir+1-iOffsZ+Nr][0])+
+												ddz *((1-ddr)*atPotPtr[ir-iOffsZ	 ][0]+ddr*atPotPtr[ir+1-iOffsZ	 ][0]);
+#if USE_Q_POT_OFFSETS
+											// add the charge-dependent potential offset
+											if (atPotOffsPtr != NULL) {
+												potVal += atoms[iatom].q*((1-ddz)*((1-ddr)*atPotOffsPtr[ir-iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1-iOffsZ+Nr][0])+
+													ddz *((1-ddr)*atPotOffsPtr[ir-iOffsZ   ][0]+ddr*atPotOffsPtr[ir+1-iOffsZ   ][0]));		
+											}	
+#endif  // USE_Q_POT_OFFSETS
+#else  // Z_INTERPOLATION
+											potVal = (1-ddr)*atPotPtr[ir-iOffsZ+Nr][0]+ddr*atPotPtr[ir+1-iOffsZ+Nr][0];
+#if USE_Q_POT_OFFSETS
+											// add the charge-dependent potential offset
+											if (atPotOffsPtr != NULL) {
+												potVal += atoms[iatom].q*((1-ddr)*atPotOffsPtr[ir-iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1-iOffsZ+Nr][0]);
+											}	
+#endif  // USE_Q_POT_OFFSETS
+#endif  // Z_INTERPOLATION
+										}
+									}
+									else {
+										// select the pointer to the right layer in the lookup box
+										// printf("%4d: iOffsZ: %d, iaz: %d (slice: %d, pos: %g [%d .. %d])\n",iatom,iOffsZ,iaz,iAtomZ+iaz,atomZ,iaz0,iaz1);
+										if (iOffsZ < iOffsLimHi) {
+											// do the real part by linear interpolation in r-dimension:
+#if Z_INTERPOLATION
+											potVal = (1-ddz)*((1-ddr)*atPotPtr[ir+iOffsZ][0]+ddr*atPotPtr[ir+1+iOffsZ][0])+
+												ddz *((1-ddr)*atPotPtr[ir+iOffsZ+Nr][0]+ddr*atPotPtr[ir+1+iOffsZ+Nr][0]);
+#if USE_Q_POT_OFFSETS
+											// add the charge-dependent potential offset
+											if (atPotOffsPtr != NULL) {
+												potVal += atoms[iatom].q*((1-ddz)*((1-ddr)*atPotOffsPtr[ir+iOffsZ][0]+ddr*atPotOffsPtr[ir+1+iOffsZ][0])+
+													ddz *((1-ddr)*atPotOffsPtr[ir+iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1+iOffsZ+Nr][0]));
+											}
+#endif  // USE_Q_POT_OFFSETS
+#else  // Z_INTERPOLATION
+											potVal = (1-ddr)*atPotPtr[ir+iOffsZ][0]+ddr*atPotPtr[ir+1+iOffsZ][0];
+#if USE_Q_POT_OFFSETS
+											// add the charge-dependent potential offset
+											if (atPotOffsPtr != NULL) {
+												potVal += atoms[iatom].q*((1-ddr)*atPotOffsPtr[ir+iOffsZ][0]+ddr*atPotOffsPtr[ir+1+iOffsZ][0]);												
+											}
+#endif  // USE_Q_POT_OFFSETS
+#endif  // Z_INTERPOLATION
+										}
+									}
+									if ((layer >= 0) && (layer < muls->trans.Nz()))
+										ptr[(size_t)layer*sliceStep] += potVal;
+
+									layer++;  // advance to the next slice
+									// add the remaining potential to the next slice:
+									// if (iaz < iaz1)  *ptr += (1-ddz)*potVal;
+									iOffsZ += iOffsStep;
+								}
+							} // if ir < Nr-1
+							// advance pointer to next complex potential point:
+							potPtr+=2;
+							// make imaginary part zero for now
+							// *potPtr = 0;
+							// potPtr++;
+
+							// wrap around when end of y-line is reached:
+							if (++iay % muls->potNy == 0) potPtr -= 2*muls->potNy;		
+						}   
+					}
+				} // iaz0+iAtomZ < muls->slices
+			}  // muls->potential3D	
+			////////////////////////////////////////////////////////////////////
+			// 2D potential (periodic) calculation already seems to work!
+			else {
+				iAtomZ = (int)floor(atomZ/muls->sliceThickness);
+				iax0 = iAtomX-iRadX+2*muls->potNx;
+				iax1 = iAtomX+iRadX+2*muls->potNx; 
+				iay0 = iAtomY-iRadY+2*muls->potNy;
+				iay1 = iAtomY+iRadY+2*muls->potNy;
+
+				ddx = (-(double)iax0+(atomX/dx-(double)(iRadX-2*muls->potNx)))*(double)OVERSAMP_X;
+				ddy = (-(double)iay0+(atomY/dy-(double)(iRadY-2*muls->potNy)))*(double)OVERSAMP_X;
+				iOffsX = (int)floor(ddx);
+				iOffsY = (int)floor(ddy);
+				ddx -= (double)iOffsX;
+				ddy -= (double)iOffsY;
+				/*
+				s11 = (1-ddx)*(1-ddy);
+				s12 = (1-ddx)*ddy;
+				s21 = ddx*(1-ddy);
+				s22 = ddx*ddy;
+				*/									
+			    s22 = (1-ddx)*(1-ddy);
+				s21 = (1-ddx)*ddy;
+				s12 = ddx*(1-ddy);
+				s11 = ddx*ddy;
+
+				atPotPtr = getAtomPotential2D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw);
+				layer = windowLayer(muls,iAtomZ);
+
+				// if (iatom < 3) printf("atom #%d: ddx=%g, ddy=%g iatomZ=%d, atomZ=%g, %g\n",iatom,ddx,ddy,iAtomZ,atomZ,atoms[iatom].z);
+				for (iax=iax0; iax < iax1; iax++) {  // TODO: should use ix += OVERSAMP_X
+					if ((iax % muls->potNx < xLo) || (iax % muls->potNx >= xHi) || (layer < 0)) continue;
+					// printf("(%d, %d): %d,%d\n",iax,nyAtBox,(iOffsX+OVERSAMP_X*(iax-iax0)),iOffsY+iay1-iay0);
+					// potPtr and ptr are of type (float *)
+					//////////////////
+					// Only the exact slice that this atom is located in is affected by this atom:
+					int atPosX = (OVERSAMP_X*(iax-iax0)-iOffsX);
+					if ((atPosX >= 0) && (atPosX < nyAtBox-1)) {
+						ptr = &(atPotPtr[atPosX*nyAtBox-iOffsY][0]);
+					for (iay=iay0; iay < iay1; iay++) {
+						// wrap around when end of y-line is reached:
+							int atPosY = (iay-iay0)*OVERSAMP_X-iOffsY; 
+							if ((atPosY < nyAtBox-1) && (atPosY >=0)) {
+						// do the real part
+								muls->trans[layer][iax % muls->potNx][iay % muls->potNy][0] +=
+								     s11*(*ptr)+s12*(*(ptr+2))+s21*(*(ptr+nyAtBox2))+s22*(*(ptr+nyAtBox2+2));
+							}
+						// make imaginary part zero for now
+							// *potPtr = 0;  potPtr++;
+						ptr += 2*OVERSAMP_X;
+					}
+					} // if atPosX within limits
+				}   
+			}  // muls->potential3D	== 0
 		}
+		////////////////////////////////////////////////////////////////////
+	} /* end of if (fftpotential) */
+} // end of addAtomPotential
+
+/*****************************************************
+* initAtomPotentials()
+*
+* Creates the lookup tables that addAtomPotential() needs for
+* the atoms in atomList, before several threads use them.
+* The atoms are visited in the same order as when they are
+* added by a single thread, so the tables are the same.
+* For the real space lookup these are the atom boxes of all
+* the elements and Debye-Waller factors in atomList.
+****************************************************/
+static void initAtomPotentials(MULS *muls,int nlayer,atom *atoms,
+							   const std::vector<int> &atomList,const std::vector<real> &atomZList) {
+	boxAxes axes;
+	int i;
+
+	if (muls->fftpotential) {
+		// with an empty range of rows only the lookup tables are retrieved
+		for (i=0;i<(int)atomList.size();i++) 
+			addAtomPotential(muls,nlayer,atoms,atomList[i],atomZList[i],0,0,axes);
+		return;
 	}
-	else {
-		if (aBox[Znum].B > 0) {
-			sum[0] = (1.0-dy)*((1.0-dx)*aBox[Znum].potential[0][ix][iy][0]+
-				dx*aBox[Znum].potential[0][ix+1][iy][0])+
-				dy*((1.0-dx)*aBox[Znum].potential[0][ix][iy+1][0]+
-				dx*aBox[Znum].potential[0][ix+1][iy+1][0]);
-			sum[1] = (1.0-dy)*((1.0-dx)*aBox[Znum].potential[0][ix][iy][1]+
-				dx*aBox[Znum].potential[0][ix+1][iy][1])+
-				dy*((1.0-dx)*aBox[Znum].potential[0][ix][iy+1][1]+
-				dx*aBox[Znum].potential[0][ix+1][iy+1][1]);
+	for (i=0;i<(int)atomList.size();i++) 
+		getAtomBox(muls,atoms[atomList[i]].Znum,muls->tds ? 0 : atoms[atomList[i]].dw);
+}
+
+/*****************************************************
+* addAtomPotentials()
+*
+* Adds the potential of the atoms in atomList to muls->trans
+* ("potential threads:", 0: all).  The rows of trans are 
+* divided into tiles, and a cell list keeps the atoms whose 
+* potential reaches into each tile, i.e. the atoms within the
+* tile and a halo of atomRadius around it.  Each tile is filled
+* by one thread in the order of atomList, so the threads never
+* write the same pixel and the potential is exactly the same 
+* as with a single thread.
+****************************************************/
+static void addAtomPotentials(MULS *muls,int nlayer,atom *atoms,
+							  const std::vector<int> &atomList,const std::vector<real> &atomZList) {
+	std::vector<std::vector<int> > tileAtoms;
+	std::vector<boxAxes> axes;
+	int threads,tiles,tileRows,nx,natom,iRadX,iAtomX,ix,ix0,ix1,i,k,t;
+	real dx,atomX;
+
+	nx = muls->potNx;
+	natom = (int)atomList.size();
+	threads = (muls->potThreads > 0) ? muls->potThreads : omp_get_max_threads();
+	// the phonon batches build the next configurations while the other threads propagate:
+	if (omp_in_parallel()) threads = 1;
+	if (threads > 1) initAtomPotentials(muls,nlayer,atoms,atomList,atomZList);
+	axes.resize(threads);
+	if (threads <= 1) {
+		for (k=0;k<natom;k++) addAtomPotential(muls,nlayer,atoms,atomList[k],atomZList[k],0,nx,axes[0]);
+		return;
+	}
+
+	// a few tiles per thread, to balance the load:
+	tiles = (4*threads < nx) ? 4*threads : nx;
+	tileRows = (nx+tiles-1)/tiles;
+	tiles = (nx+tileRows-1)/tileRows;
+	tileAtoms.resize(tiles);
+
+	dx = muls->resolutionX;
+	iRadX = (int)ceil(muls->atomRadius/dx);
+	for (k=0;k<natom;k++) {
+		atomX = atoms[atomList[k]].x - muls->potOffsetX;
+		iAtomX = (int)floor(atomX/dx);
+		// the rows that this atom reaches, with a margin of one row:
+		ix0 = iAtomX-iRadX-1;
+		ix1 = iAtomX+iRadX+1;
+		if (muls->nonPeriod) {
+			if (ix0 < 0) ix0 = 0;
+			if (ix1 > nx-1) ix1 = nx-1;
 		}
-		else {
-			sum[0] = (1.0-dy)*((1.0-dx)*aBox[Znum].rpotential[0][ix][iy]+
-				dx*aBox[Znum].rpotential[0][ix+1][iy])+
-				dy*((1.0-dx)*aBox[Znum].rpotential[0][ix][iy+1]+
-				dx*aBox[Znum].rpotential[0][ix+1][iy+1]);
+		else if (ix1-ix0 >= nx) {
+			ix0 = 0;
+			ix1 = nx-1;
+		}
+		for (ix=ix0;ix<=ix1;) {
+			i = (ix % nx + nx) % nx;  // shift into the positive range
+			t = i/tileRows;
+			if (tileAtoms[t].empty() || (tileAtoms[t].back() != k)) tileAtoms[t].push_back(k);
+			// continue with the next tile, or at row 0 if the potential wraps around:
+			ix += (t*tileRows+tileRows < nx) ? t*tileRows+tileRows-i : nx-i;
 		}
 	}
-	(*vlu)[0] = sum[0];
-	(*vlu)[1] = sum[1];
+
+#pragma omp parallel for if(threads > 1) num_threads(threads) schedule(dynamic) private(i,ix0,ix1)
+	for (t=0;t<tiles;t++) {
+		ix0 = t*tileRows;
+		ix1 = (ix0+tileRows < nx) ? ix0+tileRows : nx;
+		for (i=0;i<(int)tileAtoms[t].size();i++)
+			addAtomPotential(muls,nlayer,atoms,atomList[tileAtoms[t][i]],atomZList[tileAtoms[t][i]],ix0,ix1,
+				axes[omp_get_thread_num()]);
+	}
+}
+
+/*****************************************************
+* The reciprocal space potential ("reciprocal potential: yes")
+*
+* The potential of a slice is the inverse fourier transform of 
+* sum_g P_g(|k|) S_g(k)/A, where S_g is the structure factor (see 
+* structure_factor.h) of the atoms of group g, i.e. of one element
+* and Debye-Waller factor, A the area of the slice and P_g the fourier
+* transform of the potential of one atom of the group.  For the 2D 
+* potential this is the scattering factor f(k/2)exp(-B k^2/4) (in the
+* units of createAtomBox()), for the 3D potential its integral over a
+* slice of thickness 2h at the distance Delta from the atom:
+* P(k,Delta) = 2 int_0^kzmax f(q/2) exp(-B q^2/4) 
+*              [sin(2 pi kz (Delta+h))-sin(2 pi kz (Delta-h))]/(2 pi kz) dkz,
+* q^2 = k^2+kz^2, tabulated for the levels Delta = d*cz/OVERSAMPLINGZ, 
+* d = 0 .. recipLevels-1 (up to atomRadius+h).  An atom is added to
+* the structure factors of the two levels next to its distance from a
+* slice, with linear weights.
+* The tables depend on the slices only, and are kept as long as these
+* do not change.
+****************************************************/
+typedef struct {
+	int Znum;
+	double B;
+	std::vector<float> P;  /* recipLevels x recipNk values, recipDk apart */
+} recipGroup;
+
+static std::vector<recipGroup> recipGroups;
+static std::vector<int> recipIndex;    /* table index of |k| of each pixel */
+static std::vector<float> recipFrac;   /* and the offset from it */
+static int recipNx=0,recipNy=0,recipNk,recipLevels,recip3D;
+static double recipDx,recipDy,recipDz,recipRadius,recipDk;
+
+/* one atom in the structure factor of group run/recipLevels, level run % recipLevels */
+typedef struct {
+	int run;
+	double x,y,w;
+} recipAtom;
+
+static bool recipAtomCompare(const recipAtom &a,const recipAtom &b) {
+	return a.run < b.run;
 }
 
+/* the group of element Znum and Debye-Waller factor B, whose table is made if needed */
+static int getRecipGroup(int Znum,double B) {
+	std::vector<double> splinb(N_SF),splinc(N_SF),splind(N_SF);
+	std::vector<double> fq,kern,F;
+	double qmax,dq,q,kz,dkz,h,delta,w;
+	int g,nq,nkz,ik,j,d;
+
+	for (g=0;g<(int)recipGroups.size();g++) 
+		if ((recipGroups[g].Znum == Znum) && (fabs(recipGroups[g].B-B) <= 1e-6)) return g;
+
+	if ((Znum < 1) || (Znum >= N_ELEM)) {
+		printf("getRecipGroup: no scattering factors for Z=%d - exit!\n",Znum);
+		exit(0);
+	}
+	recipGroups.resize(g+1);
+	recipGroups[g].Znum = Znum;
+	recipGroups[g].B = B;
+	recipGroups[g].P.assign(recipLevels*recipNk,0.0f);
+
+	/* f(q/2)exp(-B q^2/4), up to the last tabulated s.  The form factors
+	 * are those of scatPar, as in createAtomBox() and the fft potential, 
+	 * so that all three builders make the same potential.  fe3D() would 
+	 * need the parameter files read by ReadfeTable(), and sfLUT() only 
+	 * has the atom kinds of the custom CBED slices. */
+	splinh(scatPar[0],scatPar[Znum],&splinb[0],&splinc[0],&splind[0],N_SF);
+	qmax = 2.0*scatPar[0][N_SF-4];
+	dq = 0.002;
+	nq = (int)(qmax/dq)+1;
+	fq.resize(nq+1);
+	for (j=0;j<=nq;j++) {
+		q = (double)j*dq;
+		fq[j] = (q > qmax) ? 0.0 : 
+			seval(scatPar[0],scatPar[Znum],&splinb[0],&splinc[0],&splind[0],N_SF,0.5*q)*exp(-0.25*B*q*q);
+	}
+	if (!recip3D) {
+		for (ik=0;ik<recipNk;ik++) 
+			recipGroups[g].P[ik] = (float)tableValue(fq,dq,(double)ik*recipDk);
+		return g;
+	}
+
+	/* Simpson's rule in kz: P(k,Delta_d) = sum_j kern[d][j]*F[k][j] */
+	nkz = 2*(int)ceil(qmax/0.01);
+	dkz = qmax/(double)nkz;
+	h = 0.5*recipDz*(double)OVERSAMPLINGZ;
+	kern.resize(recipLevels*(nkz+1));
+	for (d=0;d<recipLevels;d++) {
+		delta = (double)d*recipDz;
+		for (j=0;j<=nkz;j++) {
+			kz = (double)j*dkz;
+			w = ((j == 0) || (j == nkz) ? 1.0 : (j % 2 ? 4.0 : 2.0))*dkz/3.0;
+			kern[d*(nkz+1)+j] = (j == 0) ? w*4.0*h :
+				w*(sin(2.0*PI*kz*(delta+h))-sin(2.0*PI*kz*(delta-h)))/(PI*kz);
+		}
+	}
+	F.resize(nkz+1);
+	for (ik=0;ik<recipNk;ik++) {
+		q = (double)ik*recipDk;
+		for (j=0;j<=nkz;j++) {
+			kz = (double)j*dkz;
+			F[j] = tableValue(fq,dq,sqrt(q*q+kz*kz));
+		}
+		for (d=0;d<recipLevels;d++) {
+			for (w=0,j=0;j<=nkz;j++) w += kern[d*(nkz+1)+j]*F[j];
+			recipGroups[g].P[d*recipNk+ik] = (float)w;
+		}
+	}
+	return g;
+}
 
+/* the smallest size >= n without prime factors above 7, which FFTW transforms fastest */
+static int recipFFTSize(int n) {
+	int m;
+
+	for (;;n++) {
+		for (m=n;m % 2 == 0;m /= 2);
+		for (;m % 3 == 0;m /= 3);
+		for (;m % 5 == 0;m /= 5);
+		for (;m % 7 == 0;m /= 7);
+		if (m == 1) return n;
+	}
+}
+
+/*****************************************************
+* addAtomPotentialsRecip()
+*
+* Adds the potential of the atoms in atomList to muls->trans
+* in reciprocal space (see above), with the slices placed as 
+* for the fft potential: slice iz is at the distance atomZ-(iz-1)*cz
+* from an atom, the 2D potential of an atom is only added to slice 
+* floor(atomZ/cz).  A potential that is not periodic in x and y
+* (nonPeriod) is made in a larger array with a margin of at least 
+* atomRadius, from the atoms within that margin.  Each slice is made by 
+* one thread ("potential threads:", 0: all) in the same order,
+* so the potential does not depend on the number of threads.
+****************************************************/
+static void addAtomPotentialsRecip(MULS *muls,int nlayer,atom *atoms,
+								   const std::vector<int> &atomList,const std::vector<real> &atomZList) {
+	std::vector<std::vector<recipAtom> > sliceAtoms(nlayer);
+	std::vector<StructureFactorPtr> sf;
+	std::vector<fftwf_complex *> sums;
+	fftwf_plan plan;
+	recipAtom a;
+	double dz,reach,u,kx,ky,k,area;
+	int threads,nx,ny,nz,px,py,ix,iy,iz,iz0,iz1,i,t,g,d;
+
+	// the margin, and the size of the array with it
+	px = muls->nonPeriod ? (int)ceil(muls->atomRadius/muls->resolutionX) : 0;
+	py = muls->nonPeriod ? (int)ceil(muls->atomRadius/muls->resolutionY) : 0;
+	nx = muls->nonPeriod ? recipFFTSize(muls->potNx+2*px) : muls->potNx;
+	ny = muls->nonPeriod ? recipFFTSize(muls->potNy+2*py) : muls->potNy;
+	dz = muls->sliceThickness;
+	if ((nx != recipNx) || (ny != recipNy) || (muls->resolutionX != recipDx) || (muls->resolutionY != recipDy) ||
+		(dz/(double)OVERSAMPLINGZ != recipDz) || (muls->atomRadius != recipRadius) || (muls->potential3D != recip3D)) {
+		recipNx = nx;
+		recipNy = ny;
+		recipDx = muls->resolutionX;
+		recipDy = muls->resolutionY;
+		recipDz = dz/(double)OVERSAMPLINGZ;
+		recipRadius = muls->atomRadius;
+		recip3D = muls->potential3D;
+		recipLevels = recip3D ? (int)ceil((recipRadius+0.5*dz)/recipDz)+1 : 1;
+		recipDk = 0.01;
+		recipIndex.resize(nx*ny);
+		recipFrac.resize(nx*ny);
+		for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
+			kx = (double)((ix > nx/2) ? ix-nx : ix)/((double)nx*recipDx);
+			ky = (double)((iy > ny/2) ? iy-ny : iy)/((double)ny*recipDy);
+			k = sqrt(kx*kx+ky*ky)/recipDk;
+			recipIndex[ix*ny+iy] = (int)k;
+			recipFrac[ix*ny+iy] = (float)(k-(double)(int)k);
+		}
+		recipNk = *std::max_element(recipIndex.begin(),recipIndex.end())+2;
+		recipGroups.clear();
+	}
+	/* sort the atoms into the slices they reach */
+	reach = muls->atomRadius+0.5*dz;
+	for (i=0;i<(int)atomList.size();i++) {
+		a.x = atoms[atomList[i]].x-muls->potOffsetX+(double)px*muls->resolutionX;
+		a.y = atoms[atomList[i]].y-muls->potOffsetY+(double)py*muls->resolutionY;
+		if (muls->nonPeriod && ((a.x < 0) || (a.x > (double)nx*muls->resolutionX) || 
+			(a.y < 0) || (a.y > (double)ny*muls->resolutionY))) continue;
+		g = getRecipGroup(atoms[atomList[i]].Znum,muls->tds ? 0 : atoms[atomList[i]].dw);
+		if (!recip3D) {
+			iz = (int)floor(atomZList[i]/dz);
+			if (muls->nonPeriodZ && ((iz < 0) || (iz >= nlayer))) continue;
+			a.run = g;
+			a.w = 1.0;
+			sliceAtoms[(iz % nlayer + nlayer) % nlayer].push_back(a);
+			continue;
+		}
+		iz0 = (int)ceil((atomZList[i]-reach)/dz)+1;
+		iz1 = (int)floor((atomZList[i]+reach)/dz)+1;
+		for (iz=iz0;iz<=iz1;iz++) {
+			if (muls->nonPeriodZ && ((iz < 0) || (iz >= nlayer))) continue;
+			u = fabs(atomZList[i]-(double)(iz-1)*dz)/recipDz;
+			d = (int)u;
+			if (d >= recipLevels) continue;
+			a.run = g*recipLevels+d;
+			a.w = 1.0-(u-(double)d);
+			sliceAtoms[(iz % nlayer + nlayer) % nlayer].push_back(a);
+			if (d+1 < recipLevels) {
+				a.run++;
+				a.w = u-(double)d;
+				sliceAtoms[(iz % nlayer + nlayer) % nlayer].push_back(a);
+			}
+		}
+	}
+
+	// the slices that muls->trans holds (see windowLayer()):
+	nz = muls->trans.Nz();
+	threads = (muls->potThreads > 0) ? muls->potThreads : omp_get_max_threads();
+	// the phonon batches build the next configurations while the other threads propagate:
+	if (omp_in_parallel()) threads = 1;
+	if (threads > nz) threads = nz;
+	// the FFT plans must be made here, outside of the parallel region.  
+	// Every thread transforms its own slices, with a plan of one thread.
+	for (t=0;t<threads;t++) {
+		sf.push_back(StructureFactorPtr(new StructureFactor(nx,ny,muls->resolutionX,muls->resolutionY)));
+		sums.push_back((fftwf_complex *)fftwf_malloc(nx*ny*sizeof(fftwf_complex)));
+	}
+	plan = getFFTPlanf(nx,ny,1,FFTW_BACKWARD,sums[0],1);
+	area = (double)nx*muls->resolutionX*(double)ny*muls->resolutionY;
+
+#pragma omp parallel for num_threads(threads) schedule(dynamic) private(t,i,ix,iy)
+	for (iz=0;iz<nz;iz++) {
+		if (iz+muls->sliceFirst >= nlayer) continue;
+		std::vector<recipAtom> &list = sliceAtoms[iz+muls->sliceFirst];
+		const fftwf_complex *s;
+		const float *P;
+		fftwf_complex *sum;
+		float v;
+		int run;
+
+		t = omp_get_thread_num();
+		sum = sums[t];
+		memset(sum,0,nx*ny*sizeof(fftwf_complex));
+		std::stable_sort(list.begin(),list.end(),recipAtomCompare);
+		for (i=0;i<(int)list.size();) {
+			run = list[i].run;
+			sf[t]->Clear();
+			for (;(i<(int)list.size()) && (list[i].run == run);i++) sf[t]->Add(list[i].x,list[i].y,list[i].w);
+			s = sf[t]->Transform();
+			P = &recipGroups[run/recipLevels].P[(run % recipLevels)*recipNk];
+			for (ix=0;ix<nx*ny;ix++) {
+				v = P[recipIndex[ix]]+recipFrac[ix]*(P[recipIndex[ix]+1]-P[recipIndex[ix]]);
+				sum[ix][0] += v*s[ix][0];
+				sum[ix][1] += v*s[ix][1];
+			}
+		}
+		fftwf_execute_dft(plan,sum,sum);
+		for (ix=0;ix<muls->potNx;ix++) for (iy=0;iy<muls->potNy;iy++)
+			muls->trans[iz][ix][iy][0] += (float)(sum[(ix+px)*ny+iy+py][0]/area);
+	}
+
+	for (t=0;t<threads;t++) fftwf_free(sums[t]);
+}
 
 /*****************************************************
 * void make3DSlices()
@@ -382,67 +1403,24 @@ void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,doubl
 ****************************************************/
 void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	// FILE *fpu2;
-	char fileOut[512]; // RAM: this is terrible, why is fileName a function argument and here we have filename?  FIXED: rename function argument to fileIn and this to fileOut
-	int natom,iatom,iz;  /* number of atoms */
+	int natom;  /* number of atoms */
 	atom *atoms;
 	real dx,dy,dz;
-	real c,atomX,atomY,atomZ;
-	int i=0,j,nx,ny,ix,iy,iax,iay,iaz,sliceStep;
-	int iAtomX,iAtomY,iAtomZ,iRadX,iRadY,iRadZ,iRad2;
-	int iax0,iax1,iay0,iay1,iaz0,iaz1,nyAtBox,nyAtBox2,nxyAtBox,nxyAtBox2,iOffsX,iOffsY,iOffsZ;
-	int nzSub,Nr,ir,Nz_lut;
-	int iOffsLimHi,iOffsLimLo,iOffsStep;
+	real c;
+	int i=0,nx,ny;
+	int divCount;
 
 	real *slicePos;
-	double z,x,y,r,ddx,ddy,ddr,dr,r2sqr,x2,y2,potVal,dOffsZ;
 	// char *sliceFile = "slices.dat";
 	char buf[BUF_LEN];
 	FILE *sliceFp;
 	real minX,maxX,minY,maxY,minZ,maxZ;
-	double atomRadius2;
-	time_t time0,time1;
-	float s11,s12,s21,s22;
-	fftwf_complex	*atPotPtr;
-	float *potPtr=NULL, *ptr;
-	static int divCount = 0;
-	static real **tempPot = NULL;
-#if FLOAT_PRECISION == 1
-	static fftwf_complex ***oldTrans = NULL;
-	static fftwf_complex ***oldTrans0 = NULL;
-#else
-	static fftw_complex ***oldTrans = NULL;
-	static fftw_complex ***oldTrans0 = NULL;
-#endif
-	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls->potNx,muls->potNy,
-				muls->sliceThickness,muls->resolutionX,muls->resolutionY));
-	fftw_complex dPot;
-#if Z_INTERPOLATION
-	double ddz;
-#endif
-#if USE_Q_POT_OFFSETS
-	fftwf_complex	*atPotOffsPtr;
-#endif
 
-	if (muls->trans == NULL) {
+	if (muls->trans.Empty()) {
 		printf("Severe error: trans-array not allocated - exit!\n");
 		exit(0);
 	}
 
-	if (oldTrans0 == NULL) {
-#if FLOAT_PRECISION == 1
-		oldTrans0 = (fftwf_complex ***)fftw_malloc(nlayer * sizeof(fftwf_complex**));
-#else
-		oldTrans0 = (fftw_complex ***)fftw_malloc(nlayer * sizeof(fftw_complex**));
-#endif
-		for (i=0;i<nlayer;i++) {
-			// printf("%d %d\n",i,(int)(muls->trans));
-			oldTrans0[i] = muls->trans[i]; 
-		}
-		oldTrans = muls->trans;
-	}
-	if (oldTrans != muls->trans)
-		printf("Warning: Transmission function pointer has changed!\n");
-
 	/* return, if there is nothing to do */
 	if (nlayer <1)
 		return;
@@ -455,17 +1433,18 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	/* we need to keep track of which subdivision of the unit cell we are in
 	* If the cell is not subdivided, then muls.cellDiv-1 = 0.
 	*/
-	if ((divCount == 0) || (muls->equalDivs))
-		divCount = muls->cellDiv;
-	divCount--;
+	if ((muls->divCount == 0) || (muls->equalDivs))
+		muls->divCount = muls->cellDiv;
+	muls->divCount--;
+	divCount = muls->divCount;
 
 	/* we only want to reread and shake the atoms, if we have finished the 
 	* current unit cell.
 	*/
 	if (divCount == muls->cellDiv-1) {
-		if (muls->avgCount == 0) {
+		if ((muls->avgCount == 0) || muls->keepAtoms) {
 			// if this is the first run, the atoms have already been
-			// read during initialization
+			// read during initialization (or restored from a checkpoint)
 			natom = (*muls).natom;
 			atoms = (*muls).atoms;
 		}
@@ -543,13 +1522,14 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 		if ((*muls).cfgFile != NULL) 
 		{
 			sprintf(buf,"%s/%s",muls->folder,muls->cfgFile);
-			// append the TDS run number
+			// append the TDS run number (phonon group g does the runs g, g+phononGroups, ...)
 			if (strcmp(buf+strlen(buf)-4,".cfg") == 0) *(buf+strlen(buf)-4) = '\0';
-			if (muls->tds) sprintf(buf+strlen(buf),"_%d.cfg",muls->avgCount);
+			if (muls->tds) sprintf(buf+strlen(buf),"_%d.cfg",muls->phononGroup+muls->avgCount*muls->phononGroups);
 			else sprintf(buf+strlen(buf),".cfg");
 		
 			// printf("Will write CFG file <%s> (%d)\n",buf,muls->tds)
-			writeCFG(atoms,natom,buf,muls);
+			// the other MPI processes of a phonon group have the same atoms
+			if (muls->rowRank == 0) writeCFG(atoms,natom,buf,muls);
 
 			if (muls->readPotential) 
 			{
@@ -573,12 +1553,6 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	c = muls->sliceThickness * muls->slices;
 	dx = (*muls).resolutionX;
 	dy = (*muls).resolutionY;
-	dr   = muls->resolutionX/OVERSAMP_X;  // define step width in which radial V(r,z) is defined 
-	iRadX = (int)ceil((*muls).atomRadius/dx);
-	iRadY = (int)ceil((*muls).atomRadius/dy);
-	iRadZ = (int)ceil((*muls).atomRadius/muls->sliceThickness);
-	iRad2 = iRadX*iRadX+iRadY*iRadY;
-	atomRadius2 = (*muls).atomRadius * (*muls).atomRadius;
 
 	if (muls->printLevel >= 3) {
 		printf("Slab thickness: %gA z-offset: %gA (cellDiv=%d)\n",
@@ -587,686 +1561,196 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	/*******************************************************
 	* initializing slicPos, cz, and transr
 	*************************************************************/
-	if (oldTrans0[0] != muls->trans[0]) {
-		printf("Warning: transmision array pointers have changed!\n");
-		for (i=0;i<nlayer;i++)
-			muls->trans[i] = oldTrans0[i];
-	}
-	/*
-	if (oldTrans0[0][0] != muls->trans[0][0]) {
-	printf("Warning: transmision array pointers have changed!\n");
-	for (i=0;i<nlayer;i++)
-	muls->trans[i] = oldTrans0[i];
-	}
-	*/
 	if ((*muls).cz == NULL) {
 		(*muls).cz = float1D(nlayer,"cz");
 	}
 	// sliceFp = fopen(sliceFile,"r");
 	sliceFp = NULL;
-	slicePos = float1D(nlayer,"slicePos");
-
-
-	if (muls->sliceThickness == 0)
-		(*muls).cz[0] = c/(real)nlayer;
-	else
-		(*muls).cz[0] = muls->sliceThickness;
-	slicePos[0] = (*muls).czOffset;  
-	/*
-	************************************************************/
-
-
-	for (i=1;i<nlayer;i++) {
-		if (sliceFp == NULL) (*muls).cz[i] = (*muls).cz[0];  
-		/* don't need to all be the same, yes they do for fast 3D-FFT method! */
-		else {
-			fgets(buf,BUF_LEN,sliceFp);
-			(*muls).cz[i] = atof(buf);
-		}
-		slicePos[i] = slicePos[i-1]+(*muls).cz[i-1]/2.0+(*muls).cz[i]/2.0;
-	}
-
-	memset(muls->trans[0][0],0,nlayer*nx*ny*sizeof(fftwf_complex));
-	/* check whether we have constant slice thickness */
-
-	if (muls->fftpotential) {
-		for (i = 0;i<nlayer;i++)  if ((*muls).cz[0] != (*muls).cz[i]) break;
-		if (i<nlayer) printf("Warning: slice thickness not constant, will give wrong results (iz=%d)!\n",i);
-
-	}
-
-	/*************************************************************************
-	* read the potential that has been created externally!
-	*/
-	if (muls->readPotential) {
-		for (i=(divCount+1)*muls->slices-1,j=0;i>=(divCount)*muls->slices;i--,j++) {
-			sprintf(buf,"%s/potential_%d.img",muls->folder,i);
-			imageIO->ReadImage((void **)tempPot,nx,ny,buf);
-			for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
-				(*muls).trans[j][ix][iy][0] = tempPot[ix][iy];
-				(*muls).trans[j][ix][iy][1] = 0.0;
-			}
-		}
-		return;
-	}
-
-	// reset the potential to zero:  
-#if FLOAT_PRECISION == 1
-	memset((void *)&(muls->trans[0][0][0][0]),0,
-		muls->slices*muls->potNx*muls->potNy*sizeof(fftwf_complex));
-#else
-	memset((void *)&(muls->trans[0][0][0][0]),0,
-		muls->slices*muls->potNx*muls->potNy*sizeof(fftw_complex));
-#endif
-	nyAtBox   = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
-	nxyAtBox  = nyAtBox*(2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX));
-	nyAtBox2  = 2*nyAtBox;
-	nxyAtBox2 = 2*nxyAtBox;
-	sliceStep = 2*muls->potNx*muls->potNy;
-
-	/*
-	for (i=0;i<nlayer;i++)
-	printf("slice center: %g width: %g\n",slicePos[i],(*muls).cz[i]);
-	*/ 
-
-	/****************************************************************
-	* Loop through all the atoms and add their potential 
-	* to the slices:									 
-	***************************************************************/
-
-	time(&time0);
-	for (iatom = 0;iatom<natom;iatom++) {
-		// make sure we skip vacancies:
-		while (atoms[iatom].Znum == 0) iatom++;
-		if (iatom >=natom) break;
-
-		if ((muls->printLevel >= 4) && (muls->displayPotCalcInterval > 0)) {
-			if (((iatom+1) % (muls->displayPotCalcInterval)) == 0) {
-				printf("Adding potential for atom %d (Z=%d, pos=[%.1f, %.1f, %.1f])\n",iatom+1,atoms[iatom].Znum,atoms[iatom].x,atoms[iatom].y,atoms[iatom].z);
-			}
-		}
-		// printf("c=%g, slice thickness=%g, slices=%d, %d\n",c,muls->sliceThickness,muls->slices,muls->displayPotCalcInterval);
-		/*
-		* c = the thickness of the current slab.
-		*
-		* if the z-position of this atom is outside the potential slab
-		* we won't consider it and skip to the next
-		*/
-		/* cellDiv = number of times that the big super cell is divided into
-		* less big ones, yet often still bigger than a single unit cell
-		* (for saving memory)
-		* divCount = counter of how many such semi-super cells we already 
-		* passed through.
-		* c = height in A of one such semi-super cell.
-		* Since cellDiv is always >=1, and divCount starts at 0, the actual position
-		* of this atom with the super cell is given by:
-		*/
-		/* c*(real)((*muls).cellDiv-divCount-1) will pick the right super-cell
-		* division in the big super-cell
-		* The z-offset 0.5*cz[0] will position atoms at z=0 into the middle of the first 
-		* slice.
-		*/
-		atomZ = atoms[iatom].z-c*(real)(muls->cellDiv-divCount-1) + muls->czOffset 
-			-(0.5*muls->sliceThickness*(1-muls->centerSlices));
-		// make sure that slices are centered for 2D and 3D differently:
-		if (muls->potential3D==0)	atomZ += 0.5*muls->sliceThickness;
-		else atomZ -= muls->sliceThickness;
-
-		/* Now we need to find the first atom that contributes to this slice */
-		/* Make use of the fact that we sorted the atoms in z */
-		if ((*muls).nonPeriodZ) {
-			if (((*muls).potential3D) && (atomZ -(*muls).atomRadius > c)) break;	 
-			if (((*muls).potential3D==0) && (atomZ > c)) break;		
-			do {
-				// printf("z: %g c: %g\n",atomZ,c);
-				if (((*muls).potential3D) && (atomZ+(*muls).atomRadius+muls->sliceThickness >=0)) break;
-				if (((*muls).potential3D==0) && (atomZ >=0)) break;			  
-				// atomZ = atoms[++iatom].z-c*(real)((*muls).cellDiv-divCount-1)+ (0.5*(*muls).cz[0]*muls->centerSlices);	
-				atomZ = atoms[++iatom].z-c*(real)(muls->cellDiv-divCount-1) + muls->czOffset 
-					-(0.5*muls->sliceThickness*(1-muls->centerSlices));
-				if (muls->potential3D==0)	atomZ += 0.5*muls->sliceThickness;
-				else atomZ -= muls->sliceThickness;
-			}
-			while (iatom < natom-1);
-		}
-		/* atom coordinates in cartesian coords
-		* The x- and y-position will be offset by the starting point
-		* of the actually needed array of projected potential
-		*/
-		atomX = atoms[iatom].x -(*muls).potOffsetX;
-		atomY = atoms[iatom].y -(*muls).potOffsetY;
-
-		/* so far we need periodicity in z-direction.
-		* This requirement can later be removed, if we 
-		* use some sort of residue slice which will contain the 
-		* proj. potential that we need to add to the first slice of
-		* the next stack of slices
-		*	
-		* 
-		*/
-
-		/*************************************************************
-		* real space potential lookup table summation
-		************************************************************/
-		if (!muls->fftpotential) {
-			/* Warning: will assume constant slice thickness ! */
-			/* do not round here: atomX=0..dx -> iAtomX=0 */
-			/*
-			iAtomX = (int)(atomX/dx);	
-			if (atomX/dx < (float)iAtomX) iAtomX--; // in case iAtomX is negative
-			iAtomY = (int)(atomY/dy);
-			if (atomY/dy < (float)iAtomY) iAtomY--;
-			iAtomZ = (int)(atomZ/(*muls).cz[0]);
-			if (atomZ/(*muls).cz[0] < (float)iAtomZ) iAtomZ--;
-			*/
-			iAtomX = (int)floor(atomX/dx);  
-			iAtomY = (int)floor(atomY/dy);
-			iAtomZ = (int)floor(atomZ/muls->cz[0]);
-
-			// printf("atomZ(%d)=%g(%d)\t",iatom,atomZ,iAtomZ);
-
-			if (muls->displayPotCalcInterval > 0) {
-				if ((muls->printLevel>=3) && ((iatom+1) % muls->displayPotCalcInterval == 0)) {
-					printf("adding atom %d [%.3f %.3f %.3f (%.3f)], Z=%d\n",
-						iatom+1,atomX+(*muls).potOffsetX,atomY+(*muls).potOffsetY,
-						atoms[iatom].z,atomZ,atoms[iatom].Znum);
-					/*    (*muls).ax,(*muls).by,(*muls).potOffsetX,(*muls).potOffsetY); */
-				}
-			}
-
-			for (iax = -iRadX;iax<=iRadX;iax++) {
-				if ((*muls).nonPeriod) {
-					if (iax+iAtomX < 0) {
-						iax = -iAtomX;
-						if (abs(iax)>iRadX) break;
-					} 
-					if (iax+iAtomX >= nx)	break;
-				}
-				x = (double)(iAtomX+iax)*dx-atomX;
-				ix = (iax+iAtomX+16*nx) % nx;	/* shift into the positive range */
-				for (iay=-iRadY;iay<=iRadY;iay++) {
-					if ((*muls).nonPeriod) {
-						if (iay+iAtomY < 0) {
-							iay = -iAtomY;
-							if (abs(iay)>iRadY) break;
-						} 
-						if (iay+iAtomY >= ny)	break;
-					}
-					y = (double)(iAtomY+iay)*dy-atomY;
-					iy = (iay+iAtomY+16*ny) % ny;	  /* shift into the positive range */
-					r2sqr = x*x + y*y;
-
-					if (r2sqr <= atomRadius2) {
-
-						if (muls->potential3D) {
-							/* calculate the range which we have left to cover with z-variation */
-							/* iRadZ is the number of slices (rounded up) that this atom
-							* will contribute to, given its current x,y-radius
-							*/ 
-							iRadZ = (int)(sqrt(atomRadius2-r2sqr)/(*muls).cz[0]+1.0);
-							/* loop through the slices that this atoms contributes to */
-							for (iaz=-iRadZ;iaz <=iRadZ;iaz++) {
-								if ((*muls).nonPeriodZ) {
-									if (iaz+iAtomZ < 0)  {
-										if (-iAtomZ <= iRadZ) iaz = -iAtomZ;
-										else break;
-										if (abs(iaz)>nlayer) break;
-									} 
-									if (iaz+iAtomZ >= nlayer)	break;
-								}
-								z = (double)(iAtomZ+iaz+0.5)*(*muls).cz[0]-atomZ;
-								/* shift into the positive range */
-								iz = (iaz+iAtomZ+32*nlayer) % nlayer;	  
-								/* x,y,z is the true vector from the atom center
-								* We can look up the proj potential at that spot
-								* using trilinear extrapolation.
-								*/
-								atomBoxLookUp(&dPot,muls,atoms[iatom].Znum,x,y,z,
-									muls->tds ? 0 : atoms[iatom].dw);
-								//    printf("access: %d %d %d\n",iz,ix,iy);
-								muls->trans[iz][ix][iy][0] += dPot[0];
-								muls->trans[iz][ix][iy][1] += dPot[1]; 	
-							} /* end of for iaz=-iRadZ .. iRadZ */
-						} /* end of if potential3D */
-
-						/********************************************************************/ 
-
-						else { /* if 2D potential */
-							if ((*muls).nonPeriodZ) {
-								if (iAtomZ < 0)  break;			
-								if (iAtomZ >= nlayer)	break;	
-							}		 
-							iz = (iAtomZ+32*nlayer) % nlayer;	  /* shift into the positive range */
-							atomBoxLookUp(&dPot,muls,atoms[iatom].Znum,x,y,0,
-								muls->tds ? 0 : atoms[iatom].dw);
-							z = (double)(iAtomZ+1)*(*muls).cz[0]-atomZ;
-
-							/* 
-							printf("iz=%d,%d, z=%g, atomZ=%g(%g), iAtomZ=%d, c=%g (%d, %d))\n",
-							iz,iatom,z,atomZ,atoms[iatom].z,iAtomZ,c, divCount,(*muls).cellDiv);
-							*/
-							/* split the atom if it is close to the top edge of the slice */
-							//    printf("access: %d %d %d\n",iz,ix,iy);
-							if ((z<0.15*(*muls).cz[0]) && (iz >0)) {
-								muls->trans[iz][ix][iy][0] += 0.5*dPot[0];
-								muls->trans[iz][ix][iy][1] += 0.5*dPot[1]; 
-								muls->trans[iz-1][ix][iy][0] += 0.5*dPot[0];
-								muls->trans[iz-1][ix][iy][1] += 0.5*dPot[1];			
-							}
-							/* split the atom if it is close to the bottom edge of the slice */
-							else {
-								if ((z>0.85*(*muls).cz[0]) && (iz < nlayer-1)) {
-									(*muls).trans[iz][ix][iy][0] += 0.5*dPot[0];
-									(*muls).trans[iz][ix][iy][1] += 0.5*dPot[1];	
-									(*muls).trans[iz+1][ix][iy][0] += 0.5*dPot[0];
-									(*muls).trans[iz+1][ix][iy][1] += 0.5*dPot[1]; 		
-								}
-								else {
-									(*muls).trans[iz][ix][iy][0] += dPot[0];
-									(*muls).trans[iz][ix][iy][1] += dPot[1];	
-								}
-							}
-							/*
-							if ((iatom % 100 == 0) && (fabs(x) <0.04) && (fabs(y) < 0.04))
-							printf("i: %d iz: %d atomZ: %g (%g)\n",iatom,iz,atomZ,z);
-							*/ 	  
-						}
-					}
-				}
-			}
-		}
-
-
-		/**************************************************************************
-		* Newer, even faster method based on FFT of tabulated scattering factors
-		**************************************************************************/ 
-		else {	/* fftpotential */
-			iAtomX = (int)floor(atomX/dx);	
-			iAtomY = (int)floor(atomY/dy);
-			if (muls->potential3D) atomZ+=muls->sliceThickness;  // why ??? !!!!!
-			// printf("%d: pos=[%d, %d, %.1f]\n",iatom,iAtomX,iAtomY,atomZ);
-			// atomZ is z-distance with respect to the start of the current stack of slices.
-			// ddz = atomZ-dz*iAtomZ;
-
-
-			/////////////////////////////////////////////////////////////////////////////
-			// if we need to cut away at the edges, i.e. non-periodic potential arrays:
-			if (muls->nonPeriod) {
-				if (muls->potential3D) {
-					iAtomZ = (int)floor(atomZ/muls->sliceThickness+0.5);
-					// printf("iAtomZ: %d\n",iAtomZ);
-
-					iax0 = iAtomX-iRadX <  0 ? 0 : iAtomX-iRadX;
-					iax1 = iAtomX+iRadX >= muls->potNx ? muls->potNx-1 : iAtomX+iRadX;
-					iay0 = iAtomY-iRadY <  0 ? 0 : iAtomY-iRadY;
-					iay1 = iAtomY+iRadY >= muls->potNy ? muls->potNy-1 : iAtomY+iRadY;
-					// if within the potential map range:
-					if ((iax0 <  muls->potNx) && (iax1 >= 0) && (iay0 <  muls->potNy) && (iay1 >= 0)) {
-
-
-						// define range of sampling from atomZ-/+atomRadius
-						iaz0 = iAtomZ-iRadZ <  0 ? -iAtomZ : -iRadZ;
-						iaz1 = iAtomZ+iRadZ >= muls->slices ?  muls->slices-iAtomZ-1 : iRadZ;
-						// iaz0 = 0;  iaz1 = 0;
-						// printf("iatomZ: %d, %d..%d cz=%g, %g (%d), dOffsZ=%g (%d)\n",iAtomZ,iaz0,iaz1,muls->sliceThickness,atomZ,(int)atomZ,(iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub,(int)(iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub+0.5);
-						if ((iAtomZ+iaz0 <	muls->slices) && (iAtomZ+iaz1 >= 0)) {
-							// retrieve the pointer for this atom
-							atPotPtr     = getAtomPotential3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut);
-#if USE_Q_POT_OFFSETS
-							// retrieve the pointer to the array of charge-dependent potential offset
-							// This function will return NULL; if the charge of this atom is zero:
-							atPotOffsPtr = getAtomPotentialOffset3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut,atoms[iatom].q);
-#endif // USE_Q_POT_OFFSETS
-							iOffsLimHi   =  Nr*(Nz_lut-1);
-							iOffsLimLo   = -Nr*(Nz_lut-1);
-							iOffsStep    = nzSub*Nr;
-
-							// Slices around the slice that this atom is located in must be affected by this atom:
-							// iaz must be relative to the first slice of the atom potential box.
-							for (iax=iax0; iax <= iax1; iax++) {
-								potPtr = &(muls->trans[iAtomZ+iaz0][iax][iay0][0]);
-								// potPtr = &(muls->trans[iAtomZ-iaz0+iaz][iax][iay0][0]);
-								// printf("access: %d %d %d (%d)\n",iAtomZ+iaz0,iax,iay0,(int)potPtr);							
-
-								//////////////////////////////////////////////////////////////////////
-								// Computation of Radius must be made faster by using pre-calculated ddx
-								// and LUT for sqrt:
-								// use of sqrt slows down from 120sec to 180 sec.
-								x2 = iax*dx - atomX;  x2 *= x2;
-								for (iay=iay0; iay <= iay1; iay++) {
-									// printf("iax=%d, iay=%d\n",iax,iay); 
-									y2 = iay*dy - atomY;  y2 *= y2;
-									r = sqrt(x2+y2);
-									// r = (x2+y2);
-									ddr = r/dr;
-									ir	= (int)floor(ddr);
-									// add in different slices, once r has been defined
-									if (ir < Nr-1) {
-										ddr = ddr-(double)ir;
-										ptr = potPtr;
-
-										dOffsZ = (iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub;
-#if Z_INTERPOLATION
-										iOffsZ = (int)dOffsZ;
-										ddz    = fabs(dOffsZ - (double)iOffsZ);
-#else
-										iOffsZ = (int)(dOffsZ+0.5);
-#endif
-										iOffsZ *= Nr;
-
-										for (iaz=iaz0; iaz <= iaz1; iaz++) {
-											potVal = 0;
-											// iOffsZ = (int)(fabs(iAtomZ+iaz-atomZ/muls->sliceThickness)*nzSub+0.5);
-											if (iOffsZ < 0) {
-												if (iOffsZ > iOffsLimLo) {
-													// do the real part by linear interpolation in r-dimension:
-#if Z_INTERPOLATION
-													potVal = (1-ddz)*((1-ddr)*atPotPtr[ir-iOffsZ+Nr][0]+ddr*atPotPtr[ir+1-iOffsZ+Nr][0])+
-														ddz *((1-ddr)*atPotPtr[ir-iOffsZ   ][0]+ddr*atPotPtr[ir+1-iOffsZ   ][0]);
-#if USE_Q_POT_OFFSETS
-													// add the charge-dependent potential offset
-													if (atPotOffsPtr != NULL) {
-														potVal += atoms[iatom].q*((1-ddz)*((1-ddr)*atPotOffsPtr[ir-iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1-iOffsZ+Nr][0])+
-															ddz *((1-ddr)*atPotOffsPtr[ir-iOffsZ   ][0]+ddr*atPotOffsPtr[ir+1-iOffsZ   ][0]));		
-													}	
-#endif  // USE_Q_POT_OFFSETS
-#else   // Z_INTERPOLATION
-													potVal = (1-ddr)*atPotPtr[ir-iOffsZ+Nr][0]+ddr*atPotPtr[ir+1-iOffsZ+Nr][0];
-#if USE_Q_POT_OFFSETS
-													// add the charge-dependent potential offset
-													if (atPotOffsPtr != NULL) {
-														potVal += atoms[iatom].q*((1-ddr)*atPotOffsPtr[ir-iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1-iOffsZ+Nr][0]);
-													}	
-#endif  // USE_Q_POT_OFFSETS
-#endif  // Z_INTERPOLATION
-													// if (r < dr) printf("%d: iaz=%d,pot=%g,ddr=%g, iOffsZ=%d\n",iatom,iaz,potVal,ddr,iOffsZ);												
-												}
-											} // if iOffZ < 0
-											else {
-												// select the pointer to the right layer in the lookup box
-												// printf("%4d: iOffsZ: %d, iaz: %d (slice: %d, pos: %g [%d .. %d])\n",iatom,iOffsZ,iaz,iAtomZ+iaz,atomZ,iaz0,iaz1);
-												if (iOffsZ < iOffsLimHi) {
-													// do the real part by linear interpolation in r-dimension:
-#if Z_INTERPOLATION
-													potVal = (1-ddz)*((1-ddr)*atPotPtr[ir+iOffsZ][0]+ddr*atPotPtr[ir+1+iOffsZ][0])+
-														ddz *((1-ddr)*atPotPtr[ir+iOffsZ+Nr][0]+ddr*atPotPtr[ir+1+iOffsZ+Nr][0]);
-#if USE_Q_POT_OFFSETS
-													// add the charge-dependent potential offset
-													if (atPotOffsPtr != NULL) {
-														potVal += atoms[iatom].q*((1-ddz)*((1-ddr)*atPotOffsPtr[ir+iOffsZ][0]+ddr*atPotOffsPtr[ir+1+iOffsZ][0])+
-															ddz *((1-ddr)*atPotOffsPtr[ir+iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1+iOffsZ+Nr][0]));
-													}
-#endif  // USE_Q_POT_OFFSETS
-#else   // Z_INTERPOLATION
-													potVal = (1-ddr)*atPotPtr[ir+iOffsZ][0]+ddr*atPotPtr[ir+1+iOffsZ][0];
-#if USE_Q_POT_OFFSETS
-													// add the charge-dependent potential offset
-													if (atPotOffsPtr != NULL) {
-														potVal += atoms[iatom].q*((1-ddr)*atPotOffsPtr[ir+iOffsZ][0]+ddr*atPotOffsPtr[ir+1+iOffsZ][0]);												
-													}
-#endif  // USE_Q_POT_OFFSETS
-#endif  // Z_INTERPOLATION
-													// if (r < dr) printf("%d: iaz=%d,pot=%g,ddr=%g, iOffsZ=%d\n",iatom,iaz,potVal,ddr,iOffsZ);
-
-												}
-											} // if iOffsZ >=0
-											*ptr += potVal;  // ptr = potPtr = muls->trans[...]
-
-											ptr  += sliceStep;	// advance to the next slice
-											// add the remaining potential to the next slice:
-											// if (iaz < iaz1)	*ptr += (1-ddz)*potVal;
-											iOffsZ += iOffsStep;
-										} // end of iaz-loop
-									} // if ir < Nr
-									// advance pointer to next complex potential point:
-									potPtr+=2;
-									// make imaginary part zero for now
-									// *potPtr = 0;
-									// potPtr++;
-
-									// wrap around when end of y-line is reached:
-									// if (++iay % muls->potNy == 0) potPtr -= 2*muls->potNy;		
-								} // iay=iay0 .. iay1	  
-							} // iax=iax0 .. iax1
-						} // iaz0+iAtomZ < muls->slices
-						// dOffsZ = (iAtomZ-atomZ/muls->sliceThickness)*nzSub;
-						// printf("%5d (%2d): iAtomZ=%2d, offsZ=%g, diff=%g, (%g)\n",
-						//	  iatom,atoms[iatom].Znum,iAtomZ,dOffsZ,dOffsZ - (int)(dOffsZ+0.5),iAtomZ-atomZ/muls->sliceThickness);
-					} // if within bounds	
-				}  // muls->potential3D and non-periodic in x-y
-				////////////////////////////////////////////////////////////////////
-				// 2D potential calculation already seems to work!
-				// However, the potential is calculated wrongly, it is not integrated 
-				// in z-direction.	This must be done in the potential slice initialization
-				// procedure.
-				else {
-					iAtomZ = (int)floor(atomZ/muls->sliceThickness);
-					iax0 = iAtomX-iRadX <  0 ? 0 : iAtomX-iRadX;
-					iax1 = iAtomX+iRadX >= muls->potNx ? muls->potNx-1 : iAtomX+iRadX;
-					iay0 = iAtomY-iRadY <  0 ? 0 : iAtomY-iRadY;
-					iay1 = iAtomY+iRadY >= muls->potNy ? muls->potNy-1 : iAtomY+iRadY;
-					// if within the potential map range:
-					if ((iax0 <  muls->potNx) && (iax1 >= 0) && (iay0 <  muls->potNy) && (iay1 >= 0)) {
-						ddx = (-(double)iax0+(atomX/dx-(double)iRadX))*(double)OVERSAMP_X;
-						ddy = (-(double)iay0+(atomY/dy-(double)iRadY))*(double)OVERSAMP_X;
-						iOffsX = (int)floor(ddx);
-						iOffsY = (int)floor(ddy);
-						ddx -= (double)iOffsX;
-						ddy -= (double)iOffsY;
-						s11 = (1-ddx)*(1-ddy);
-						s12 = (1-ddx)*ddy;
-						s21 = ddx*(1-ddy);
-						s22 = ddx*ddy;
-						atPotPtr = getAtomPotential2D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw);
-
-						for (iax=iax0; iax < iax1; iax++) {
-							// printf("(%d, %d): %d,%d\n",iax,nyAtBox,(iOffsX+OVERSAMP_X*(iax-iax0)),iOffsY+iay1-iay0);
-							// potPtr and ptr are of type (float *)
-							potPtr = &(muls->trans[iAtomZ][iax][iay0][0]);
-							ptr = &(atPotPtr[(iOffsX+OVERSAMP_X*(iax-iax0))*nyAtBox+iOffsY][0]);
-							for (iay=iay0; iay < iay1; iay++) {
-								*potPtr += s11*(*ptr)+s12*(*(ptr+2))+s21*(*(ptr+nyAtBox2))+s22*(*(ptr+nyAtBox2+2));
-
-								potPtr++;
-								// *potPtr = 0;
-								potPtr++;
-								ptr += 2*OVERSAMP_X;
-							}
-						}
-
-					}  // not muls->potential3D
-				}
-			} // end of if not periodic
-
-			/////////////////////////////////////////////////////////////////////////////
-			// if the potential array is periodic:
-			else {
-
-
-				// printf("Z=%d (z=%d), iOffs: %d, %d (%g, %g) %g, %g, %g %g, atom: %g, %g\n",
-				//		atoms[iatom].Znum,iAtomZ,iOffsX,iOffsY,ddx,ddy,s11,s12,s21,s22,atomX,atomY);
-				////////////////////////////////////////////////////////////////////
-				// add code here!
-				if (muls->potential3D) {
-					iAtomZ = (int)floor(atomZ/muls->sliceThickness+0.5);
-					iax0 = iAtomX-iRadX;
-					iax1 = iAtomX+iRadX; 
-					iay0 = iAtomY-iRadY;
-					iay1 = iAtomY+iRadY;
-
-					// define range of sampling from atomZ-/+atomRadius
-					iaz0 = iAtomZ-iRadZ <  0 ? -iAtomZ : -iRadZ;
-					iaz1 = iAtomZ+iRadZ >= muls->slices ?  muls->slices-iAtomZ-1 : iRadZ;
-					// if (iatom < 2) printf("iatomZ: %d, %d cz=%g, %g: %d, %d\n",iAtomZ,iaz0,muls->sliceThickness,atomZ,(int)(-2.5-atomZ),(int)(atomZ+2.5));
-					// printf("%d: iatomZ: %d, %d cz=%g, %g\n",iatom,iAtomZ,iaz0,muls->sliceThickness,atomZ);
-					if ((iAtomZ+iaz0 <  muls->slices) && (iAtomZ+iaz1 >= 0)) {
-						// retrieve the pointer for this atom
-						atPotPtr = getAtomPotential3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut);
-#if USE_Q_POT_OFFSETS
-						// retrieve the pointer to the array of charge-dependent potential offset
-						// This function will return NULL; if the charge of this atom is zero:
-						atPotOffsPtr = getAtomPotentialOffset3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut,atoms[iatom].q);
-#endif // USE_Q_POT_OFFSETS
-						iOffsLimHi =	Nr*(Nz_lut-1);
-						iOffsLimLo = -Nr*(Nz_lut-1);
-						iOffsStep  = nzSub*Nr;
-
-						// Slices around the slice that this atom is located in must be affected by this atom:
-						// iaz must be relative to the first slice of the atom potential box.
-						for (iax=iax0; iax < iax1; iax++) {
-							potPtr = &(muls->trans[iAtomZ+iaz0][(iax+2*muls->potNx) % muls->potNx][(iay0+2*muls->potNy) % muls->potNy][0]);
-							// potPtr = &(muls->trans[iAtomZ-iaz0+iaz][iax][iay0][0]);
-							x2 = iax*dx - atomX;	x2 *= x2;
-							for (iay=iay0; iay < iay1; ) {
-								// printf("iax=%d, iay=%d\n",iax,iay); 
-								y2 = iay*dy - atomY;	y2 *= y2;
-								r = sqrt(x2+y2);
-								ddr = r/dr;
-								ir  = (int)floor(ddr);
-								// add in different slices, once r has been defined
-								if (ir < Nr-1) {
-									ddr = ddr-(double)ir;
-									ptr = potPtr;
-									// Include interpolation in z-direction as well (may do it in a very smart way here !):
-
-									dOffsZ = (iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub;
-#if Z_INTERPOLATION
-									iOffsZ = (int)dOffsZ;
-									ddz	 = fabs(dOffsZ - (double)iOffsZ);
-#else  // Z_INTERPOLATION
-									iOffsZ = (int)(dOffsZ+0.5);
-#endif  // Z_INTERPOLATION
-									iOffsZ *= Nr;
-
-									for (iaz=iaz0; iaz <= iaz1; iaz++) {
-										potVal = 0;
-										// iOffsZ = (int)(fabs(iAtomZ+iaz-atomZ/muls->sliceThickness)*nzSub+0.5);
-										if (iOffsZ < 0) {
-											if (iOffsZ > iOffsLimLo) {
-												// do the real part by linear interpolation in r-dimension:
-#if Z_INTERPOLATION
-												potVal = (1-ddz)*((1-ddr)*atPotPtr[ir-iOffsZ+Nr][0]+ddr*atPotPtr[ir+1-iOffsZ+Nr][0])+
-													ddz *((1-ddr)*atPotPtr[ir-iOffsZ	 ][0]+ddr*atPotPtr[ir+1-iOffsZ	 ][0]);
-#if USE_Q_POT_OFFSETS
-												// add the charge-dependent potential offset
-												if (atPotOffsPtr != NULL) {
-													potVal += atoms[iatom].q*((1-ddz)*((1-ddr)*atPotOffsPtr[ir-iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1-iOffsZ+Nr][0])+
-														ddz *((1-ddr)*atPotOffsPtr[ir-iOffsZ   ][0]+ddr*atPotOffsPtr[ir+1-iOffsZ   ][0]));		
-												}	
-#endif  // USE_Q_POT_OFFSETS
-#else  // Z_INTERPOLATION
-												potVal = (1-ddr)*atPotPtr[ir-iOffsZ+Nr][0]+ddr*atPotPtr[ir+1-iOffsZ+Nr][0];
-#if USE_Q_POT_OFFSETS
-												// add the charge-dependent potential offset
-												if (atPotOffsPtr != NULL) {
-													potVal += atoms[iatom].q*((1-ddr)*atPotOffsPtr[ir-iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1-iOffsZ+Nr][0]);
-												}	
-#endif  // USE_Q_POT_OFFSETS
-#endif  // Z_INTERPOLATION
-											}
-										}
-										else {
-											// select the pointer to the right layer in the lookup box
-											// printf("%4d: iOffsZ: %d, iaz: %d (slice: %d, pos: %g [%d .. %d])\n",iatom,iOffsZ,iaz,iAtomZ+iaz,atomZ,iaz0,iaz1);
-											if (iOffsZ < iOffsLimHi) {
-												// do the real part by linear interpolation in r-dimension:
-#if Z_INTERPOLATION
-												potVal = (1-ddz)*((1-ddr)*atPotPtr[ir+iOffsZ][0]+ddr*atPotPtr[ir+1+iOffsZ][0])+
-													ddz *((1-ddr)*atPotPtr[ir+iOffsZ+Nr][0]+ddr*atPotPtr[ir+1+iOffsZ+Nr][0]);
-#if USE_Q_POT_OFFSETS
-												// add the charge-dependent potential offset
-												if (atPotOffsPtr != NULL) {
-													potVal += atoms[iatom].q*((1-ddz)*((1-ddr)*atPotOffsPtr[ir+iOffsZ][0]+ddr*atPotOffsPtr[ir+1+iOffsZ][0])+
-														ddz *((1-ddr)*atPotOffsPtr[ir+iOffsZ+Nr][0]+ddr*atPotOffsPtr[ir+1+iOffsZ+Nr][0]));
-												}
-#endif  // USE_Q_POT_OFFSETS
-#else  // Z_INTERPOLATION
-												potVal = (1-ddr)*atPotPtr[ir+iOffsZ][0]+ddr*atPotPtr[ir+1+iOffsZ][0];
-#if USE_Q_POT_OFFSETS
-												// add the charge-dependent potential offset
-												if (atPotOffsPtr != NULL) {
-													potVal += atoms[iatom].q*((1-ddr)*atPotOffsPtr[ir+iOffsZ][0]+ddr*atPotOffsPtr[ir+1+iOffsZ][0]);												
-												}
-#endif  // USE_Q_POT_OFFSETS
-#endif  // Z_INTERPOLATION
-											}
-										}
-										*ptr += potVal;
+	slicePos = float1D(nlayer,"slicePos");
 
-										ptr  += sliceStep;  // advance to the next slice
-										// add the remaining potential to the next slice:
-										// if (iaz < iaz1)  *ptr += (1-ddz)*potVal;
-										iOffsZ += iOffsStep;
-									}
-								} // if ir < Nr-1
-								// advance pointer to next complex potential point:
-								potPtr+=2;
-								// make imaginary part zero for now
-								// *potPtr = 0;
-								// potPtr++;
 
-								// wrap around when end of y-line is reached:
-								if (++iay % muls->potNy == 0) potPtr -= 2*muls->potNy;		
-							}   
-						}
-					} // iaz0+iAtomZ < muls->slices
-				}  // muls->potential3D	
-				////////////////////////////////////////////////////////////////////
-				// 2D potential (periodic) calculation already seems to work!
-				else {
-					iAtomZ = (int)floor(atomZ/muls->sliceThickness);
-					iax0 = iAtomX-iRadX+2*muls->potNx;
-					iax1 = iAtomX+iRadX+2*muls->potNx; 
-					iay0 = iAtomY-iRadY+2*muls->potNy;
-					iay1 = iAtomY+iRadY+2*muls->potNy;
-
-					ddx = (-(double)iax0+(atomX/dx-(double)(iRadX-2*muls->potNx)))*(double)OVERSAMP_X;
-					ddy = (-(double)iay0+(atomY/dy-(double)(iRadY-2*muls->potNy)))*(double)OVERSAMP_X;
-					iOffsX = (int)floor(ddx);
-					iOffsY = (int)floor(ddy);
-					ddx -= (double)iOffsX;
-					ddy -= (double)iOffsY;
-					/*
-					s11 = (1-ddx)*(1-ddy);
-					s12 = (1-ddx)*ddy;
-					s21 = ddx*(1-ddy);
-					s22 = ddx*ddy;
-					*/									
-				    s22 = (1-ddx)*(1-ddy);
-					s21 = (1-ddx)*ddy;
-					s12 = ddx*(1-ddy);
-					s11 = ddx*ddy;
+	if (muls->sliceThickness == 0)
+		(*muls).cz[0] = c/(real)nlayer;
+	else
+		(*muls).cz[0] = muls->sliceThickness;
+	slicePos[0] = (*muls).czOffset;  
+	/*
+	************************************************************/
 
-					atPotPtr = getAtomPotential2D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw);
 
-					// if (iatom < 3) printf("atom #%d: ddx=%g, ddy=%g iatomZ=%d, atomZ=%g, %g\n",iatom,ddx,ddy,iAtomZ,atomZ,atoms[iatom].z);
-					for (iax=iax0; iax < iax1; iax++) {  // TODO: should use ix += OVERSAMP_X
-						// printf("(%d, %d): %d,%d\n",iax,nyAtBox,(iOffsX+OVERSAMP_X*(iax-iax0)),iOffsY+iay1-iay0);
-						// potPtr and ptr are of type (float *)
-						//////////////////
-						// Only the exact slice that this atom is located in is affected by this atom:
-						int atPosX = (OVERSAMP_X*(iax-iax0)-iOffsX);
-						if ((atPosX >= 0) && (atPosX < nyAtBox-1)) {
-							ptr = &(atPotPtr[atPosX*nyAtBox-iOffsY][0]);
-						for (iay=iay0; iay < iay1; iay++) {
-							// wrap around when end of y-line is reached:
-								int atPosY = (iay-iay0)*OVERSAMP_X-iOffsY; 
-								if ((atPosY < nyAtBox-1) && (atPosY >=0)) {
-							// do the real part
-									muls->trans[iAtomZ][iax % muls->potNx][iay % muls->potNy][0] +=
-									     s11*(*ptr)+s12*(*(ptr+2))+s21*(*(ptr+nyAtBox2))+s22*(*(ptr+nyAtBox2+2));
-								}
-							// make imaginary part zero for now
-								// *potPtr = 0;  potPtr++;
-							ptr += 2*OVERSAMP_X;
-						}
-						} // if atPosX within limits
-					}   
-				}  // muls->potential3D	== 0
+	for (i=1;i<nlayer;i++) {
+		if (sliceFp == NULL) (*muls).cz[i] = (*muls).cz[0];  
+		/* don't need to all be the same, yes they do for fast 3D-FFT method! */
+		else {
+			fgets(buf,BUF_LEN,sliceFp);
+			(*muls).cz[i] = atof(buf);
+		}
+		slicePos[i] = slicePos[i-1]+(*muls).cz[i-1]/2.0+(*muls).cz[i]/2.0;
+	}
+
+	/* check whether we have constant slice thickness */
+
+	if (muls->fftpotential) {
+		for (i = 0;i<nlayer;i++)  if ((*muls).cz[0] != (*muls).cz[i]) break;
+		if (i<nlayer) printf("Warning: slice thickness not constant, will give wrong results (iz=%d)!\n",i);
+
+	}
+
+	makeSliceWindow(muls,nlayer,0);
+} // end of make3DSlices
+
+/*****************************************************
+* reachesWindow() - whether the atom at the height atomZ 
+* (w.r.t. the slab, see makeSliceWindow()) may add to the 
+* slices that muls->trans holds.  The range of slices is wide
+* enough for every way of adding the potential.
+****************************************************/
+static int reachesWindow(MULS *muls,int nlayer,real atomZ) {
+	int iz,rad,lo,hi,first,nz;
+
+	first = muls->sliceFirst;
+	nz = muls->trans.Nz();
+	if ((first == 0) && (nz >= nlayer)) return 1;
+	iz = (int)floor(atomZ/muls->cz[0]);
+	rad = (muls->potential3D ? (int)ceil(muls->atomRadius/muls->cz[0]) : 0)+2;
+	lo = iz-rad;
+	hi = iz+rad;
+	if (muls->nonPeriodZ) return (lo < first+nz) && (hi >= first);
+	if (hi-lo >= nlayer) return 1;
+	// shift into the positive range, the slices beyond the slab wrap around:
+	iz = (lo % nlayer + nlayer) % nlayer;
+	hi += iz-lo;
+	lo = iz;
+	return ((lo < first+nz) && (hi >= first)) || (hi-nlayer >= first);
+}
+
+/*****************************************************
+* makeSliceWindow()
+*
+* Builds the slices first .. first+trans.Nz()-1 of the slab
+* of nlayer slices into muls->trans, from the atoms and slice
+* thicknesses that make3DSlices() has set up for the slab.  
+* make3DSlices() builds all of them (first = 0, trans.Nz() = 
+* nlayer); with a slice ring (see runMulsSTEMRing()) trans only
+* holds a few slices, and the layers beyond the slab stay empty.
+* Called by a single thread while others propagate, after the
+* first window of the slab has made the lookup tables and FFT 
+* plans.
+****************************************************/
+void makeSliceWindow(MULS *muls,int nlayer,int first) {
+	char fileOut[512];
+	int natom,iatom,iz;
+	atom *atoms;
+	real c,atomZ;
+	int j,nx,ny,nz,ix,iy;
+	int divCount;
+	double ddx,ddy,potVal;
+	char buf[BUF_LEN];
+	time_t time0,time1;
+	static real **tempPot = NULL;
+	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls->potNx,muls->potNy,
+				muls->sliceThickness,muls->resolutionX,muls->resolutionY));
+	std::vector<int> atomList;
+	std::vector<real> atomZList;
+
+	nx = muls->potNx;
+	ny = muls->potNy;
+	nz = muls->trans.Nz();
+	natom = muls->natom;
+	atoms = muls->atoms;
+	divCount = muls->divCount;
+	c = muls->sliceThickness * muls->slices;
+	muls->sliceFirst = first;
+	memset(muls->trans.Data(),0,muls->trans.Size()*sizeof(muls->trans.Data()[0]));
+
+	/*************************************************************************
+	* read the potential that has been created externally!
+	*/
+	if (muls->readPotential) {
+		for (iz=(divCount+1)*muls->slices-1,j=0;iz>=(divCount)*muls->slices;iz--,j++) {
+			if (windowLayer(muls,j) < 0) continue;
+			sprintf(buf,"%s/potential_%d.img",muls->folder,iz);
+			imageIO->ReadImage((void **)tempPot,nx,ny,buf);
+			for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
+				(*muls).trans[j-first][ix][iy][0] = tempPot[ix][iy];
+				(*muls).trans[j-first][ix][iy][1] = 0.0;
 			}
-			////////////////////////////////////////////////////////////////////
-		} /* end of if (fftpotential) */
+		}
+		return;
+	}
+
+	/****************************************************************
+	* Loop through all the atoms and find the ones whose potential 
+	* must be added to the slices:									 
+	***************************************************************/
+
+	time(&time0);
+	for (iatom = 0;iatom<natom;iatom++) {
+		// make sure we skip vacancies:
+		while (atoms[iatom].Znum == 0) iatom++;
+		if (iatom >=natom) break;
+
+		if ((muls->printLevel >= 4) && (muls->displayPotCalcInterval > 0)) {
+			if (((iatom+1) % (muls->displayPotCalcInterval)) == 0) {
+				printf("Adding potential for atom %d (Z=%d, pos=[%.1f, %.1f, %.1f])\n",iatom+1,atoms[iatom].Znum,atoms[iatom].x,atoms[iatom].y,atoms[iatom].z);
+			}
+		}
+		// printf("c=%g, slice thickness=%g, slices=%d, %d\n",c,muls->sliceThickness,muls->slices,muls->displayPotCalcInterval);
+		/*
+		* c = the thickness of the current slab.
+		*
+		* if the z-position of this atom is outside the potential slab
+		* we won't consider it and skip to the next
+		*/
+		/* cellDiv = number of times that the big super cell is divided into
+		* less big ones, yet often still bigger than a single unit cell
+		* (for saving memory)
+		* divCount = counter of how many such semi-super cells we already 
+		* passed through.
+		* c = height in A of one such semi-super cell.
+		* Since cellDiv is always >=1, and divCount starts at 0, the actual position
+		* of this atom with the super cell is given by:
+		*/
+		/* c*(real)((*muls).cellDiv-divCount-1) will pick the right super-cell
+		* division in the big super-cell
+		* The z-offset 0.5*cz[0] will position atoms at z=0 into the middle of the first 
+		* slice.
+		*/
+		atomZ = atoms[iatom].z-c*(real)(muls->cellDiv-divCount-1) + muls->czOffset 
+			-(0.5*muls->sliceThickness*(1-muls->centerSlices));
+		// make sure that slices are centered for 2D and 3D differently:
+		if (muls->potential3D==0)	atomZ += 0.5*muls->sliceThickness;
+		else atomZ -= muls->sliceThickness;
+
+		/* Now we need to find the first atom that contributes to this slice */
+		/* Make use of the fact that we sorted the atoms in z */
+		if ((*muls).nonPeriodZ) {
+			if (((*muls).potential3D) && (atomZ -(*muls).atomRadius > c)) break;	 
+			if (((*muls).potential3D==0) && (atomZ > c)) break;		
+			do {
+				// printf("z: %g c: %g\n",atomZ,c);
+				if (((*muls).potential3D) && (atomZ+(*muls).atomRadius+muls->sliceThickness >=0)) break;
+				if (((*muls).potential3D==0) && (atomZ >=0)) break;			  
+				// atomZ = atoms[++iatom].z-c*(real)((*muls).cellDiv-divCount-1)+ (0.5*(*muls).cz[0]*muls->centerSlices);	
+				atomZ = atoms[++iatom].z-c*(real)(muls->cellDiv-divCount-1) + muls->czOffset 
+					-(0.5*muls->sliceThickness*(1-muls->centerSlices));
+				if (muls->potential3D==0)	atomZ += 0.5*muls->sliceThickness;
+				else atomZ -= muls->sliceThickness;
+			}
+			while (iatom < natom-1);
+		}
+		if ((!muls->fftpotential) && (muls->displayPotCalcInterval > 0)) {
+			if ((muls->printLevel>=3) && ((iatom+1) % muls->displayPotCalcInterval == 0)) {
+				printf("adding atom %d [%.3f %.3f %.3f (%.3f)], Z=%d\n",
+					iatom+1,atoms[iatom].x,atoms[iatom].y,atoms[iatom].z,atomZ,atoms[iatom].Znum);
+			}
+		}
+		if (!reachesWindow(muls,nlayer,atomZ)) continue;
+		atomList.push_back(iatom);
+		atomZList.push_back(atomZ);
 	} /* for iatom =0 ... */
+	if (muls->recipPotential) addAtomPotentialsRecip(muls,nlayer,atoms,atomList,atomZList);
+	else addAtomPotentials(muls,nlayer,atoms,atomList,atomZList);
 	time(&time1);
 	if (iatom > 0)
 	if (muls->printLevel) printf("%g sec used for real space potential calculation (%g sec per atom)\n",difftime(time1,time0),difftime(time1,time0)/iatom);
@@ -1278,14 +1762,14 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	/* Save the potential slices					   */
 
 	if (muls->savePotential) {
-		for (iz = 0;iz<nlayer;iz++){
+		for (iz = first;(iz<nlayer) && (iz<first+nz);iz++){
 			/*
 			muls->thickness = iz;
 			showCrossSection(muls,(*muls).transr[iz],nx,1,0);
 			*/	
 			// find the maximum value of each layer:
-			potVal = muls->trans[iz][0][0][0];
-			for (ddx=potVal,ddy = potVal,ix=0;ix<muls->potNy*muls->potNx;potVal = muls->trans[iz][0][++ix][0]) {
+			potVal = muls->trans[iz-first][0][0][0];
+			for (ddx=potVal,ddy = potVal,ix=0;ix<muls->potNy*muls->potNx;potVal = muls->trans[iz-first][0][++ix][0]) {
 				if (ddy<potVal) ddy = potVal; 
 				if (ddx>potVal) ddx = potVal; 
 			}
@@ -1301,16 +1785,19 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 			imageIO->SetThickness(muls->sliceThickness);
 			sprintf(buf,"Projected Potential (slice %d)",iz);		 
 			imageIO->SetComment(buf);
-			imageIO->WriteComplexImage( (void **)muls->trans[iz], fileOut );
+			imageIO->WriteComplexImage( (void **)muls->trans[iz-first], fileOut );
 		} // loop through all slices
 	} /* end of if savePotential ... */
 	if (muls->saveTotalPotential) {
 		if (tempPot == NULL) tempPot = float2D(muls->potNx,muls->potNy,"total projected potential");
 
+		// the windows of a slice ring add up to the total
 		for (ix=0;ix<muls->potNx;ix++) for (iy=0;iy<muls->potNy;iy++) {
-			tempPot[ix][iy] = 0;
-			for (iz=0;iz<nlayer;iz++) tempPot[ix][iy] += muls->trans[iz][ix][iy][0];
+			if (first == 0) tempPot[ix][iy] = 0;
+			for (iz=0;(iz<nz) && (first+iz<nlayer);iz++) tempPot[ix][iy] += muls->trans[iz][ix][iy][0];
 		}
+	}
+	if (muls->saveTotalPotential && (first+nz >= nlayer)) {
 
 		for (ddx=tempPot[0][0],ddy = potVal,ix=0;ix<muls->potNy*muls->potNx;potVal = tempPot[0][++ix]) {
 			if (ddy<potVal) ddy = potVal; 
@@ -1330,8 +1817,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 		imageIO->SetComment(buf);
 		imageIO->WriteRealImage( (void **)tempPot, fileOut );
 	}
-
-} // end of make3DSlices
+} // end of makeSliceWindow
 
 
 
@@ -1938,15 +2424,53 @@ void writePix(char *outFile,fftw_complex **pict,MULS *muls,int iz) {
 
 #define SMOOTH_EDGE 5 // make a smooth edge on AIS aperture over +/-SMOOTH_EDGE pixels
 
-void probeShiftAndCrop(MULS *muls, WavePtr wave, double dx, double dy, double cnx, double cny)
+/**************************************************************
+* probeShift() 
+* makes wave the cached probe (see updateProbeCache()) shifted 
+* by (dx,dy) Angstroem.  The shift is applied as the phase ramp 
+* exp(-2 pi i (kx*dx+ky*dy)) to the cached probe spectrum, so it 
+* can be any fraction of a pixel.  The probe wraps around 
+* periodically at the edges of the wave function array.
+* (This replaces the old probeShiftAndCrop() stub.)
+**************************************************************/
+void probeShift(MULS *muls, WavePtr wave, double dx, double dy)
 {
-	// Robert A. McLeod
-	// 09 April 2014
-	// This function takes an input wave and shifts it by [dx,dy] and crops it to [cnx,cny]
-	// In general the input wave should have wave.nx > nx + 2*abs(dx) and wave.ny > ny + 2*abs(dy) for a scanned system
-
-	// 
-	printf("Debug: probeShiftAndCrop does nothing at present\n");
+	int ix, iy, nx, ny;
+	double phase, pi, xr, xi, rr, ri;
+	std::vector<double> rampYr, rampYi;
+	float_tt *wRow, *sRow;
+	int threads = getWaveThreads();
+
+	nx = muls->nx;
+	ny = muls->ny;
+	pi = 4.0 * atan( 1.0 );
+	rampYr.resize(ny);
+	rampYi.resize(ny);
+	for (iy=0; iy<ny; iy++) {
+		phase = -2.0*pi*((iy > ny/2) ? iy-ny : iy)*dy/(ny*muls->resolutionY);
+		rampYr[iy] = cos(phase);
+		rampYi[iy] = sin(phase);
+	}
+#pragma omp parallel for if(threads > 1) num_threads(threads) private(iy,phase,xr,xi,rr,ri,wRow,sRow)
+	for (ix=0; ix<nx; ix++) {
+		/* the 1/(nx*ny) of the inverse FFT is included here */
+		phase = -2.0*pi*((ix > nx/2) ? ix-nx : ix)*dx/(nx*muls->resolutionX);
+		xr = cos(phase)/((double)nx*ny);
+		xi = sin(phase)/((double)nx*ny);
+		wRow = (float_tt *)wave->wave[ix];
+		sRow = (float_tt *)muls->probeSpectrum->wave[ix];
+		for (iy=0; iy<ny; iy++) {
+			rr = xr*rampYr[iy]-xi*rampYi[iy];
+			ri = xr*rampYi[iy]+xi*rampYr[iy];
+			wRow[2*iy]   = (float_tt)(sRow[2*iy]*rr-sRow[2*iy+1]*ri);
+			wRow[2*iy+1] = (float_tt)(sRow[2*iy]*ri+sRow[2*iy+1]*rr);
+		}
+	}
+#if FLOAT_PRECISION == 1
+	fftwf_execute_dft(wave->fftPlanWaveInv,wave->wave.Data(),wave->wave.Data());
+#else
+	fftw_execute_dft(wave->fftPlanWaveInv,wave->wave.Data(),wave->wave.Data());
+#endif
 }
 
 void probe(MULS *muls, WavePtr wave, double dx, double dy)
@@ -1990,7 +2514,7 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 	delta = muls->Cc*muls->dE_E;
 	if (muls->printLevel > 2) printf("defocus offset: %g nm (Cc = %g)\n",delta,muls->Cc);
 
-	if (wave->wave == NULL) {
+	if (wave->wave.Empty()) {
 		printf("Error in probe(): Wave not allocated!\n");
 		exit(0);
 	}
@@ -2106,9 +2630,9 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 	/* Fourier transform into real space */
 	// fftwnd_one(muls->fftPlanInv, &(muls->wave[0][0]), NULL);
 #if FLOAT_PRECISION == 1
-	fftwf_execute(wave->fftPlanWaveInv);
+	fftwf_execute_dft(wave->fftPlanWaveInv,wave->wave.Data(),wave->wave.Data());
 #else
-	fftw_execute(wave->fftPlanWaveInv);
+	fftw_execute_dft(wave->fftPlanWaveInv,wave->wave.Data(),wave->wave.Data());
 #endif
 	/**********************************************************
 	* display cross section of probe intensity
@@ -2190,13 +2714,60 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 
 }  /* end probe() */
 
+/**************************************************************
+* updateProbeCache() 
+* makes muls->probeCache the probe in the center of the wave 
+* function array, i.e. probe(muls,wave,nx/2*resolutionX,ny/2*resolutionY).
+* The probe is only recomputed, if any of the parameters it 
+* depends on (aberrations, dE_E, avgCount, ...) has changed.
+* STEM pixels copy this probe instead of calling probe() each,
+* or shift it with probeShift(), using muls->probeSpectrum.
+* Must be called from serial code.
+**************************************************************/
+static std::vector<double> probeParameters(MULS *muls) {
+	double p[] = {(double)muls->nx, (double)muls->ny, muls->resolutionX, muls->resolutionY, 
+		muls->v0, muls->alpha, muls->df0, muls->Cc, muls->dE_E, muls->astigMag, muls->astigAngle,
+		muls->a33, muls->phi33, muls->a31, muls->phi31, muls->a44, muls->phi44, muls->a42, muls->phi42,
+		muls->a55, muls->phi55, muls->a53, muls->phi53, muls->a51, muls->phi51,
+		muls->a66, muls->phi66, muls->a64, muls->phi64, muls->a62, muls->phi62, muls->Cs, muls->C5,
+		(double)muls->ismoth, (double)muls->gaussFlag, muls->gaussScale, muls->aAIS, 
+		(double)muls->avgCount};
+	return std::vector<double>(p, p+sizeof(p)/sizeof(p[0]));
+}
+
+void updateProbeCache(MULS *muls) {
+	if (muls->probeCache && (muls->probeKey == probeParameters(muls))) return;
+
+	if ((!muls->probeCache) || (muls->probeCache->nx != muls->nx) || (muls->probeCache->ny != muls->ny))
+		muls->probeCache = WavePtr(new WAVEFUNC(muls->nx, muls->ny, muls->resolutionX, muls->resolutionY));
+	probe(muls, muls->probeCache, muls->nx/2*muls->resolutionX, muls->ny/2*muls->resolutionY);
+	if ((!muls->probeSpectrum) || (muls->probeSpectrum->nx != muls->nx) || (muls->probeSpectrum->ny != muls->ny))
+		muls->probeSpectrum = WavePtr(new WAVEFUNC(muls->nx, muls->ny, muls->resolutionX, muls->resolutionY));
+	memcpy(muls->probeSpectrum->wave.Data(), muls->probeCache->wave.Data(), 
+		muls->probeCache->wave.Size()*sizeof(muls->probeCache->wave.Data()[0]));
+#if FLOAT_PRECISION == 1
+	fftwf_execute_dft(muls->probeSpectrum->fftPlanWaveForw,muls->probeSpectrum->wave.Data(),muls->probeSpectrum->wave.Data());
+#else
+	fftw_execute_dft(muls->probeSpectrum->fftPlanWaveForw,muls->probeSpectrum->wave.Data(),muls->probeSpectrum->wave.Data());
+#endif
+	// probe() may modify muls (a62), so take the key afterwards
+	muls->probeKey = probeParameters(muls);
+	if (muls->printLevel > 2) printf("Computed new incident probe (avgCount %d, dE_E = %g)\n",muls->avgCount,muls->dE_E);
+}
+
 /**************************************************************
 * The imaginary part of the trans arrays is already allocated
 * The projected potential is already located in trans[][][][0]
 *
+* makeTransmission() turns the potential of the nlayer layers 
+* of muls->trans into band limited transmission functions, 
+* initSTEMSlices() also sets up the propagators for the slices.
+* The propagators are shared by all threads, so that only 
+* makeTransmission() may run while waves are propagated (see 
+* runMulsSTEMRing()).
 **************************************************************/
 #define PHI_SCALE 47.87658
-void initSTEMSlices(MULS *muls, int nlayer) {
+void makeTransmission(MULS *muls, int nlayer) {
 	int printFlag = 0;
 	int ilayer;
 	int nbeams;
@@ -2207,6 +2778,8 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	real pi;
 	double fftScale;
 	double timer1,timer2,time2=0,time1=0;
+	size_t i,nxy;
+	real *t;
 	// char filename[32];
 
 	pi = (float)PI;
@@ -2261,7 +2834,7 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	k2max = k2max*k2max;
 	(*muls).k2max = k2max;
 
-	if(muls->trans==NULL) {
+	if(muls->trans.Empty()) {
 		printf("Memory for trans has not been allocated\n");
 		exit(0);
 	}
@@ -2287,15 +2860,17 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	fftScale = 1.0/(nx*ny);
 	vzscale= 1.0;
 	timer1 = cputim();    
+	nxy = (size_t)nx*ny;
 	for( ilayer=0;  ilayer<nlayer; ilayer++ ) {     
 		timer2 = cputim();    
-		for( iy=0; iy<ny; iy++) for( ix=0; ix<nx; ix++) {
-			vz= muls->trans[ilayer][ix][iy][0]*scale;  // scale = lambda*gamma
+		// each layer is one contiguous block of nx*ny complex numbers
+		t = (real *)muls->trans.Slice(ilayer);
+		for( i=0; i<2*nxy; i+=2) {
+			vz= t[i]*scale;  // scale = lambda*gamma
 			// include absorption:
-			// vzscale= exp(-(*muls).trans[ilayer][ix][iy][1]*scale);
-			/* printf("vz(%d %d) = %g\n",ix,iy,vz); */
-			muls->trans[ilayer][ix][iy][0] =  cos(vz);
-			muls->trans[ilayer][ix][iy][1] =  sin(vz);
+			// vzscale= exp(-t[i+1]*scale);
+			t[i]   =  cos(vz);
+			t[i+1] =  sin(vz);
 		}
 	}
 
@@ -2305,32 +2880,35 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	if (muls->bandlimittrans) {
 		timer2 = cputim();    
 #if FLOAT_PRECISION == 1
-		fftwf_execute(muls->fftPlanPotForw);
+		fftwf_execute_dft(muls->fftPlanPotForw,muls->trans.Data(),muls->trans.Data());
 #else
-		fftw_execute(muls->fftPlanPotForw);
+		fftw_execute_dft(muls->fftPlanPotForw,muls->trans.Data(),muls->trans.Data());
 #endif
 		time2 = cputim()-timer2;
 		//     printf("%g sec used for 1st set of FFTs\n",time2);  
 		for( ilayer=0;  ilayer<nlayer; ilayer++ ) {     
-			for( ix=0; ix<nx; ix++) for( iy=0; iy<ny; iy++) {
-				k2= ky2[iy] + kx2[ix];
-				if (k2 < k2max) {
-					nbeams++;
-					(*muls).trans[ilayer][ix][iy][0] *= fftScale;
-					(*muls).trans[ilayer][ix][iy][1] *= fftScale;
+			for( ix=0; ix<nx; ix++) {
+				t = (real *)muls->trans[ilayer][ix];
+				for( iy=0; iy<ny; iy++) {
+					k2= ky2[iy] + kx2[ix];
+					if (k2 < k2max) {
+						nbeams++;
+						t[2*iy]   *= fftScale;
+						t[2*iy+1] *= fftScale;
+					}
+					else {
+						t[2*iy]   = 0.0F;
+						t[2*iy+1] = 0.0F;
+					}	
 				}
-				else {
-					(*muls).trans[ilayer][ix][iy][0] = 0.0F;
-					(*muls).trans[ilayer][ix][iy][1] = 0.0F;
-				}	
 			}
 		}  /* end for(ilayer=... */
 		timer2 = cputim();    
 		// old code: fftwnd_one((*muls).fftPlanPotInv, (*muls).trans[ilayer][0], NULL);
 #if FLOAT_PRECISION == 1
-		fftwf_execute(muls->fftPlanPotInv);
+		fftwf_execute_dft(muls->fftPlanPotInv,muls->trans.Data(),muls->trans.Data());
 #else
-		fftw_execute(muls->fftPlanPotInv);
+		fftw_execute_dft(muls->fftPlanPotInv,muls->trans.Data(),muls->trans.Data());
 #endif
 		time2 += cputim()-timer2;
 	}  /* end of ... if bandlimittrans */
@@ -2354,12 +2932,275 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	nx,ny, nx*ny);
 	printf("Lattice constant a = %.4f, b = %.4f\n", (*muls).ax,(*muls).by);
 	*/
+}  // makeTransmission
+
+void initSTEMSlices(MULS *muls, int nlayer) {
+	makeTransmission(muls,nlayer);
+	initPropagators(muls);
 }  // initSTEMSlices
 
-#undef PHI_SCALE
+#undef PHI_SCALE
+
+/**************************************************************
+* copyTransReplica() - (re)allocates the copy of muls->trans for
+* node and fills it.  The calling thread touches its pages first.
+**************************************************************/
+static void copyTransReplica(MULS *muls, int node) {
+#if FLOAT_PRECISION == 1
+	boost::shared_ptr<Array3D<fftwf_complex> > &replica = muls->transReplicas[node];
+	if ((!replica) || (replica->Size() != muls->trans.Size()))
+		replica.reset(new Array3D<fftwf_complex>(muls->trans.Nz(),muls->trans.Nx(),muls->trans.Ny(),"trans replica"));
+#else
+	boost::shared_ptr<Array3D<fftw_complex> > &replica = muls->transReplicas[node];
+	if ((!replica) || (replica->Size() != muls->trans.Size()))
+		replica.reset(new Array3D<fftw_complex>(muls->trans.Nz(),muls->trans.Nx(),muls->trans.Ny(),"trans replica"));
+#endif
+	memcpy(replica->Data(), muls->trans.Data(), muls->trans.Size()*sizeof(muls->trans.Data()[0]));
+}
+
+/**************************************************************
+* updateTransReplicas() - with muls->replicateTrans, every NUMA 
+* node but that of thread 0 gets a copy of muls->trans (thread 0's
+* node reads muls->trans itself).  Each copy is written by the 
+* first thread of its node, so that it is placed on that node.
+* Must be called whenever the transmission functions change.
+**************************************************************/
+void updateTransReplicas(MULS *muls) {
+	int node, th;
+	std::vector<int> done;
+
+	if ((!muls->replicateTrans) || (!muls->numa) || (muls->numa->Nodes() < 2)) {
+		muls->transReplicas.clear();
+		return;
+	}
+	muls->transReplicas.resize(muls->numa->Nodes());
+	done.assign(muls->numa->Nodes(), 0);
+	done[muls->numa->ThreadNode(0)] = 1;
+#pragma omp parallel private(node, th) shared(muls, done) default(none)
+	{
+		th = omp_get_thread_num();
+		node = muls->numa->ThreadNode(th);
+		if ((!done[node]) && (muls->numa->FirstThread(node) == th)) {
+			muls->numa->Pin(th);
+			copyTransReplica(muls, node);
+			done[node] = 1;
+		}
+	}
+	/* nodes whose first thread was not part of the team */
+	for (node=0; node<muls->numa->Nodes(); node++) 
+		if (!done[node]) copyTransReplica(muls, node);
+}
+
+
+
+
+static void finishMulsSTEM(MULS *muls, WavePtr wave, int printFlag);
+
+/* the kernels for either precision of the wave function, see below */
+template <class T> void transmitWave(T (**w)[2], real (**t)[2],int nx, int ny,int posx,int posy,int potNx,int potNy);
+template <class T> void transmitWaveFast(T (**w)[2], real (**t)[2],int nx, int ny,int posx,int posy,int potNx,int potNy);
+template <class T> void normalizeWave(T (**w)[2],int nx, int ny);
+
+static void applyPropagator(const Propagator &prop, fftwf_complex **w, float norm) {
+	prop.Apply((void **)w, norm);
+}
+static void applyPropagator(const Propagator &prop, fftw_complex **w, double norm) {
+	prop.Apply(w, norm);
+}
+
+/*****************************************************************
+* waveFFT() - in place FFT of the wave function of precision T
+* 
+* In single precision muls->bandFFT is used, if it is set 
+* (only the band limited rows are transformed); the other 
+* precisions do not need muls.
+*****************************************************************/
+template <class T> static void waveFFT(MULS *, WavePtr wave, int direction) {
+	FFTW<T>::Execute((direction == FFTW_FORWARD) ? wave->PlanForw<T>() : wave->PlanInv<T>(), 
+		wave->Rows<T>()[0]);
+}
+
+template <> void waveFFT<float>(MULS *muls, WavePtr wave, int direction) {
+	if (!muls->bandFFT) 
+		FFTW<float>::Execute((direction == FFTW_FORWARD) ? wave->PlanForw<float>() : wave->PlanInv<float>(), 
+			wave->Rows<float>()[0]);
+	else if (direction == FFTW_FORWARD) muls->bandFFT->Forward((void **)wave->Rows<float>());
+	else muls->bandFFT->Inverse((void **)wave->Rows<float>());
+}
+
+/******************************************************************
+* waveTrans() - the transmission function wave is propagated through:
+* that of its own frozen phonon configuration in a phonon batch (see 
+* phononbatch.h), the replica on the NUMA node of the wave (see 
+* updateTransReplicas()), or else muls->trans.
+*****************************************************************/
+#if FLOAT_PRECISION == 1
+static Array3D<fftwf_complex> &waveTrans(MULS *muls, WavePtr &wave) {
+#else
+static Array3D<fftw_complex> &waveTrans(MULS *muls, WavePtr &wave) {
+#endif
+	if ((wave->config != NULL) && !wave->config->trans.Empty()) return wave->config->trans;
+	if ((wave->numaNode < (int)muls->transReplicas.size()) && muls->transReplicas[wave->numaNode]) 
+		return *(muls->transReplicas[wave->numaNode]);
+	return muls->trans;
+}
+
+/*****************************************************************
+* sliceStepFused() - transmit, FFT and propagate one slice
+*
+* Applies the transmission function of slice islice (layer of the
+* transmission function of the wave, see waveTrans()), transforms to
+* reciprocal space and propagates, including the bandwidth limit and
+* the 1/(nx*ny) FFT normalization.  On return the wave function of 
+* precision T holds the propagated spectrum, scaled by 1/(nx*ny) 
+* w.r.t. the reference path.
+* If muls->bandFFT is set, only the band limited rows are transformed.
+*****************************************************************/
+template <class T> static void sliceStepFused(MULS *muls, WavePtr wave, int islice, int layer) {
+	T (**w)[2] = wave->Rows<T>();
+
+	transmitWaveFast(w, waveTrans(muls,wave)[layer], muls->nx,muls->ny, wave->iPosX, wave->iPosY, muls->potNx, muls->potNy);
+	waveFFT<T>(muls, wave, FFTW_FORWARD);
+	applyPropagator(*(muls->propagators[islice]), w, (T)1/((T)muls->nx*(T)muls->ny));
+}
+
+/******************************************************************
+* propagateSlices() - the slice loop of runMulsSTEM()
+*
+* Propagates the wave function of precision T (float: wave->wave,
+* double: wave->waveD) through the slices first .. first+count-1 of 
+* the slab, in the repetition mRepeat of it.  The transmission 
+* function of the wave (see waveTrans()) holds these slices from 
+* its first layer on.
+*****************************************************************/
+template <class T> static void propagateSlices(MULS *muls, WavePtr wave, int printFlag, int mRepeat, int first, int count) {
+	int showEverySlice=1;
+	int islice,i,ix,iy;
+	real scale,sum=0.0; //,zsum=0.0
+	int absolute_slice;
+	T (**w)[2] = wave->Rows<T>();
+
+	char outStr[64];
+	double fftScale,kScale;
+
+	fftScale = 1.0/(muls->nx*muls->ny);
+	scale = 1.0F / (((real)muls->nx) * ((real)muls->ny));
+
+	for( islice=first; islice < first+count; islice++ ) 
+	{
+		absolute_slice = (muls->totalSliceCount+islice);
+
+		// if ((muls->cubez > 0) && (muls->thickness >= muls->cubez)) break;
+		//  else if ((muls->cubez == 0) && (muls->thickness >= muls->c)) break;
+
+		if (muls->sliceEngine == SLICE_ENGINE_FUSED) {
+			/***********************************************************************
+			* transmit, FFT and propagate in one step.  The 1/(nx*ny) of the FFT 
+			* is applied by the propagator, so the spectrum is scaled by kScale.
+			**********************************************************************/
+			sliceStepFused<T>(muls,wave,islice,islice-first);
+			kScale = fftScale;
+		}
+		else {
+			/***********************************************************************
+			* Transmit is a simple multiplication of wave with trans in real space
+			**********************************************************************/
+			transmitWave(w, waveTrans(muls,wave)[islice-first], muls->nx,muls->ny, wave->iPosX, wave->iPosY, muls->potNx, muls->potNy);
+			//    writeImage_old(wave,(*muls).nx,(*muls).ny,(*muls).thickness,"wavet.img");      
+			/***************************************************** 
+			* remember: prop must be here to anti-alias
+			* propagate is a simple multiplication of wave with prop
+			* but it also takes care of the bandwidth limiting
+			*******************************************************/
+			FFTW<T>::Execute(wave->PlanForw<T>(), w[0]);
+			applyPropagator(*(muls->propagators[islice]), w, (T)1);
+			kScale = 1.0;
+		}
+
+		collectIntensity(muls, wave, muls->totalSliceCount+islice*(1+mRepeat), kScale);
+
+		if (muls->mode != STEM) {
+			/* write pendelloesung plots, if this is not STEM */
+			writeBeams(muls,wave,islice, absolute_slice, kScale);
+		}
+
+		// go back to real space:
+		if (muls->sliceEngine == SLICE_ENGINE_FUSED) 
+			waveFFT<T>(muls, wave, FFTW_BACKWARD);
+		else {
+			FFTW<T>::Execute(wave->PlanInv<T>(), w[0]);
+			// old code: fftwnd_one((*muls).fftPlanInv,(fftw_complex *)wave[0][0], NULL);
+			normalizeWave(w,muls->nx,muls->ny);
+		}
+
+		/*
+		sprintf(outStr,"wave%d.img",islice);
+		writeImage_old(wave,(*muls).nx,(*muls).ny,(*muls).thickness,"wavep.img");
+		*/    
+
+		// write the intermediate TEM wave function:
+
+		/********************************************************************
+		* show progress:
+		********************************************************************/
+		wave->thickness = (absolute_slice+1)*muls->sliceThickness;
+		if ((printFlag)) {
+			sum = 0.0;
+			for( ix=0; ix<(*muls).nx; ix++)  for( iy=0; iy<(*muls).ny; iy++) {
+				sum +=  w[ix][iy][0]* w[ix][iy][0] +
+					w[ix][iy][1]* w[ix][iy][1];
+			}
+			sum *= scale;
+
+			sprintf(outStr,"position (%3d, %3d), slice %4d (%.2f), int. = %f", 
+				wave->detPosX, wave->detPosY,
+				muls->totalSliceCount+islice,wave->thickness,sum );
+			if (showEverySlice)
+				printf("%s\n",outStr);
+			else {
+				printf("%s",outStr);
+				for (i=0;i<(int)strlen(outStr);i++) printf("\b");
+			}
+		}
+		
+		if ( (muls->mode == TEM) || ((muls->mode == CBED) && (muls->saveLevel > 1)) || ((muls->mode == NBED) && (muls->saveLevel > 1)) )
+		{
+			// TODO (MCS 2013/04): this restructure probably broke this file saving - 
+			//   need to rewrite a function to save things for TEM/CBED?
+			// This used to call interimWave(muls,wave,muls->totalSliceCount+islice*(1+mRepeat));
+			if (muls->precision == PRECISION_DOUBLE) wave->FromDouble();
+			interimWave(muls,wave,absolute_slice*(1+mRepeat)); 
+			collectIntensity(muls,wave,absolute_slice*(1+mRepeat));
+		}
+	} /* end for(islice...) */
+}
 
+/******************************************************************
+* multisliceLoop() - runMulsSTEM() in the precision T
+*
+* Propagates the wave function through all slices, muls->mulsRepeat1 
+* times.
+*****************************************************************/
+template <class T> static void multisliceLoop(MULS *muls, WavePtr wave, int printFlag) {
+	int islice,mRepeat;
+	real cztot=0.0;
 
+	/*  calculate the total specimen thickness and echo */
+	cztot=0.0;
+	for( islice=0; islice<(*muls).slices; islice++) {
+		cztot += (*muls).cz[islice];
+	}
+	if (printFlag)
+		printf("Specimen thickness: %g Angstroms\n", cztot);
 
+	for (mRepeat = 0; mRepeat < muls->mulsRepeat1; mRepeat++) 
+	{
+		propagateSlices<T>(muls,wave,printFlag,mRepeat,0,muls->slices);
+		// collect intensity at the final slice
+		//collectIntensity(muls, wave, muls->totalSliceCount+muls->slices*(1+mRepeat));
+	} /* end of mRepeat = 0 ... */
+	if (printFlag) printf("\n***************************************\n");
+}
 
 /******************************************************************
 * runMulsSTEM() - do the multislice propagation in STEM/CBED mode
@@ -2371,126 +3212,140 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 *
 * waver, wavei are expected to contain incident wave function 
 * they will be updated at return
+* With muls->precision == PRECISION_DOUBLE, the wave function is 
+* propagated in double precision (in wave->waveD, see WAVEFUNC::UseDouble()).
 *****************************************************************/
 int runMulsSTEM(MULS *muls, WavePtr wave) {
 	int printFlag = 0; 
-	int showEverySlice=1;
-	int islice,i,ix,iy,mRepeat;
-	real cztot=0.0;
-	real wavlen,scale,sum=0.0; //,zsum=0.0
-	// static int *layer=NULL;
-	real x,y;
-	int absolute_slice;
-
-	char outStr[64];
-	double fftScale;
 
 	printFlag = (muls->printLevel > 3);
-	fftScale = 1.0/(muls->nx*muls->ny);
 
-	wavlen = (real)wavelength((*muls).v0);
-
-	/*  calculate the total specimen thickness and echo */
-	cztot=0.0;
-	for( islice=0; islice<(*muls).slices; islice++) {
-		cztot += (*muls).cz[islice];
+	if (muls->precision == PRECISION_DOUBLE) {
+		if (wave->waveD.Empty()) {
+			printf("runMulsSTEM: double precision wave function not allocated - exit!\n");
+			exit(0);
+		}
+		wave->ToDouble();
+		multisliceLoop<double>(muls,wave,printFlag);
+		wave->FromDouble();
 	}
-	if (printFlag)
-		printf("Specimen thickness: %g Angstroms\n", cztot);
-
-	scale = 1.0F / (((real)muls->nx) * ((real)muls->ny));
-
-	for (mRepeat = 0; mRepeat < muls->mulsRepeat1; mRepeat++) 
-	{
-		for( islice=0; islice < muls->slices; islice++ ) 
-		{
-			absolute_slice = (muls->totalSliceCount+islice);
+	else 
+		multisliceLoop<float>(muls,wave,printFlag);
 
-			// if ((muls->cubez > 0) && (muls->thickness >= muls->cubez)) break;
-			//  else if ((muls->cubez == 0) && (muls->thickness >= muls->c)) break;
+	/****************************************************
+	****************************************************
+	**           this -WAS- the big loop              **
+	****************************************************
+	***************************************************/
+	finishMulsSTEM(muls,wave,printFlag);
+	return 0;
+}  // end of runMulsSTEM
 
-			/***********************************************************************
-			* Transmit is a simple multiplication of wave with trans in real space
-			**********************************************************************/
-			transmit((void **)wave->wave, (void **)(muls->trans[islice]), muls->nx,muls->ny, wave->iPosX, wave->iPosY);
-			//    writeImage_old(wave,(*muls).nx,(*muls).ny,(*muls).thickness,"wavet.img");      
-			/***************************************************** 
-			* remember: prop must be here to anti-alias
-			* propagate is a simple multiplication of wave with prop
-			* but it also takes care of the bandwidth limiting
-			*******************************************************/
+/* the FFT plans of wave for the current number of wave threads */
+static void ringWavePlans(WavePtr wave) {
 #if FLOAT_PRECISION == 1
-			fftwf_execute(wave->fftPlanWaveForw);
+	wave->fftPlanWaveForw = getFFTPlanf(wave->nx,wave->ny,1,FFTW_FORWARD);
+	wave->fftPlanWaveInv = getFFTPlanf(wave->nx,wave->ny,1,FFTW_BACKWARD);
 #else
-			fftw_execute(wave->fftPlanWaveForw);
+	wave->fftPlanWaveForw = getFFTPlan(wave->nx,wave->ny,1,FFTW_FORWARD);
+	wave->fftPlanWaveInv = getFFTPlan(wave->nx,wave->ny,1,FFTW_BACKWARD);
 #endif
-			propagate_slow((void **)wave->wave, muls->nx, muls->ny, muls);
-
-			collectIntensity(muls, wave, muls->totalSliceCount+islice*(1+mRepeat));
+	if (!wave->waveD.Empty()) {
+		wave->fftPlanWaveDForw = getFFTPlan(wave->nx,wave->ny,1,FFTW_FORWARD);
+		wave->fftPlanWaveDInv = getFFTPlan(wave->nx,wave->ny,1,FFTW_BACKWARD);
+	}
+}
 
-			if (muls->mode != STEM) {
-				/* write pendelloesung plots, if this is not STEM */
-				writeBeams(muls,wave,islice, absolute_slice);
-			}
+/******************************************************************
+* runMulsSTEMRing() - TEM/CBED: builds and propagates the slab a 
+* few slices at a time ("slice ring:")
+*
+* muls->trans only holds muls->trans.Nz() slices of the slab.  While
+* the wave of config is propagated through one window of slices, 
+* which config.trans holds, the master thread builds the 
+* transmission functions of the next window into muls->trans (see 
+* makeSliceWindow()), and then the two are exchanged.  The potential
+* thus needs the memory of two windows instead of that of the slab,
+* and building and propagating overlap.  The master thread builds
+* alone (the potential builders see that they are in a parallel 
+* region), the other threads propagate the wave in a nested parallel
+* region: the wave threads are one less while the ring runs.
+* newSlab: the atoms of the slab are set up by make3DSlices(), 
+* otherwise those of the previous slab are used again.  The slab is
+* built again for each of its muls->mulsRepeat1 repetitions, unless
+* it fits into a single window.
+* The wave is the same as with runMulsSTEM() and the slab built 
+* at once.
+*****************************************************************/
+int runMulsSTEMRing(MULS *muls, PhononConfig &config, int newSlab) {
+	int printFlag,nz,windows,w,mRepeat,first,count,next,th,levels,waveThreads;
+	WavePtr wave = config.wave;
 
-			// go back to real space:
-#if FLOAT_PRECISION == 1
-			fftwf_execute(wave->fftPlanWaveInv);
-#else
-			fftw_execute(wave->fftPlanWaveInv);
-#endif
-			// old code: fftwnd_one((*muls).fftPlanInv,(fftw_complex *)wave[0][0], NULL);
-			fft_normalize((void **)wave->wave,muls->nx,muls->ny);
+	printFlag = (muls->printLevel > 3);
+	nz = muls->trans.Nz();
+	windows = (muls->slices+nz-1)/nz;
+	if (config.trans.Empty()) config.trans.Resize(nz,muls->trans.Nx(),muls->trans.Ny(),"trans");
+	if ((muls->precision == PRECISION_DOUBLE) && wave->waveD.Empty()) {
+		printf("runMulsSTEMRing: double precision wave function not allocated - exit!\n");
+		exit(0);
+	}
 
-			/*
-			sprintf(outStr,"wave%d.img",islice);
-			writeImage_old(wave,(*muls).nx,(*muls).ny,(*muls).thickness,"wavep.img");
-			*/    
-
-			// write the intermediate TEM wave function:
-
-			/********************************************************************
-			* show progress:
-			********************************************************************/
-			wave->thickness = (absolute_slice+1)*muls->sliceThickness;
-			if ((printFlag)) {
-				sum = 0.0;
-				for( ix=0; ix<(*muls).nx; ix++)  for( iy=0; iy<(*muls).ny; iy++) {
-					sum +=  wave->wave[ix][iy][0]* wave->wave[ix][iy][0] +
-						wave->wave[ix][iy][1]* wave->wave[ix][iy][1];
-				}
-				sum *= scale;
-
-				sprintf(outStr,"position (%3d, %3d), slice %4d (%.2f), int. = %f", 
-					wave->detPosX, wave->detPosY,
-					muls->totalSliceCount+islice,wave->thickness,sum );
-				if (showEverySlice)
-					printf("%s\n",outStr);
-				else {
-					printf("%s",outStr);
-					for (i=0;i<(int)strlen(outStr);i++) printf("\b");
-				}
+	// the first window is built by all threads, which also makes the
+	// lookup tables and FFT plans, and the propagators are set up:
+	if (newSlab) make3DSlices(muls,muls->slices,muls->atomPosFile,NULL);
+	else makeSliceWindow(muls,muls->slices,0);
+	initSTEMSlices(muls,nz);
+	if (printFlag) printf("Slice ring: %d windows of %d slices\n",windows,nz);
+
+	if (muls->precision == PRECISION_DOUBLE) wave->ToDouble();
+	levels = omp_get_max_active_levels();
+	omp_set_max_active_levels(2);
+	waveThreads = getWaveThreads();
+	if ((windows > 1) && (waveThreads > 1) && (omp_get_max_threads() > 1)) {
+		setWaveThreads(waveThreads-1);
+		ringWavePlans(wave);
+	}
+	for (mRepeat=0; mRepeat<muls->mulsRepeat1; mRepeat++) for (w=0; w<windows; w++) {
+		// a single window stays in config.trans for all the repetitions
+		if ((windows > 1) || (mRepeat == 0)) muls->trans.Swap(config.trans);
+		first = w*nz;
+		count = (first+nz < muls->slices) ? nz : muls->slices-first;
+		// the window that is built meanwhile, -1: none
+		next = (w+1 < windows) ? first+nz : (((windows > 1) && (mRepeat+1 < muls->mulsRepeat1)) ? 0 : -1);
+#pragma omp parallel num_threads(2) if((next >= 0) && (omp_get_max_threads() > 1)) private(th) shared(muls, config, wave, nz, mRepeat, first, count, next, printFlag)
+		{
+			th = omp_get_thread_num();
+			if ((th == 0) && (next >= 0)) {
+				makeSliceWindow(muls,muls->slices,next);
+				makeTransmission(muls,nz);
 			}
-			
-			if ( (muls->mode == TEM) || ((muls->mode == CBED) && (muls->saveLevel > 1)) || ((muls->mode == NBED) && (muls->saveLevel > 1)) )
-			{
-				// TODO (MCS 2013/04): this restructure probably broke this file saving - 
-				//   need to rewrite a function to save things for TEM/CBED?
-				// This used to call interimWave(muls,wave,muls->totalSliceCount+islice*(1+mRepeat));
-				interimWave(muls,wave,absolute_slice*(1+mRepeat)); 
-				collectIntensity(muls,wave,absolute_slice*(1+mRepeat));
+			if ((th == 1) || (omp_get_num_threads() == 1)) {
+				if (muls->precision == PRECISION_DOUBLE) propagateSlices<double>(muls,wave,printFlag,mRepeat,first,count);
+				else propagateSlices<float>(muls,wave,printFlag,mRepeat,first,count);
 			}
-		} /* end for(islice...) */
-		// collect intensity at the final slice
-		//collectIntensity(muls, wave, muls->totalSliceCount+muls->slices*(1+mRepeat));
-	} /* end of mRepeat = 0 ... */
-	if (printFlag) printf("\n***************************************\n");
+		}
+	}
+	omp_set_max_active_levels(levels);
+	if (getWaveThreads() != waveThreads) {
+		setWaveThreads(waveThreads);
+		ringWavePlans(wave);
+	}
+	if (muls->precision == PRECISION_DOUBLE) wave->FromDouble();
+
+	finishMulsSTEM(muls,wave,printFlag);
+	return 0;
+}  // end of runMulsSTEMRing
 
-	/****************************************************
-	****************************************************
-	**           this -WAS- the big loop              **
-	****************************************************
-	***************************************************/
+
+/*****************************************************************
+* finishMulsSTEM() - statistics and output of the exit wave
+* at the end of runMulsSTEM() and runMulsSTEMBatch()
+*****************************************************************/
+static void finishMulsSTEM(MULS *muls, WavePtr wave, int printFlag) {
+	int ix,iy;
+	real x,y,sum,scale;
+
+	scale = 1.0F / (((real)muls->nx) * ((real)muls->ny));
 
 	// TODO: modifying shared value from multiple threads?
 	//#pragma omp single
@@ -2523,15 +3378,90 @@ int runMulsSTEM(MULS *muls, WavePtr wave) {
 			(*muls).rmin,(*muls).rmax,(*muls).aimin,(*muls).aimax);
 
 	}
+	// (the STEM waves between slabs are kept in muls->waveStore)
 	if (muls->saveFlag) {
-		if ((muls->saveLevel > 1) || (muls->cellDiv > 1)) {
+		if ((muls->saveLevel > 1) || ((muls->cellDiv > 1) && (muls->waveStore == NULL))) {
 			wave->WriteWave(wave->fileout);
 			if (printFlag)
 				printf("Created complex image file %s\n",(*wave).fileout);    
 		}
 	}
+}
+
+/*****************************************************************
+* runMulsSTEMBatch() - multislice propagation of a batch of probes
+*
+* Propagates the batch->count waves of batch together, slice by slice,
+* so that each transmission function slice is read once for the whole
+* batch while it is still in cache.  The FFTs of all waves are done with
+* one batched plan, or with muls->bandFFT, if that is set.  A batch 
+* that is not full (the last one of a tile) uses the plans of its 
+* waves, so that the unused waves are not transformed.  Only used in 
+* STEM mode with SLICE_ENGINE_FUSED, whose FFT normalization is folded 
+* into the propagator (readFile() turns scan batches off otherwise).
+*****************************************************************/
+int runMulsSTEMBatch(MULS *muls, WaveBatchPtr batch) {
+	int printFlag;
+	int islice,k,mRepeat;
+	int absolute_slice;
+	double kScale;
+	WavePtr wave;
+
+	printFlag = (muls->printLevel > 3);
+	kScale = 1.0/(muls->nx*muls->ny);
+
+	for (mRepeat = 0; mRepeat < muls->mulsRepeat1; mRepeat++) 
+	{
+		for( islice=0; islice < muls->slices; islice++ ) 
+		{
+			absolute_slice = (muls->totalSliceCount+islice);
+
+			for (k=0; k<batch->count; k++) {
+				wave = batch->waves[k];
+				transmitWaveFast(wave->Rows<float>(), waveTrans(muls,wave)[islice], muls->nx,muls->ny, wave->iPosX, wave->iPosY, muls->potNx, muls->potNy);
+			}
+			if (muls->bandFFT) {
+				for (k=0; k<batch->count; k++) muls->bandFFT->Forward((void **)batch->waves[k]->wave);
+			}
+			else if (batch->count < batch->K) {
+				for (k=0; k<batch->count; k++) 
+					FFTW<float>::Execute(batch->waves[k]->PlanForw<float>(), batch->waves[k]->Rows<float>()[0]);
+			}
+			else {
+#if FLOAT_PRECISION == 1
+				fftwf_execute_dft(batch->fftPlanForw,batch->stack.Data(),batch->stack.Data());
+#else
+				fftw_execute_dft(batch->fftPlanForw,batch->stack.Data(),batch->stack.Data());
+#endif
+			}
+			for (k=0; k<batch->count; k++) {
+				wave = batch->waves[k];
+				propagate_normalized((void **)wave->wave, muls->nx, muls->ny, muls, islice);
+				collectIntensity(muls, wave, muls->totalSliceCount+islice*(1+mRepeat), kScale);
+			}
+			if (muls->bandFFT) {
+				for (k=0; k<batch->count; k++) muls->bandFFT->Inverse((void **)batch->waves[k]->wave);
+			}
+			else if (batch->count < batch->K) {
+				for (k=0; k<batch->count; k++) 
+					FFTW<float>::Execute(batch->waves[k]->PlanInv<float>(), batch->waves[k]->Rows<float>()[0]);
+			}
+			else {
+#if FLOAT_PRECISION == 1
+				fftwf_execute_dft(batch->fftPlanInv,batch->stack.Data(),batch->stack.Data());
+#else
+				fftw_execute_dft(batch->fftPlanInv,batch->stack.Data(),batch->stack.Data());
+#endif
+			}
+			for (k=0; k<batch->count; k++) 
+				batch->waves[k]->thickness = (absolute_slice+1)*muls->sliceThickness;
+		} /* end for(islice...) */
+	} /* end of mRepeat = 0 ... */
+
+	for (k=0; k<batch->count; k++) 
+		finishMulsSTEM(muls,batch->waves[k],printFlag);
 	return 0;
-}  // end of runMulsSTEM
+}  // end of runMulsSTEMBatch
 
 
 ////////////////////////////////////////////////////////////////
@@ -2560,132 +3490,168 @@ void interimWave(MULS *muls,WavePtr wave,int slice) {
 	// produce the following filename:
 	// wave_avgCount_thicknessIndex.img or
 	// wave_thicknessIndex.img if tds is turned off
-	if (muls->tds) sprintf(fileName,"%s/wave_%d_%d.img",muls->folder,muls->avgCount,t);
+	if (muls->tds) sprintf(fileName,"%s/wave_%d_%d.img",muls->folder,
+		wave->config ? wave->config->run : muls->avgCount,t);
 	else sprintf(fileName,"%s/wave_%d.img",muls->folder,t);
 	wave->WriteWave(fileName, "Wave Function", params);
 }
 
+/********************************************************************
+* fillDiffPat() - stores the intensity of the (fourier transformed) 
+* wave function w of precision T in wave->diffpat, with the zero 
+* beam in the center.
+*******************************************************************/
+template <class T> static void fillDiffPat(MULS *muls, WavePtr wave, T (**w)[2], double scaleDiff)
+{
+	int ix,iy,ny2;
+	float_tt *dRow;
+	T (*wRow)[2];
+	int threads = getWaveThreads();
+
+	ny2 = muls->ny/2;
+#pragma omp parallel for if(threads > 1) num_threads(threads) private(iy,dRow,wRow)
+	for (ix = 0; ix < muls->nx; ix++) 
+	{
+		wRow = w[ix];
+		dRow = wave->diffpat[(ix+muls->nx/2)%muls->nx];
+		for (iy = 0; iy < muls->ny-ny2; iy++) 
+			dRow[iy+ny2] = (wRow[iy][0]*wRow[iy][0]+wRow[iy][1]*wRow[iy][1])*scaleDiff;
+		for (; iy < muls->ny; iy++) 
+			dRow[iy-(muls->ny-ny2)] = (wRow[iy][0]*wRow[iy][0]+wRow[iy][1]*wRow[iy][1])*scaleDiff;
+	}
+}
+
+/********************************************************************
+* detectorSlice() - the index of the detector images (thickness) that 
+* slice contributes to.
+*******************************************************************/
+int detectorSlice(MULS *muls, int slice)
+{
+	int tCount = (int)(ceil((double)((muls->slices * muls->cellDiv) / muls->outputInterval)));
+
+	if (muls->outputInterval == 0) return 0;
+	if (slice < ((muls->slices*muls->cellDiv)-1)) return (int)((slice) / muls->outputInterval);
+	return tCount;
+}
+
+/********************************************************************
+* initDetectorMap() 
+* (re)creates muls->detectorMap for the detectors of muls, if the 
+* detectors or the k-vectors have changed.  Must be called after 
+* initPropagators().
+*******************************************************************/
+void initDetectorMap(MULS *muls)
+{
+	if ((muls->detectorNum == 0) || (muls->detectors.empty())) {
+		muls->detectorMap.reset();
+		return;
+	}
+	if ((muls->detectorMap) && 
+		(muls->detectorMap->Matches(muls->nx,muls->ny,muls->kx2,muls->ky2,muls->detectors[0]))) return;
+	muls->detectorMap = DetectorMapPtr(new DetectorMap(muls->nx,muls->ny,muls->kx2,muls->ky2,muls->detectors[0]));
+	if (muls->printLevel > 2) 
+		printf("Detector map: %d detectors, %d segments, %d of %d pixels\n",muls->detectorNum,
+			(int)muls->detectorMap->segStart.size()-1,muls->detectorMap->Pixels(),muls->nx*muls->ny);
+}
+
 /********************************************************************
 * collectIntensity(muls, wave, slice)
 * collect the STEM signal on the annular detector(s) defined in muls
-* and write the appropriate pixel in the image for each detector and thickness
+* and keep it for the pixel in Detector::pass for each detector and thickness
 * The number of images is determined by the following formula:
 * muls->slices*muls->cellDiv/muls->outputInterval 
 * There are muls->detectorNum different detectors
+* kScale is the factor by which wave is scaled w.r.t. the unnormalized
+* FFT of the wave function (1/(nx*ny) for the fused slice engine).
+* Only the last slice before each output thickness is collected, the 
+* others would be overwritten by it anyway.  The pixels seen by each 
+* detector are taken from muls->detectorMap (see initDetectorMap()).
 *******************************************************************/
-void collectIntensity(MULS *muls, WavePtr wave, int slice) 
+void collectIntensity(MULS *muls, WavePtr wave, int slice, double kScale) 
 {
-	int i,ix,iy,ixs,iys,t;
-	real k2;
-	double intensity,scale,scaleCBED,scaleDiff,intensity_save;
-	char fileName[256],avgName[256]; 
-	float_tt **diffpatAvg = NULL;
-	int tCount = 0;
+	int i,t;
+	double intensity,scale,scaleDiff;
+	std::vector<double> sums;
 
-	std::vector<std::vector<DetectorPtr> > detectors;
+	if ((slice < ((muls->slices*muls->cellDiv)-1)) && 
+		(detectorSlice(muls,slice+1) == detectorSlice(muls,slice))) return;
 
 	scale = muls->electronScale/((double)(muls->nx*muls->ny)*(muls->nx*muls->ny));
-	// scaleCBED = 1.0/(scale*sqrt((double)(muls->nx*muls->ny)));
 	scaleDiff = 1.0/sqrt((double)(muls->nx*muls->ny));
+	scale     /= kScale*kScale;
+	scaleDiff /= kScale*kScale;
 
-	tCount = (int)(ceil((double)((muls->slices * muls->cellDiv) / muls->outputInterval)));
+	t = detectorSlice(muls,slice);
 
-	// we write directly to the shared muls object.  This is safe only because 
-	//    each thread is accessing different pixels in the output images.
-	detectors = muls->detectors;
-
-	if (muls->outputInterval == 0) t = 0;
-	else if (slice < ((muls->slices*muls->cellDiv)-1))
-	{
-		t = (int)((slice) / muls->outputInterval);
-		//if (t > tCount)
-		//{
-			// printf("t = %d, which is greater than tCount (%d)\n",t,tCount);
-			//t = tCount-1;
-		//}
+	/* add the intensities in the already 
+	fourier transformed wave function */
+	if (muls->precision == PRECISION_DOUBLE) {
+		fillDiffPat(muls, wave, wave->Rows<double>(), scaleDiff);
+		if (muls->detectorMap) muls->detectorMap->Integrate(wave->Rows<double>(), sums);
 	}
-	else
-	{
-		t = tCount;
+	else {
+		fillDiffPat(muls, wave, wave->Rows<float>(), scaleDiff);
+		if (muls->detectorMap) muls->detectorMap->Integrate(wave->Rows<float>(), sums);
 	}
 
-	int position_offset = wave->detPosY * muls->scanXN + wave->detPosX;
-
-	// Multiply each image by its number of averages and divide by it later again:
-	for (i=0;i<muls->detectorNum;i++) 
-	{
-		detectors[t][i]->image[wave->detPosX][wave->detPosY]  *= detectors[t][i]->Navg;	
-		detectors[t][i]->image2[wave->detPosX][wave->detPosY] *= detectors[t][i]->Navg;	
-		detectors[t][i]->error = 0;
-	}
-	/* add the intensities in the already 
-	fourier transformed wave function */
-	for (ix = 0; ix < muls->nx; ix++) 
-	{
-		for (iy = 0; iy < muls->ny; iy++) 
+	// only the slot of this pixel is written, which no other thread touches.
+	// The averages are updated by addDetectorPasses(), after the threads are done.
+	if (muls->detectorMap) {
+		std::vector<DetectorPtr> &detectors = muls->detectors[t];
+		for (i=0;i<muls->detectorNum;i++) 
 		{
-			k2 = muls->kx2[ix]+muls->ky2[iy];
-			intensity = (wave->wave[ix][iy][0]*wave->wave[ix][iy][0]+
-				wave->wave[ix][iy][1]*wave->wave[ix][iy][1]);
-			wave->diffpat[(ix+muls->nx/2)%muls->nx][(iy+muls->ny/2)%muls->ny] = intensity*scaleDiff;
-			intensity *= scale;
-			for (i=0;i<muls->detectorNum;i++) {
-				if ((k2 >= detectors[t][i]->k2Inside) && (k2 <= detectors[t][i]->k2Outside)) 
-				{
-					// detector in center of diffraction pattern:
-					if ((detectors[t][i]->shiftX == 0) && (detectors[t][i]->shiftY == 0)) 
-					{
-						detectors[t][i]->image[wave->detPosX][wave->detPosY] += intensity;
-						// misuse the error number for collecting this pixels raw intensity
-						detectors[t][i]->error += intensity;
-					}
-					/* special case for shifted detectors: */		
-					else 
-					{
-						intensity_save = intensity;
-						ixs = (ix+(int)detectors[t][i]->shiftX+muls->nx) % muls->nx;
-						iys = (iy+(int)detectors[t][i]->shiftY+muls->ny) % muls->ny;	    
-						intensity = scale * (wave->wave[ixs][iys][0]*wave->wave[ixs][iys][0]+
-							wave->wave[ixs][iys][1]*wave->wave[ixs][iys][1]);
-						detectors[t][i]->image[wave->detPosX][wave->detPosY] += intensity;
-						// repurpose the error number for collecting this pixels raw intensity
-						detectors[t][i]->error += intensity;
-						/* restore intensity, so that it will not be shifted for the other detectors */
-						intensity = intensity_save;
-					}
-				} /* end of if k2 ... */
-			} /* end of for i=0 ... detectorNum */
-		} /* end of for iy=0... */
-	} /* end of for ix = ... */
+			intensity = sums[i]*scale;
+			detectors[i]->pass[wave->detPosX][wave->detPosY] = intensity;
+		}
+	}
 
 	////////////////////////////////////////////////////////////////////////////
-	// write the diffraction pattern to disc in case we are working in CBED mode
-	if ((muls->mode == CBED) && (muls->saveLevel > 0)) {
-		sprintf(avgName,"%s/diff_%d.img",muls->folder,t);
-		// for (ix=0;ix<muls->nx*muls->ny;ix++) wave->diffpat[0][ix] *= scaleCBED;
-		if (muls->avgCount == 0) {
-			wave->WriteDiffPat(avgName);
-		}
-		else {
-			wave->ReadAvgArray(avgName);
-			for (ix=0;ix<muls->nx*muls->ny;ix++) {
-				wave->avgArray[0][ix] = (muls->avgCount*wave->avgArray[0][ix]+wave->diffpat[0][ix])/(muls->avgCount+1);
-			}
-			wave->WriteAvgArray(avgName);
-		}
+	// keep the diffraction pattern in case we are working in CBED mode, 
+	// it is added to diff_t.img after the run, see averageCBEDPattern()
+	if ((muls->mode == CBED) && (muls->saveLevel > 0) && (wave->config != NULL)) {
+		memcpy(wave->config->diffSeries.Slice(t), wave->diffpat.Data(), wave->diffpat.Size()*sizeof(float_tt));
+		wave->config->diffSeriesSet[t] = 1;
 	}
+}
 
-	// Divide each image by its number of averages again:
-	for (i=0;i<muls->detectorNum;i++) {
-		// add intensity squared to image2 for this detector and pixel, then rescale:
-		detectors[t][i]->image2[wave->detPosX][wave->detPosY] += detectors[t][i]->error*detectors[t][i]->error;
-		detectors[t][i]->image2[wave->detPosX][wave->detPosY] /= detectors[t][i]->Navg+1;	
+/********************************************************************
+* averageCBEDPattern() - adds the CBED pattern in wave->diffpat to the 
+* average of output thickness t over the runs in diff_t.img 
+* (wave->avgArray is overwritten).
+*******************************************************************/
+void averageCBEDPattern(MULS *muls, WavePtr wave, int t)
+{
+	int ix;
+	char avgName[256]; 
 
-		// do the rescaling for the average image:
-		detectors[t][i]->image[wave->detPosX][wave->detPosY] /= detectors[t][i]->Navg+1;	
+	sprintf(avgName,"%s/diff_%d.img",muls->folder,t);
+	if (muls->avgCount == 0) {
+		wave->WriteDiffPat(avgName);
+	}
+	else {
+		wave->ReadAvgArray(avgName);
+		for (ix=0;ix<muls->nx*muls->ny;ix++) {
+			wave->avgArray[0][ix] = (muls->avgCount*wave->avgArray[0][ix]+wave->diffpat[0][ix])/(muls->avgCount+1);
+		}
+		wave->WriteAvgArray(avgName);
 	}
 }
 
+/********************************************************************
+* addDetectorPasses() - adds the intensities collected since the last 
+* call (see collectIntensity()) to the detector images.  Call it from 
+* serial code, after the threads have finished their pixels.  Every 
+* pixel is updated on its own, so the result does not depend on 
+* which thread did which pixel.
+*******************************************************************/
+void addDetectorPasses(MULS *muls)
+{
+	int t, i;
+
+	for (t=0; t<(int)muls->detectors.size(); t++) 
+		for (i=0; i<muls->detectorNum; i++) muls->detectors[t][i]->AddPass();
+}
+
 /*****  saveSTEMImages *******/
 // Saves all detector images (STEM images) that are defined in muls.
 //   When saving intermediate STEM images is enabled, this also saves
@@ -2726,11 +3692,16 @@ void saveSTEMImages(MULS *muls)
 					detectors[i]->image[0][ix] * detectors[i]->image[0][ix]);
 				intensity += detectors[i]->image[0][ix] * detectors[i]->image[0][ix];
 			}
-			detectors[i]->error /= intensity;
+			if (intensity > 0) detectors[i]->error /= intensity;
 			if (islice <tCount)
-				sprintf(fileName,"%s/%s_%d.img", muls->folder, detectors[i]->name, islice);
+				sprintf(fileName,"%s/%s_%d", muls->folder, detectors[i]->name, islice);
+			else
+				sprintf(fileName,"%s/%s", muls->folder, detectors[i]->name);
+			// a shard of the scan only has some of the rows, see stem3-merge
+			if (muls->shardCount > 1)
+				sprintf(fileName+strlen(fileName), SCAN_SHARD_SUFFIX, muls->shardIndex, muls->shardCount);
 			else
-				sprintf(fileName,"%s/%s.img", muls->folder, detectors[i]->name, islice);
+				strcat(fileName, ".img");
 			//detectors[i]->SetComment(detectors[i]->name);
 			// NOTE: the comment for STEM images must be this, or else the MATLAB GUI doesn't recognize it as a STEM image!
 			//     That means the quantification and source size dialogs will be disabled.
@@ -2757,97 +3728,68 @@ void readStartWave(WavePtr wave) {
 * propagate_slow() 
 * replicates the original way, mulslice did it:
 *****************************************************************/
-void propagate_slow(void **w,int nx, int ny,MULS *muls)
+void propagate_slow(void **w,MULS *muls,int islice)
 {
-	int ixa, iya;
-	real wr, wi, tr, ti,ax,by;
-	real scale,t,dz; 
-	static real dzs=0;
-	static real *propxr=NULL,*propyr=NULL;
-	static real *propxi=NULL,*propyi=NULL;
-	static real *kx2,*ky2;
-	static real *kx,*ky;
-	static real k2max=0,wavlen;
-#if FLOAT_PRECISION == 1
-	fftwf_complex **wave;
-	wave = (fftwf_complex **)w;
-#else
-	fftw_complex **wave;
-	wave = (fftw_complex **)w;
-#endif
+	muls->propagators[islice]->Apply(w,1.0F);
+}
 
-	ax = (*muls).resolutionX*nx;
-	by = (*muls).resolutionY*ny;
-	dz = (*muls).cz[0];
-
-	if (dz != dzs) {
-		if (propxr == NULL) {
-			propxr = float1D(nx, "propxr" );
-			propxi = float1D(nx, "propxi" );
-			propyr = float1D(ny, "propyr" );
-			propyi = float1D(ny, "propyi" );
-			kx2    = float1D(nx, "kx2" );
-			kx     = float1D(nx, "kx" );
-			ky2    = float1D(ny, "ky2" );
-			ky     = float1D(ny, "ky" );
-		}
-		dzs = dz;
-		scale = dz*PI;
-		wavlen = wavelength((*muls).v0);
-
-		for( ixa=0; ixa<nx; ixa++) {
-			kx[ixa] = (ixa>nx/2) ? (real)(ixa-nx)/ax : 
-				(real)ixa/ax;
-			kx2[ixa] = kx[ixa]*kx[ixa];
-			t = scale * (kx2[ixa]*wavlen);
-			propxr[ixa] = (real)  cos(t);
-			propxi[ixa] = (real) -sin(t);
-		}
-		for( iya=0; iya<ny; iya++) {
-			ky[iya] = (iya>ny/2) ? 
-				(real)(iya-ny)/by : 
-			(real)iya/by;
-			ky2[iya] = ky[iya]*ky[iya];
-			t = scale * (ky2[iya]*wavlen);
-			propyr[iya] = (real)  cos(t);
-			propyi[iya] = (real) -sin(t);
-		}
-		k2max = nx/(2.0F*ax);
-		if (ny/(2.0F*by) < k2max ) k2max = ny/(2.0F*by);
-		k2max = 2.0/3.0 * k2max;
-		// TODO: modifying shared value from multiple threads?
-		k2max = k2max*k2max;
-		(*muls).kx2=kx2;
-		(*muls).ky2=ky2;
-		(*muls).kx=kx;
-		(*muls).ky=ky;
-	} 
-	/* end of: if dz != dzs */
-	/*************************************************************/
+/******************************************************************
+* propagate_normalized() 
+* like propagate_slow(), but also applies the 1/(nx*ny) scaling of
+* the FFT, so that no fft_normalize() is needed after going back 
+* to real space.  The spectrum left in wave is scaled accordingly.
+*****************************************************************/
+void propagate_normalized(void **w,int nx, int ny,MULS *muls,int islice)
+{
+	muls->propagators[islice]->Apply(w,1.0F/((real)nx*(real)ny));
+}
 
-	/*************************************************************
-	* Propagation
-	************************************************************/
-	for( ixa=0; ixa<nx; ixa++) {
-		if( kx2[ixa] < k2max ) {
-			for( iya=0; iya<ny; iya++) {
-				if( (kx2[ixa] + ky2[iya]) < k2max ) {
-
-					wr = wave[ixa][iya][0];
-					wi = wave[ixa][iya][1];
-					tr = wr*propyr[iya] - wi*propyi[iya];
-					ti = wr*propyi[iya] + wi*propyr[iya];
-					wave[ixa][iya][0] = tr*propxr[ixa] - ti*propxi[ixa];
-					wave[ixa][iya][1] = tr*propxi[ixa] + ti*propxr[ixa];
-
-				} else
-					wave[ixa][iya][0] = wave[ixa][iya][1] = 0.0F;
-			} /* end for(iy..) */
-
-		} else for( iya=0; iya<ny; iya++)
-			wave[ixa][iya][0] = wave[ixa][iya][1] = 0.0F;
-	} /* end for(ix..) */
-} /* end propagate_slow() */
+/******************************************************************
+* initPropagators() 
+* creates the propagator for each slice.  Slices of equal thickness
+* share the same (read-only) Propagator object, and propagators from
+* a previous call are reused, if nothing has changed.
+* muls->kx, kx2, ky, ky2 will point to the k-vectors of the wave.
+*****************************************************************/
+void initPropagators(MULS *muls) {
+	int islice,i;
+	real ax,by,wavlen;
+	PropagatorPtr prop;
+	std::vector<PropagatorPtr> propagators;
+
+	ax = muls->resolutionX*muls->nx;
+	by = muls->resolutionY*muls->ny;
+	wavlen = wavelength(muls->v0);
+
+	for (islice=0; islice<muls->slices; islice++) {
+		prop.reset();
+		for (i=0; i<(int)propagators.size(); i++) 
+			if (propagators[i]->Matches(muls->nx,muls->ny,ax,by,muls->cz[islice],wavlen)) prop = propagators[i];
+		for (i=0; (!prop) && (i<(int)muls->propagators.size()); i++) 
+			if (muls->propagators[i]->Matches(muls->nx,muls->ny,ax,by,muls->cz[islice],wavlen)) prop = muls->propagators[i];
+		if (!prop) {
+			prop = PropagatorPtr(new Propagator(muls->nx,muls->ny,ax,by,muls->cz[islice],wavlen));
+			if (muls->printLevel > 2) 
+				printf("Created propagator for dz = %gA (%d rows band limited)\n",prop->dz,(int)prop->spanStart.size());
+		}
+		propagators.push_back(prop);
+	}
+	muls->propagators = propagators;
+
+	if ((!muls->pruneFFT) || (muls->sliceEngine != SLICE_ENGINE_FUSED) || 
+		(muls->precision != PRECISION_SINGLE)) muls->bandFFT.reset();
+	else if ((!muls->bandFFT) || (muls->bandFFT->nx != muls->nx) || (muls->bandFFT->ny != muls->ny)) {
+		muls->bandFFT = PrunedFFTPtr(new PrunedFFT(*(propagators[0])));
+		if (muls->printLevel > 1) 
+			printf("Band limited FFT: %d of %d rows, %.0f%% of the full FFT\n",
+				muls->bandFFT->rowsLow+muls->bandFFT->rowsHigh,muls->nx,100.0*muls->bandFFT->Work());
+	}
+	muls->kx  = &(muls->propagators[0]->kx[0]);
+	muls->ky  = &(muls->propagators[0]->ky[0]);
+	muls->kx2 = &(muls->propagators[0]->kx2[0]);
+	muls->ky2 = &(muls->propagators[0]->ky2[0]);
+	initDetectorMap(muls);
+}
 
 
 /*------------------------ transmit() ------------------------*/
@@ -2863,48 +3805,102 @@ nx, ny = size of array
 on entrance waver,i and transr,i are in real space
 
 only waver,i will be changed by this routine
+
+transmitWave() does the same for wave functions of either precision
+(T = float or double), always computing in double precision.  
+The transmission function (potNx x potNy) is periodic: parts of the 
+wave beyond its edges see the opposite edge.
 */
-void transmit(void **wave, void **trans,int nx, int ny,int posx,int posy) {
-	int ix, iy;
+template <class T> static void transmitRow(T (*wRow)[2], const real (*tRow)[2], int n) {
+	int iy;
 	double wr, wi, tr, ti;
-#if FLOAT_PRECISION == 1
-	fftwf_complex **w, **t;
-	w = (fftwf_complex **)wave;
-	t = (fftwf_complex **)trans;
-#else
-	fftw_complex **w,**t;
-	w = (fftw_complex **)wave;
-	t = (fftw_complex **)trans;
-#endif
+
+	for( iy=0; iy<n; iy++) {
+		wr = wRow[iy][0];
+		wi = wRow[iy][1];
+		tr = tRow[iy][0];
+		ti = tRow[iy][1];
+		wRow[iy][0] = wr*tr - wi*ti;
+		wRow[iy][1] = wr*ti + wi*tr;
+	}
+}
+
+template <class T> void transmitWave(T (**w)[2], real (**t)[2],int nx, int ny,int posx,int posy,int potNx,int potNy) {
+	int ix, iy, ty, n;
+	int threads = getWaveThreads();
+
 	/*  trans += posx; */
-	for( ix=0; ix<nx; ix++) for( iy=0; iy<ny; iy++) {
-		wr = w[ix][iy][0];
-		wi = w[ix][iy][1];
-		tr = t[ix+posx][iy+posy][0];
-		ti = t[ix+posx][iy+posy][1];
-		w[ix][iy][0] = wr*tr - wi*ti;
-		w[ix][iy][1] = wr*ti + wi*tr;
-	} /* end for(iy.. ix .) */
+#pragma omp parallel for if(threads > 1) num_threads(threads) private(iy,ty,n)
+	for( ix=0; ix<nx; ix++) {
+		for (iy=0, ty=posy; iy<ny; iy+=n, ty=0) {
+			n = (ny-iy < potNy-ty) ? ny-iy : potNy-ty;
+			transmitRow(w[ix]+iy, t[(ix+posx) % potNx]+ty, n);
+		}
+	} /* end for(ix.. ) */
+} /* end transmitWave() */
+
+void transmit(void **wave, void **trans,int nx, int ny,int posx,int posy) {
+	transmitWave((real (**)[2])wave, (real (**)[2])trans, nx, ny, posx, posy, posx+nx, posy+ny);
 } /* end transmit() */
 
-void fft_normalize(void **array,int nx, int ny) {
+/*------------------------ transmit_fast() ------------------------*/
+/*
+same as transmit(), but works in the precision of the wave function
+directly on the contiguous rows of wave and trans, so that the compiler 
+can vectorize the inner loop.
+*/
+template <class T> static void transmitRowFast(T * __restrict w, const real * __restrict t, int n) {
+	int iy;
+	T wr, wi, tr, ti;
+
+	for( iy=0; iy<2*n; iy+=2) {
+		wr = w[iy];
+		wi = w[iy+1];
+		tr = t[iy];
+		ti = t[iy+1];
+		w[iy]   = wr*tr - wi*ti;
+		w[iy+1] = wr*ti + wi*tr;
+	}
+}
+
+template <class T> void transmitWaveFast(T (**wave)[2], real (**trans)[2],int nx, int ny,int posx,int posy,int potNx,int potNy) {
+	int ix, iy, ty, n;
+	int threads = getWaveThreads();
+
+#pragma omp parallel for if(threads > 1) num_threads(threads) private(iy,ty,n)
+	for( ix=0; ix<nx; ix++) {
+		for (iy=0, ty=posy; iy<ny; iy+=n, ty=0) {
+			n = (ny-iy < potNy-ty) ? ny-iy : potNy-ty;
+			transmitRowFast((T *)(wave[ix]+iy), (const real *)(trans[(ix+posx) % potNx]+ty), n);
+		}
+	} /* end for(ix..) */
+} /* end transmitWaveFast() */
+
+void transmit_fast(void **wave, void **trans,int nx, int ny,int posx,int posy) {
+	transmitWaveFast((real (**)[2])wave, (real (**)[2])trans, nx, ny, posx, posy, posx+nx, posy+ny);
+} /* end transmit_fast() */
+
+template <class T> void normalizeWave(T (**carray)[2],int nx, int ny) {
 	int ix,iy;
 	double fftScale;
-#if FLOAT_PRECISION == 1
-	fftwf_complex **carray;
-	carray = (fftwf_complex **)array;
-#else
-	fftw_complex **carray;
-	carray = (fftw_complex **)array;
-#endif
+	T (*a)[2];
+	int threads = getWaveThreads();
 
 	fftScale = 1.0/(double)(nx*ny);
-	for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
-		carray[ix][iy][0] *= fftScale;
-		carray[ix][iy][1] *= fftScale;
+#pragma omp parallel for if(threads > 1) num_threads(threads) private(iy,a)
+	for (ix=0;ix<nx;ix++) {
+		a = carray[ix];
+		for (iy=0;iy<ny;iy++) {
+			a[iy][0] *= fftScale;
+			a[iy][1] *= fftScale;
+		}
 	}
 }
 
+void fft_normalize(void **array,int nx, int ny) {
+	normalizeWave((real (**)[2])array, nx, ny);
+}
+
 void showPotential(fftw_complex ***pot,int nz,int nx,int ny,double dx,double dy,double dz) {
 	char *fileName = "potential.dat";
 	char systStr[256];
@@ -2963,7 +3959,7 @@ void showPotential(fftw_complex ***pot,int nz,int nx,int ny,double dx,double dy,
 * This function will write a data file with the pendeloesungPlot 
 * for selected beams
 ****************************************************************/
-void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice) {
+void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice, double kScale) {
 	static char fileAmpl[32];
 	static char filePhase[32];
 	static char fileBeam[32];
@@ -3055,9 +4051,15 @@ void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice) {
 		fprintf( fpAmpl, "%g",zsum);
 		fprintf( fpPhase, "%g",zsum);
 		for( ib=0; ib<(*muls).nbout; ib++) {
-			fprintf(fp1, "\t%g\t%g",
-				rPart = scale*(*wave).wave[hbeam[ib]][kbeam[ib]][0],
-				iPart = scale*(*wave).wave[hbeam[ib]][kbeam[ib]][1]);
+			if (muls->precision == PRECISION_DOUBLE) {
+				rPart = scale*wave->waveD[hbeam[ib]][kbeam[ib]][0]/kScale;
+				iPart = scale*wave->waveD[hbeam[ib]][kbeam[ib]][1]/kScale;
+			}
+			else {
+				rPart = scale*(*wave).wave[hbeam[ib]][kbeam[ib]][0]/kScale;
+				iPart = scale*(*wave).wave[hbeam[ib]][kbeam[ib]][1]/kScale;
+			}
+			fprintf(fp1, "\t%g\t%g",rPart,iPart);
 			ampl = (real)sqrt(rPart*rPart+iPart*iPart);
 			phase = (real)atan2(iPart,rPart);	
 			fprintf(fpAmpl,"\t%g",ampl);
@@ -3079,8 +4081,8 @@ void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice) {
 				(*muls).nbout,(*muls).slices*(*muls).mulsRepeat1*(*muls).mulsRepeat2);
 		}
 		for( ib=0; ib<muls->nbout; ib++) {
-			rPart = (*wave).wave[muls->hbeam[ib]][muls->kbeam[ib]][0];
-			iPart = (*wave).wave[muls->hbeam[ib]][muls->kbeam[ib]][1];
+			rPart = (*wave).wave[muls->hbeam[ib]][muls->kbeam[ib]][0]/kScale;
+			iPart = (*wave).wave[muls->hbeam[ib]][muls->kbeam[ib]][1]/kScale;
 			muls->pendelloesung[ib][absolute_slice] = scale*(real)(rPart*rPart+iPart*iPart);
 			// printf("slice: %d beam: %d [%d,%d], intensity: %g\n",muls->nslic0,ib,muls->hbeam[ib],muls->kbeam[ib],muls->pendelloesung[ib][muls->nslic0]);			
 		} // end of ib=0 ... 
@@ -32,21 +32,32 @@ QSTEM - image simulation for TEM/STEM/CBED
  * with parameters given in muls
  *********************************************/
 // int probe(MULS *muls,double dx, double dy);
-void probeShiftAndCrop(MULS *muls, WavePtr wave, double dx, double dy, double cnx, double cny);
+void probeShift(MULS *muls, WavePtr wave, double dx, double dy);
 void probe(MULS *muls, WavePtr wave, double dx, double dy);
+void updateProbeCache(MULS *muls);
 void probePlot(MULS *muls, WavePtr wave);
 
 void initSTEMSlices(MULS *muls, int nlayer);
+void makeTransmission(MULS *muls, int nlayer);
+void updateTransReplicas(MULS *muls);
 void interimWave(MULS *muls,WavePtr wave,int slice);
-void collectIntensity(MULS *muls, WavePtr wave, int slices);
+void collectIntensity(MULS *muls, WavePtr wave, int slices, double kScale=1.0);
+void addDetectorPasses(MULS *muls);
+int detectorSlice(MULS *muls, int slice);
+void averageCBEDPattern(MULS *muls, WavePtr wave, int t);
 //void detectorCollect(MULS *muls, WavePtr wave);
 void saveSTEMImages(MULS *muls);
 
 void make3DSlices(MULS *muls,int nlayer,char *fileName,atom *center);
+void makeSliceWindow(MULS *muls,int nlayer,int first);
 void make3DSlicesFFT(MULS *muls,int nlayer,char *fileName,atom *center);
 void createAtomBox(MULS *muls, int Znum, atomBox *aBox);
 void transmit(void **wave,void **trans,int nx, int ny,int posx,int posy);
-void propagate_slow(void** wave,int nx, int ny,MULS *muls);
+void transmit_fast(void **wave,void **trans,int nx, int ny,int posx,int posy);
+void propagate_slow(void** wave,MULS *muls,int islice);
+void propagate_normalized(void** wave,int nx, int ny,MULS *muls,int islice);
+void initPropagators(MULS *muls);
+void initDetectorMap(MULS *muls);
 fftwf_complex *getAtomPotential3D_3DFFT(int Znum, MULS *muls,double B);
 fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int*Nz_lut);
 fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int*Nz_lut,float q);
@@ -62,13 +73,16 @@ void readStartWave(WavePtr wave);
  *****************************************************************/
 int runMulsSTEM_old(MULS *muls,int lstart);
 int runMulsSTEM(MULS *muls, WavePtr wave);
+int runMulsSTEMBatch(MULS *muls, WaveBatchPtr batch);
+struct PhononConfig;
+int runMulsSTEMRing(MULS *muls, PhononConfig &config, int newSlab);
 void writePix(char *outFile,fftw_complex **pict,MULS *muls,int iz);
 void fft_normalize(void **array,int nx, int ny);
 void showPotential(fftw_complex ***pot,int nz,int nx,int ny,
 		   double dx,double dy,double dz);
 void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,
 			   double z,double B);
-void writeBeams(MULS *muls, WavePtr wave,int ilayer, int absolute_slice);
+void writeBeams(MULS *muls, WavePtr wave,int ilayer, int absolute_slice, double kScale=1.0);
 
 /***********************************************************************************
  * old image read/write functions, may soon be outdated
@@ -0,0 +1,147 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+#include "stemmpi.h"
+
+#ifdef USE_MPI
+/* number of the frozen phonon runs done by group (run = group, group+groups, ...) */
+static int groupRuns(int group, int groups, int avgRuns)
+{
+	return (avgRuns > group) ? (avgRuns-group+groups-1)/groups : 0;
+}
+#endif
+
+void mpiInit(int *argc, char ***argv, int *rank, int *size)
+{
+	*rank = 0;
+	*size = 1;
+#ifdef USE_MPI
+	MPI_Init(argc, argv);
+	MPI_Comm_rank(MPI_COMM_WORLD, rank);
+	MPI_Comm_size(MPI_COMM_WORLD, size);
+#else
+	(void)argc;
+	(void)argv;
+#endif
+}
+
+void mpiFinalize()
+{
+#ifdef USE_MPI
+	MPI_Finalize();
+#endif
+}
+
+void mpiBarrier()
+{
+#ifdef USE_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+/****************************************************************
+* mpiSetupSTEM() 
+* Splits the processes into groups of frozen phonon configurations 
+* and, within a group, into scan rows.  All processes of a group must 
+* draw the same random displacements, so they get the same seed, 
+* different from the other groups.
+****************************************************************/
+void mpiSetupSTEM(MULS *muls)
+{
+	long seed;
+
+	if ((muls->phononGroups < 1) || (muls->mpiSize % muls->phononGroups != 0) || 
+		(muls->phononGroups > muls->avgRuns)) {
+		if ((muls->mpiRank == 0) && (muls->phononGroups != 1))
+			printf("Cannot split %d processes and %d runs into %d phonon groups, using 1\n",
+				muls->mpiSize,muls->avgRuns,muls->phononGroups);
+		muls->phononGroups = 1;
+	}
+	muls->rowRanks = muls->mpiSize/muls->phononGroups;
+	muls->phononGroup = muls->mpiRank/muls->rowRanks;
+	muls->rowRank = muls->mpiRank%muls->rowRanks;
+
+	seed = muls->phononSeed;
+#ifdef USE_MPI
+	if (muls->mpiSize > 1) {
+		if (seed == 0) seed = (long)time(NULL);
+		MPI_Bcast(&seed, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+	}
+#endif
+	if ((seed != 0) && (muls->phononGroups > 1)) 
+		seed += 1000003L*muls->phononGroup;
+	muls->phononSeed = seed;
+
+	// only rank 0 reports
+	if (muls->mpiRank > 0) muls->printLevel = 0;
+}
+
+/****************************************************************
+* mpiReduceSTEM() 
+* Within a group each process has its own scan rows (and zeros 
+* elsewhere), so the images of all processes are simply added up, 
+* weighted by the share of the configurations its group did.
+* chisq[k] is summed over the scan rows of a group and averaged over 
+* the groups that did at least k+2 runs.
+****************************************************************/
+void mpiReduceSTEM(MULS *muls)
+{
+#ifdef USE_MPI
+	int t, i, ix, g, n;
+	double w;
+	std::vector<double> local, total;
+
+	if (muls->mpiSize < 2) return;
+	w = (double)groupRuns(muls->phononGroup,muls->phononGroups,muls->avgRuns)/muls->avgRuns;
+	n = muls->scanXN*muls->scanYN;
+	local.resize(2*n);
+	total.resize(2*n);
+	for (t=0; t<(int)muls->detectors.size(); t++) for (i=0; i<muls->detectorNum; i++) {
+		DetectorPtr det = muls->detectors[t][i];
+		for (ix=0; ix<n; ix++) {
+			local[ix]   = w*det->image.Data()[ix];
+			local[n+ix] = w*det->image2.Data()[ix];
+		}
+		MPI_Reduce(&local[0], &total[0], 2*n, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+		if (muls->mpiRank == 0) for (ix=0; ix<n; ix++) {
+			det->image.Data()[ix]  = (float_tt)total[ix];
+			det->image2.Data()[ix] = (float_tt)total[n+ix];
+		}
+	}
+
+	local = muls->chisq;
+	total.assign(local.size(), 0.0);
+	MPI_Reduce(&local[0], &total[0], (int)local.size(), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	if (muls->mpiRank == 0) for (i=0; i<(int)total.size(); i++) {
+		for (n=0, g=0; g<muls->phononGroups; g++) 
+			if (groupRuns(g,muls->phononGroups,muls->avgRuns) > i+1) n++;
+		muls->chisq[i] = (n > 0) ? total[i]/n : 0.0;
+	}
+#else
+	(void)muls;
+#endif
+}
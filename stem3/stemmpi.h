@@ -0,0 +1,41 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STEMMPI_H
+#define STEMMPI_H
+
+#include "data_containers.h"
+
+/* Distribution of STEM runs over MPI processes (cmake -DUSE_MPI=ON).
+ * The processes are split into muls->phononGroups groups, which do 
+ * every phononGroups-th frozen phonon configuration each.  The 
+ * processes of a group build the same potentials and split the scan 
+ * rows among themselves.  Without MPI all of these functions do 
+ * nothing, and there is one process with one group.
+ */
+void mpiInit(int *argc, char ***argv, int *rank, int *size);
+void mpiFinalize();
+void mpiBarrier();
+/* sets up the groups for muls->mpiRank, muls->mpiSize */
+void mpiSetupSTEM(MULS *muls);
+/* combines the detector images and chisq of all processes on rank 0, 
+ * weighted by the number of configurations of each group */
+void mpiReduceSTEM(MULS *muls);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* file stem3merge.cpp: combines the STEM images of a scan that was split 
+* into shards (stem3 --shard i/N) into the images a single stem3 run 
+* would have written.
+*
+* Every shard writes <name>_shard<i>of<N>.img with the full size of the 
+* scan, but only its own rows filled in, for image (the average 
+* intensity) as well as for the parameters 2.. (the average squared 
+* intensity, see saveSTEMImages()).  So the shards are simply added up, 
+* and the relative error (parameter 1) is calculated again.
+********************************************************************/
+
+#include <stdio.h>	/*  ANSI-C libraries */
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+#include <string>
+#include <set>
+#include <vector>
+
+#include "stemtypes_fftw3.h"
+#include "imagelib_fftw3.h"
+#include "arrays.h"
+#include "scan_scheduler.h"
+
+void usage() {
+	printf("usage: stem3-merge <shard image> [<shard image> ...]\n\n"
+		   "  Each shard image is one of the files <name>_shard<i>of<N>.img\n"
+		   "  written by stem3 --shard i/N, e.g. \"out/*_shard0of4.img\".\n"
+		   "  The N shards of <name> are combined into <name>.img.\n\n");
+}
+
+/* splits fileName into the base name and the number of shards, 
+* returns 0 if it is not a shard image */
+int parseShardName(const char *fileName, std::string &base, int &shards)
+{
+	const char *p, *last = NULL;
+	char check[64];
+	int shard;
+
+	for (p = strstr(fileName, "_shard"); p != NULL; p = strstr(p+1, "_shard")) last = p;
+	if (last == NULL) return 0;
+	if (sscanf(last, "_shard%dof%d", &shard, &shards) != 2) return 0;
+	snprintf(check, sizeof(check), SCAN_SHARD_SUFFIX, shard, shards);
+	if ((strcmp(last, check) != 0) || (shards < 1)) return 0;
+	base = std::string(fileName, last-fileName);
+	return 1;
+}
+
+/* adds up the N shards of base into base.img */
+int mergeShards(const std::string &base, int shards)
+{
+	int i, ix, length, nx = 0, ny = 0;
+	char fileName[512];
+	double error = 0, intensity = 0;
+	Array2D<float_tt> image, sum;
+	std::vector<double> params, sumParams;
+	CImageIO first(0, 0);
+
+	for (i=0; i<shards; i++) {
+		length = snprintf(fileName, sizeof(fileName), "%s" SCAN_SHARD_SUFFIX, base.c_str(), i, shards);
+		if ((length < 0) || (length >= (int)sizeof(fileName))) {
+			printf("The name of shard %d of %s is too long\n", i, base.c_str());
+			return 0;
+		}
+		CImageIO imageIO(0, 0);
+		try {
+			imageIO.ReadHeader(fileName);
+			if (i == 0) {
+				nx = imageIO.GetNx();
+				ny = imageIO.GetNy();
+				image.Resize(nx, ny, "image");
+				sum.Resize(nx, ny, "sum");
+				memset(sum.Data(), 0, nx*ny*sizeof(float_tt));
+				first.ReadHeader(fileName);
+			}
+			else if ((imageIO.GetNx() != nx) || (imageIO.GetNy() != ny)) {
+				printf("%s: image size %d x %d, but shard 0 has %d x %d\n", fileName, 
+					imageIO.GetNx(), imageIO.GetNy(), nx, ny);
+				return 0;
+			}
+			imageIO.ReadImage((void **)image.Rows(), nx, ny, fileName);
+		}
+		catch (std::runtime_error &e) {
+			printf("Could not read shard %d of %s: %s\n", i, base.c_str(), e.what());
+			return 0;
+		}
+
+		params = imageIO.GetParams();
+		if ((int)params.size() != 2+nx*ny) {
+			printf("%s is not a STEM image (%d parameters instead of %d)\n", fileName, 
+				(int)params.size(), 2+nx*ny);
+			return 0;
+		}
+		if (i == 0) sumParams = params;
+		else {
+			if (params[0] != sumParams[0]) 
+				printf("Warning: %s has %g averages, shard 0 has %g\n", fileName, params[0], sumParams[0]);
+			for (ix=2; ix<2+nx*ny; ix++) sumParams[ix] += params[ix];
+		}
+		for (ix=0; ix<nx*ny; ix++) sum.Data()[ix] += image.Data()[ix];
+	}
+
+	// the relative error as calculated by saveSTEMImages()
+	for (ix=0; ix<nx*ny; ix++) {
+		error     += sumParams[2+ix]-sum.Data()[ix]*sum.Data()[ix];
+		intensity += sum.Data()[ix]*sum.Data()[ix];
+	}
+	sumParams[1] = (intensity > 0) ? error/intensity : error;
+
+	length = snprintf(fileName, sizeof(fileName), "%s.img", base.c_str());
+	if ((length < 0) || (length >= (int)sizeof(fileName))) {
+		printf("The name of the merged image %s.img is too long\n", base.c_str());
+		return 0;
+	}
+	first.SetParams(sumParams);
+	first.WriteRealImage((void **)sum.Rows(), fileName);
+	printf("Merged %d shards into %s\n", shards, fileName);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	int i, shards, failed = 0;
+	std::string base;
+	std::set<std::string> done;
+
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+	for (i=1; i<argc; i++) {
+		if (!parseShardName(argv[i], base, shards)) {
+			printf("%s is not a shard image\n", argv[i]);
+			failed++;
+			continue;
+		}
+		// every shard of base may be given, but it is merged only once
+		if (done.count(base)) continue;
+		done.insert(base);
+		if (!mergeShards(base, shards)) failed++;
+	}
+	return (failed > 0) ? 1 : 0;
+}